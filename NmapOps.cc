@@ -93,6 +93,10 @@ NmapOps::~NmapOps() {
     free(dns_servers);
     dns_servers = NULL;
   }
+  if (traceroute_cache_file) {
+    free(traceroute_cache_file);
+    traceroute_cache_file = NULL;
+  }
   if (extra_payload) {
     free(extra_payload);
     extra_payload = NULL;
@@ -137,6 +141,10 @@ NmapOps::~NmapOps() {
     free(scriptargs);
     scriptargs = NULL;
   }
+  if (scriptcache) {
+    free(scriptcache);
+    scriptcache = NULL;
+  }
 #endif
 }
 
@@ -248,6 +256,7 @@ void NmapOps::Initialize() {
   timing_level = 3;
   max_parallelism = 0;
   min_parallelism = 0;
+  cc_algo = CC_RENO;
   max_os_tries = 5;
   max_rtt_timeout = MAX_RTT_TIMEOUT;
   min_rtt_timeout = MIN_RTT_TIMEOUT;
@@ -304,6 +313,7 @@ void NmapOps::Initialize() {
   resolve_all = false;
   unique = false;
   dns_servers = NULL;
+  traceroute_cache_file = NULL;
   implicitARPPing = true;
   numhosts_scanned = 0;
   numhosts_up = 0;
@@ -325,6 +335,9 @@ void NmapOps::Initialize() {
   scriptupdatedb = false;
   scripthelp = false;
   scripttimeout = 0;
+  scriptworkers = 1;
+  scripthostsockets = 0;
+  scriptcache = NULL;
   chosenScripts.clear();
 #endif
   memset(&sourcesock, 0, sizeof(sourcesock));
@@ -67,6 +67,7 @@
 #include "nmap.h" /* MAX_DECOYS */
 #include "scan_lists.h"
 #include "output.h" /* LOG_NUM_FILES */
+#include "timing.h" /* enum cc_algorithm */
 #include <nbase.h>
 #include <nsock.h>
 #include <string>
@@ -159,6 +160,7 @@ class NmapOps {
   int timing_level; // 0-5, corresponding to Paranoid, Sneaky, Polite, Normal, Aggressive, Insane
   int max_parallelism; // 0 means it has not been set
   int min_parallelism; // 0 means it has not been set
+  enum cc_algorithm cc_algo; /* --congestion-control */
   double topportlevel; // -1 means it has not been set
 
   /* The maximum number of OS detection (gen2) tries we will make
@@ -301,6 +303,7 @@ class NmapOps {
   bool deprecated_xml_osclass;
 
   bool traceroute;
+  char *traceroute_cache_file; /* --traceroute-cache, or NULL */
   bool reason;
   bool adler32;
   FILE *excludefd;
@@ -321,6 +324,9 @@ class NmapOps {
   bool scriptupdatedb;
   bool scripthelp;
   double scripttimeout;
+  int scriptworkers; /* --script-workers: processes sharing a host group */
+  int scripthostsockets; /* --script-host-sockets, 0 for no fixed cap */
+  char *scriptcache; /* --script-cache: directory of compiled chunks */
   void chooseScripts(char* argument);
   std::vector<std::string> chosenScripts;
 #endif
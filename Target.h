@@ -78,6 +78,7 @@
 #include "probespec.h"
 #include "osscan.h"
 #include "osscan2.h"
+#include "timing.h"
 class FingerPrintResults;
 
 #include <list>
@@ -259,6 +260,7 @@ class Target {
   int weird_responses; /* echo responses from other addresses, Ie a network broadcast address */
   int flags; /* HOST_UNKNOWN, HOST_UP, or HOST_DOWN. */
   struct timeout_info to;
+  LatencyStats latency; /* Round-trip times of ultra_scan() probes */
   char *hostname; // Null if unable to resolve or unset
   char * targetname; // The name of the target host given on the command line if it is a named host
 
@@ -105,6 +105,8 @@
 #include "struct_ip.h"
 
 #include <stdio.h>
+#include <string>
+#include <vector>
 
 extern NmapOps o;
 
@@ -317,19 +319,23 @@ static u16 byteswap_u16(u16 h) {
    one, assuming the given IP ID Sequencing class.  Returns -1 if the
    distance cannot be determined */
 
-static int ipid_distance(int seqclass , u32 startid, u32 endid) {
+int ipid_distance(int seqclass , u32 startid, u32 endid) {
+  /* IPv4 IP IDs are 16 bits and wrap around to 0; IPv6 fragment IDs use
+     all 32. */
+  u32 mask = (o.af() == AF_INET) ? 0xFFFF : 0xFFFFFFFF;
+
   if (seqclass == IPID_SEQ_INCR)
-    return endid - startid;
+    return (endid - startid) & mask;
 
   if (seqclass == IPID_SEQ_BROKEN_INCR) {
     /* Convert to network byte order */
     startid = byteswap_u16((u16) startid);
     endid = byteswap_u16((u16) endid);
-    return endid - startid;
+    return (endid - startid) & mask;
   }
 
   if (seqclass == IPID_SEQ_INCR_BY_2) {
-    return (endid - startid)/2;
+    return ((endid - startid) & mask)/2;
   }
 
   return -1;
@@ -954,109 +960,175 @@ static void adjust_idle_timing(struct idle_proxy_info *proxy,
 }
 
 
+/* Returns the number of open ports a zombie has answered for, given the IP
+   ID it had before the SYN probes were sent (latestid), the IP ID of its
+   latest reply (newid) and how many IP ID probes it has answered since
+   latestid. The result is negative when the count can't be made, such as
+   when a probe was lost or the sequence class has no usable distance. */
+int idle_count_ports(int seqclass, u32 latestid, u32 newid, int probes_sent) {
+  int dist;
+
+  dist = ipid_distance(seqclass, latestid, newid);
+  if (dist < 0)
+    return -1;
+
+  return dist - probes_sent;
+}
+
+/* Hands out the ports from index portidx on for one round of a scan through
+   several zombies: zombie i gets the next groupsz[i] ports (fewer once the
+   ports run out, and at least one). The first port index and the number of
+   ports of each group are stored in group_start and group_len. Returns the
+   number of groups, which is less than nzombies if the ports ran out
+   first. */
+int idle_split_ports(int numports, int portidx, const int *groupsz,
+                     int nzombies, int *group_start, int *group_len) {
+  int i;
+
+  for (i = 0; i < nzombies && portidx < numports; i++) {
+    group_start[i] = portidx;
+    group_len[i] = MIN(numports - portidx, MAX(1, groupsz[i]));
+    portidx += group_len[i];
+  }
+
+  return i;
+}
+
+
+/* One group of ports to be counted through one zombie. When several zombies
+   are available, idlescan_countopen_multi() counts one group per zombie at
+   the same time. */
+struct idle_group {
+  struct idle_proxy_info *proxy;
+  u16 *ports;
+  int numports;
+  /* Filled in by idlescan_countopen_multi(), with the same meaning as the
+     return value and the sent_time and rcv_time arguments of
+     idlescan_countopen2(). */
+  int openports;
+  struct timeval sent_time;
+  struct timeval rcv_time;
+};
+
+/* Per-group bookkeeping for idlescan_countopen_multi() */
+struct idle_group_state {
+  struct timeval start, end, latestchange;
+  struct timeval probe_times[4];
+  int proxyprobes_sent; /* diff. from tries 'cause sometimes we
+                           skip tries */
+  int proxyprobes_rcvd; /* To determine if packets were dr0pped */
+  int newipid;
+  bool done;
+  struct eth_nfo eth;
+};
+
 /* OK, now this is the hardcore idle scan function which actually does
    the testing (most of the other cruft in this file is just
    coordination, preparation, etc).  This function simply uses the
-   idle scan technique to try and count the number of open ports in the
-   given port array.  The sent_time and rcv_time are filled in with
-   the times that the probe packet & response were sent/received.
-   They can be NULL if you don't want to use them.  The purpose is for
-   timing adjustments if the numbers turn out to be accurate */
-
-static int idlescan_countopen2(struct idle_proxy_info *proxy,
-                               Target *target, u16 *ports, int numports,
-                               struct timeval *sent_time, struct timeval *rcv_time) {
-  int openports;
+   idle scan technique to try and count the number of open ports in
+   each of the given groups.  The sent_time and rcv_time of each group are
+   filled in with the times that the probe packet & response were
+   sent/received.  The purpose is for timing adjustments if the numbers
+   turn out to be accurate.
+
+   Every group must use a different zombie.  The SYN probes for all the
+   groups are sent first, and then each zombie's IP ID is checked at the
+   usual times after its own probes went out, so the waiting for the target
+   to respond is shared by all the groups instead of being paid once per
+   group. */
+static void idlescan_countopen_multi(Target *target, struct idle_group *groups,
+                                     int ngroups) {
+  struct idle_group_state *states;
+  struct idle_group *g;
+  struct idle_group_state *gs;
+  struct idle_proxy_info *proxy;
   int tries;
-  int proxyprobes_sent = 0; /* diff. from tries 'cause sometimes we
-                               skip tries */
-  int proxyprobes_rcvd = 0; /* To determine if packets were dr0pped */
   int sent, rcvd;
   int ipid_dist;
-  struct timeval start, end, latestchange, now;
-  struct timeval probe_times[4];
+  struct timeval now;
   int pr0be;
   static u32 seq = 0;
-  int newipid = 0;
   int sleeptime;
   int lasttry = 0;
   int dotry3 = 0;
-  struct eth_nfo eth;
   u8 *packet = NULL;
   u32 packetlen = 0;
   int res;
+  int i;
 
   if (seq == 0)
     seq = get_random_u32();
 
-  memset(&end, 0, sizeof(end));
-  memset(&latestchange, 0, sizeof(latestchange));
-  gettimeofday(&start, NULL);
-  if (sent_time)
-    memset(sent_time, 0, sizeof(*sent_time));
-  if (rcv_time)
-    memset(rcv_time, 0, sizeof(*rcv_time));
-
-  if (proxy->rawsd < 0) {
-    if (!setTargetNextHopMAC(target))
-      fatal("%s: Failed to determine dst MAC address for Idle proxy", __func__);
-    memcpy(eth.srcmac, target->SrcMACAddress(), 6);
-    memcpy(eth.dstmac, target->NextHopMACAddress(), 6);
-    eth.ethsd = eth_open_cached(target->deviceName());
-    if (eth.ethsd == NULL)
-      fatal("%s: Failed to open ethernet device (%s)", __func__, target->deviceName());
-  } else eth.ethsd = NULL;
-
-  /* I start by sending out the SYN probes */
-  for (pr0be = 0; pr0be < numports; pr0be++) {
-    if (o.scan_delay)
-      enforce_scan_delay(NULL);
-    else if (proxy->senddelay && pr0be > 0) usleep(proxy->senddelay);
-
-    /* Maybe I should involve decoys in the picture at some point --
-       but doing it the straightforward way (using the same decoys as
-       we use in probing the proxy box is risky.  I'll have to think
-       about this more. */
-   if (o.af() == AF_INET ) {
-      send_tcp_raw(proxy->rawsd, eth.ethsd ? &eth : NULL,
-                   proxy->host.v4hostip(), target->v4hostip(),
-                   o.ttl, false,
-                   o.ipoptions, o.ipoptionslen,
-                   proxy->probe_port, ports[pr0be], seq, 0, 0, TH_SYN, 0, 0,
-                   (u8 *) TCP_SYN_PROBE_OPTIONS, TCP_SYN_PROBE_OPTIONS_LEN,
-                   o.extra_payload, o.extra_payload_length);
-   } else {
-        packet = build_tcp_raw_ipv6(proxy->host.v6hostip(), target->v6hostip(),
-                                    0x00, 0x0000,
-                                    o.ttl,
-                                    proxy->probe_port, ports[pr0be], seq, 0, 0, TH_SYN, 0, 0,
-                                    (u8 *) TCP_SYN_PROBE_OPTIONS, TCP_SYN_PROBE_OPTIONS_LEN,
-                                    o.extra_payload, o.extra_payload_length,
-                                    &packetlen);
-        res = send_ip_packet(proxy->rawsd, eth.ethsd ? &eth : NULL, target->TargetSockAddr(), packet, packetlen);
-        if (res == -1)
-          fatal("Error occurred while trying to send IPv6 packet");
-        free(packet);
+  states = (struct idle_group_state *) safe_zalloc(ngroups * sizeof(*states));
+
+  for (i = 0; i < ngroups; i++) {
+    g = &groups[i];
+    gs = &states[i];
+    proxy = g->proxy;
+    g->openports = -1;
+    memset(&g->sent_time, 0, sizeof(g->sent_time));
+    memset(&g->rcv_time, 0, sizeof(g->rcv_time));
+
+    if (proxy->rawsd < 0) {
+      if (!setTargetNextHopMAC(target))
+        fatal("%s: Failed to determine dst MAC address for Idle proxy", __func__);
+      memcpy(gs->eth.srcmac, target->SrcMACAddress(), 6);
+      memcpy(gs->eth.dstmac, target->NextHopMACAddress(), 6);
+      gs->eth.ethsd = eth_open_cached(target->deviceName());
+      if (gs->eth.ethsd == NULL)
+        fatal("%s: Failed to open ethernet device (%s)", __func__, target->deviceName());
+    } else gs->eth.ethsd = NULL;
+
+    gettimeofday(&gs->start, NULL);
+
+    /* I start by sending out the SYN probes */
+    for (pr0be = 0; pr0be < g->numports; pr0be++) {
+      if (o.scan_delay)
+        enforce_scan_delay(NULL);
+      else if (proxy->senddelay && pr0be > 0) usleep(proxy->senddelay);
+
+      /* Maybe I should involve decoys in the picture at some point --
+         but doing it the straightforward way (using the same decoys as
+         we use in probing the proxy box is risky.  I'll have to think
+         about this more. */
+     if (o.af() == AF_INET ) {
+        send_tcp_raw(proxy->rawsd, gs->eth.ethsd ? &gs->eth : NULL,
+                     proxy->host.v4hostip(), target->v4hostip(),
+                     o.ttl, false,
+                     o.ipoptions, o.ipoptionslen,
+                     proxy->probe_port, g->ports[pr0be], seq, 0, 0, TH_SYN, 0, 0,
+                     (u8 *) TCP_SYN_PROBE_OPTIONS, TCP_SYN_PROBE_OPTIONS_LEN,
+                     o.extra_payload, o.extra_payload_length);
+     } else {
+          packet = build_tcp_raw_ipv6(proxy->host.v6hostip(), target->v6hostip(),
+                                      0x00, 0x0000,
+                                      o.ttl,
+                                      proxy->probe_port, g->ports[pr0be], seq, 0, 0, TH_SYN, 0, 0,
+                                      (u8 *) TCP_SYN_PROBE_OPTIONS, TCP_SYN_PROBE_OPTIONS_LEN,
+                                      o.extra_payload, o.extra_payload_length,
+                                      &packetlen);
+          res = send_ip_packet(proxy->rawsd, gs->eth.ethsd ? &gs->eth : NULL, target->TargetSockAddr(), packet, packetlen);
+          if (res == -1)
+            fatal("Error occurred while trying to send IPv6 packet");
+          free(packet);
+      }
     }
+    gettimeofday(&gs->end, NULL);
+
+    int tmp = (target->to.srtt * 3) / (4 * 1000);
+    tmp = MAX(50, tmp);
+    TIMEVAL_MSEC_ADD(gs->probe_times[0], gs->start, tmp);
+    tmp = target->to.srtt / 1000;
+    TIMEVAL_MSEC_ADD(gs->probe_times[1], gs->start, tmp);
+    tmp = (2 * target->to.srtt + target->to.rttvar) / 1000;
+    tmp = MAX(75, tmp);
+    TIMEVAL_MSEC_ADD(gs->probe_times[2], gs->end, tmp);
+    tmp = (2 * target->to.srtt + (target->to.rttvar << 2 )) / 1000;
+    tmp = MIN(4000, tmp);
+    TIMEVAL_MSEC_ADD(gs->probe_times[3], gs->end, tmp);
   }
-  gettimeofday(&end, NULL);
-
-  openports = -1;
-  tries = 0;
-
-  int tmp = (target->to.srtt * 3) / (4 * 1000);
-  tmp = MAX(50, tmp);
-  TIMEVAL_MSEC_ADD(probe_times[0], start, tmp);
-  tmp = target->to.srtt / 1000;
-  TIMEVAL_MSEC_ADD(probe_times[1], start, tmp);
-  tmp = (2 * target->to.srtt + target->to.rttvar) / 1000;
-  tmp = MAX(75, tmp);
-  TIMEVAL_MSEC_ADD(probe_times[2], end, tmp);
-  tmp = (2 * target->to.srtt + (target->to.rttvar << 2 )) / 1000;
-  tmp = MIN(4000, tmp);
-  TIMEVAL_MSEC_ADD(probe_times[3], end, tmp);
 
-  do {
+  for (tries = 0; tries <= 3; tries++) {
     if (tries == 2)
       dotry3 = (get_random_u8() > 200);
     if (tries == 3 && !dotry3)
@@ -1064,81 +1136,115 @@ static int idlescan_countopen2(struct idle_proxy_info *proxy,
     if (tries == 3 || (tries == 2 && !dotry3))
       lasttry = 1;
 
-    gettimeofday(&now, NULL);
-    sleeptime = TIMEVAL_SUBTRACT(probe_times[tries], now);
-    if (!lasttry && proxyprobes_sent > 0 && sleeptime < 50000)
-      continue; /* No point going again so soon */
-
-    if (tries == 0 && sleeptime < 500)
-      sleeptime = 500;
-    if (o.debugging > 1)
-      error("In preparation for idle scan probe try #%d, sleeping for %d usecs", tries, sleeptime);
-    if (sleeptime > 0)
-      usleep(sleeptime);
-
-    newipid = ipid_proxy_probe(proxy, &sent, &rcvd);
-    proxyprobes_sent += sent;
-    proxyprobes_rcvd += rcvd;
-
-    if (newipid > 0) {
-      ipid_dist = ipid_distance(proxy->seqclass, proxy->latestid, newipid);
-      /* I used to only do this if ipid_sit >= proxyprobes_sent, but I'd
-      rather have a negative number in that case */
-      if (ipid_dist < proxyprobes_sent) {
-        if (o.debugging)
-          error("%s: Must have lost a sent packet because ipid_dist is %d while proxyprobes_sent is %d.", __func__, ipid_dist, proxyprobes_sent);
-        /* I no longer whack timing here ... done at bottom */
-      }
-      ipid_dist -= proxyprobes_sent;
-      if (ipid_dist > openports) {
-        openports = ipid_dist;
-        gettimeofday(&latestchange, NULL);
-      } else if (ipid_dist < openports && ipid_dist >= 0) {
-        /* Uh-oh.  Perhaps I dropped a packet this time */
-        if (o.debugging > 1) {
-          error("%s: Counted %d open ports in try #%d, but counted %d earlier ... probably a proxy_probe problem", __func__, ipid_dist, tries, openports);
+    for (i = 0; i < ngroups; i++) {
+      g = &groups[i];
+      gs = &states[i];
+      proxy = g->proxy;
+      if (gs->done)
+        continue;
+
+      gettimeofday(&now, NULL);
+      sleeptime = TIMEVAL_SUBTRACT(gs->probe_times[tries], now);
+      if (!lasttry && gs->proxyprobes_sent > 0 && sleeptime < 50000)
+        continue; /* No point going again so soon */
+
+      if (tries == 0 && sleeptime < 500)
+        sleeptime = 500;
+      if (o.debugging > 1)
+        error("In preparation for idle scan probe try #%d, sleeping for %d usecs", tries, sleeptime);
+      if (sleeptime > 0)
+        usleep(sleeptime);
+
+      gs->newipid = ipid_proxy_probe(proxy, &sent, &rcvd);
+      gs->proxyprobes_sent += sent;
+      gs->proxyprobes_rcvd += rcvd;
+
+      if (gs->newipid > 0) {
+        ipid_dist = idle_count_ports(proxy->seqclass, proxy->latestid,
+                                     gs->newipid, gs->proxyprobes_sent);
+        /* I used to only do this if ipid_sit >= proxyprobes_sent, but I'd
+        rather have a negative number in that case */
+        if (ipid_dist < 0) {
+          if (o.debugging)
+            error("%s: Must have lost a sent packet because ipid_dist is %d while proxyprobes_sent is %d.", __func__, ipid_dist + gs->proxyprobes_sent, gs->proxyprobes_sent);
+          /* I no longer whack timing here ... done at bottom */
+        }
+        if (ipid_dist > g->openports) {
+          g->openports = ipid_dist;
+          gettimeofday(&gs->latestchange, NULL);
+        } else if (ipid_dist < g->openports && ipid_dist >= 0) {
+          /* Uh-oh.  Perhaps I dropped a packet this time */
+          if (o.debugging > 1) {
+            error("%s: Counted %d open ports in try #%d, but counted %d earlier ... probably a proxy_probe problem", __func__, ipid_dist, tries, g->openports);
+          }
+          /* I no longer whack timing here ... done at bottom */
         }
-        /* I no longer whack timing here ... done at bottom */
       }
+
+      if (g->openports > g->numports || (g->numports <= 2 && (g->openports == g->numports)))
+        gs->done = true;
     }
+  }
 
-    if (openports > numports || (numports <= 2 && (openports == numports)))
-      break;
-  } while (tries++ < 3);
+  for (i = 0; i < ngroups; i++) {
+    g = &groups[i];
+    gs = &states[i];
+    proxy = g->proxy;
 
-  if (proxyprobes_sent > proxyprobes_rcvd) {
-    /* Uh-oh.  It looks like we lost at least one proxy probe packet */
-    if (o.debugging) {
-      error("%s: Sent %d probes; only %d responses.  Slowing scan.", __func__, proxyprobes_sent, proxyprobes_rcvd);
+    if (gs->proxyprobes_sent > gs->proxyprobes_rcvd) {
+      /* Uh-oh.  It looks like we lost at least one proxy probe packet */
+      if (o.debugging) {
+        error("%s: Sent %d probes; only %d responses.  Slowing scan.", __func__, gs->proxyprobes_sent, gs->proxyprobes_rcvd);
+      }
+      proxy->senddelay += 5000;
+      proxy->senddelay = MIN(proxy->max_senddelay, proxy->senddelay);
+      /* No group size should be greater than .5s of send delays */
+      proxy->current_groupsz = MAX(proxy->min_groupsz, MIN(proxy->current_groupsz, 500000 / (proxy->senddelay + 1)));
+    } else {
+      /* Yeah, we got as many responses as we sent probes.  This calls for a
+         very light timing acceleration ... */
+      proxy->senddelay = (int) (proxy->senddelay * 0.95);
+      if (proxy->senddelay < 500)
+        proxy->senddelay = 0;
+      proxy->current_groupsz = MAX(proxy->min_groupsz, MIN(proxy->current_groupsz, 500000 / (proxy->senddelay + 1)));
     }
-    proxy->senddelay += 5000;
-    proxy->senddelay = MIN(proxy->max_senddelay, proxy->senddelay);
-    /* No group size should be greater than .5s of send delays */
-    proxy->current_groupsz = MAX(proxy->min_groupsz, MIN(proxy->current_groupsz, 500000 / (proxy->senddelay + 1)));
-  } else {
-    /* Yeah, we got as many responses as we sent probes.  This calls for a
-       very light timing acceleration ... */
-    proxy->senddelay = (int) (proxy->senddelay * 0.95);
-    if (proxy->senddelay < 500)
-      proxy->senddelay = 0;
-    proxy->current_groupsz = MAX(proxy->min_groupsz, MIN(proxy->current_groupsz, 500000 / (proxy->senddelay + 1)));
-  }
 
-  if ((openports > 0) && (openports <= numports)) {
-    /* Yeah, we found open ports... lets adjust the timing ... */
-    if (o.debugging > 2)
-      error("%s:  found %d open ports (out of %d) in %lu usecs", __func__, openports, numports, (unsigned long) TIMEVAL_SUBTRACT(latestchange, start));
-    if (sent_time)
-      *sent_time = start;
-    if (rcv_time)
-      *rcv_time = latestchange;
-  }
-  if (newipid > 0)
-    proxy->latestid = newipid;
-  if (eth.ethsd) {
-    eth.ethsd = NULL;  /* don't need to close it due to caching */
+    if ((g->openports > 0) && (g->openports <= g->numports)) {
+      /* Yeah, we found open ports... lets adjust the timing ... */
+      if (o.debugging > 2)
+        error("%s:  found %d open ports (out of %d) in %lu usecs", __func__, g->openports, g->numports, (unsigned long) TIMEVAL_SUBTRACT(gs->latestchange, gs->start));
+      g->sent_time = gs->start;
+      g->rcv_time = gs->latestchange;
+    }
+    if (gs->newipid > 0)
+      proxy->latestid = gs->newipid;
+    if (gs->eth.ethsd) {
+      gs->eth.ethsd = NULL;  /* don't need to close it due to caching */
+    }
   }
-  return openports;
+
+  free(states);
+}
+
+/* Count the open ports among the given ports through one zombie. The
+   sent_time and rcv_time are filled in with the times that the probe
+   packet & response were sent/received. They can be NULL if you don't want
+   to use them. */
+static int idlescan_countopen2(struct idle_proxy_info *proxy,
+                               Target *target, u16 *ports, int numports,
+                               struct timeval *sent_time, struct timeval *rcv_time) {
+  struct idle_group group;
+
+  group.proxy = proxy;
+  group.ports = ports;
+  group.numports = numports;
+  idlescan_countopen_multi(target, &group, 1);
+  if (sent_time)
+    *sent_time = group.sent_time;
+  if (rcv_time)
+    *rcv_time = group.rcv_time;
+
+  return group.openports;
 }
 
 
@@ -1318,17 +1424,128 @@ static int idle_treescan(struct idle_proxy_info *proxy, Target *target,
 
 
 
+/* Scans one group of ports per zombie at the same time. Each group is
+   counted once through its own zombie, and then handled the way
+   idle_treescan() handles each half of its range: groups with open ports are
+   drilled down into one at a time, and groups that appear to have none are
+   counted again (together) to make sure. */
+static void idle_multiscan(Target *target, struct idle_group *groups,
+                           int ngroups) {
+  std::vector<struct idle_group> recount;
+  int i, flatcount, deepcount, retry2;
+  struct idle_group *g;
+
+  idlescan_countopen_multi(target, groups, ngroups);
+
+  for (i = 0; i < ngroups; i++) {
+    g = &groups[i];
+    flatcount = g->openports;
+    if (flatcount < 0 || flatcount > g->numports) {
+      /* Let the one-zombie code do its retries (and give up if need be). */
+      flatcount = idlescan_countopen(g->proxy, target, g->ports, g->numports,
+                                     &g->sent_time, &g->rcv_time);
+    }
+
+    if (flatcount == 0) {
+      recount.push_back(*g);
+      continue;
+    }
+
+    deepcount = flatcount;
+    if (g->numports > 1) {
+      deepcount = idle_treescan(g->proxy, target, g->ports, g->numports,
+                                flatcount);
+      adjust_idle_timing(g->proxy, target, flatcount, deepcount);
+    } else {
+      target->ports.setPortState(g->ports[0], IPPROTO_TCP, PORT_OPEN);
+    }
+    if (deepcount == flatcount)
+      adjust_timeouts2(&g->sent_time, &g->rcv_time, &(target->to));
+  }
+
+  if (recount.empty())
+    return;
+
+  idlescan_countopen_multi(target, &recount[0], recount.size());
+
+  for (i = 0; i < (int) recount.size(); i++) {
+    g = &recount[i];
+    flatcount = g->openports;
+    if (flatcount < 0 || flatcount > g->numports)
+      flatcount = idlescan_countopen(g->proxy, target, g->ports, g->numports,
+                                     NULL, NULL);
+    if (flatcount == 0)
+      continue;
+
+    if (g->numports > 1) {
+      retry2 = flatcount;
+      flatcount = idle_treescan(g->proxy, target, g->ports, g->numports,
+                                flatcount);
+      adjust_idle_timing(g->proxy, target, retry2, flatcount);
+    } else {
+      if (o.debugging)
+        error("Adjusting timing because my first scan of %d ports, starting with %hu found %d open, while second scan yielded %d", g->numports, g->ports[0], 0, flatcount);
+      adjust_idle_timing(g->proxy, target, 0, flatcount);
+      if (flatcount == 1)
+        target->ports.setPortState(g->ports[0], IPPROTO_TCP, PORT_OPEN);
+    }
+  }
+}
+
+/* Set up a zombie for each comma-separated entry in proxyNames. */
+static void initialize_idleproxies(std::vector<struct idle_proxy_info *> &proxies,
+                                   const char *proxyNames, Target *target,
+                                   const struct scan_lists *ports) {
+  char *names, *name, *next;
+  struct idle_proxy_info *proxy;
+  size_t i;
+
+  names = strdup(proxyNames);
+  for (name = names; name != NULL; name = next) {
+    next = strchr(name, ',');
+    if (next != NULL)
+      *next++ = '\0';
+    if (*name == '\0')
+      continue;
+    if (strlen(name) > FQDN_LEN)
+      fatal("Idle scan zombie specification \"%s\" is too long", name);
+    if (proxies.size() >= MAX_IDLE_ZOMBIES)
+      fatal("Idle scan can use at most %d zombies", MAX_IDLE_ZOMBIES);
+
+    proxy = new struct idle_proxy_info;
+    initialize_idleproxy(proxy, name, target, ports);
+    for (i = 0; i < proxies.size(); i++) {
+      if (sockaddr_storage_cmp(proxy->host.TargetSockAddr(),
+                               proxies[i]->host.TargetSockAddr()) == 0)
+        fatal("Idle scan zombie %s (%s) was given more than once", name,
+              proxy->host.targetipstr());
+    }
+    proxies.push_back(proxy);
+  }
+  free(names);
+
+  if (proxies.empty())
+    fatal("idle scan requires a proxy host");
+}
+
 /* The very top-level idle scan function -- scans the given target
-   host using the given proxy -- the proxy is cached so that you can keep
-   calling this function with different targets */
+   host using the given proxies -- the proxies are cached so that you can keep
+   calling this function with different targets. proxyName is one zombie, or
+   a comma-separated list of them to scan through in parallel. */
 void idle_scan(Target *target, u16 *portarray, int numports,
                char *proxyName, const struct scan_lists *ports) {
 
-  static char lastproxy[FQDN_LEN + 1] = ""; /* The proxy used in any previous call */
-  static struct idle_proxy_info proxy;
+  static std::string lastproxy; /* The proxy used in any previous call */
+  static std::vector<struct idle_proxy_info *> proxies;
+  struct idle_proxy_info *proxy;
+  std::vector<struct idle_group> groups;
+  struct idle_group group;
   int groupsz;
   int portidx = 0; /* Used for splitting the port array into chunks */
   int portsleft;
+  int sizes[MAX_IDLE_ZOMBIES], starts[MAX_IDLE_ZOMBIES], lens[MAX_IDLE_ZOMBIES];
+  int ngroups;
+  size_t i;
   char scanname[128];
   Snprintf(scanname, sizeof(scanname), "idle scan against %s", target->NameIP());
   ScanProgressMeter SPM(scanname);
@@ -1338,7 +1555,7 @@ void idle_scan(Target *target, u16 *portarray, int numports,
   if (!proxyName)
     fatal("idle scan requires a proxy host");
 
-  if (*lastproxy && strcmp(proxyName, lastproxy))
+  if (!lastproxy.empty() && lastproxy != proxyName)
     fatal("%s: You are not allowed to change proxies midstream.  Sorry", __func__);
   assert(target);
 
@@ -1353,20 +1570,27 @@ void idle_scan(Target *target, u16 *portarray, int numports,
   target->startTimeOutClock(NULL);
 
   /* If this is the first call,  */
-  if (!*lastproxy) {
-    initialize_idleproxy(&proxy, proxyName, target, ports);
-    strncpy(lastproxy, proxyName, sizeof(lastproxy));
+  if (lastproxy.empty()) {
+    initialize_idleproxies(proxies, proxyName, target, ports);
+    lastproxy = proxyName;
   }
+  proxy = proxies[0];
 
   /* If we don't have timing infoz for the new target, we'll use values
-     derived from the proxy */
+     derived from the proxies */
   if (target->to.srtt == -1 && target->to.rttvar == -1) {
-    target->to.srtt = MAX(200000, 2 * proxy.host.to.srtt);
-    target->to.rttvar = MAX(10000, MIN(proxy.host.to.rttvar, 2000000));
+    target->to.srtt = MAX(200000, 2 * proxy->host.to.srtt);
+    target->to.rttvar = MAX(10000, MIN(proxy->host.to.rttvar, 2000000));
+    for (i = 1; i < proxies.size(); i++) {
+      target->to.srtt = MAX(target->to.srtt, 2 * proxies[i]->host.to.srtt);
+      target->to.rttvar = MAX(target->to.rttvar, MIN(proxies[i]->host.to.rttvar, 2000000));
+    }
     target->to.timeout = target->to.srtt + (target->to.rttvar << 2);
   } else {
-    target->to.srtt = MAX(target->to.srtt, proxy.host.to.srtt);
-    target->to.rttvar = MAX(target->to.rttvar, proxy.host.to.rttvar);
+    for (i = 0; i < proxies.size(); i++) {
+      target->to.srtt = MAX(target->to.srtt, proxies[i]->host.to.srtt);
+      target->to.rttvar = MAX(target->to.rttvar, proxies[i]->host.to.rttvar);
+    }
     target->to.timeout = target->to.srtt + (target->to.rttvar << 2);
   }
 
@@ -1376,11 +1600,32 @@ void idle_scan(Target *target, u16 *portarray, int numports,
      space into smaller groups and then call a recursive
      divide-and-conquer function to find the open ports */
   while (portidx < numports) {
-    portsleft = numports - portidx;
-    /* current_groupsz is doubled below because idle_subscan cuts in half */
-    groupsz = MIN(portsleft, (int) (proxy.current_groupsz * 2));
-    idle_treescan(&proxy, target, portarray + portidx, groupsz, -1);
-    portidx += groupsz;
+    if (proxies.size() == 1) {
+      portsleft = numports - portidx;
+      /* current_groupsz is doubled below because idle_subscan cuts in half */
+      groupsz = MIN(portsleft, (int) (proxy->current_groupsz * 2));
+      idle_treescan(proxy, target, portarray + portidx, groupsz, -1);
+      portidx += groupsz;
+      continue;
+    }
+
+    /* With several zombies, give each one a group of the size it has
+       earned on its own, and count all the groups at once. */
+    groups.clear();
+    for (i = 0; i < proxies.size(); i++)
+      sizes[i] = (int) proxies[i]->current_groupsz;
+    ngroups = idle_split_ports(numports, portidx, sizes, proxies.size(),
+                               starts, lens);
+    for (i = 0; i < (size_t) ngroups; i++) {
+      group.proxy = proxies[i];
+      group.ports = portarray + starts[i];
+      group.numports = lens[i];
+      groups.push_back(group);
+      portidx += lens[i];
+    }
+    idle_multiscan(target, &groups[0], groups.size());
+    if (SPM.mayBePrinted(NULL))
+      SPM.printStatsIfNecessary((double) portidx / numports, NULL);
   }
 
 
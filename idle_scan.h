@@ -72,11 +72,31 @@
 
 class Target;
 
+/* The most zombies that can be given to -sI at once */
+#define MAX_IDLE_ZOMBIES 16
+
 /* Handles the scan types where no positive-acknowledgment of open
    port is received (those scans are in pos_scan).  Super_scan
    includes scans such as FIN/XMAS/NULL/Maimon/UDP and IP Proto scans */
 void idle_scan(Target *target, u16 *portarray, int numports,
                char *proxy, const struct scan_lists *ports);
 
+/* Returns the number of increments between an early IP ID and a later
+   one, assuming the given IP ID Sequencing class (IPID_SEQ_* in
+   osscan2.h).  Returns -1 if the distance cannot be determined */
+int ipid_distance(int seqclass, u32 startid, u32 endid);
+
+/* Returns the number of open ports counted through a zombie whose IP ID
+   went from latestid to newid while it answered probes_sent of our IP ID
+   probes. Negative if the count can't be made. */
+int idle_count_ports(int seqclass, u32 latestid, u32 newid, int probes_sent);
+
+/* Splits the ports from index portidx on into one group per zombie for a
+   round of a scan through several zombies, zombie i getting up to
+   groupsz[i] ports. Returns the number of groups filled into group_start
+   and group_len. */
+int idle_split_ports(int numports, int portidx, const int *groupsz,
+                     int nzombies, int *group_start, int *group_len);
+
 #endif /* IDLE_SCAN_H */
 
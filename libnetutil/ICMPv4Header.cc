@@ -975,7 +975,7 @@ u32 ICMPv4Header::getOutputLinkMTU() const {
  *  8bytes + ValueInFieldNumberOfAddresses*8, we only return 8 because we
  *  cannot guarantee that the NumberOfAddresses field has been set before
  *  the call to this method. Same applies to the rest of types.              */
-int ICMPv4Header::getICMPHeaderLengthFromType( u8 type ) const {
+int ICMPv4Header::getICMPHeaderLengthFromType( u8 type ){
 
   switch( type ){
 
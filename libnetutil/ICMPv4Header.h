@@ -521,7 +521,7 @@ class ICMPv4Header : public ICMPHeader {
         u32 getOutputLinkMTU() const;
 
         /* Misc */
-        int getICMPHeaderLengthFromType( u8 type ) const;
+        static int getICMPHeaderLengthFromType( u8 type );
         const char *type2string(int type, int code) const;
         bool isError() const;
 
@@ -1112,7 +1112,7 @@ struct in6_addr ICMPv6Header::getMulticastAddress() const {
   * bytes but then the packet may contain ICMPv6 options. We only return 40
   * because we don't know in advance the total number of bytes for the message.
   * Same applies to the rest of types. */
-int ICMPv6Header::getHeaderLengthFromType(u8 type) const {
+int ICMPv6Header::getHeaderLengthFromType(u8 type){
 
   switch( type ){
     case ICMPv6_UNREACH:
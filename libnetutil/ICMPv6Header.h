@@ -661,7 +661,7 @@ class ICMPv6Header : public ICMPHeader {
         struct in6_addr getMulticastAddress() const;
 
         /* Misc */
-        int getHeaderLengthFromType(u8 type) const;
+        static int getHeaderLengthFromType(u8 type);
         bool isError() const;
         const char *type2string(int type, int code) const;
 
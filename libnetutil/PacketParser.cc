@@ -120,34 +120,191 @@ const char *PacketParser::header_type2string(int val){
 
 
 
-#define MAX_HEADERS_IN_PACKET 32
-pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_included){
+/* Reads a 16-bit field in network byte order. */
+static inline u16 get16(const u8 *p){
+  return (p[0] << 8) | p[1];
+} /* End of get16() */
+
+
+/* Sets the layer and header type that follow an IPv4 header carrying the
+ * given protocol. */
+static void next_after_ipv4(u8 proto, int *next_layer, int *expected){
+  switch(proto){
+    case HEADER_TYPE_ICMPv4:
+    case HEADER_TYPE_TCP:
+    case HEADER_TYPE_UDP:
+    case HEADER_TYPE_SCTP:
+        *next_layer=TRANSPORT_LAYER;
+        *expected=proto;
+    break;
+    case HEADER_TYPE_IPv4: /* IP in IP */
+    case HEADER_TYPE_IPv6: /* IPv6 in IPv4 */
+        *next_layer=NETWORK_LAYER;
+        *expected=proto;
+    break;
+    default:
+        *next_layer=APPLICATION_LAYER;
+        *expected=HEADER_TYPE_RAW_DATA;
+    break;
+  }
+} /* End of next_after_ipv4() */
+
+
+/* Same as next_after_ipv4() for the Next Header field of an IPv6 header or
+ * of an IPv6 extension header. */
+static void next_after_ipv6(u8 nh, int *next_layer, int *expected){
+  switch(nh){
+    case HEADER_TYPE_ICMPv6:
+    case HEADER_TYPE_TCP:
+    case HEADER_TYPE_UDP:
+    case HEADER_TYPE_SCTP:
+        *next_layer=TRANSPORT_LAYER;
+        *expected=nh;
+    break;
+    case HEADER_TYPE_IPv4: /* IPv4 in IPv6 */
+    case HEADER_TYPE_IPv6: /* IPv6 in IPv6 */
+        *next_layer=NETWORK_LAYER;
+        *expected=nh;
+    break;
+    case HEADER_TYPE_IPv6_HOPOPT:
+    case HEADER_TYPE_IPv6_OPTS:
+    case HEADER_TYPE_IPv6_ROUTE:
+    case HEADER_TYPE_IPv6_FRAG:
+        *next_layer=EXTHEADERS_LAYER;
+        *expected=nh;
+    break;
+    default:
+        *next_layer=APPLICATION_LAYER;
+        *expected=HEADER_TYPE_RAW_DATA;
+    break;
+  }
+} /* End of next_after_ipv6() */
+
+
+/* Checks the TLV-encoded options of a Hop-by-Hop or Destination Options
+ * header the way HopByHopHeader::validate() does. */
+static bool valid_ext_options(const u8 *opt, int left){
+  while(left>0){
+    if(opt[0]==EXTOPT_PAD1){
+        opt++;
+        left--;
+        continue;
+    }
+    if(left<2)
+        return false;
+    /* Options of a known type must have the length it calls for. */
+    switch(opt[0]){
+        case EXTOPT_JUMBO:
+            if(opt[1]!=4) return false;
+        break;
+        case EXTOPT_TUNENCAPLIM:
+            if(opt[1]!=1) return false;
+        break;
+        case EXTOPT_ROUTERALERT:
+            if(opt[1]!=2) return false;
+        break;
+        case EXTOPT_QUICKSTART:
+            if(opt[1]!=6) return false;
+        break;
+        case EXTOPT_CALIPSO:
+            if(opt[1]<8) return false;
+        break;
+        case EXTOPT_HOMEADDR:
+            if(opt[1]!=16) return false;
+        break;
+        default:
+        break;
+    }
+    if(left<2+opt[1])
+        return false;
+    left-=2+opt[1];
+    opt+=2+opt[1];
+  }
+  return true;
+} /* End of valid_ext_options() */
+
+
+/* Returns the length of the IPv6 extension header of the given type at hdr,
+ * which has len bytes after it, or -1 if the header is not valid. The checks
+ * are those of the storeRecvData() and validate() methods of HopByHopHeader,
+ * DestOptsHeader, RoutingHeader and FragmentHeader. */
+static int ext_header_len(int type, const u8 *hdr, size_t len){
+  size_t hlen;
+
+  switch(type){
+    case HEADER_TYPE_IPv6_HOPOPT:
+    case HEADER_TYPE_IPv6_OPTS:
+        if(len<HOPBYHOP_MIN_HEADER_LEN)
+            return -1;
+        hlen=(hdr[1]+1)*8;
+        if(hlen>len || !valid_ext_options(hdr+2, hlen-2))
+            return -1;
+        return hlen;
+
+    case HEADER_TYPE_IPv6_ROUTE:
+        if(len<ROUTING_HEADER_MIN_LEN)
+            return -1;
+        hlen=(hdr[1]+1)*8;
+        switch(hdr[2]){
+            /* Routing Type 0: an even HdrExtLen and no more segments left
+             * than it has addresses. */
+            case 0:
+                if(hdr[1]%2==1 || hlen>len || hdr[3]>hdr[1]/2)
+                    return -1;
+                return hlen;
+            /* Routing Type 2 (RFC 6275): fixed length and contents. */
+            case 2:
+                if(len<ROUTING_TYPE_2_HEADER_LEN || hdr[1]!=2 || hdr[3]!=1)
+                    return -1;
+                return ROUTING_TYPE_2_HEADER_LEN;
+            default:
+                if(hlen>len)
+                    return -1;
+                return hlen;
+        }
+
+    case HEADER_TYPE_IPv6_FRAG:
+        if(len<FRAGMENT_HEADER_LEN)
+            return -1;
+        return FRAGMENT_HEADER_LEN;
+  }
+  return -1;
+} /* End of ext_header_len() */
+
+
+/* Returns true if the len bytes at p look like an Ethernet/IPv4 ARP message.
+ * This is how ARP is recognized when there is no link layer header to say
+ * so. */
+static bool looks_like_arp(const u8 *p, size_t len){
+  return len>=ARP_HEADER_LEN && get16(p)==HDR_ETH10MB && get16(p+2)==0x0800
+         && p[4]==ETH_ADDRESS_LEN && p[5]==IPv4_ADDRESS_LEN;
+} /* End of looks_like_arp() */
+
+
+/** Finds the headers of a packet and describes them in "view", without
+  * copying anything out of the packet or allocating any memory. A header is
+  * accepted under the same rules that the storeRecvData() and validate()
+  * methods of its PacketElement class apply; the first one that fails them,
+  * and everything after it, is taken to be raw data. Any PacketElement chain
+  * is built later, if at all, by split(view).
+  * Returns the number of headers found. */
+int PacketParser::parse_view(const u8 *pkt, size_t pktlen, bool eth_included, packet_view_t *view){
   if(PKTPARSERDEBUG)printf("%s(%p, %lu)\n", __func__, pkt, (long unsigned)pktlen);
-  static pkt_type_t this_packet[MAX_HEADERS_IN_PACKET+1]; /* Packet structure array   */
-  u8 current_header=0;             /* Current array position of "this_packet" */
-  const u8 *curr_pkt=pkt;          /* Pointer to current part of the packet   */
-  size_t curr_pktlen=pktlen;       /* Remaining packet length                 */
-  int ethlen=0, arplen=0;          /* Aux length variables: link layer        */
-  int iplen=0,ip6len=0;            /* Aux length variables: network layer     */
-  int tcplen=0,udplen=0,icmplen=0; /* Aux length variables: transport layer   */
-  int exthdrlen=0;                 /* Aux length variables: extension headers */
-  int next_layer=0;                /* Next header type to process             */
-  int expected=0;                  /* Next protocol expected                  */
-  bool finished=false;             /* Loop breaking flag                      */
-  bool unknown_hdr=false;          /* Indicates unknown header found          */
-  IPv4Header ip4;
-  IPv6Header ip6;
-  TCPHeader tcp;
-  UDPHeader udp;
-  ICMPv4Header icmp4;
-  ICMPv6Header icmp6;
-  EthernetHeader eth;
-  DestOptsHeader ext_dopts;
-  FragmentHeader ext_frag;
-  HopByHopHeader ext_hopt;
-  RoutingHeader ext_routing;
-  ARPHeader arp;
-  memset(this_packet, 0, sizeof(this_packet));
+  size_t off=0;                    /* Where the current header starts     */
+  size_t left=pktlen;              /* Bytes from there to the end         */
+  size_t hlen=0;                   /* Length of the current header        */
+  int type=0;                      /* Type of the current header          */
+  int next_layer=0;                /* Next header type to process         */
+  int expected=0;                  /* Next protocol expected              */
+  bool finished=false;             /* Loop breaking flag                  */
+  bool unknown_hdr=false;          /* Indicates unknown header found      */
+  const u8 *p=NULL;
+
+  view->pkt=pkt;
+  view->pktlen=pktlen;
+  view->count=0;
+  if(pkt==NULL)
+    left=0;
 
   /* Decide which layer we have to start from */
   if( eth_included ){
@@ -158,29 +315,25 @@ pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_in
   }
 
   /* Header processing loop */
-  while(!finished && curr_pktlen>0 && current_header<MAX_HEADERS_IN_PACKET){
+  while(!finished && left>0 && view->count<MAX_HEADERS_IN_PACKET){
+    p=pkt+off;
     /* Ethernet and ARP headers ***********************************************/
-    if(next_layer==LINK_LAYER ){
-        if(PKTPARSERDEBUG)puts("Next Layer=Link");
+    if(next_layer==LINK_LAYER){
         if(expected==HEADER_TYPE_ETHERNET){
-            if(PKTPARSERDEBUG)puts("Expected Layer=Ethernet");
-            if(eth.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE){
-                unknown_hdr=true;
-                break;
-            }
-            if( (ethlen=eth.validate())==OP_FAILURE){
+            if(left<ETH_HEADER_LEN){
                 unknown_hdr=true;
                 break;
             }
-            /* Determine next header type */
-            switch( eth.getEtherType() ){
+            type=HEADER_TYPE_ETHERNET;
+            hlen=ETH_HEADER_LEN;
+            switch( get16(p+12) ){
                 case ETHTYPE_IPV4:
-                    expected=HEADER_TYPE_IPv4;
                     next_layer=NETWORK_LAYER;
+                    expected=HEADER_TYPE_IPv4;
                 break;
                 case ETHTYPE_IPV6:
-                    expected=HEADER_TYPE_IPv6;
                     next_layer=NETWORK_LAYER;
+                    expected=HEADER_TYPE_IPv6;
                 break;
                 case ETHTYPE_ARP:
                     next_layer=LINK_LAYER;
@@ -191,194 +344,79 @@ pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_in
                     expected=HEADER_TYPE_RAW_DATA;
                 break;
             }
-            this_packet[current_header].length=ethlen;
-            this_packet[current_header++].type=HEADER_TYPE_ETHERNET;
-            eth.reset();
-            curr_pkt+=ethlen;
-            curr_pktlen-=ethlen;
-        }else if(expected==HEADER_TYPE_ARP){
-            if(PKTPARSERDEBUG)puts("Expected Layer=ARP");
-            if(arp.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE){
-                unknown_hdr=true;
-                break;
-            }
-            if( (arplen=arp.validate())==OP_FAILURE){
+        }else{
+            if(left<ARP_HEADER_LEN){
                 unknown_hdr=true;
                 break;
             }
-            this_packet[current_header].length=arplen;
-            this_packet[current_header++].type=HEADER_TYPE_ARP;
-            arp.reset();
-            curr_pkt+=arplen;
-            curr_pktlen-=arplen;
-            if(curr_pktlen>0){
-                next_layer=APPLICATION_LAYER;
-                expected=HEADER_TYPE_RAW_DATA;
-            }else{
-                finished=true;
-            }
-        }else{
-            assert(finished==true);
+            type=HEADER_TYPE_ARP;
+            hlen=ARP_HEADER_LEN;
+            next_layer=APPLICATION_LAYER;
+            expected=HEADER_TYPE_RAW_DATA;
         }
     /* IPv4 and IPv6 headers **************************************************/
     }else if(next_layer==NETWORK_LAYER){
-        if(PKTPARSERDEBUG)puts("Next Layer=Network");
-        /* Determine IP version */
-        if (ip4.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE){
+        if(left<IP_HEADER_LEN){
             unknown_hdr=true;
             break;
         }
-
-        /* IP version 4 ---------------------------------*/
-        if(ip4.getVersion()==4){
-            if( (iplen=ip4.validate())==OP_FAILURE){
-                unknown_hdr=true;
-                break;
-            }
-            /* Determine next header type */
-            switch(ip4.getNextProto()){
-                case HEADER_TYPE_ICMPv4:
-                    next_layer=TRANSPORT_LAYER;
-                    expected=HEADER_TYPE_ICMPv4;
-                break;
-                case HEADER_TYPE_IPv4: /* IP in IP */
-                    next_layer=NETWORK_LAYER;
-                    expected=HEADER_TYPE_IPv4;
-                break;
-                case HEADER_TYPE_TCP:
-                    next_layer=TRANSPORT_LAYER;
-                    expected=HEADER_TYPE_TCP;
-                break;
-                case HEADER_TYPE_UDP:
-                    next_layer=TRANSPORT_LAYER;
-                    expected=HEADER_TYPE_UDP;
-                break;
-                case HEADER_TYPE_IPv6: /* IPv6 in IPv4 */
-                    next_layer=NETWORK_LAYER;
-                    expected=HEADER_TYPE_IPv6;
-                break;
-                default:
-                    next_layer=APPLICATION_LAYER;
-                    expected=HEADER_TYPE_RAW_DATA;
-                break;
-            }
-            this_packet[current_header].length=iplen;
-            this_packet[current_header++].type=HEADER_TYPE_IPv4;
-            ip4.reset();
-            curr_pkt+=iplen;
-            curr_pktlen-=iplen;
-        /* IP version 6 ---------------------------------*/
-        }else if(ip4.getVersion()==6){
-            ip4.reset();
-            if (ip6.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE){
+        if((p[0]>>4)==4){
+            hlen=(p[0]&0x0F)*4;
+            if(hlen<IP_HEADER_LEN || hlen>left){
                 unknown_hdr=true;
                 break;
             }
-            if( (ip6len=ip6.validate())==OP_FAILURE ){
+            type=HEADER_TYPE_IPv4;
+            next_after_ipv4(p[9], &next_layer, &expected);
+        }else if((p[0]>>4)==6){
+            if(left<IPv6_HEADER_LEN){
                 unknown_hdr=true;
                 break;
             }
-            switch( ip6.getNextHeader() ){
-                case HEADER_TYPE_ICMPv6:
-                    next_layer=TRANSPORT_LAYER;
-                    expected=HEADER_TYPE_ICMPv6;
-                break;
-                case HEADER_TYPE_IPv4: /* IPv4 in IPv6 */
-                    next_layer=NETWORK_LAYER;
-                    expected=HEADER_TYPE_IPv4;
-                break;
-                case HEADER_TYPE_TCP:
-                    next_layer=TRANSPORT_LAYER;
-                    expected=HEADER_TYPE_TCP;
-                break;
-                case HEADER_TYPE_UDP:
-                    next_layer=TRANSPORT_LAYER;
-                    expected=HEADER_TYPE_UDP;
-                break;
-                case HEADER_TYPE_IPv6: /* IPv6 in IPv6 */
-                    next_layer=NETWORK_LAYER;
-                    expected=HEADER_TYPE_IPv6;
-                break;
-                case HEADER_TYPE_IPv6_HOPOPT:
-                    next_layer=EXTHEADERS_LAYER;
-                    expected=HEADER_TYPE_IPv6_HOPOPT;
-                break;
-                case HEADER_TYPE_IPv6_OPTS:
-                    next_layer=EXTHEADERS_LAYER;
-                    expected=HEADER_TYPE_IPv6_OPTS;
-                break;
-                case HEADER_TYPE_IPv6_ROUTE:
-                    next_layer=EXTHEADERS_LAYER;
-                    expected=HEADER_TYPE_IPv6_ROUTE;
-                break;
-                case HEADER_TYPE_IPv6_FRAG:
-                    next_layer=EXTHEADERS_LAYER;
-                    expected=HEADER_TYPE_IPv6_FRAG;
-                break;
-                default:
-                    next_layer=APPLICATION_LAYER;
-                    expected=HEADER_TYPE_RAW_DATA;
-                break;
-            }
-            this_packet[current_header].length=ip6len;
-            this_packet[current_header++].type=HEADER_TYPE_IPv6;
-            ip6.reset();
-            curr_pkt+=ip6len;
-            curr_pktlen-=ip6len;
-        /* Bogus IP version -----------------------------*/
+            type=HEADER_TYPE_IPv6;
+            hlen=IPv6_HEADER_LEN;
+            next_after_ipv6(p[6], &next_layer, &expected);
         }else{
             /* Wrong IP version, treat as raw data. */
             next_layer=APPLICATION_LAYER;
             expected=HEADER_TYPE_RAW_DATA;
+            continue;
         }
-    /* TCP, UDP, ICMPv4 and ICMPv6 headers ************************************/
+    /* TCP, UDP, SCTP, ICMPv4 and ICMPv6 headers ******************************/
     }else if(next_layer==TRANSPORT_LAYER){
-        if(PKTPARSERDEBUG)puts("Next Layer=Transport");
-        if(expected==HEADER_TYPE_TCP){
-            if(PKTPARSERDEBUG)puts("Expected Layer=TCP");
-            if(tcp.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE ){
-                unknown_hdr=true;
-                break;
-            }
-            if( (tcplen=tcp.validate())==OP_FAILURE){
+        type=expected;
+        next_layer=APPLICATION_LAYER;
+        expected=HEADER_TYPE_RAW_DATA;
+        if(type==HEADER_TYPE_TCP){
+            if(left<TCP_HEADER_LEN){
                 unknown_hdr=true;
                 break;
             }
-            expected=HEADER_TYPE_RAW_DATA;
-            this_packet[current_header].length=tcplen;
-            this_packet[current_header++].type=HEADER_TYPE_TCP;
-            tcp.reset();
-            curr_pkt+=tcplen;
-            curr_pktlen-=tcplen;
-            next_layer=APPLICATION_LAYER;
-        }else if(expected==HEADER_TYPE_UDP){
-            if(PKTPARSERDEBUG)puts("Expected Layer=UDP");
-            if(udp.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE ){
+            hlen=(p[12]>>4)*4;
+            if(hlen<TCP_HEADER_LEN || hlen>left){
                 unknown_hdr=true;
                 break;
             }
-            if( (udplen=udp.validate())==OP_FAILURE){
+        }else if(type==HEADER_TYPE_UDP){
+            if(left<UDP_HEADER_LEN){
                 unknown_hdr=true;
                 break;
             }
-            expected=HEADER_TYPE_RAW_DATA;
-            this_packet[current_header].length=udplen;
-            this_packet[current_header++].type=HEADER_TYPE_UDP;
-            udp.reset();
-            curr_pkt+=udplen;
-            curr_pktlen-=udplen;
-            next_layer=APPLICATION_LAYER;
-        }else if(expected==HEADER_TYPE_ICMPv4){
-            if(PKTPARSERDEBUG)puts("Expected Layer=ICMPv4");
-            if(icmp4.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE ){
+            hlen=UDP_HEADER_LEN;
+        }else if(type==HEADER_TYPE_SCTP){
+            /* Common header only; the chunks are left as raw data. */
+            if(left<SCTP_COMMON_HEADER_LEN){
                 unknown_hdr=true;
                 break;
             }
-            if( (icmplen=icmp4.validate())==OP_FAILURE){
+            hlen=SCTP_COMMON_HEADER_LEN;
+        }else if(type==HEADER_TYPE_ICMPv4){
+            hlen=ICMPv4Header::getICMPHeaderLengthFromType(p[0]);
+            if(left<ICMP_STD_HEADER_LEN || hlen>left){
                 unknown_hdr=true;
                 break;
             }
-            switch( icmp4.getType() ){
+            switch(p[0]){
                 /* Types that include an IPv4 packet as payload */
                 case ICMP_UNREACH:
                 case ICMP_TIMXCEED:
@@ -388,28 +426,14 @@ pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_in
                     next_layer=NETWORK_LAYER;
                     expected=HEADER_TYPE_IPv4;
                 break;
-                /* ICMP types that include misc payloads (or no payload) */
-                default:
-                    expected=HEADER_TYPE_RAW_DATA;
-                    next_layer=APPLICATION_LAYER;
-                break;
-            }
-            this_packet[current_header].length=icmplen;
-            this_packet[current_header++].type=HEADER_TYPE_ICMPv4;
-            icmp4.reset();
-            curr_pkt+=icmplen;
-            curr_pktlen-=icmplen;
-        }else if(expected==HEADER_TYPE_ICMPv6){
-            if(PKTPARSERDEBUG)puts("Expected Layer=ICMPv6");
-            if(icmp6.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE){
-                unknown_hdr=true;
-                break;
             }
-            if( (icmplen=icmp6.validate())==OP_FAILURE){
+        }else{ /* HEADER_TYPE_ICMPv6 */
+            hlen=ICMPv6Header::getHeaderLengthFromType(p[0]);
+            if(left<ICMPv6_MIN_HEADER_LEN || hlen>left){
                 unknown_hdr=true;
                 break;
             }
-            switch( icmp6.getType() ){
+            switch(p[0]){
                 /* Types that include an IPv6 packet as payload */
                 case ICMPv6_UNREACH:
                 case ICMPv6_PKTTOOBIG:
@@ -418,193 +442,75 @@ pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_in
                     next_layer=NETWORK_LAYER;
                     expected=HEADER_TYPE_IPv6;
                 break;
-                /* ICMPv6 types that include misc payloads (or no payload) */
-                default:
-                    expected=HEADER_TYPE_RAW_DATA;
-                    next_layer=APPLICATION_LAYER;
-                break;
             }
-            this_packet[current_header].length=icmplen;
-            this_packet[current_header++].type=HEADER_TYPE_ICMPv6;
-            icmp6.reset();
-            curr_pkt+=icmplen;
-            curr_pktlen-=icmplen;
-        }else{
-            /* Wrong application layer protocol, treat as raw data. */
-            next_layer=APPLICATION_LAYER;
-            expected=HEADER_TYPE_RAW_DATA;
         }
-
-    /* IPv6 Extension Headers */
+    /* IPv6 Extension Headers *************************************************/
     }else if(next_layer==EXTHEADERS_LAYER){
-        if(PKTPARSERDEBUG)puts("Next Layer=ExtHdr");
-        u8 ext_next=0;
-        /* Hop-by-Hop Options */
-        if(expected==HEADER_TYPE_IPv6_HOPOPT){
-            if(PKTPARSERDEBUG)puts("Expected=Hopt");
-            if(ext_hopt.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE ){
-                unknown_hdr=true;
-                break;
-            }
-            if( (exthdrlen=ext_hopt.validate())==OP_FAILURE){
-                unknown_hdr=true;
-                break;
-            }
-            ext_next=ext_hopt.getNextHeader();
-            ext_hopt.reset();
-        /* Routing Header */
-        }else if(expected==HEADER_TYPE_IPv6_ROUTE){
-            if(PKTPARSERDEBUG)puts("Expected=Route");
-            if(ext_routing.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE ){
-                unknown_hdr=true;
-                break;
-            }
-            if( (exthdrlen=ext_routing.validate())==OP_FAILURE){
-                unknown_hdr=true;
-                break;
-            }
-            ext_next=ext_routing.getNextHeader();
-            ext_routing.reset();
-        /* Fragmentation Header */
-        }else if(expected==HEADER_TYPE_IPv6_FRAG){
-            if(PKTPARSERDEBUG)puts("Expected=Frag");
-            if(ext_frag.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE ){
-                unknown_hdr=true;
-                break;
-            }
-            if( (exthdrlen=ext_frag.validate())==OP_FAILURE){
-                unknown_hdr=true;
-                break;
-            }
-            ext_next=ext_frag.getNextHeader();
-            ext_frag.reset();
-        /* Destination Options Header */
-        }else if(expected==HEADER_TYPE_IPv6_OPTS){
-            if(PKTPARSERDEBUG)puts("Expected=Dopts");
-            if(ext_dopts.storeRecvData(curr_pkt, curr_pktlen)==OP_FAILURE ){
-                unknown_hdr=true;
-                break;
-            }
-            if( (exthdrlen=ext_dopts.validate())==OP_FAILURE){
-                unknown_hdr=true;
-                break;
-            }
-            ext_next=ext_dopts.getNextHeader();
-            ext_dopts.reset();
-        }else{
-            /* Should never happen. */
+        int len=ext_header_len(expected, p, left);
+        if(len<0){
             unknown_hdr=true;
             break;
         }
-
-        /* Update the info for this header */
-        this_packet[current_header].length=exthdrlen;
-        this_packet[current_header++].type=expected;
-        curr_pkt+=exthdrlen;
-        curr_pktlen-=exthdrlen;
-
-        /* Lets's see what comes next */
-        switch(ext_next){
-            case HEADER_TYPE_ICMPv6:
-                next_layer=TRANSPORT_LAYER;
-                expected=HEADER_TYPE_ICMPv6;
-            break;
-            case HEADER_TYPE_IPv4: /* IPv4 in IPv6 */
-                next_layer=NETWORK_LAYER;
-                expected=HEADER_TYPE_IPv4;
-            break;
-            case HEADER_TYPE_TCP:
-                next_layer=TRANSPORT_LAYER;
-                expected=HEADER_TYPE_TCP;
-            break;
-            case HEADER_TYPE_UDP:
-                next_layer=TRANSPORT_LAYER;
-                expected=HEADER_TYPE_UDP;
-            break;
-            case HEADER_TYPE_IPv6: /* IPv6 in IPv6 */
-                next_layer=NETWORK_LAYER;
-                expected=HEADER_TYPE_IPv6;
-            break;
-            case HEADER_TYPE_IPv6_HOPOPT:
-                next_layer=EXTHEADERS_LAYER;
-                expected=HEADER_TYPE_IPv6_HOPOPT;
-            break;
-            case HEADER_TYPE_IPv6_OPTS:
-                next_layer=EXTHEADERS_LAYER;
-                expected=HEADER_TYPE_IPv6_OPTS;
-            break;
-            case HEADER_TYPE_IPv6_ROUTE:
-                next_layer=EXTHEADERS_LAYER;
-                expected=HEADER_TYPE_IPv6_ROUTE;
-            break;
-            case HEADER_TYPE_IPv6_FRAG:
-                next_layer=EXTHEADERS_LAYER;
-                expected=HEADER_TYPE_IPv6_FRAG;
-            break;
-            default:
-                next_layer=APPLICATION_LAYER;
-                expected=HEADER_TYPE_RAW_DATA;
-            break;
-        }
-
+        type=expected;
+        hlen=len;
+        next_after_ipv6(p[0], &next_layer, &expected);
     /* Miscellaneous payloads *************************************************/
     }else{ // next_layer==APPLICATION_LAYER
-        if(PKTPARSERDEBUG)puts("Next Layer=Application");
-
         /* If we get here it is possible that the packet is ARP but
-         * we have no access to the original Ethernet header. We
-         * determine if this header is ARP by checking its size
-         * and checking for some common values. */
-        if(arp.storeRecvData(curr_pkt, curr_pktlen)!=OP_FAILURE){
-          if( (arplen=arp.validate())!=OP_FAILURE){
-            if(arp.getHardwareType()==HDR_ETH10MB){
-              if(arp.getProtocolType()==0x0800){
-                if(arp.getHwAddrLen()==ETH_ADDRESS_LEN){
-                  if(arp.getProtoAddrLen()==IPv4_ADDRESS_LEN){
-                    this_packet[current_header].length=arplen;
-                    this_packet[current_header++].type=HEADER_TYPE_ARP;
-                    arp.reset();
-                    curr_pkt+=arplen;
-                    curr_pktlen-=arplen;
-                    if(curr_pktlen>0){
-                        next_layer=APPLICATION_LAYER;
-                        expected=HEADER_TYPE_RAW_DATA;
-                    }else{
-                        finished=true;
-                    }
-                    continue;
-                  }
-                }
-              }
-            }
-          }
+         * we have no access to the original Ethernet header. */
+        if(looks_like_arp(p, left)){
+            type=HEADER_TYPE_ARP;
+            hlen=ARP_HEADER_LEN;
+        }else{
+            type=HEADER_TYPE_RAW_DATA;
+            hlen=left;
+            finished=true;
         }
-
-        //if(expected==HEADER_TYPE_DNS){
-        //}else if(expected==HEADER_TYPE_HTTP){
-        //}... ETC
-        this_packet[current_header].length=curr_pktlen;
-        this_packet[current_header++].type=HEADER_TYPE_RAW_DATA;
-        curr_pktlen=0;
-        finished=true;
     }
+
+    view->hdr[view->count].type=type;
+    view->hdr[view->count].length=hlen;
+    view->offset[view->count++]=off;
+    off+=hlen;
+    left-=hlen;
   } /* End of header processing loop */
 
   /* If we couldn't validate some header, treat that header and any remaining
    * data, as raw application data. */
-  if (unknown_hdr==true && current_header < MAX_HEADERS_IN_PACKET) {
-    if(curr_pktlen>0){
-        if(PKTPARSERDEBUG)puts("Unknown layer found. Treating it as raw data.");
-        this_packet[current_header].length=curr_pktlen;
-        this_packet[current_header++].type=HEADER_TYPE_RAW_DATA;
-    }
+  if(unknown_hdr==true && view->count<MAX_HEADERS_IN_PACKET && left>0){
+    if(PKTPARSERDEBUG)puts("Unknown layer found. Treating it as raw data.");
+    view->hdr[view->count].type=HEADER_TYPE_RAW_DATA;
+    view->hdr[view->count].length=left;
+    view->offset[view->count++]=off;
+  }
+  return view->count;
+} /* End of parse_view() */
+
+
+/** Returns the index in "view" of the first header of the given type at or
+  * after index "start", or -1 if there is none. */
+int PacketParser::find_header(const packet_view_t *view, u32 type, int start){
+  for(int i=start; i<view->count; i++){
+    if(view->hdr[i].type==type)
+        return i;
   }
+  return -1;
+} /* End of find_header() */
+
 
-  /* Ensure the sentinel value is correct: */
-  assert(current_header <= MAX_HEADERS_IN_PACKET);
-  this_packet[current_header].length = 0;
+/* Returns the types and lengths of the headers of a packet, in an array that
+ * ends with an entry of length zero. The array is overwritten by the next
+ * call; parse_view() is the reentrant version. */
+pkt_type_t *PacketParser::parse_packet(const u8 *pkt, size_t pktlen, bool eth_included){
+  static pkt_type_t this_packet[MAX_HEADERS_IN_PACKET+1]; /* Packet structure array   */
+  packet_view_t view;
+
+  parse_view(pkt, pktlen, eth_included, &view);
+  memcpy(this_packet, view.hdr, view.count*sizeof(pkt_type_t));
+  this_packet[view.count].type=0;
+  this_packet[view.count].length=0;
   return this_packet;
-} /* End of parse_received_packet() */
+} /* End of parse_packet() */
 
 
 /* TODO: remove */
@@ -642,47 +548,21 @@ int PacketParser::dummy_print_packet(const u8 *pkt, size_t pktlen, bool eth_incl
   * if the packet did not contain application data and a negative integer in
   * case of error. */
 int PacketParser::payload_offset(const u8 *pkt, size_t pktlen, bool link_included){
-  PacketElement *me=NULL, *aux=NULL;
-  size_t offset=pktlen; /* Initially, point to the end of the packet. */
+  packet_view_t view;
+  int i;
 
   /* Safe checks*/
   if(pkt==NULL || pktlen<=0)
       return -1;
 
-  dummy_print_packet_type(pkt, pktlen, link_included);
-
-  /* Split the packet into separate protocol headers */
-  if( (me=split(pkt, pktlen, link_included))==NULL )
-    return -2;
-  else{
-      aux=me;
-  }
-
-  /* Find if there is application data and where it begins */
-  while(me!=NULL){
-    /* When we find application data, we compute the offset by substacting the
-       length of the application data from the packet's total length */
-    if(me->protocol_id()==HEADER_TYPE_RAW_DATA){
-        offset = pktlen - me->getLen();
-        break;
-    }
-    me = me->getNextElement();
-  }
-
-  /* Free the structs */
-  me=aux;
-  while(me!=NULL){
-    aux=me->getNextElement();
-    delete me;
-    me=aux;
-  }
+  if(PKTPARSERDEBUG)dummy_print_packet_type(pkt, pktlen, link_included);
 
-  /* Return 0 if we didn't find any application data */
-  if(offset==pktlen){
+  /* Application data, if there is any, is the last thing in the packet. Return
+   * 0 if we didn't find any. */
+  parse_view(pkt, pktlen, link_included, &view);
+  if((i=find_header(&view, HEADER_TYPE_RAW_DATA))<0)
       return 0;
-  }else{
-      return offset;
-  }
+  return view.offset[i];
 } /* End of payload_offset() */
 
 
@@ -694,8 +574,18 @@ PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen){
 
 
 PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen, bool eth_included){
-  pkt_type_t *packetheaders=NULL;
-  const u8 *curr_pkt=pkt;
+  packet_view_t view;
+
+  parse_view(pkt, pktlen, eth_included, &view);
+  return split(&view);
+} /* End of split() */
+
+
+/* Builds the chain of PacketElement objects for a packet that has been
+ * through parse_view(). Headers for which there is no class, like SCTP, become
+ * RawData objects. The chain should be freed with freePacketChain(). */
+PacketElement *PacketParser::split(const packet_view_t *view){
+  const u8 *curr_pkt=NULL;
   PacketElement *first=NULL;
   PacketElement *last=NULL;
   IPv4Header *ip4=NULL;
@@ -711,13 +601,11 @@ PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen, bool eth_includ
   EthernetHeader *eth=NULL;
   ARPHeader *arp=NULL;
   RawData *raw=NULL;
-
-  /* Analyze the packet. This returns a list of header types and lengths */
-  if((packetheaders=PacketParser::parse_packet(pkt, pktlen, eth_included))==NULL)
-    return NULL;
+  const pkt_type_t *packetheaders=view->hdr;
 
   /* Store each header in its own PacketHeader object type */
-  for(int i=0; packetheaders[i].length!=0; i++){
+  for(int i=0; i<view->count; i++){
+    curr_pkt=view->pkt+view->offset[i];
 
     switch(packetheaders[i].type){
 
@@ -865,7 +753,6 @@ PacketElement *PacketParser::split(const u8 *pkt, size_t pktlen, bool eth_includ
             last=raw;
         break;
     }
-    curr_pkt+=packetheaders[i].length;
   }
   return first;
 } /* End of split() */
@@ -104,6 +104,21 @@ typedef struct packet_type{
     u32 length;
 }pkt_type_t;
 
+#define MAX_HEADERS_IN_PACKET 32
+#define SCTP_COMMON_HEADER_LEN 12
+
+/* The headers of a packet, as found by PacketParser::parse_view(): the type,
+ * offset and length of each, from the outermost to any application data at
+ * the end. Nothing is copied out of the packet, so a view is good only as long
+ * as the packet's buffer is. */
+typedef struct packet_view{
+    const u8 *pkt;
+    size_t pktlen;
+    int count;                               /* Number of headers found  */
+    pkt_type_t hdr[MAX_HEADERS_IN_PACKET];   /* Type and length of each  */
+    u32 offset[MAX_HEADERS_IN_PACKET];       /* Where each one starts    */
+}packet_view_t;
+
 
 class PacketParser {
 
@@ -117,12 +132,15 @@ class PacketParser {
     void reset();
 
     static const char *header_type2string(int val);
+    static int parse_view(const u8 *pkt, size_t pktlen, bool eth_included, packet_view_t *view);
+    static int find_header(const packet_view_t *view, u32 type, int start=0);
     static pkt_type_t *parse_packet(const u8 *pkt, size_t pktlen, bool eth_included);
     static int dummy_print_packet_type(const u8 *pkt, size_t pktlen, bool eth_included); /* TODO: remove */
     static int dummy_print_packet(const u8 *pkt, size_t pktlen, bool eth_included); /* TODO: remove */
     static int payload_offset(const u8 *pkt, size_t pktlen, bool link_included);
     static PacketElement *split(const u8 *pkt, size_t pktlen, bool eth_included);
     static PacketElement *split(const u8 *pkt, size_t pktlen);
+    static PacketElement *split(const packet_view_t *view);
     static int freePacketChain(PacketElement *first);
     static const char *test_packet_parser(PacketElement *test_pkt);
     static bool is_response(PacketElement *sent, PacketElement *rcvd);
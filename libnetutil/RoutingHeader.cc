@@ -160,8 +160,9 @@ int RoutingHeader::storeRecvData(const u8 *buf, size_t len){
                this->length=0;
                return OP_FAILURE;
              }else{
+                int pkt_len=(this->h.len+1)*8;
                 this->reset();
-                this->length=(this->h.len+1)*8;
+                this->length=pkt_len;
                 memcpy(&(this->h), buf, this->length);
                 return OP_SUCCESS;
              }
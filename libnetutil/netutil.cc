@@ -476,86 +476,241 @@ int ip_is_reserved(const struct sockaddr_storage *addr)
   return addrset_contains(reserved, (struct sockaddr *)addr);
 }
 
-/* A trivial functon that maintains a cache of IP to MAC Address
-   entries.  If the command is MACCACHE_GET, this func looks for the
-   IPv4 address in ss and fills in the 'mac' parameter and returns
-   true if it is found.  Otherwise (not found), the function returns
-   false.  If the command is MACCACHE_SET, the function adds an entry
-   with the given ip (ss) and mac address.  An existing entry for the
-   IP ss will be overwritten with the new MAC address.  true is always
-   returned for the set command. */
-#define MACCACHE_GET 1
-#define MACCACHE_SET 2
-static int do_mac_cache(int command, const struct sockaddr_storage *ss, u8 *mac) {
-  struct MacCache {
-    struct sockaddr_storage ip;
-    u8 mac[6];
-  };
-  static struct MacCache *Cache = NULL;
-  static int MacCapacity = 0;
-  static int MacCacheSz = 0;
+/* The neighbor cache of IP to MAC address entries. It is an open-addressed
+   hash table with linear probing, keyed on the address family and the raw
+   IPv4 or IPv6 address, so lookups during ARP or ND discovery of a large
+   segment take constant time. Entries expire MACCACHE_TTL seconds after they
+   were set; an expired entry is a miss and is dropped when the table grows.
+   On Linux, the first lookup preloads the table with the kernel's reachable
+   and stale neighbors, IPv4 and IPv6, so that hosts the system already knows
+   need no ARP or ND request of ours. */
+#define MACCACHE_TTL 600
+#define MACCACHE_INITIAL_CAPACITY 256
+
+struct mac_cache_entry {
+  u8 family;    /* 0 for an empty slot */
+  u8 addr[16];
+  u8 mac[6];
+  time_t set_at;
+};
+
+static struct mac_cache_entry *MacCache = NULL;
+static unsigned int MacCacheCapacity = 0; /* Always a power of 2 */
+static unsigned int MacCacheSz = 0;
+
+/* Fills in the family and address of key from ss. Returns false for families
+   other than AF_INET and AF_INET6. */
+static bool mac_cache_key(const struct sockaddr_storage *ss,
+                          struct mac_cache_entry *key) {
+  memset(key, 0, sizeof(*key));
+  if (ss->ss_family == AF_INET) {
+    key->family = AF_INET;
+    memcpy(key->addr, &((const struct sockaddr_in *) ss)->sin_addr, 4);
+  } else if (ss->ss_family == AF_INET6) {
+    key->family = AF_INET6;
+    memcpy(key->addr, &((const struct sockaddr_in6 *) ss)->sin6_addr, 16);
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static unsigned int mac_cache_hash(const struct mac_cache_entry *key) {
+  u32 h = key->family, w;
   int i;
 
-  if (command == MACCACHE_GET) {
-    for (i = 0; i < MacCacheSz; i++) {
-      if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-        memcpy(mac, Cache[i].mac, 6);
-        return 1;
-      }
-    }
-    return 0;
+  for (i = 0; i < 16; i += 4) {
+    memcpy(&w, key->addr + i, 4);
+    h ^= w;
+    h *= 0x9e3779b1;
+    h ^= h >> 15;
   }
-  assert(command == MACCACHE_SET);
-  if (MacCacheSz == MacCapacity) {
-    if (MacCapacity == 0)
-      MacCapacity = 32;
-    else
-      MacCapacity <<= 2;
-    Cache = (struct MacCache *) safe_realloc(Cache, MacCapacity * sizeof(struct MacCache));
+  return h;
+}
+
+/* Returns the slot holding key, or the empty slot where it belongs. */
+static struct mac_cache_entry *mac_cache_slot(const struct mac_cache_entry *key) {
+  unsigned int mask = MacCacheCapacity - 1;
+  unsigned int i = mac_cache_hash(key) & mask;
+
+  while (MacCache[i].family != 0) {
+    if (MacCache[i].family == key->family
+        && memcmp(MacCache[i].addr, key->addr, sizeof(key->addr)) == 0)
+      break;
+    i = (i + 1) & mask;
   }
+  return &MacCache[i];
+}
 
-  /* Ensure that it isn't already there ... */
-  for (i = 0; i < MacCacheSz; i++) {
-    if (sockaddr_storage_cmp(&Cache[i].ip, ss) == 0) {
-      memcpy(Cache[i].mac, mac, 6);
-      return 1;
+/* Doubles the table (or creates it), leaving out expired entries. */
+static void mac_cache_grow(time_t now) {
+  struct mac_cache_entry *old = MacCache;
+  unsigned int oldcap = MacCacheCapacity;
+  unsigned int i;
+
+  MacCacheCapacity = oldcap ? oldcap * 2 : MACCACHE_INITIAL_CAPACITY;
+  MacCache = (struct mac_cache_entry *) safe_zalloc(MacCacheCapacity * sizeof(*MacCache));
+  MacCacheSz = 0;
+  for (i = 0; i < oldcap; i++) {
+    if (old[i].family != 0 && now - old[i].set_at < MACCACHE_TTL) {
+      *mac_cache_slot(&old[i]) = old[i];
+      MacCacheSz++;
     }
   }
+  free(old);
+}
 
-  /* Add it to the end of the list */
-  memcpy(&Cache[i].ip, ss, sizeof(struct sockaddr_storage));
-  memcpy(Cache[i].mac, mac, 6);
-  MacCacheSz++;
-  return 1;
+static void mac_cache_insert(const struct mac_cache_entry *key, const u8 *mac,
+                             time_t now) {
+  struct mac_cache_entry *e;
+
+  /* Keep the load factor under 3/4. */
+  if ((MacCacheSz + 1) * 4 > MacCacheCapacity * 3)
+    mac_cache_grow(now);
+  e = mac_cache_slot(key);
+  if (e->family == 0) {
+    *e = *key;
+    MacCacheSz++;
+  }
+  memcpy(e->mac, mac, 6);
+  e->set_at = now;
 }
 
-/* A couple of trivial functions that maintain a cache of IP to MAC
- * Address entries. Function mac_cache_get() looks for the IPv4 address
- * in ss and fills in the 'mac' parameter and returns true if it is
- * found.  Otherwise (not found), the function returns false.
- * Function mac_cache_set() adds an entry with the given ip (ss) and
+#ifdef HAVE_LINUX_RTNETLINK_H
+/* Adds the kernel's usable neighbor entries to the cache with an
+   RTM_GETNEIGH dump. This is only an optimization, so any failure simply
+   leaves the cache as it was. */
+static void mac_cache_load_system(time_t now) {
+  struct {
+    struct nlmsghdr nlmsg;
+    struct ndmsg ndmsg;
+  } req;
+  struct sockaddr_nl snl;
+  char buf[16384];
+  int fd;
+  bool done = false;
+
+  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (fd == -1)
+    return;
+
+  memset(&snl, 0, sizeof(snl));
+  snl.nl_family = AF_NETLINK;
+  memset(&req, 0, sizeof(req));
+  req.nlmsg.nlmsg_len = NLMSG_LENGTH(sizeof(req.ndmsg));
+  req.nlmsg.nlmsg_type = RTM_GETNEIGH;
+  req.nlmsg.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.nlmsg.nlmsg_seq = 1;
+  req.ndmsg.ndm_family = AF_UNSPEC;
+  if (sendto(fd, &req, req.nlmsg.nlmsg_len, 0, (struct sockaddr *) &snl, sizeof(snl)) == -1) {
+    close(fd);
+    return;
+  }
+
+  while (!done) {
+    int len = recv(fd, buf, sizeof(buf), 0);
+    struct nlmsghdr *nlmsg;
+
+    if (len <= 0)
+      break;
+    for (nlmsg = (struct nlmsghdr *) buf; NLMSG_OK(nlmsg, (unsigned int) len);
+         nlmsg = NLMSG_NEXT(nlmsg, len)) {
+      struct ndmsg *ndmsg;
+      struct rtattr *rtattr;
+      unsigned int attrlen;
+      const void *dst = NULL, *lladdr = NULL;
+      size_t dstlen = 0, lladdrlen = 0;
+      struct mac_cache_entry key;
+
+      if (nlmsg->nlmsg_type == NLMSG_DONE || nlmsg->nlmsg_type == NLMSG_ERROR) {
+        done = true;
+        break;
+      }
+      if (nlmsg->nlmsg_type != RTM_NEWNEIGH
+          || nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(*ndmsg)))
+        continue;
+      ndmsg = (struct ndmsg *) NLMSG_DATA(nlmsg);
+      if (!(ndmsg->ndm_state & (NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT)))
+        continue;
+
+      attrlen = nlmsg->nlmsg_len - NLMSG_LENGTH(sizeof(*ndmsg));
+      for (rtattr = (struct rtattr *) ((char *) ndmsg + NLMSG_ALIGN(sizeof(*ndmsg)));
+           RTA_OK(rtattr, attrlen); rtattr = RTA_NEXT(rtattr, attrlen)) {
+        if (rtattr->rta_type == NDA_DST) {
+          dst = RTA_DATA(rtattr);
+          dstlen = RTA_PAYLOAD(rtattr);
+        } else if (rtattr->rta_type == NDA_LLADDR) {
+          lladdr = RTA_DATA(rtattr);
+          lladdrlen = RTA_PAYLOAD(rtattr);
+        }
+      }
+      if (lladdr == NULL || lladdrlen != 6)
+        continue;
+
+      memset(&key, 0, sizeof(key));
+      if (ndmsg->ndm_family == AF_INET && dstlen == 4)
+        key.family = AF_INET;
+      else if (ndmsg->ndm_family == AF_INET6 && dstlen == 16)
+        key.family = AF_INET6;
+      else
+        continue;
+      memcpy(key.addr, dst, dstlen);
+      /* Addresses we resolved ourselves take precedence. */
+      if (mac_cache_slot(&key)->family == 0)
+        mac_cache_insert(&key, (const u8 *) lladdr, now);
+    }
+  }
+  close(fd);
+}
+#endif
+
+/* A couple of functions that maintain a cache of IP to MAC
+ * Address entries. Function mac_cache_get() looks for the IPv4 or IPv6
+ * address in ss and fills in the 'mac' parameter and returns true if it is
+ * found and has not expired.  Otherwise (not found), the function returns
+ * false.  Function mac_cache_set() adds an entry with the given ip (ss) and
  * mac address.  An existing entry for the IP ss will be overwritten
- * with the new MAC address.  mac_cache_set() always returns true.
- * WARNING: The caller must ensure that the supplied "ss" is of family
- * AF_INET. Otherwise the function will return 0 and there would be
- * no way for the caller to tell tell the difference between an error
- * or a cache miss.*/
+ * with the new MAC address.  mac_cache_set() returns true unless ss is
+ * of some other family. */
 int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac){
-    return do_mac_cache(MACCACHE_GET, ss, mac);
+  static bool loaded = false;
+  struct mac_cache_entry key;
+  struct mac_cache_entry *e;
+  time_t now = time(NULL);
+
+  if (!mac_cache_key(ss, &key))
+    return 0;
+  if (!loaded) {
+    loaded = true;
+    if (MacCache == NULL)
+      mac_cache_grow(now);
+#ifdef HAVE_LINUX_RTNETLINK_H
+    mac_cache_load_system(now);
+#endif
+  }
+  e = mac_cache_slot(&key);
+  if (e->family == 0 || now - e->set_at >= MACCACHE_TTL)
+    return 0;
+  memcpy(mac, e->mac, 6);
+  return 1;
 }
 int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac){
-    return do_mac_cache(MACCACHE_SET, ss, mac);
+  struct mac_cache_entry key;
+
+  if (!mac_cache_key(ss, &key))
+    return 0;
+  mac_cache_insert(&key, mac, time(NULL));
+  return 1;
 }
 
-/* Standard BSD internet checksum routine. Uses libdnet helper functions. */
+/* Standard BSD internet checksum routine. The sum comes from nbase, which
+   uses vector instructions where the processor has them. */
 unsigned short in_cksum(u16 *ptr,int nbytes) {
-  int sum;
-
-   sum = ip_cksum_add(ptr, nbytes, 0);
+  unsigned int sum;
 
-  return ip_cksum_carry(sum);
+  sum = nbase_cksum_add(ptr, nbytes, 0);
 
-  return 0;
+  return ~sum & 0xffff;
 }
 
 
@@ -778,9 +933,9 @@ unsigned short ipv4_pseudoheader_cksum(const struct in_addr *src,
   hdr.length = htons(len);
 
   /* Get the ones'-complement sum of the pseudo-header. */
-  sum = ip_cksum_add(&hdr, sizeof(hdr), 0);
+  sum = nbase_cksum_add(&hdr, sizeof(hdr), 0);
   /* Add it to the sum of the packet. */
-  sum = ip_cksum_add(hstart, len, sum);
+  sum = nbase_cksum_add(hstart, len, sum);
 
   /* Fold in the carry, take the complement, and return. */
   sum = ip_cksum_carry(sum);
@@ -813,8 +968,8 @@ u16 ipv6_pseudoheader_cksum(const struct in6_addr *src,
   hdr.length = htonl(len);
   hdr.nxt = nxt;
 
-  sum = ip_cksum_add(&hdr, sizeof(hdr), 0);
-  sum = ip_cksum_add(hstart, len, sum);
+  sum = nbase_cksum_add(&hdr, sizeof(hdr), 0);
+  sum = nbase_cksum_add(hstart, len, sum);
   sum = ip_cksum_carry(sum);
   /* RFC 2460: "Unlike IPv4, when UDP packets are originated by an IPv6 node,
      the UDP checksum is not optional.  That is, whenever originating a UDP
@@ -3204,10 +3359,14 @@ static void add_rtattr_addr(struct nlmsghdr *nlmsg,
 }
 
 /* Does route_dst using the Linux-specific rtnetlink interface. See rtnetlink(3)
-   and rtnetlink(7). */
+   and rtnetlink(7). *cacheable is set to true if the answer is an ordinary
+   unicast route that holds for every address the route covers, as opposed
+   to, for example, a local address or a gateway that is the destination
+   itself. */
 static int route_dst_netlink(const struct sockaddr_storage *dst,
                              struct route_nfo *rnfo, const char *device,
-                             const struct sockaddr_storage *spoofss) {
+                             const struct sockaddr_storage *spoofss,
+                             int *cacheable) {
   struct sockaddr_nl snl;
   struct msghdr msg;
   struct iovec iov;
@@ -3219,6 +3378,7 @@ static int route_dst_netlink(const struct sockaddr_storage *dst,
   unsigned int len;
   int fd, rc;
 
+  *cacheable = 0;
   fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
   if (fd == -1)
     netutil_fatal("%s: cannot create AF_NETLINK socket: %s", __func__, strerror(errno));
@@ -3299,6 +3459,7 @@ static int route_dst_netlink(const struct sockaddr_storage *dst,
   rnfo->srcaddr.ss_family = AF_UNSPEC;
   if (spoofss != NULL)
     rnfo->srcaddr = *spoofss;
+  *cacheable = nlmsg->nlmsg_type == RTM_NEWROUTE && rtmsg->rtm_type == RTN_UNICAST;
 
   for (rtattr = RTM_RTA(rtmsg); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
     if (rtattr->rta_type == RTA_GATEWAY) {
@@ -3307,6 +3468,8 @@ static int route_dst_netlink(const struct sockaddr_storage *dst,
       /* Don't consider it directly connected if nexthop != dst. */
       if (!sockaddr_storage_equal(dst, &rnfo->nexthop))
         rnfo->direct_connect = 0;
+      else
+        *cacheable = 0;
     } else if (rtattr->rta_type == RTA_OIF && ii == NULL) {
       char namebuf[IFNAMSIZ];
       char *p;
@@ -3335,6 +3498,279 @@ static int route_dst_netlink(const struct sockaddr_storage *dst,
   }
 }
 
+/* A cache of route_dst_netlink answers for IPv4 destinations, so that setting
+   up the targets of a large sweep does not cost a netlink round trip each.
+   The destination prefixes of the routes in every table, and of every policy
+   routing rule, are kept in a binary trie. Two addresses with the same
+   longest matching prefix in the trie are matched by exactly the same routes
+   and rules, so the kernel routes them alike, and an answer for one holds for
+   every address under that prefix; it is kept at the prefix's node. Routes
+   with several next hops choose one per flow, so nothing under them is
+   cached. The whole cache is dropped when the kernel announces a change to
+   routes, rules, addresses or links, and rebuilt on a later lookup. */
+#define ROUTE_CACHE_MAX_PREFIXES 65536
+/* Seconds to wait after a change before building the trie again, so that a
+   routing daemon that keeps changing routes does not make every lookup dump
+   the whole table. */
+#define ROUTE_CACHE_REBUILD_DELAY 1
+
+struct route_trie_node {
+  int child[2];      /* 0 for none; the root is never a child */
+  int is_prefix;
+  int multipath;     /* Some route for this prefix has several next hops */
+  int entry;         /* Index into RouteCacheEntries, or -1 */
+};
+
+struct route_cache_entry {
+  char device[64];
+  int spoofed;
+  struct sockaddr_storage spoofss;
+  struct route_nfo rnfo;
+};
+
+/* 0 if the trie needs building, 1 if it is built, -1 if there is no cache. */
+static int RouteCacheState = 0;
+static int RouteCacheNotifyFd = -1;
+static time_t RouteCacheChanged = 0;
+static struct route_trie_node *RouteTrie = NULL;
+static int RouteTrieSz = 0, RouteTrieCapacity = 0, RouteTriePrefixes = 0;
+static struct route_cache_entry *RouteCacheEntries = NULL;
+static int RouteCacheEntriesSz = 0, RouteCacheEntriesCapacity = 0;
+
+static void route_cache_clear(void) {
+  free(RouteTrie);
+  free(RouteCacheEntries);
+  RouteTrie = NULL;
+  RouteCacheEntries = NULL;
+  RouteTrieSz = RouteTrieCapacity = RouteTriePrefixes = 0;
+  RouteCacheEntriesSz = RouteCacheEntriesCapacity = 0;
+}
+
+static int route_trie_new_node(void) {
+  if (RouteTrieSz == RouteTrieCapacity) {
+    RouteTrieCapacity = RouteTrieCapacity ? RouteTrieCapacity * 2 : 256;
+    RouteTrie = (struct route_trie_node *) safe_realloc(RouteTrie,
+      RouteTrieCapacity * sizeof(*RouteTrie));
+  }
+  memset(&RouteTrie[RouteTrieSz], 0, sizeof(*RouteTrie));
+  RouteTrie[RouteTrieSz].entry = -1;
+  return RouteTrieSz++;
+}
+
+/* Adds the prefix addr/bits (addr in host byte order). */
+static void route_trie_add(u32 addr, int bits, int multipath) {
+  int node = 0, i;
+
+  for (i = 0; i < bits; i++) {
+    int b = (addr >> (31 - i)) & 1;
+    if (RouteTrie[node].child[b] == 0) {
+      int child = route_trie_new_node();
+      RouteTrie[node].child[b] = child;
+    }
+    node = RouteTrie[node].child[b];
+  }
+  if (!RouteTrie[node].is_prefix)
+    RouteTriePrefixes++;
+  RouteTrie[node].is_prefix = 1;
+  RouteTrie[node].multipath |= multipath;
+}
+
+/* Adds the destination prefix of an RTM_NEWROUTE or RTM_NEWRULE message.
+   Rule headers (struct fib_rule_hdr) begin like struct rtmsg, and FRA_DST is
+   RTA_DST. */
+static void route_cache_add_msg(struct nlmsghdr *nlmsg) {
+  struct rtmsg *rtmsg;
+  struct rtattr *rtattr;
+  unsigned int len;
+  u32 addr = 0;
+  int multipath = 0;
+
+  if (nlmsg->nlmsg_len < NLMSG_LENGTH(sizeof(*rtmsg)))
+    return;
+  rtmsg = (struct rtmsg *) NLMSG_DATA(nlmsg);
+  if (rtmsg->rtm_family != AF_INET || rtmsg->rtm_dst_len > 32)
+    return;
+  len = nlmsg->nlmsg_len - NLMSG_LENGTH(sizeof(*rtmsg));
+  for (rtattr = RTM_RTA(rtmsg); RTA_OK(rtattr, len); rtattr = RTA_NEXT(rtattr, len)) {
+    if (rtattr->rta_type == RTA_DST && RTA_PAYLOAD(rtattr) == IP_ADDR_LEN) {
+      memcpy(&addr, RTA_DATA(rtattr), IP_ADDR_LEN);
+      addr = ntohl(addr);
+    } else if (nlmsg->nlmsg_type == RTM_NEWROUTE
+      && (rtattr->rta_type == RTA_MULTIPATH || rtattr->rta_type == RTA_NH_ID)) {
+      /* A nexthop object may be a group, so treat it like a multipath route. */
+      multipath = 1;
+    }
+  }
+  route_trie_add(addr, rtmsg->rtm_dst_len, multipath);
+}
+
+/* Sends a dump request of the given type for IPv4 and adds every answer to
+   the trie. Returns -1 on error. */
+static int route_cache_dump(int fd, int type) {
+  struct {
+    struct nlmsghdr nlmsg;
+    struct rtmsg rtmsg;
+  } req;
+  struct sockaddr_nl snl;
+  char buf[32768];
+
+  memset(&snl, 0, sizeof(snl));
+  snl.nl_family = AF_NETLINK;
+  memset(&req, 0, sizeof(req));
+  req.nlmsg.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtmsg));
+  req.nlmsg.nlmsg_type = type;
+  req.nlmsg.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  req.rtmsg.rtm_family = AF_INET;
+  if (sendto(fd, &req, req.nlmsg.nlmsg_len, 0, (struct sockaddr *) &snl, sizeof(snl)) == -1)
+    return -1;
+
+  for (;;) {
+    int len = recv(fd, buf, sizeof(buf), 0);
+    struct nlmsghdr *nlmsg;
+
+    if (len <= 0)
+      return -1;
+    for (nlmsg = (struct nlmsghdr *) buf; NLMSG_OK(nlmsg, (unsigned int) len);
+         nlmsg = NLMSG_NEXT(nlmsg, len)) {
+      if (nlmsg->nlmsg_type == NLMSG_DONE)
+        return 0;
+      if (nlmsg->nlmsg_type == NLMSG_ERROR)
+        return -1;
+      if (nlmsg->nlmsg_type == RTM_NEWROUTE || nlmsg->nlmsg_type == RTM_NEWRULE)
+        route_cache_add_msg(nlmsg);
+      if (RouteTriePrefixes > ROUTE_CACHE_MAX_PREFIXES)
+        return -1;
+    }
+  }
+}
+
+/* Reads any pending change notifications and drops the cache if there were
+   any. */
+static void route_cache_check(void) {
+  char buf[8192];
+  int changed = 0;
+
+  if (RouteCacheNotifyFd == -1)
+    return;
+  for (;;) {
+    int n = recv(RouteCacheNotifyFd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (n > 0) {
+      changed = 1;
+      continue;
+    }
+    /* ENOBUFS means notifications were lost. */
+    if (n == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+      changed = 1;
+    break;
+  }
+  if (changed) {
+    route_cache_clear();
+    RouteCacheState = 0;
+    RouteCacheChanged = time(NULL);
+  }
+}
+
+static void route_cache_build(void) {
+  struct sockaddr_nl snl;
+  int fd;
+
+  if (RouteCacheNotifyFd == -1) {
+    /* Subscribe before dumping, so that no change can slip in between. */
+    RouteCacheNotifyFd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+    if (RouteCacheNotifyFd == -1) {
+      RouteCacheState = -1;
+      return;
+    }
+    memset(&snl, 0, sizeof(snl));
+    snl.nl_family = AF_NETLINK;
+    snl.nl_groups = RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV4_ROUTE | RTMGRP_IPV4_RULE;
+    if (bind(RouteCacheNotifyFd, (struct sockaddr *) &snl, sizeof(snl)) == -1) {
+      close(RouteCacheNotifyFd);
+      RouteCacheNotifyFd = -1;
+      RouteCacheState = -1;
+      return;
+    }
+  }
+
+  route_cache_clear();
+  route_trie_new_node();
+  RouteTrie[0].is_prefix = 1; /* 0.0.0.0/0, whether or not there is a default route */
+  fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+  if (fd == -1 || route_cache_dump(fd, RTM_GETROUTE) == -1
+      || route_cache_dump(fd, RTM_GETRULE) == -1) {
+    if (fd != -1)
+      close(fd);
+    route_cache_clear();
+    RouteCacheState = -1;
+    return;
+  }
+  close(fd);
+  RouteCacheState = 1;
+}
+
+static int route_dst_cached(const struct sockaddr_storage *dst,
+                            struct route_nfo *rnfo, const char *device,
+                            const struct sockaddr_storage *spoofss) {
+  struct route_cache_entry *e;
+  u32 addr;
+  int node, best, multipath, cacheable, rc, i;
+
+  if (device == NULL)
+    device = "";
+  if (dst->ss_family != AF_INET || strlen(device) >= sizeof(e->device))
+    return route_dst_netlink(dst, rnfo, device, spoofss, &cacheable);
+
+  route_cache_check();
+  if (RouteCacheState == 0 && time(NULL) - RouteCacheChanged >= ROUTE_CACHE_REBUILD_DELAY)
+    route_cache_build();
+  if (RouteCacheState != 1)
+    return route_dst_netlink(dst, rnfo, device, spoofss, &cacheable);
+
+  /* Find the longest matching prefix. */
+  addr = ntohl(((const struct sockaddr_in *) dst)->sin_addr.s_addr);
+  node = best = 0;
+  multipath = RouteTrie[0].multipath;
+  for (i = 31; i >= 0; i--) {
+    node = RouteTrie[node].child[(addr >> i) & 1];
+    if (node == 0)
+      break;
+    if (RouteTrie[node].is_prefix) {
+      best = node;
+      multipath |= RouteTrie[node].multipath;
+    }
+  }
+  if (multipath)
+    return route_dst_netlink(dst, rnfo, device, spoofss, &cacheable);
+
+  if (RouteTrie[best].entry != -1) {
+    e = &RouteCacheEntries[RouteTrie[best].entry];
+    if (strcmp(e->device, device) == 0 && e->spoofed == (spoofss != NULL)
+        && (spoofss == NULL || sockaddr_storage_equal(&e->spoofss, spoofss))) {
+      *rnfo = e->rnfo;
+      return 1;
+    }
+  }
+
+  rc = route_dst_netlink(dst, rnfo, device, spoofss, &cacheable);
+  if (rc == 1 && cacheable) {
+    if (RouteTrie[best].entry == -1) {
+      if (RouteCacheEntriesSz == RouteCacheEntriesCapacity) {
+        RouteCacheEntriesCapacity = RouteCacheEntriesCapacity ? RouteCacheEntriesCapacity * 2 : 16;
+        RouteCacheEntries = (struct route_cache_entry *) safe_realloc(RouteCacheEntries,
+          RouteCacheEntriesCapacity * sizeof(*RouteCacheEntries));
+      }
+      RouteTrie[best].entry = RouteCacheEntriesSz++;
+    }
+    e = &RouteCacheEntries[RouteTrie[best].entry];
+    Strncpy(e->device, device, sizeof(e->device));
+    e->spoofed = spoofss != NULL;
+    if (spoofss != NULL)
+      e->spoofss = *spoofss;
+    e->rnfo = *rnfo;
+  }
+  return rc;
+}
+
 #else
 
 static struct interface_info *find_loopback_iface(struct interface_info *ifaces,
@@ -3567,7 +4003,7 @@ static int route_dst_generic(const struct sockaddr_storage *dst,
 int route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo,
               const char *device, const struct sockaddr_storage *spoofss) {
 #ifdef HAVE_LINUX_RTNETLINK_H
-  return route_dst_netlink(dst, rnfo, device, spoofss);
+  return route_dst_cached(dst, rnfo, device, spoofss);
 #else
   return route_dst_generic(dst, rnfo, device, spoofss);
 #endif
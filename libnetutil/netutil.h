@@ -169,13 +169,15 @@ int ip_is_reserved(const struct sockaddr_storage *addr);
 
 
 
-/* A couple of trivial functions that maintain a cache of IP to MAC
- * Address entries. Function mac_cache_get() looks for the IPv4 address
- * in ss and fills in the 'mac' parameter and returns true if it is
- * found.  Otherwise (not found), the function returns false.
+/* A couple of functions that maintain a hashed cache of IP to MAC
+ * Address entries. Function mac_cache_get() looks for the IPv4 or IPv6
+ * address in ss and fills in the 'mac' parameter and returns true if it is
+ * found and has not expired.  Otherwise (not found), the function returns
+ * false.  On Linux, the first call loads the kernel's neighbor table.
  * Function mac_cache_set() adds an entry with the given ip (ss) and
  * mac address.  An existing entry for the IP ss will be overwritten
- * with the new MAC address.  mac_cache_set() always returns true. */
+ * with the new MAC address.  mac_cache_set() returns true unless ss is
+ * of some other family. */
 int mac_cache_get(const struct sockaddr_storage *ss, u8 *mac);
 int mac_cache_set(const struct sockaddr_storage *ss, u8 *mac);
 
@@ -452,7 +454,9 @@ const char *ippackethdrinfo(const u8 *packet, u32 len, int detail);
  * specified), along with a suitable network device (parameter "device").
  * Even if spoofss is NULL, if user specified a network device with -e,
  * it should still be passed. Note that it's OK to pass either NULL or
- * an empty string as the "device", as long as spoofss==NULL. */
+ * an empty string as the "device", as long as spoofss==NULL. On Linux,
+ * answers for IPv4 destinations are cached per routing table prefix
+ * until the kernel reports a change to its routes. */
 int route_dst(const struct sockaddr_storage *dst, struct route_nfo *rnfo,
               const char *device, const struct sockaddr_storage *spoofss);
 
@@ -543,6 +547,10 @@ int read_ns_reply_pcap(pcap_t *pd, u8 *sendermac,
                         struct timeval *rcvdtime, bool *has_mac,
                         void (*traceArp_callback)(int, const u8 *, u32 , struct timeval *));
 
+/* Return the data offset for the given datalink. This function understands the
+   datalink types DLT_EN10MB and DLT_LINUX_SLL. Returns -1 on error. */
+int datalink_offset(int datalink);
+
 /* Attempts to read one IP packet from the pcap descriptor pd. Input parameters are pd,
    to_usec, and accept_callback. If a received frame passes accept_callback,
    then the output parameters p, head, rcvdtime, datalink, and offset are filled
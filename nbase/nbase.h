@@ -483,9 +483,34 @@ int socket_bindtodevice(int sd, const char *device);
 unsigned long nbase_crc32(unsigned char *buf, int len);
 /* CRC32C Cyclic Redundancy Check (Castagnoli) */
 unsigned long nbase_crc32c(unsigned char *buf, int len);
+/* Ones'-complement sum of the 16-bit words of buf (RFC 1071) added to sum,
+   folded to 16 bits. Its complement is the Internet checksum of buf. */
+unsigned int nbase_cksum_add(const void *buf, size_t len, unsigned int sum);
 /* Adler32 Checksum */
 unsigned long nbase_adler32(unsigned char *buf, int len);
 
+/* A histogram of latencies (or any other u32 values), with 8 buckets per
+   power of two so that any value is off by at most 1/16 of itself. Values
+   below 8 are counted exactly. Adding a value takes constant time, and two
+   histograms can be merged by adding their buckets. */
+#define LATENCY_HIST_SUB_BITS 3
+#define LATENCY_HIST_SUB (1 << LATENCY_HIST_SUB_BITS)
+#define LATENCY_HIST_BUCKETS ((32 - LATENCY_HIST_SUB_BITS + 1) * LATENCY_HIST_SUB)
+struct latency_hist {
+  u64 count;
+  u64 sum;
+  u32 min;
+  u32 max;
+  u64 buckets[LATENCY_HIST_BUCKETS];
+};
+void latency_hist_init(struct latency_hist *h);
+void latency_hist_add(struct latency_hist *h, u32 value);
+void latency_hist_merge(struct latency_hist *dst, const struct latency_hist *src);
+/* Returns the value below which p percent (0-100) of the values fall,
+   or 0 if the histogram is empty. */
+u32 latency_hist_percentile(const struct latency_hist *h, double p);
+double latency_hist_mean(const struct latency_hist *h);
+
 double tval2secs(const char *tspec);
 long tval2msecs(const char *tspec);
 const char *tval_unit(const char *tspec);
@@ -0,0 +1,379 @@
+/***************************************************************************
+ * nbase_cksum.c -- Internet checksum and CRC-32C, with vector and         *
+ * hardware-assisted versions chosen at run time.                          *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+/* $Id$ */
+
+/* Every probe Nmap sends and many of the replies it reads go through the
+ * Internet checksum, and SCTP packets through CRC-32C as well. Each has a
+ * portable version here and faster ones for the processors that can run
+ * them: SSE2 and AVX2 sums and the SSE4.2 crc32 instruction on x86, NEON and
+ * the ARMv8 CRC32 instructions on AArch64. The best version the processor
+ * supports is picked the first time each function is called. */
+
+#include "nbase.h"
+#include "nbase_crc32ct.h"
+
+#include <string.h>
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) \
+  && (defined(__x86_64__) || defined(__i386__))
+#define CKSUM_X86 1
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__) && defined(__AARCH64EL__)
+#define CKSUM_ARM64 1
+#include <arm_neon.h>
+#if defined(__linux__) && !defined(__ARM_FEATURE_CRC32)
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+#endif
+
+typedef u64 (*sum_fn)(const u8 *p, size_t len, u64 sum);
+typedef u32 (*crc_fn)(u32 crc, const u8 *p, size_t len);
+
+/* The sums below are kept modulo 2^64 - 1 rather than 2^16 - 1. Since the
+ * first is a multiple of the second, folding the result down to 16 bits gives
+ * the same ones'-complement sum as adding up 16-bit words, and a word may be
+ * added in any lane of a wider one. */
+static inline u64 add_carry(u64 sum, u64 w)
+{
+  sum += w;
+  return sum + (sum < w);
+}
+
+static unsigned int fold(u64 sum)
+{
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+  return (unsigned int) sum;
+}
+
+static u64 sum_generic(const u8 *p, size_t len, u64 sum)
+{
+  u64 w;
+  u32 x;
+  u16 h;
+
+  while (len >= 8) {
+    memcpy(&w, p, 8);
+    sum = add_carry(sum, w);
+    p += 8;
+    len -= 8;
+  }
+  if (len >= 4) {
+    memcpy(&x, p, 4);
+    sum = add_carry(sum, x);
+    p += 4;
+    len -= 4;
+  }
+  if (len >= 2) {
+    memcpy(&h, p, 2);
+    sum = add_carry(sum, h);
+    p += 2;
+    len -= 2;
+  }
+  if (len > 0) {
+    /* An odd byte is padded with a zero after it. */
+    h = 0;
+    memcpy(&h, p, 1);
+    sum = add_carry(sum, h);
+  }
+  return sum;
+}
+
+/* Generic CRC-32C, a byte at a time from the table in nbase_crc32ct.h. */
+static u32 crc32c_generic(u32 crc, const u8 *p, size_t len)
+{
+  unsigned long c = crc;
+
+  while (len-- > 0)
+    CRC32C(c, *p++);
+  return (u32) c;
+}
+
+#if CKSUM_X86
+
+/* The 32-bit words of each vector are widened into 64-bit lanes, which cannot
+ * overflow however long the buffer. */
+__attribute__((target("sse2")))
+static u64 sum_sse2(const u8 *p, size_t len, u64 sum)
+{
+  __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, b = zero;
+  u64 lanes[2];
+
+  while (len >= 32) {
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i w = _mm_loadu_si128((const __m128i *) (p + 16));
+    a = _mm_add_epi64(a, _mm_unpacklo_epi32(v, zero));
+    b = _mm_add_epi64(b, _mm_unpackhi_epi32(v, zero));
+    a = _mm_add_epi64(a, _mm_unpacklo_epi32(w, zero));
+    b = _mm_add_epi64(b, _mm_unpackhi_epi32(w, zero));
+    p += 32;
+    len -= 32;
+  }
+  _mm_storeu_si128((__m128i *) lanes, _mm_add_epi64(a, b));
+  sum = add_carry(sum, lanes[0]);
+  sum = add_carry(sum, lanes[1]);
+  return sum_generic(p, len, sum);
+}
+
+__attribute__((target("avx2")))
+static u64 sum_avx2(const u8 *p, size_t len, u64 sum)
+{
+  __m256i zero = _mm256_setzero_si256();
+  __m256i a = zero, b = zero;
+  u64 lanes[4];
+  int i;
+
+  /* Setting up the wide registers costs more than it saves on a header. */
+  if (len < 128)
+    return sum_sse2(p, len, sum);
+
+  while (len >= 64) {
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i w = _mm256_loadu_si256((const __m256i *) (p + 32));
+    a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(v, zero));
+    b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(v, zero));
+    a = _mm256_add_epi64(a, _mm256_unpacklo_epi32(w, zero));
+    b = _mm256_add_epi64(b, _mm256_unpackhi_epi32(w, zero));
+    p += 64;
+    len -= 64;
+  }
+  _mm256_storeu_si256((__m256i *) lanes, _mm256_add_epi64(a, b));
+  for (i = 0; i < 4; i++)
+    sum = add_carry(sum, lanes[i]);
+  return sum_generic(p, len, sum);
+}
+
+__attribute__((target("sse4.2")))
+static u32 crc32c_sse42(u32 crc, const u8 *p, size_t len)
+{
+  u32 x;
+
+#if defined(__x86_64__)
+  u64 c = crc, w;
+
+  while (len >= 8) {
+    memcpy(&w, p, 8);
+    c = _mm_crc32_u64(c, w);
+    p += 8;
+    len -= 8;
+  }
+  crc = (u32) c;
+#endif
+  while (len >= 4) {
+    memcpy(&x, p, 4);
+    crc = _mm_crc32_u32(crc, x);
+    p += 4;
+    len -= 4;
+  }
+  while (len-- > 0)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+
+#elif CKSUM_ARM64
+
+/* NEON is part of every AArch64 processor. */
+static u64 sum_neon(const u8 *p, size_t len, u64 sum)
+{
+  uint64x2_t a = vdupq_n_u64(0), b = a;
+
+  while (len >= 32) {
+    a = vpadalq_u32(a, vreinterpretq_u32_u8(vld1q_u8(p)));
+    b = vpadalq_u32(b, vreinterpretq_u32_u8(vld1q_u8(p + 16)));
+    p += 32;
+    len -= 32;
+  }
+  a = vaddq_u64(a, b);
+  sum = add_carry(sum, vgetq_lane_u64(a, 0));
+  sum = add_carry(sum, vgetq_lane_u64(a, 1));
+  return sum_generic(p, len, sum);
+}
+
+/* The CRC32 instructions are optional before ARMv8.1. They are written out
+ * here so that the rest of the file need not be built for a processor that
+ * has them. */
+static u32 crc32c_arm(u32 crc, const u8 *p, size_t len)
+{
+  u64 w;
+  u32 x;
+
+  while (len >= 8) {
+    memcpy(&w, p, 8);
+    __asm__(".arch_extension crc\n\tcrc32cx %w0, %w0, %x1" : "+r" (crc) : "r" (w));
+    p += 8;
+    len -= 8;
+  }
+  if (len >= 4) {
+    memcpy(&x, p, 4);
+    __asm__(".arch_extension crc\n\tcrc32cw %w0, %w0, %w1" : "+r" (crc) : "r" (x));
+    p += 4;
+    len -= 4;
+  }
+  while (len-- > 0) {
+    x = *p++;
+    __asm__(".arch_extension crc\n\tcrc32cb %w0, %w0, %w1" : "+r" (crc) : "r" (x));
+  }
+  return crc;
+}
+
+static int have_arm_crc(void)
+{
+#if defined(__ARM_FEATURE_CRC32)
+  return 1;
+#elif defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+  return 0;
+#endif
+}
+
+#endif
+
+static u64 sum_first(const u8 *p, size_t len, u64 sum);
+static u32 crc32c_first(u32 crc, const u8 *p, size_t len);
+
+static sum_fn sum_impl = sum_first;
+static crc_fn crc32c_impl = crc32c_first;
+
+static void choose_impl(void)
+{
+  sum_fn s = sum_generic;
+  crc_fn c = crc32c_generic;
+
+#if CKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    s = sum_sse2;
+  if (__builtin_cpu_supports("avx2"))
+    s = sum_avx2;
+  if (__builtin_cpu_supports("sse4.2"))
+    c = crc32c_sse42;
+#elif CKSUM_ARM64
+  s = sum_neon;
+  if (have_arm_crc())
+    c = crc32c_arm;
+#endif
+  sum_impl = s;
+  crc32c_impl = c;
+}
+
+static u64 sum_first(const u8 *p, size_t len, u64 sum)
+{
+  choose_impl();
+  return sum_impl(p, len, sum);
+}
+
+static u32 crc32c_first(u32 crc, const u8 *p, size_t len)
+{
+  choose_impl();
+  return crc32c_impl(crc, p, len);
+}
+
+/* Adds the 16-bit words of buf to the ones'-complement sum sum and returns the
+ * new sum, folded to 16 bits. */
+unsigned int nbase_cksum_add(const void *buf, size_t len, unsigned int sum)
+{
+  return fold(sum_impl((const u8 *) buf, len, sum));
+}
+
+
+/*
+ * CRC-32C (Castagnoli) Cyclic Redundancy Check.
+ * Taken straight from Appendix C of RFC 4960 (SCTP), with the difference that
+ * the remainder register (crc32) is initialized to 0xffffffffL rather than ~0L,
+ * for correct operation on platforms where unsigned long is longer than 32
+ * bits.
+ */
+
+/* Return the CRC-32C of the bytes buf[0..len-1] */
+unsigned long nbase_crc32c(unsigned char *buf, int len)
+{
+  unsigned long result;
+  unsigned char byte0, byte1, byte2, byte3;
+
+  result = ~crc32c_impl(0xffffffff, buf, len > 0 ? len : 0) & 0xffffffffUL;
+
+  /*  result now holds the negated polynomial remainder;
+   *  since the table and algorithm is "reflected" [williams95].
+   *  That is, result has the same value as if we mapped the message
+   *  to a polynomial, computed the host-bit-order polynomial
+   *  remainder, performed final negation, then did an end-for-end
+   *  bit-reversal.
+   *  Note that a 32-bit bit-reversal is identical to four inplace
+   *  8-bit reversals followed by an end-for-end byteswap.
+   *  In other words, the bytes of each bit are in the right order,
+   *  but the bytes have been byteswapped.  So we now do an explicit
+   *  byteswap.  On a little-endian machine, this byteswap and
+   *  the final ntohl cancel out and could be elided.
+   */
+
+  byte0 =  result        & 0xff;
+  byte1 = (result >>  8) & 0xff;
+  byte2 = (result >> 16) & 0xff;
+  byte3 = (result >> 24) & 0xff;
+  return (((unsigned long) byte0 << 24) | (byte1 << 16) | (byte2 <<  8) | byte3);
+}
@@ -0,0 +1,188 @@
+/***************************************************************************
+ * nbase_hist.c -- A log-bucketed histogram for recording latencies.       *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+/* $Id$ */
+
+/* Nmap and Nping record the round-trip time of every probe that gets a reply
+ * into one of these histograms, so that they can report percentiles rather
+ * than only a smoothed average. Buckets are laid out like in HdrHistogram:
+ * values 0-7 get a bucket each, and every power of two from 8 up is split
+ * into 8 equal buckets. A value is then known to within 1/16 of itself,
+ * using 240 buckets for the whole u32 range. */
+
+#include "nbase.h"
+
+#include <string.h>
+
+/* Index of the highest set bit of v, which must not be 0. */
+static int highbit(u32 v)
+{
+#if defined(__GNUC__)
+  return 31 - __builtin_clz(v);
+#else
+  int n = 0;
+
+  while (v >>= 1)
+    n++;
+  return n;
+#endif
+}
+
+static int bucket_of(u32 v)
+{
+  int shift;
+
+  if (v < LATENCY_HIST_SUB)
+    return v;
+  shift = highbit(v) - LATENCY_HIST_SUB_BITS;
+  return (shift + 1) * LATENCY_HIST_SUB + ((v >> shift) & (LATENCY_HIST_SUB - 1));
+}
+
+/* The smallest value that falls in bucket i, and the number of values that
+   do. */
+static u32 bucket_low(int i, u32 *width)
+{
+  int shift;
+
+  if (i < LATENCY_HIST_SUB) {
+    *width = 1;
+    return i;
+  }
+  shift = i / LATENCY_HIST_SUB - 1;
+  *width = (u32) 1 << shift;
+  return (u32) (LATENCY_HIST_SUB + i % LATENCY_HIST_SUB) << shift;
+}
+
+void latency_hist_init(struct latency_hist *h)
+{
+  memset(h, 0, sizeof(*h));
+}
+
+void latency_hist_add(struct latency_hist *h, u32 value)
+{
+  if (h->count == 0 || value < h->min)
+    h->min = value;
+  if (value > h->max)
+    h->max = value;
+  h->count++;
+  h->sum += value;
+  h->buckets[bucket_of(value)]++;
+}
+
+void latency_hist_merge(struct latency_hist *dst, const struct latency_hist *src)
+{
+  int i;
+
+  if (src->count == 0)
+    return;
+  if (dst->count == 0 || src->min < dst->min)
+    dst->min = src->min;
+  if (src->max > dst->max)
+    dst->max = src->max;
+  dst->count += src->count;
+  dst->sum += src->sum;
+  for (i = bucket_of(src->min); i <= bucket_of(src->max); i++)
+    dst->buckets[i] += src->buckets[i];
+}
+
+/* The value reported for a bucket is its midpoint, kept within the smallest
+   and largest values seen so that p0 and p100 are exact. */
+u32 latency_hist_percentile(const struct latency_hist *h, double p)
+{
+  u64 rank, seen;
+  u32 low, width, v;
+  int i;
+
+  if (h->count == 0)
+    return 0;
+  if (p <= 0)
+    return h->min;
+  if (p >= 100)
+    return h->max;
+
+  rank = (u64) (p / 100.0 * h->count);
+  if ((double) rank < p / 100.0 * h->count)
+    rank++;
+  if (rank < 1)
+    rank = 1;
+
+  seen = 0;
+  for (i = bucket_of(h->min); i < LATENCY_HIST_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank)
+      break;
+  }
+  if (i == LATENCY_HIST_BUCKETS)
+    return h->max;
+
+  low = bucket_low(i, &width);
+  v = low + (width - 1) / 2;
+  if (v < h->min)
+    v = h->min;
+  if (v > h->max)
+    v = h->max;
+  return v;
+}
+
+double latency_hist_mean(const struct latency_hist *h)
+{
+  if (h->count == 0)
+    return 0;
+  return (double) h->sum / h->count;
+}
@@ -75,7 +75,6 @@ extern int errno;
 #include <limits.h>
 #include <stdio.h>
 #include "nbase_ipv6.h"
-#include "nbase_crc32ct.h"
 
 #include <assert.h>
 #include <fcntl.h>
@@ -509,51 +508,6 @@ unsigned long nbase_crc32(unsigned char *buf, int len)
 }
 
 
-/*
- * CRC-32C (Castagnoli) Cyclic Redundancy Check.
- * Taken straight from Appendix C of RFC 4960 (SCTP), with the difference that
- * the remainder register (crc32) is initialized to 0xffffffffL rather than ~0L,
- * for correct operation on platforms where unsigned long is longer than 32
- * bits.
- */
-
-/* Return the CRC-32C of the bytes buf[0..len-1] */
-unsigned long nbase_crc32c(unsigned char *buf, int len)
-{
-  int i;
-  unsigned long crc32 = 0xffffffffL;
-  unsigned long result;
-  unsigned char byte0, byte1, byte2, byte3;
-
-  for (i = 0; i < len; i++) {
-    CRC32C(crc32, buf[i]);
-  }
-
-  result = ~crc32;
-
-  /*  result now holds the negated polynomial remainder;
-   *  since the table and algorithm is "reflected" [williams95].
-   *  That is, result has the same value as if we mapped the message
-   *  to a polynomial, computed the host-bit-order polynomial
-   *  remainder, performed final negation, then did an end-for-end
-   *  bit-reversal.
-   *  Note that a 32-bit bit-reversal is identical to four inplace
-   *  8-bit reversals followed by an end-for-end byteswap.
-   *  In other words, the bytes of each bit are in the right order,
-   *  but the bytes have been byteswapped.  So we now do an explicit
-   *  byteswap.  On a little-endian machine, this byteswap and
-   *  the final ntohl cancel out and could be elided.
-   */
-
-  byte0 =  result        & 0xff;
-  byte1 = (result >>  8) & 0xff;
-  byte2 = (result >> 16) & 0xff;
-  byte3 = (result >> 24) & 0xff;
-  crc32 = ((byte0 << 24) | (byte1 << 16) | (byte2 <<  8) | byte3);
-  return crc32;
-}
-
-
 /*
  * Adler32 Checksum Calculation.
  * Taken straight from RFC 2960 (SCTP).
@@ -0,0 +1,242 @@
+/*
+Usage: test-cksum [-b]
+
+This is a test program for the Internet checksum and CRC-32C functions in
+nbase_cksum.c. It includes that file so that it can call every version the
+processor supports, not only the one nbase would choose, and compares each
+against simple reference versions over buffers of every length up to a few
+kilobytes at every alignment. With -b, it also reports the throughput of each
+version on packet-sized and larger buffers.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../nbase_cksum.c"
+
+struct sum_version {
+  const char *name;
+  sum_fn fn;
+};
+
+struct crc_version {
+  const char *name;
+  crc_fn fn;
+};
+
+static struct sum_version sum_versions[4];
+static struct crc_version crc_versions[4];
+static int num_sum_versions, num_crc_versions;
+
+static void add_sum_version(const char *name, sum_fn fn)
+{
+  sum_versions[num_sum_versions].name = name;
+  sum_versions[num_sum_versions].fn = fn;
+  num_sum_versions++;
+}
+
+static void add_crc_version(const char *name, crc_fn fn)
+{
+  crc_versions[num_crc_versions].name = name;
+  crc_versions[num_crc_versions].fn = fn;
+  num_crc_versions++;
+}
+
+static void find_versions(void)
+{
+  add_sum_version("generic", sum_generic);
+  add_crc_version("generic", crc32c_generic);
+#if CKSUM_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2"))
+    add_sum_version("sse2", sum_sse2);
+  if (__builtin_cpu_supports("avx2"))
+    add_sum_version("avx2", sum_avx2);
+  if (__builtin_cpu_supports("sse4.2"))
+    add_crc_version("sse4.2", crc32c_sse42);
+#elif CKSUM_ARM64
+  add_sum_version("neon", sum_neon);
+  if (have_arm_crc())
+    add_crc_version("armv8-crc", crc32c_arm);
+#endif
+}
+
+/* The BSD in_cksum loop: 16-bit words, with an odd byte padded with zero. */
+static unsigned int ref_sum(const u8 *p, size_t len, unsigned int start)
+{
+  unsigned long sum = start;
+  u16 w;
+
+  while (len >= 2) {
+    memcpy(&w, p, 2);
+    sum += w;
+    p += 2;
+    len -= 2;
+  }
+  if (len > 0) {
+    w = 0;
+    memcpy(&w, p, 1);
+    sum += w;
+  }
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return (unsigned int) sum;
+}
+
+/* CRC-32C a bit at a time, from the reflected polynomial. */
+static u32 ref_crc32c(u32 crc, const u8 *p, size_t len)
+{
+  int i;
+
+  while (len-- > 0) {
+    crc ^= *p++;
+    for (i = 0; i < 8; i++)
+      crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+  }
+  return crc;
+}
+
+#define MAX_LEN 4096
+#define MAX_ALIGN 64
+
+static int test_versions(const u8 *buf)
+{
+  size_t len, off;
+  int i, failures = 0;
+  unsigned int start;
+
+  for (len = 0; len <= MAX_LEN; len += len < 300 ? 1 : 37) {
+    for (off = 0; off < MAX_ALIGN; off++) {
+      const u8 *p = buf + off;
+      start = (len * 2654435761U) & 0xffff;
+      unsigned int want_sum = ref_sum(p, len, start);
+      u32 want_crc = ref_crc32c(0xffffffff, p, len);
+      for (i = 0; i < num_sum_versions; i++) {
+        unsigned int got = fold(sum_versions[i].fn(p, len, start));
+        if (got != want_sum) {
+          if (failures++ < 10)
+            printf("FAIL: %s sum of %lu bytes at offset %lu: %04x, expected %04x\n",
+                sum_versions[i].name, (unsigned long) len, (unsigned long) off,
+                got, want_sum);
+        }
+      }
+      for (i = 0; i < num_crc_versions; i++) {
+        u32 got = crc_versions[i].fn(0xffffffff, p, len);
+        if (got != want_crc) {
+          if (failures++ < 10)
+            printf("FAIL: %s CRC-32C of %lu bytes at offset %lu: %08lx, expected %08lx\n",
+                crc_versions[i].name, (unsigned long) len, (unsigned long) off,
+                (unsigned long) got, (unsigned long) want_crc);
+        }
+      }
+    }
+  }
+  return failures;
+}
+
+/* Known answers, through the public functions. */
+static int test_known(void)
+{
+  /* RFC 3720 B.4 */
+  static const u8 zeros[32] = { 0 };
+  u8 ones[32], incr[32];
+  /* RFC 1071 section 3 */
+  static const u8 rfc1071[8] = { 0x00, 0x01, 0xf2, 0x03, 0xf4, 0xf5, 0xf6, 0xf7 };
+  u16 want;
+  int i, failures = 0;
+
+  memset(ones, 0xff, sizeof(ones));
+  for (i = 0; i < 32; i++)
+    incr[i] = i;
+
+  /* nbase_crc32c returns the CRC in the order it is sent, as htonl expects. */
+  if (nbase_crc32c((unsigned char *) zeros, 32) != 0xaa36918aUL) {
+    printf("FAIL: CRC-32C of 32 zeros\n");
+    failures++;
+  }
+  if (nbase_crc32c(ones, 32) != 0x43aba862UL) {
+    printf("FAIL: CRC-32C of 32 0xff bytes\n");
+    failures++;
+  }
+  if (nbase_crc32c(incr, 32) != 0x4e79dd46UL) {
+    printf("FAIL: CRC-32C of 0..31\n");
+    failures++;
+  }
+  if (nbase_crc32c(incr, 0) != 0) {
+    printf("FAIL: CRC-32C of nothing\n");
+    failures++;
+  }
+  /* The sum in network byte order is ddf2. */
+  want = htons(0xddf2);
+  if (nbase_cksum_add(rfc1071, sizeof(rfc1071), 0) != want) {
+    printf("FAIL: RFC 1071 example sum\n");
+    failures++;
+  }
+  return failures;
+}
+
+static double now(void)
+{
+  return (double) clock() / CLOCKS_PER_SEC;
+}
+
+static void bench(const u8 *buf)
+{
+  static const size_t sizes[] = { 40, 576, 1500, 65536 };
+  volatile u64 sink = 0;
+  size_t s;
+  int i;
+
+  for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    size_t len = sizes[s];
+    long n, iters = (long) (200000000 / len);
+    double t;
+
+    for (i = 0; i < num_sum_versions; i++) {
+      t = now();
+      for (n = 0; n < iters; n++)
+        sink += sum_versions[i].fn(buf + (n & 1), len, 0);
+      t = now() - t;
+      printf("sum %-10s %6lu bytes: %8.1f MB/s\n", sum_versions[i].name,
+          (unsigned long) len, iters * len / t / 1e6);
+    }
+    for (i = 0; i < num_crc_versions; i++) {
+      t = now();
+      for (n = 0; n < iters; n++)
+        sink += crc_versions[i].fn(0xffffffff, buf + (n & 1), len);
+      t = now() - t;
+      printf("crc32c %-10s %6lu bytes: %8.1f MB/s\n", crc_versions[i].name,
+          (unsigned long) len, iters * len / t / 1e6);
+    }
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  u8 *buf;
+  int i, failures;
+
+  buf = (u8 *) malloc(65536 + MAX_ALIGN);
+  if (buf == NULL)
+    return 1;
+  srand(1);
+  for (i = 0; i < 65536 + MAX_ALIGN; i++)
+    buf[i] = rand() & 0xff;
+
+  find_versions();
+  failures = test_known();
+  failures += test_versions(buf);
+  /* Sums of all ones, where every addition carries. */
+  memset(buf, 0xff, 65536 + MAX_ALIGN);
+  failures += test_versions(buf);
+
+  if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    bench(buf);
+
+  printf("%d versions of the checksum, %d of CRC-32C: %d failures\n",
+      num_sum_versions, num_crc_versions, failures);
+  free(buf);
+  return failures == 0 ? 0 : 1;
+}
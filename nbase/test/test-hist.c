@@ -0,0 +1,136 @@
+/*
+Usage: test-hist
+
+This is a test program for the latency histogram in nbase_hist.c. It includes
+that file so that it can check the bucket layout directly: every bucket must
+start where the previous one ended, and every value must land in a bucket
+that contains it. It then checks percentiles against a sorted list of random
+values, and that merging histograms gives the same result as adding all the
+values to one.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../nbase_hist.c"
+
+#define NUM_VALUES 10000
+
+static int test_buckets(void)
+{
+  u32 low, width, next, v;
+  int i, failures = 0;
+
+  next = 0;
+  for (i = 0; i < LATENCY_HIST_BUCKETS; i++) {
+    low = bucket_low(i, &width);
+    if (low != next) {
+      printf("FAIL: bucket %d starts at %lu, not %lu\n", i,
+          (unsigned long) low, (unsigned long) next);
+      failures++;
+    }
+    if (bucket_of(low) != i || bucket_of(low + (width - 1)) != i) {
+      printf("FAIL: bucket %d does not hold %lu-%lu\n", i,
+          (unsigned long) low, (unsigned long) (low + (width - 1)));
+      failures++;
+    }
+    next = low + width;
+  }
+  if (next != 0) {
+    printf("FAIL: buckets end at %lu, not at 2^32\n", (unsigned long) next);
+    failures++;
+  }
+
+  /* A few values at the edges of powers of two. */
+  for (i = 0; i < 32; i++) {
+    v = (u32) 1 << i;
+    if (bucket_of(v - 1) >= bucket_of(v)) {
+      printf("FAIL: %lu and %lu share a bucket\n", (unsigned long) (v - 1),
+          (unsigned long) v);
+      failures++;
+    }
+  }
+  if (bucket_of(0xffffffff) != LATENCY_HIST_BUCKETS - 1) {
+    printf("FAIL: 2^32-1 is not in the last bucket\n");
+    failures++;
+  }
+  return failures;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+  u32 x = *(const u32 *) a, y = *(const u32 *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static int test_percentiles(void)
+{
+  static const double ps[] = { 0, 1, 25, 50, 90, 99, 99.9, 100 };
+  static u32 values[NUM_VALUES];
+  struct latency_hist all, parts[4], merged;
+  u32 got, want, err;
+  size_t i;
+  int failures = 0;
+
+  latency_hist_init(&all);
+  for (i = 0; i < 4; i++)
+    latency_hist_init(&parts[i]);
+  latency_hist_init(&merged);
+
+  /* Round-trip times in microseconds, from a few hundred to a few seconds. */
+  for (i = 0; i < NUM_VALUES; i++) {
+    values[i] = 100 + (u32) ((rand() & 0x7fff) * (rand() & 0xff));
+    latency_hist_add(&all, values[i]);
+    latency_hist_add(&parts[i % 4], values[i]);
+  }
+  for (i = 0; i < 4; i++)
+    latency_hist_merge(&merged, &parts[i]);
+  if (memcmp(&all, &merged, sizeof(all)) != 0) {
+    printf("FAIL: merged histogram differs\n");
+    failures++;
+  }
+
+  qsort(values, NUM_VALUES, sizeof(values[0]), cmp_u32);
+  for (i = 0; i < sizeof(ps) / sizeof(ps[0]); i++) {
+    size_t rank = (size_t) (ps[i] / 100.0 * NUM_VALUES + 0.999999);
+
+    want = values[rank == 0 ? 0 : rank - 1];
+    got = latency_hist_percentile(&all, ps[i]);
+    err = got > want ? got - want : want - got;
+    if (err > want / 16) {
+      printf("FAIL: p%g is %lu, want %lu\n", ps[i], (unsigned long) got,
+          (unsigned long) want);
+      failures++;
+    }
+  }
+  if (all.min != values[0] || all.max != values[NUM_VALUES - 1]) {
+    printf("FAIL: min/max\n");
+    failures++;
+  }
+
+  latency_hist_init(&all);
+  if (latency_hist_percentile(&all, 50) != 0 || latency_hist_mean(&all) != 0) {
+    printf("FAIL: empty histogram\n");
+    failures++;
+  }
+  latency_hist_add(&all, 3);
+  if (latency_hist_percentile(&all, 50) != 3) {
+    printf("FAIL: single value\n");
+    failures++;
+  }
+  return failures;
+}
+
+int main(void)
+{
+  int failures;
+
+  srand(1);
+  failures = test_buckets();
+  failures += test_percentiles();
+
+  printf("latency histogram: %d failures\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -918,6 +918,38 @@ int http_read_header(struct socket_buffer *buf, char **result)
     return 0;
 }
 
+/* Like http_read_header, but take the header from the first len bytes of buf
+   instead of reading it from a socket. Returns 0 and sets *result and *n, the
+   number of bytes it took up, if the whole header is there; -1 if more data is
+   needed; or an HTTP error code. */
+int http_get_header(const char *buf, size_t len, char **result, size_t *n)
+{
+    const char *p, *end, *newline;
+    int blank;
+
+    p = buf;
+    end = buf + len;
+    do {
+        newline = (const char *) memchr(p, '\n', end - p);
+        if (newline == NULL) {
+            if (len >= MAX_HEADER_LENGTH)
+                /* Request Entity Too Large. */
+                return 413;
+            return -1;
+        }
+        blank = is_crlf(p);
+        p = newline + 1;
+        if (p - buf >= MAX_HEADER_LENGTH)
+            /* Request Entity Too Large. */
+            return 413;
+    } while (!blank);
+
+    *result = mkstr(buf, p);
+    *n = p - buf;
+
+    return 0;
+}
+
 static const char *skip_lws(const char *s)
 {
     for (;;) {
@@ -1070,6 +1102,42 @@ int http_read_request_line(struct socket_buffer *buf, char **line)
     return 0;
 }
 
+/* Like http_read_request_line, but take the Request-Line from the first len
+   bytes of buf instead of reading it from a socket. Returns 0 and sets *line
+   and *n, the number of bytes used including any empty lines before the
+   Request-Line, if the whole line is there; -1 if more data is needed; or an
+   HTTP error code. */
+int http_get_request_line(const char *buf, size_t len, char **line, size_t *n)
+{
+    const char *p, *end, *newline;
+
+    *line = NULL;
+    p = buf;
+    end = buf + len;
+    for (;;) {
+        newline = (const char *) memchr(p, '\n', end - p);
+        if (newline == NULL) {
+            if (end - p >= MAX_REQUEST_LINE_LENGTH)
+                /* Request Entity Too Large. */
+                return 413;
+            return -1;
+        }
+        if (newline + 1 - p >= MAX_REQUEST_LINE_LENGTH)
+            /* Request Entity Too Large. */
+            return 413;
+        /* Section 4.1 of RFC 2616 says "servers SHOULD ignore any empty
+           line(s) received where a Request-Line is expected." */
+        if (!is_crlf(p))
+            break;
+        p = newline + 1;
+    }
+
+    *line = mkstr(p, newline + 1);
+    *n = newline + 1 - buf;
+
+    return 0;
+}
+
 /* Returns the character pointer after the HTTP version, or s if there was a
    parse error. */
 static const char *parse_http_version(const char *s, enum http_version *version)
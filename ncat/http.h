@@ -154,11 +154,13 @@ void http_response_free(struct http_response *response);
 char *http_response_to_string(const struct http_response *response, size_t *n);
 
 int http_read_header(struct socket_buffer *buf, char **result);
+int http_get_header(const char *buf, size_t len, char **result, size_t *n);
 int http_parse_header(struct http_header **result, const char *header);
 int http_request_parse_header(struct http_request *request, const char *header);
 int http_response_parse_header(struct http_response *response, const char *header);
 
 int http_read_request_line(struct socket_buffer *buf, char **line);
+int http_get_request_line(const char *buf, size_t len, char **line, size_t *n);
 int http_parse_request_line(const char *line, struct http_request *request);
 
 int http_read_status_line(struct socket_buffer *buf, char **line);
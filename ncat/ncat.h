@@ -156,8 +156,9 @@ struct socks5_request {
  */
 #define DEFAULT_PROXY_PORT 3128
 
-/* Listen() backlog */
-#define BACKLOG 10
+/* Listen() backlog. A short one makes clients connecting in a burst wait for
+ * their SYNs to be retransmitted. */
+#define BACKLOG SOMAXCONN
 
 /* The default maximum number of simultaneous connections Ncat will accept to
  * a listening port. You may want to increase or decrease this value depending
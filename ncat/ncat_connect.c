@@ -66,11 +66,16 @@
 
 #include "nbase.h"
 #include "http.h"
+#include "ncat_splice.h"
 
 #ifndef WIN32
 #include <unistd.h>
 #include <netdb.h>
 #endif
+#ifdef HAVE_SPLICE
+#include <poll.h>
+#include <sys/stat.h>
+#endif
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
@@ -99,12 +104,17 @@ struct conn_state {
     nsock_iod stdin_nsi;
     nsock_event_id idle_timer_event_id;
     int crlf_state;
+    /* Bytes relayed by splice_relay, which Nsock doesn't count. */
+    unsigned long bytes_sent;
+    unsigned long bytes_received;
 };
 
 static struct conn_state cs = {
     NULL,
     NULL,
     0,
+    0,
+    0,
     0
 };
 
@@ -116,6 +126,10 @@ static void read_socket_handler(nsock_pool nsp, nsock_event evt, void *data);
 static void write_socket_handler(nsock_pool nsp, nsock_event evt, void *data);
 static void idle_timer_handler(nsock_pool nsp, nsock_event evt, void *data);
 static void refresh_idle_timer(nsock_pool nsp);
+#ifdef HAVE_SPLICE
+static int can_splice(void);
+static int splice_relay(int sd);
+#endif
 
 #ifdef HAVE_OPENSSL
 /* This callback is called for every certificate in a chain. ok is true if
@@ -1080,8 +1094,8 @@ int ncat_connect(void)
         gettimeofday(&end_time, NULL);
         time = TIMEVAL_FSEC_SUBTRACT(end_time, start_time);
         loguser("%lu bytes sent, %lu bytes received in %.2f seconds.\n",
-            nsock_iod_get_write_count(cs.sock_nsi),
-            nsock_iod_get_read_count(cs.sock_nsi), time);
+            nsock_iod_get_write_count(cs.sock_nsi) + cs.bytes_sent,
+            nsock_iod_get_read_count(cs.sock_nsi) + cs.bytes_received, time);
     }
 
 #if HAVE_SYS_UN_H
@@ -1233,6 +1247,15 @@ static void post_connect(nsock_pool nsp, nsock_iod iod)
         netexec(&info, o.cmdexec);
     }
 
+#ifdef HAVE_SPLICE
+    /* Relay a plain connection without Nsock, so that the data doesn't have
+       to be copied through Ncat. */
+    if (can_splice() && splice_relay(nsock_iod_get_sd(iod)) == 0) {
+        nsock_loop_quit(nsp);
+        return;
+    }
+#endif
+
     /* Start the initial reads. */
 
     if (!o.sendonly && !o.zerobyte)
@@ -1428,3 +1451,228 @@ static void refresh_idle_timer(nsock_pool nsp)
     cs.idle_timer_event_id =
         nsock_timer_create(nsp, idle_timer_handler, o.idletimeout, &o.idletimeout);
 }
+
+#ifdef HAVE_SPLICE
+/* The capacity asked for the pipes of splice_relay. */
+#define RELAY_PIPE_SIZE (1024 * 1024)
+/* The most sent from a file by one call to sendfile. */
+#define RELAY_SENDFILE_LEN (1024 * 1024)
+
+/* Whether the connection can be relayed by splice_relay: plain TCP, with no
+   option that has to see or change the data on the way. */
+static int can_splice(void)
+{
+    return o.proto == IPPROTO_TCP && !o.ssl && !o.crlf && !o.telnet
+        && !o.linedelay && o.normlogfd == -1 && o.hexlogfd == -1
+        && !o.zerobyte;
+}
+
+/* One direction of splice_relay, from in to out. */
+struct relay_dir {
+    int in;
+    int out;
+    int use_sendfile;       /* in is a regular file, sent with sendfile */
+    struct splice_pipe pipe;
+    int eof;                /* Nothing more to read from in */
+};
+
+/* The time left until deadline, in milliseconds, for poll. */
+static int msecs_until(const struct timeval *deadline)
+{
+    struct timeval now;
+    long ms;
+
+    gettimeofday(&now, NULL);
+    ms = TIMEVAL_MSEC_SUBTRACT(*deadline, now);
+
+    return ms > 0 ? ms : 0;
+}
+
+static void set_deadline(struct timeval *deadline, int ms)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    TIMEVAL_MSEC_ADD(*deadline, now, ms);
+}
+
+/* Do what can be done for one direction now that poll says its descriptor is
+   ready. Returns the number of bytes read (or sent from a file), 0 at end of
+   file, or -1 if nothing was read. Errors other than EAGAIN are fatal, as they
+   are in the Nsock handlers. */
+static int relay_step(struct relay_dir *d, int sd)
+{
+    int n;
+
+    if (d->pipe.len > 0) {
+        n = splice_to(&d->pipe, d->out);
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            if (d->out == sd) {
+                loguser("%s.\n", socket_strerror(errno));
+                exit(1);
+            }
+            die("write");
+        }
+        if (n > 0 && d->out == sd)
+            cs.bytes_sent += n;
+        return -1;
+    }
+
+    if (d->use_sendfile) {
+        n = splice_sendfile(d->out, d->in, RELAY_SENDFILE_LEN);
+        if (n > 0) {
+            cs.bytes_sent += n;
+            return n;
+        }
+        if (n == 0)
+            return 0;
+        if (errno == EAGAIN || errno == EINTR)
+            return -1;
+        if ((errno != EINVAL && errno != ENOSYS)
+            || splice_pipe_open(&d->pipe, RELAY_PIPE_SIZE) == -1) {
+            loguser("%s.\n", socket_strerror(errno));
+            exit(1);
+        }
+        /* Not a file sendfile can read after all; splice it. */
+        d->use_sendfile = 0;
+    }
+
+    n = splice_from(&d->pipe, d->in);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR)
+            return -1;
+        if (d->in == sd) {
+            loguser("%s.\n", socket_strerror(errno));
+            exit(1);
+        }
+        die("read");
+    }
+    if (n > 0 && d->in == sd)
+        cs.bytes_received += n;
+
+    return n;
+}
+
+/* Relay data between the socket sd and stdin and stdout, as the Nsock
+   handlers read_stdin_handler and read_socket_handler do, but having the
+   kernel move it: with splice through a pipe, or with sendfile from a file on
+   stdin. Returns -1, before anything is relayed, if that can't be done, or 0
+   when the relay is over. */
+static int splice_relay(int sd)
+{
+    struct relay_dir up, down;
+    struct relay_dir *dirs[2];
+    struct timeval idle_deadline = { 0 }, quit_deadline = { 0 };
+    int quitting = 0;
+    struct stat st;
+    int i;
+
+    up.in = STDIN_FILENO;
+    up.out = sd;
+    up.eof = o.recvonly;
+    up.use_sendfile = fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode);
+    splice_pipe_init(&up.pipe);
+    down.in = sd;
+    down.out = STDOUT_FILENO;
+    down.eof = o.sendonly;
+    down.use_sendfile = 0;
+    splice_pipe_init(&down.pipe);
+
+    if ((!up.eof && !up.use_sendfile && splice_pipe_open(&up.pipe, RELAY_PIPE_SIZE) == -1)
+        || (!down.eof && splice_pipe_open(&down.pipe, RELAY_PIPE_SIZE) == -1)) {
+        splice_pipe_close(&up.pipe);
+        return -1;
+    }
+
+    if (o.debug)
+        logdebug("Relaying with %s.\n", up.use_sendfile && !up.eof ? "sendfile and splice" : "splice");
+
+    dirs[0] = &up;
+    dirs[1] = &down;
+    if (o.idletimeout > 0)
+        set_deadline(&idle_deadline, o.idletimeout);
+
+    for (;;) {
+        struct pollfd pfd[2];
+        struct relay_dir *ready[2];
+        int nfds = 0, timeout = -1;
+
+        for (i = 0; i < 2; i++) {
+            struct relay_dir *d = dirs[i];
+
+            if (d->pipe.len > 0 || (!d->eof && d->use_sendfile)) {
+                pfd[nfds].fd = d->out;
+                pfd[nfds].events = POLLOUT;
+            } else if (!d->eof) {
+                pfd[nfds].fd = d->in;
+                pfd[nfds].events = POLLIN;
+            } else {
+                continue;
+            }
+            ready[nfds++] = d;
+        }
+
+        if (o.idletimeout > 0)
+            timeout = msecs_until(&idle_deadline);
+        if (quitting && (timeout < 0 || msecs_until(&quit_deadline) < timeout))
+            timeout = msecs_until(&quit_deadline);
+        /* Nothing left to wait for, as when Nsock runs out of events. */
+        if (nfds == 0 && timeout < 0)
+            break;
+
+        if (poll(pfd, nfds, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            die("poll");
+        }
+
+        if (quitting && msecs_until(&quit_deadline) == 0) {
+            loguser("Idle timeout expired (%d ms).\n", o.quitafter);
+            exit(1);
+        }
+        if (o.idletimeout > 0 && msecs_until(&idle_deadline) == 0) {
+            loguser("Idle timeout expired (%d ms).\n", o.idletimeout);
+            exit(1);
+        }
+
+        for (i = 0; i < nfds; i++) {
+            struct relay_dir *d = ready[i];
+            int n;
+
+            if (pfd[i].revents == 0)
+                continue;
+            n = relay_step(d, sd);
+            if (n > 0) {
+                if (o.idletimeout > 0)
+                    set_deadline(&idle_deadline, o.idletimeout);
+                /* Pass it on right away if the other side will take it. */
+                if (d->pipe.len > 0)
+                    relay_step(d, sd);
+            } else if (n == 0 && d == &up) {
+                /* EOF on stdin, as in read_stdin_handler. */
+                up.eof = 1;
+                if (!o.noshutdown)
+                    shutdown(sd, SHUT_WR);
+                if (o.quitafter > 0) {
+                    set_deadline(&quit_deadline, o.quitafter);
+                    quitting = 1;
+                } else if (o.quitafter == 0 && o.sendonly) {
+                    goto done;
+                }
+            } else if (n == 0) {
+                /* EOF on the socket, as in read_socket_handler. */
+                down.eof = 1;
+                Close(STDOUT_FILENO);
+                if (!o.keepopen || o.recvonly)
+                    goto done;
+            }
+        }
+    }
+
+done:
+    splice_pipe_close(&up.pipe);
+    splice_pipe_close(&down.pipe);
+
+    return 0;
+}
+#endif
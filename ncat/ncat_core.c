@@ -441,9 +441,9 @@ int ncat_send(struct fdinfo *fdn, const char *buf, size_t size)
     return n;
 }
 
-/* Broadcast a message to all the descriptors in fds. Returns -1 if any of the
-   sends failed. */
-int ncat_broadcast(fd_set *fds, const fd_list_t *fdlist, const char *msg, size_t size)
+/* Broadcast a message to all the descriptors in fdlist except except_fd (-1
+   for none). Returns -1 if any of the sends failed. */
+int ncat_broadcast(const fd_list_t *fdlist, int except_fd, const char *msg, size_t size)
 {
     struct fdinfo *fdn;
     int i, ret;
@@ -454,7 +454,7 @@ int ncat_broadcast(fd_set *fds, const fd_list_t *fdlist, const char *msg, size_t
     ret = 0;
     for (i = 0; i < fdlist->nfds; i++) {
         fdn = &fdlist->fds[i];
-        if (!checked_fd_isset(fdn->fd, fds))
+        if (fdn->fd == except_fd)
             continue;
 
         if (blocking_fdinfo_send(fdn, msg, size) <= 0) {
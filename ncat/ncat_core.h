@@ -208,9 +208,9 @@ int fdinfo_pending(struct fdinfo *fdn);
 int ncat_recv(struct fdinfo *fdn, char *buf, size_t size, int *pending);
 int ncat_send(struct fdinfo *fdn, const char *buf, size_t size);
 
-/* Broadcast a message to all the descriptors in fds. Returns -1 if any of the
-   sends failed. */
-extern int ncat_broadcast(fd_set *fds, const fd_list_t *fdlist, const char *msg, size_t size);
+/* Broadcast a message to all the descriptors in fdlist except except_fd (-1
+   for none). Returns -1 if any of the sends failed. */
+extern int ncat_broadcast(const fd_list_t *fdlist, int except_fd, const char *msg, size_t size);
 
 /* Do telnet WILL/WONT DO/DONT negotiations */
 extern void dotelnet(int s, unsigned char *buf, size_t bufsiz);
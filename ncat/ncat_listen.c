@@ -59,6 +59,7 @@
 /* $Id$ */
 
 #include "ncat.h"
+#include "ncat_poll.h"
 
 #include <errno.h>
 #include <signal.h>
@@ -104,34 +105,36 @@
 #define READ_STDIN_ERR() logdebug("Error reading from stdin: %s\n", strerror(errno))
 #endif
 
-/* read_fds is the clients we are accepting data from. broadcast_fds is the
-   clients were are sending data to. broadcast_fds doesn't include the listening
-   socket and stdin. Network clients are not added to read_fds when --send-only
-   is used, because they would be always selected without having data read.
-   write_fds is the list of clients that are waiting for some kind of response
-   from us, like a pending ssl negotiation. */
-static fd_set master_readfds, master_writefds, master_broadcastfds;
+/* client_fdlist is the listening sockets, stdin, and the clients we are
+   accepting data from. broadcast_fdlist is the clients we are sending data to;
+   it doesn't include the listening sockets and stdin. Which of them are
+   watched for reading or writing is kept by the poller (see ncat_poll.h).
+   Network clients are not read from when --send-only is used, because they
+   would be always readable without having data read. */
+static fd_list_t client_fdlist, broadcast_fdlist;
 #ifdef HAVE_OPENSSL
-/* sslpending_fds contains the list of ssl sockets that are waiting to complete
-   the ssl handshake */
-static fd_set sslpending_fds;
+/* sslpending_fdlist contains the list of ssl sockets that are waiting to
+   complete the ssl handshake */
+static fd_list_t sslpending_fdlist;
 #endif
 
-/* These are bookkeeping data structures that are parallel to read_fds and
-   broadcast_fds. */
-static fd_list_t client_fdlist, broadcast_fdlist;
+/* Set when a send to a client fails, so that it can be closed once we are
+   done with the event being handled. */
+static int broadcast_failed = 0;
 
 static int listen_socket[NUM_LISTEN_ADDRS];
 /* Has stdin seen EOF? */
 static int stdin_eof = 0;
 static int crlf_state = 0;
 
-static void handle_connection(int socket_accept, int type, fd_set *listen_fds);
+static void handle_connection(int socket_accept, int type);
 static int read_stdin(struct timeval *qtv);
 static int read_socket(int recv_fd);
 static void post_handle_connection(struct fdinfo *sinfo);
 static void close_fd(struct fdinfo *fdn, int eof);
 static void read_and_broadcast(int recv_socket);
+static int broadcast(int except_fd, const char *msg, size_t size);
+static void close_failed_clients(void);
 static void shutdown_sockets(int how);
 static int chat_announce_connect(const struct fdinfo *fdi);
 static int chat_announce_disconnect(int fd);
@@ -175,7 +178,7 @@ static void sigchld_handler(int signum)
 }
 #endif
 
-int new_listen_socket(int type, int proto, const union sockaddr_u *addr, fd_set *listen_fds)
+static int new_listen_socket(int type, int proto, const union sockaddr_u *addr)
 {
   struct fdinfo fdi = {0};
   fdi.fd = do_listen(type, proto, addr);
@@ -190,21 +193,27 @@ int new_listen_socket(int type, int proto, const union sockaddr_u *addr, fd_set
    */
   unblock_socket(fdi.fd);
 
-  /* setup select sets and max fd */
-  checked_fd_set(fdi.fd, &master_readfds);
+  poller_add(fdi.fd, POLLER_READ);
   add_fdinfo(&client_fdlist, &fdi);
 
-  checked_fd_set(fdi.fd, listen_fds);
-
   return fdi.fd;
 }
 
+static int is_listen_socket(int fd)
+{
+    int i;
+
+    for (i = 0; i < num_listenaddrs; i++) {
+        if (listen_socket[i] == fd)
+            return 1;
+    }
+    return 0;
+}
+
 int ncat_listen()
 {
-    int rc, i, j, fds_ready;
-    fd_set listen_fds;
-    struct timeval tv={0}, qtv={0};
-    struct timeval *tvp = NULL;
+    int rc, i, fds_ready;
+    struct timeval qtv={0};
     unsigned int num_sockets;
     int proto = o.proto;
     int type = o.proto == IPPROTO_UDP ? SOCK_DGRAM : SOCK_STREAM;
@@ -221,15 +230,12 @@ int ncat_listen()
         proto = 0;
 #endif
     /* clear out structs */
-    FD_ZERO(&master_readfds);
-    FD_ZERO(&master_writefds);
-    FD_ZERO(&master_broadcastfds);
-    FD_ZERO(&listen_fds);
-#ifdef HAVE_OPENSSL
-    FD_ZERO(&sslpending_fds);
-#endif
     zmem(&client_fdlist, sizeof(client_fdlist));
     zmem(&broadcast_fdlist, sizeof(broadcast_fdlist));
+#ifdef HAVE_OPENSSL
+    zmem(&sslpending_fdlist, sizeof(sslpending_fdlist));
+#endif
+    poller_init();
 
 #ifdef WIN32
     set_pseudo_sigchld_handler(decrease_conn_count);
@@ -270,6 +276,12 @@ int ncat_listen()
        number added to the supplied connection limit, that will compensate
        maxfds for the added by default listen and stdin sockets. */
     init_fdlist(&client_fdlist, sadd(o.conn_limit, num_listenaddrs + 1));
+#ifdef HAVE_OPENSSL
+    if (o.ssl)
+        init_fdlist(&sslpending_fdlist, o.conn_limit);
+#endif
+    /* Make sure we can have as many clients as we are allowed. */
+    raise_nofile_limit(sadd(o.conn_limit, num_listenaddrs + 16));
 
     for (i = 0; i < NUM_LISTEN_ADDRS; i++)
         listen_socket[i] = -1;
@@ -277,7 +289,7 @@ int ncat_listen()
     num_sockets = 0;
     for (i = 0; i < num_listenaddrs; i++) {
         /* setup the main listening socket */
-        listen_socket[num_sockets] = new_listen_socket(type, proto, &listenaddrs[i], &listen_fds);
+        listen_socket[num_sockets] = new_listen_socket(type, proto, &listenaddrs[i]);
         if (listen_socket[num_sockets] == -1) {
             if (o.debug > 0)
                 logdebug("do_listen(\"%s\"): %s\n", socktop(&listenaddrs[i], 0), socket_strerror(socket_errno()));
@@ -297,15 +309,12 @@ int ncat_listen()
     init_fdlist(&broadcast_fdlist, o.conn_limit);
 
     while (client_fdlist.nfds > 1 || get_conn_count() > 0) {
+        struct poller_event *events;
         long usec_wait = -1;
-        tvp = NULL;
-        /* We pass these temporary descriptor sets to fselect, since fselect
-           modifies the sets it receives. */
-        fd_set readfds = master_readfds, writefds = master_writefds;
-
+        int timeout_ms = -1;
 
         if (o.debug > 1)
-            logdebug("selecting, fdmax %d\n", client_fdlist.fdmax);
+            logdebug("polling, fdmax %d\n", client_fdlist.fdmax);
 
         if (o.debug > 1 && o.broker)
             logdebug("Broker connection count is %d\n", get_conn_count());
@@ -322,62 +331,60 @@ int ncat_listen()
         if (o.idletimeout > 0 && get_conn_count() && o.idletimeout * 1000 < usec_wait)
             usec_wait = o.idletimeout * 1000;
 
-        if (usec_wait >= 0) {
-            tvp = &tv;
-            tv.tv_sec = 0;
-            tv.tv_usec = usec_wait;
-        }
+        if (usec_wait >= 0)
+            timeout_ms = (usec_wait + 999) / 1000;
 
-        fds_ready = fselect(client_fdlist.fdmax + 1, &readfds, &writefds, NULL, tvp);
+        fds_ready = poller_wait(timeout_ms, &events);
 
         if (o.debug > 1)
-            logdebug("select returned %d fds ready\n", fds_ready);
+            logdebug("poll returned %d fds ready\n", fds_ready);
 
         if (fds_ready == 0)
             bye("Idle timeout expired (%ld ms).", usec_wait / 1000);
 
-        /* If client_fdlist.state increases, the list has changed and we
-         * need to go over it again. */
-restart_fd_loop:
-        client_fdlist.state = 0;
-        for (i = 0; i < client_fdlist.nfds && fds_ready > 0; i++) {
-            struct fdinfo *fdi = &client_fdlist.fds[i];
-            int cfd = fdi->fd;
+        /* Only the descriptors that are ready are looked at, so the time taken
+           doesn't depend on how many clients there are. */
+        for (i = 0; i < fds_ready; i++) {
+            int cfd = events[i].fd;
+            struct fdinfo *fdi;
+
+            /* Closed while handling an earlier event. */
+            if (cfd < 0)
+                continue;
+            fdi = get_fdinfo(&client_fdlist, cfd);
+            if (fdi == NULL)
+                continue;
             /* If we saw an error, close this fd */
             if (fdi->lasterr != 0) {
                 close_fd(fdi, 0);
-                goto restart_fd_loop;
-            }
-            /* Loop through descriptors until there's something to read */
-            if (!checked_fd_isset(cfd, &readfds) && !checked_fd_isset(cfd, &writefds))
                 continue;
+            }
 
             if (o.debug > 1)
                 logdebug("fd %d is ready\n", cfd);
 
 #ifdef HAVE_OPENSSL
             /* Is this an ssl socket pending a handshake? If so handle it. */
-            if (o.ssl && checked_fd_isset(cfd, &sslpending_fds)) {
-                checked_fd_clr(cfd, &master_readfds);
-                checked_fd_clr(cfd, &master_writefds);
+            if (o.ssl && get_fdinfo(&sslpending_fdlist, cfd) != NULL) {
+                poller_clear(cfd, POLLER_READ | POLLER_WRITE);
                 switch (ssl_handshake(fdi)) {
                 case NCAT_SSL_HANDSHAKE_COMPLETED:
-                    /* Clear from sslpending_fds once ssl is established */
-                    checked_fd_clr(cfd, &sslpending_fds);
+                    /* Clear from sslpending_fdlist once ssl is established */
+                    rm_fd(&sslpending_fdlist, cfd);
                     post_handle_connection(fdi);
                     break;
                 case NCAT_SSL_HANDSHAKE_PENDING_WRITE:
-                    checked_fd_set(cfd, &master_writefds);
+                    poller_add(cfd, POLLER_WRITE);
                     break;
                 case NCAT_SSL_HANDSHAKE_PENDING_READ:
-                    checked_fd_set(cfd, &master_readfds);
+                    poller_add(cfd, POLLER_READ);
                     break;
                 case NCAT_SSL_HANDSHAKE_FAILED:
                 default:
                     SSL_free(fdi->ssl);
-                    Close(fdi->fd);
-                    checked_fd_clr(cfd, &sslpending_fds);
-                    checked_fd_clr(cfd, &master_readfds);
+                    poller_remove(cfd);
+                    Close(cfd);
+                    rm_fd(&sslpending_fdlist, cfd);
                     rm_fd(&client_fdlist, cfd);
                     /* Are we in single listening mode(without -k)? If so
                        then we should quit also. */
@@ -388,9 +395,9 @@ restart_fd_loop:
                 }
             } else
 #endif
-            if (checked_fd_isset(cfd, &listen_fds)) {
+            if (is_listen_socket(cfd)) {
                 /* we have a new connection request */
-                handle_connection(cfd, type, &listen_fds);
+                handle_connection(cfd, type);
             } else if (cfd == STDIN_FILENO) {
                 if (o.broker) {
                     read_and_broadcast(cfd);
@@ -419,20 +426,9 @@ restart_fd_loop:
                 }
             }
 
-            fds_ready--;
-            if (client_fdlist.state > 0)
-                goto restart_fd_loop;
-
-            /* Check if any send errors were logged. */
-            for (j = 0; j < broadcast_fdlist.nfds; j++) {
-                fdi = &broadcast_fdlist.fds[j];
-                if (fdi->lasterr != 0) {
-                    close_fd(fdi, 0);
-                    /* close_fd mucks with client_fdlist, so jump back and
-                     * start the loop over */
-                    goto restart_fd_loop;
-                }
-            }
+            /* Close the clients that sends failed to. */
+            if (broadcast_failed)
+                close_failed_clients();
         }
     }
 
@@ -442,7 +438,7 @@ restart_fd_loop:
 /* Accept a connection on a listening socket. Allow or deny the connection.
    Fork a command if o.cmdexec is set. Otherwise, add the new socket to the
    watch set. */
-static void handle_connection(int socket_accept, int type, fd_set *listen_fds)
+static void handle_connection(int socket_accept, int type)
 {
     struct fdinfo s = { 0 };
     int conn_count;
@@ -498,7 +494,7 @@ static void handle_connection(int socket_accept, int type, fd_set *listen_fds)
           if (listen_socket[i] == socket_accept) {
             struct fdinfo *lfdi = get_fdinfo(&client_fdlist, socket_accept);
             union sockaddr_u localaddr = lfdi->remoteaddr;
-            listen_socket[i] = new_listen_socket(type, (o.af == AF_INET || o.af == AF_INET6) ? o.proto : 0, &localaddr, listen_fds);
+            listen_socket[i] = new_listen_socket(type, (o.af == AF_INET || o.af == AF_INET6) ? o.proto : 0, &localaddr);
             if (listen_socket[i] < 0) {
               bye("do_listen(\"%s\"): %s\n", socktop(&listenaddrs[i], 0), socket_strerror(socket_errno()));
               return;
@@ -506,10 +502,15 @@ static void handle_connection(int socket_accept, int type, fd_set *listen_fds)
             break;
           }
         }
+      } else {
+        int i;
+        for (i = 0; i < num_listenaddrs; i++) {
+          if (listen_socket[i] == socket_accept)
+            listen_socket[i] = -1;
+        }
       }
       /* Remove this socket from listening */
-      checked_fd_clr(socket_accept, &master_readfds);
-      checked_fd_clr(socket_accept, listen_fds);
+      poller_clear(socket_accept, POLLER_READ);
       rm_fd(&client_fdlist, socket_accept);
     }
 
@@ -525,9 +526,9 @@ static void handle_connection(int socket_accept, int type, fd_set *listen_fds)
         int i;
         for (i = 0; i < num_listenaddrs; i++) {
             /* If */
-            if (listen_socket[i] >= 0 && checked_fd_isset(listen_socket[i], listen_fds)) {
+            if (listen_socket[i] >= 0) {
+              poller_remove(listen_socket[i]);
               Close(listen_socket[i]);
-              checked_fd_clr(listen_socket[i], &master_readfds);
               rm_fd(&client_fdlist, listen_socket[i]);
               listen_socket[i] = -1;
             }
@@ -563,9 +564,9 @@ static void handle_connection(int socket_accept, int type, fd_set *listen_fds)
 #ifdef HAVE_OPENSSL
     if (o.ssl) {
         /* Add the socket to the necessary descriptor lists. */
-        checked_fd_set(s.fd, &sslpending_fds);
-        checked_fd_set(s.fd, &master_readfds);
-        checked_fd_set(s.fd, &master_writefds);
+        if (add_fdinfo(&sslpending_fdlist, &s) < 0)
+            bye("add_fdinfo() failed.");
+        poller_add(s.fd, POLLER_READ | POLLER_WRITE);
         /* Add it to our list of fds too for maintaining maxfd. */
         if (add_fdinfo(&client_fdlist, &s) < 0)
             bye("add_fdinfo() failed.");
@@ -585,10 +586,18 @@ static void post_handle_connection(struct fdinfo *sinfo)
     if (o.cmdexec) {
 #ifdef HAVE_OPENSSL
       /* We added this in handle_connection, but at this point the ssl
-       * connection has taken over. Stop tracking.
+       * connection has taken over. Stop tracking. sinfo points into
+       * client_fdlist, so copy it first.
        */
       if (o.ssl) {
-        rm_fd(&client_fdlist, sinfo->fd);
+        struct fdinfo s = *sinfo;
+        poller_remove(s.fd);
+        rm_fd(&client_fdlist, s.fd);
+        if (o.keepopen)
+            netrun(&s, o.cmdexec);
+        else
+            netexec(&s, o.cmdexec);
+        return;
       }
 #endif
         if (o.keepopen)
@@ -598,10 +607,10 @@ static void post_handle_connection(struct fdinfo *sinfo)
     } else {
         /* Now that a client is connected, pay attention to stdin. */
         if (!stdin_eof)
-            checked_fd_set(STDIN_FILENO, &master_readfds);
+            poller_add(STDIN_FILENO, POLLER_READ);
         if (!o.sendonly) {
             /* add to our lists */
-            checked_fd_set(sinfo->fd, &master_readfds);
+            poller_add(sinfo->fd, POLLER_READ);
             /* add it to our list of fds for maintaining maxfd */
 #ifdef HAVE_OPENSSL
             /* Don't add it twice (see handle_connection above) */
@@ -613,7 +622,6 @@ static void post_handle_connection(struct fdinfo *sinfo)
             }
 #endif
         }
-        checked_fd_set(sinfo->fd, &master_broadcastfds);
         if (add_fdinfo(&broadcast_fdlist, sinfo) < 0)
             bye("add_fdinfo() failed.");
 
@@ -634,15 +642,15 @@ static void close_fd(struct fdinfo *fdn, int eof) {
         SSL_free(fdn->ssl);
     }
 #endif
+    poller_remove(fd);
     Close(fd);
-    checked_fd_clr(fd, &master_readfds);
-    rm_fd(&client_fdlist, fd);
-    checked_fd_clr(fd, &master_broadcastfds);
+    if (get_fdinfo(&client_fdlist, fd) != NULL)
+        rm_fd(&client_fdlist, fd);
     rm_fd(&broadcast_fdlist, fd);
 
     conn_inc--;
     if (get_conn_count() == 0)
-        checked_fd_clr(STDIN_FILENO, &master_readfds);
+        poller_clear(STDIN_FILENO, POLLER_READ);
 
     if (o.chat)
         chat_announce_disconnect(fd);
@@ -669,7 +677,7 @@ int read_stdin(struct timeval *qtv)
             TIMEVAL_MSEC_ADD(*qtv, when, o.quitafter);
         }
         /* Don't close the file because that allows a socket to be fd 0. */
-        checked_fd_clr(STDIN_FILENO, &master_readfds);
+        poller_clear(STDIN_FILENO, POLLER_READ);
         /* Buf mark that we've seen EOF so it doesn't get re-added to the
            select list. */
         stdin_eof = 1;
@@ -685,11 +693,11 @@ int read_stdin(struct timeval *qtv)
 
     /* Write to everything in the broadcast set. */
     if (tempbuf != NULL) {
-        ncat_broadcast(&master_broadcastfds, &broadcast_fdlist, tempbuf, nbytes);
+        broadcast(-1, tempbuf, nbytes);
         free(tempbuf);
         tempbuf = NULL;
     } else {
-        ncat_broadcast(&master_broadcastfds, &broadcast_fdlist, buf, nbytes);
+        broadcast(-1, buf, nbytes);
     }
 
     return nbytes;
@@ -749,7 +757,6 @@ static void read_and_broadcast(int recv_fd)
         char buf[DEFAULT_TCP_BUF_LEN];
         char *chatbuf, *outbuf;
         char *tempbuf = NULL;
-        fd_set broadcastfds;
         int n;
 
         /* Behavior differs depending on whether this is stdin or a socket. */
@@ -763,7 +770,7 @@ static void read_and_broadcast(int recv_fd)
 
                 /* Don't close the file because that allows a socket to be
                    fd 0. */
-                checked_fd_clr(recv_fd, &master_readfds);
+                poller_clear(recv_fd, POLLER_READ);
                 /* But mark that we've seen EOF so it doesn't get re-added to
                    the select list. */
                 stdin_eof = 1;
@@ -812,9 +819,7 @@ static void read_and_broadcast(int recv_fd)
         }
 
         /* Send to everyone except the one who sent this message. */
-        broadcastfds = master_broadcastfds;
-        checked_fd_clr(recv_fd, &broadcastfds);
-        ncat_broadcast(&broadcastfds, &broadcast_fdlist, outbuf, n);
+        broadcast(recv_fd, outbuf, n);
 
         free(chatbuf);
         free(tempbuf);
@@ -822,17 +827,43 @@ static void read_and_broadcast(int recv_fd)
     } while (pending);
 }
 
+/* Send to everything in the broadcast list but except_fd, noting whether any
+   of the sends failed so that the failed clients can be closed. */
+static int broadcast(int except_fd, const char *msg, size_t size)
+{
+    int ret;
+
+    ret = ncat_broadcast(&broadcast_fdlist, except_fd, msg, size);
+    if (ret < 0)
+        broadcast_failed = 1;
+
+    return ret;
+}
+
+/* Close the clients that a broadcast failed to send to. Closing a client in
+   chat mode broadcasts again, so keep going until no more sends fail. */
+static void close_failed_clients(void)
+{
+    int i;
+
+    while (broadcast_failed) {
+        broadcast_failed = 0;
+        /* close_fd moves the last entry into the one it removes, so go
+           backwards to see every entry once. */
+        for (i = broadcast_fdlist.nfds - 1; i >= 0; i--) {
+            if (i < broadcast_fdlist.nfds && broadcast_fdlist.fds[i].lasterr != 0)
+                close_fd(&broadcast_fdlist.fds[i], 0);
+        }
+    }
+}
+
 static void shutdown_sockets(int how)
 {
     struct fdinfo *fdn;
     int i;
 
-    for (i = 0; i <= broadcast_fdlist.fdmax; i++) {
-        if (!checked_fd_isset(i, &master_broadcastfds))
-            continue;
-
-        fdn = get_fdinfo(&broadcast_fdlist, i);
-        ncat_assert(fdn != NULL);
+    for (i = 0; i < broadcast_fdlist.nfds; i++) {
+        fdn = &broadcast_fdlist.fds[i];
 #ifdef HAVE_OPENSSL
         if (o.ssl && fdn->ssl) {
                 SSL_shutdown(fdn->ssl);
@@ -855,20 +886,16 @@ static int chat_announce_connect(const struct fdinfo *fdi)
 
     strbuf_sprintf(&buf, &size, &offset, "<announce> already connected: ");
     count = 0;
-    for (i = 0; i <= client_fdlist.fdmax; i++) {
-        union sockaddr_u tsu;
-        socklen_t len = sizeof(tsu.storage);
+    for (i = 0; i <= broadcast_fdlist.fdmax; i++) {
+        const struct fdinfo *peer;
 
-        if (i == fdi->fd || !checked_fd_isset(i, &master_broadcastfds))
+        if (i == fdi->fd || (peer = get_fdinfo(&broadcast_fdlist, i)) == NULL)
             continue;
 
-        if (getpeername(i, &tsu.sockaddr, &len) == -1)
-            bye("getpeername for sd %d failed: %s.", i, strerror(errno));
-
         if (count > 0)
             strbuf_sprintf(&buf, &size, &offset, ", ");
 
-        strbuf_sprintf(&buf, &size, &offset, "%s as <user%d>", socktop(&tsu, len), i);
+        strbuf_sprintf(&buf, &size, &offset, "%s as <user%d>", socktop(&peer->remoteaddr, peer->ss_len), i);
 
         count++;
     }
@@ -876,7 +903,7 @@ static int chat_announce_connect(const struct fdinfo *fdi)
         strbuf_sprintf(&buf, &size, &offset, "nobody");
     strbuf_sprintf(&buf, &size, &offset, ".\n");
 
-    ret = ncat_broadcast(&master_broadcastfds, &broadcast_fdlist, buf, offset);
+    ret = broadcast(-1, buf, offset);
 
     free(buf);
 
@@ -893,7 +920,7 @@ static int chat_announce_disconnect(int fd)
     if (n < 0 || n >= sizeof(buf))
         return -1;
 
-    return ncat_broadcast(&master_broadcastfds, &broadcast_fdlist, buf, n);
+    return broadcast(-1, buf, n);
 }
 
 /*
@@ -0,0 +1,366 @@
+/***************************************************************************
+ * ncat_poll.c -- epoll- or select-based readiness notification.           *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#include "ncat.h"
+#include "ncat_poll.h"
+
+#include <errno.h>
+#include <string.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
+/* The most events returned by one poller_wait. Descriptors still ready are
+   returned by the next one. */
+#define POLLER_MAX_EVENTS 64
+
+/* Flags kept along with the events in interest[]. */
+#define POLLER_REGISTERED 0x4 /* In the epoll set */
+#define POLLER_ALWAYS     0x8 /* Can't be polled; always ready */
+
+/* The events each descriptor is watched for, indexed by descriptor. */
+static unsigned char *interest = NULL;
+static int interest_size = 0;
+
+/* Descriptors that epoll refuses, like a regular file redirected to stdin.
+   select reports those as always ready, and so do we. */
+static int *always = NULL;
+static int num_always = 0, max_always = 0;
+/* Where add_always_ready starts, so that all of them get a turn when there
+   are more than fit in one batch. */
+static int always_next = 0;
+
+static struct poller_event batch[POLLER_MAX_EVENTS];
+static int batch_len = 0;
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epfd = -1;
+#else
+static fd_set master_readfds, master_writefds;
+static int fdmax = -1;
+/* Where poller_wait starts looking for ready descriptors, so that busy low
+   ones can't keep higher ones out of the batch. */
+static int select_next = 0;
+#endif
+
+static void grow_interest(int fd)
+{
+    int n;
+
+    ncat_assert(fd >= 0);
+    if (fd < interest_size)
+        return;
+    n = interest_size > 0 ? interest_size : 64;
+    while (n <= fd)
+        n *= 2;
+    interest = (unsigned char *) safe_realloc(interest, n);
+    memset(interest + interest_size, 0, n - interest_size);
+    interest_size = n;
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+static void add_always(int fd)
+{
+    if (num_always == max_always) {
+        max_always = max_always > 0 ? max_always * 2 : 4;
+        always = (int *) safe_realloc(always, max_always * sizeof(*always));
+    }
+    always[num_always++] = fd;
+}
+#endif
+
+static void remove_always(int fd)
+{
+    int i;
+
+    for (i = 0; i < num_always; i++) {
+        if (always[i] == fd) {
+            always[i] = always[--num_always];
+            return;
+        }
+    }
+}
+
+void poller_init(void)
+{
+    batch_len = 0;
+#ifdef HAVE_SYS_EPOLL_H
+    if (epfd == -1)
+        epfd = epoll_create(POLLER_MAX_EVENTS);
+    if (epfd == -1)
+        bye("epoll_create: %s.", strerror(errno));
+#else
+    FD_ZERO(&master_readfds);
+    FD_ZERO(&master_writefds);
+    fdmax = -1;
+    select_next = 0;
+#endif
+}
+
+/* Tell the system about a change in the events fd is watched for. */
+static void update(int fd)
+{
+    int events = interest[fd] & (POLLER_READ | POLLER_WRITE);
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event ev;
+
+    if (interest[fd] & POLLER_ALWAYS)
+        return;
+
+    zmem(&ev, sizeof(ev));
+    ev.data.fd = fd;
+    if (events & POLLER_READ)
+        ev.events |= EPOLLIN;
+    if (events & POLLER_WRITE)
+        ev.events |= EPOLLOUT;
+
+    if (!(interest[fd] & POLLER_REGISTERED)) {
+        if (events == 0)
+            return;
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+            if (errno != EPERM)
+                bye("epoll_ctl(%d): %s.", fd, strerror(errno));
+            interest[fd] |= POLLER_ALWAYS;
+            add_always(fd);
+            return;
+        }
+        interest[fd] |= POLLER_REGISTERED;
+    } else if (events == 0) {
+        /* A registered descriptor is always watched for errors and hangups,
+           so take it out of the set rather than leave it with no events. */
+        epoll_ctl(epfd, EPOLL_CTL_DEL, fd, &ev);
+        interest[fd] &= ~POLLER_REGISTERED;
+    } else {
+        if (epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev) == -1)
+            bye("epoll_ctl(%d): %s.", fd, strerror(errno));
+    }
+#else
+    if (events & POLLER_READ)
+        checked_fd_set(fd, &master_readfds);
+    else
+        checked_fd_clr(fd, &master_readfds);
+    if (events & POLLER_WRITE)
+        checked_fd_set(fd, &master_writefds);
+    else
+        checked_fd_clr(fd, &master_writefds);
+
+    if (events != 0 && fd > fdmax) {
+        fdmax = fd;
+    } else if (events == 0 && fd == fdmax) {
+        while (fdmax >= 0 && (interest[fdmax] & (POLLER_READ | POLLER_WRITE)) == 0)
+            fdmax--;
+    }
+#endif
+}
+
+void poller_add(int fd, int events)
+{
+    grow_interest(fd);
+    if ((interest[fd] & events) == events)
+        return;
+    interest[fd] |= events;
+    update(fd);
+}
+
+void poller_clear(int fd, int events)
+{
+    if (fd >= interest_size || (interest[fd] & events) == 0)
+        return;
+    interest[fd] &= ~events;
+    update(fd);
+}
+
+void poller_remove(int fd)
+{
+    int i;
+
+    if (fd < 0 || fd >= interest_size)
+        return;
+    poller_clear(fd, POLLER_READ | POLLER_WRITE);
+    if (interest[fd] & POLLER_ALWAYS)
+        remove_always(fd);
+    interest[fd] = 0;
+
+    for (i = 0; i < batch_len; i++) {
+        if (batch[i].fd == fd)
+            batch[i].fd = -1;
+    }
+}
+
+/* Add the descriptors that can't be polled, which are always ready, to the
+   batch. */
+static int add_always_ready(int n)
+{
+    int i;
+
+    if (always_next >= num_always)
+        always_next = 0;
+    for (i = 0; i < num_always && n < POLLER_MAX_EVENTS; i++) {
+        int fd = always[(always_next + i) % num_always];
+        int events = interest[fd] & (POLLER_READ | POLLER_WRITE);
+        if (events != 0) {
+            batch[n].fd = fd;
+            batch[n].events = events;
+            n++;
+        }
+    }
+    always_next += i;
+    return n;
+}
+
+int poller_wait(int timeout_ms, struct poller_event **events)
+{
+    int i, n;
+#ifdef HAVE_SYS_EPOLL_H
+    struct epoll_event evs[POLLER_MAX_EVENTS];
+    int ready = 0;
+
+    batch_len = 0;
+    *events = batch;
+    for (i = 0; i < num_always; i++) {
+        if (interest[always[i]] & (POLLER_READ | POLLER_WRITE))
+            ready++;
+    }
+    if (ready > 0)
+        timeout_ms = 0;
+    /* Leave room for at least one polled descriptor however many are always
+       ready; epoll_wait fails unless maxevents is positive. */
+    if (ready > POLLER_MAX_EVENTS - 1)
+        ready = POLLER_MAX_EVENTS - 1;
+
+    n = epoll_wait(epfd, evs, POLLER_MAX_EVENTS - ready, timeout_ms);
+    if (n < 0)
+        return -1;
+    for (i = 0; i < n; i++) {
+        int fd = evs[i].data.fd;
+
+        batch[i].fd = fd;
+        batch[i].events = 0;
+        /* Like select, report errors and hangups as readiness to read or
+           write, so they are found by the read or write that follows. */
+        if (evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+            batch[i].events |= POLLER_READ;
+        if (evs[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+            batch[i].events |= POLLER_WRITE;
+        batch[i].events &= interest[fd];
+    }
+#else
+    fd_set readfds = master_readfds, writefds = master_writefds;
+    struct timeval tv, *tvp = NULL;
+    int fd, j, nfds;
+
+    batch_len = 0;
+    *events = batch;
+    for (i = 0; i < num_always; i++) {
+        if (interest[always[i]] & (POLLER_READ | POLLER_WRITE))
+            timeout_ms = 0;
+    }
+    if (timeout_ms >= 0) {
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        tvp = &tv;
+    }
+
+    n = fselect(fdmax + 1, &readfds, &writefds, NULL, tvp);
+    if (n < 0)
+        return -1;
+    i = 0;
+    nfds = fdmax + 1;
+    if (select_next >= nfds)
+        select_next = 0;
+    for (j = 0; j < nfds && i < n && i < POLLER_MAX_EVENTS; j++) {
+        int events = 0;
+
+        fd = (select_next + j) % nfds;
+        if (checked_fd_isset(fd, &readfds))
+            events |= POLLER_READ;
+        if (checked_fd_isset(fd, &writefds))
+            events |= POLLER_WRITE;
+        if (events != 0) {
+            batch[i].fd = fd;
+            batch[i].events = events;
+            i++;
+        }
+    }
+    if (nfds > 0)
+        select_next = (select_next + j) % nfds;
+    n = i;
+#endif
+    batch_len = add_always_ready(n);
+
+    return batch_len;
+}
+
+void poller_close(void)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (epfd != -1)
+        close(epfd);
+    epfd = -1;
+#endif
+    free(interest);
+    interest = NULL;
+    interest_size = 0;
+    free(always);
+    always = NULL;
+    num_always = max_always = 0;
+    always_next = 0;
+    batch_len = 0;
+}
@@ -0,0 +1,98 @@
+/***************************************************************************
+ * ncat_poll.h                                                             *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifndef NCAT_POLL_H
+#define NCAT_POLL_H
+
+/* Readiness notification for the listen and proxy modes. The poller watches
+   each descriptor for the events it is given, and poller_wait returns only the
+   descriptors that are ready, so the work done per event does not grow with
+   the number of connections. It uses epoll where that is available and select
+   everywhere else. There is one poller per process. */
+
+#define POLLER_READ  0x1
+#define POLLER_WRITE 0x2
+
+struct poller_event {
+    int fd;     /* -1 if fd was removed after the event was returned */
+    int events; /* POLLER_READ and/or POLLER_WRITE */
+};
+
+void poller_init(void);
+
+/* Add events to or remove events from the ones fd is watched for. */
+void poller_add(int fd, int events);
+void poller_clear(int fd, int events);
+
+/* Stop watching fd. Call this before closing it. Events already returned for
+   fd get an fd of -1, so a descriptor reused within one batch of events does
+   not get the events of the one it replaces. */
+void poller_remove(int fd);
+
+/* Wait up to timeout_ms milliseconds (forever if negative) for any of the
+   watched descriptors to become ready. Points *events at the ready ones, which
+   stay valid until the next call, and returns how many there are, 0 on
+   timeout, or -1 on error (including EINTR). */
+int poller_wait(int timeout_ms, struct poller_event **events);
+
+/* Release the poller's own descriptor, as in a forked child. */
+void poller_close(void);
+
+#endif
@@ -62,6 +62,8 @@
 #include "http.h"
 #include "nsock.h"
 #include "ncat.h"
+#include "ncat_poll.h"
+#include "ncat_splice.h"
 #include "sys_wrap.h"
 
 #ifndef WIN32
@@ -83,11 +85,53 @@ static int send_string(struct fdinfo *fdn, const char *s)
     return fdinfo_send(fdn, s, strlen(s));
 }
 
+/* What a connection of the proxy is doing. */
+enum proxy_state {
+    PROXY_REQUEST,      /* Reading the request from a client */
+    PROXY_CONNECTING,   /* Waiting for a CONNECT to the server to complete */
+    PROXY_TUNNEL,       /* Relaying data between client and server */
+};
+
+/* A client or server connection handled by the event loop of the proxy. Each
+   end of a tunnel has the data read from the other end waiting to be sent in
+   out, and no more is read from the other end until it has all been sent. */
+struct proxy_conn {
+    int fd;
+    enum proxy_state state;
+    struct proxy_conn *peer;    /* The other end of a tunnel, or NULL */
+    /* The request read so far, and how much of it is the Request-Line (0 if
+       it hasn't been parsed into req yet). */
+    char *request;
+    size_t request_len, request_size;
+    size_t line_len;
+    struct http_request req;
+    char out[BUFSIZ];
+    size_t out_start, out_end;
+    /* Once a tunnel carries bulk data, what comes from the peer is spliced
+       through this pipe instead of being copied through out. */
+    struct splice_pipe pipe;
+    int close_when_sent;
+};
+
+/* A client handed to a child process (a thread on Windows): an SSL client to
+   serve from the start, or one whose GET, HEAD, or POST request has already
+   been read, along with whatever came after it. */
+struct proxy_job {
+    int fd;
+    int have_request;
+    struct http_request request;
+    char leftover[BUFSIZ];
+    size_t leftover_len;
+};
+
 static void http_server_handler(int c);
+static void serve_request(struct socket_buffer *sock, struct http_request *request);
+static int authorize(const struct http_request *request, int *stale);
 static int send_proxy_authenticate(struct fdinfo *fdn, int stale);
+static char *proxy_authenticate_str(int stale);
 static char *http_code2str(int code);
 
-static void fork_handler(int s, int c);
+static void fork_handler(struct proxy_job *job);
 
 static int handle_connect(struct socket_buffer *client_sock,
     struct http_request *request);
@@ -97,12 +141,35 @@ static int handle_method(struct socket_buffer *client_sock,
 static int check_auth(const struct http_request *request,
     const struct http_credentials *credentials, int *stale);
 
+static void accept_clients(int s);
+static void read_request(struct proxy_conn *conn);
+static void finish_connect(struct proxy_conn *server);
+static void relay(struct proxy_conn *conn);
+static int flush_conn(struct proxy_conn *conn);
+
+static int listen_socket[NUM_LISTEN_ADDRS];
+static unsigned int num_sockets;
+
+/* Connections indexed by descriptor. */
+static struct proxy_conn **proxy_conns = NULL;
+static int proxy_conns_size = 0;
+
+/* Set when we ran out of descriptors and stopped accepting connections until
+   one is closed. */
+static int accept_paused = 0;
+
 /*
- * Simple forking HTTP proxy. It is an HTTP/1.0 proxy with knowledge of
- * HTTP/1.1. (The things lacking for HTTP/1.1 are the chunked transfer encoding
- * and the expect mechanism.) The proxy supports the CONNECT, GET, HEAD, and
- * POST methods. It supports Basic and Digest authentication of clients (use the
- * --proxy-auth option).
+ * Simple HTTP proxy. It is an HTTP/1.0 proxy with knowledge of HTTP/1.1. (The
+ * things lacking for HTTP/1.1 are the chunked transfer encoding and the expect
+ * mechanism.) The proxy supports the CONNECT, GET, HEAD, and POST methods. It
+ * supports Basic and Digest authentication of clients (use the --proxy-auth
+ * option).
+ *
+ * Requests are read, and CONNECT tunnels relayed, by a single event loop, so
+ * that the proxy can handle thousands of clients at once. GET, HEAD, and POST
+ * requests, which are carried out with blocking I/O, are handed to a child
+ * process (a thread on Windows) once they have been read, and so are all
+ * clients when --ssl is used, because the SSL handshake blocks.
  *
  * HTTP/1.1 is defined in RFC 2616. Many comments refer to that document.
  * http://tools.ietf.org/html/rfc2616
@@ -123,14 +190,13 @@ static int check_auth(const struct http_request *request,
  */
 int ncat_http_server(void)
 {
-    int c, i, j;
-    int listen_socket[NUM_LISTEN_ADDRS];
-    socklen_t sslen;
-    union sockaddr_u conn;
-    unsigned int num_sockets;
+    int i;
 
 #ifndef WIN32
     Signal(SIGCHLD, proxyreaper);
+    /* Ignore the SIGPIPE that occurs when a client disconnects suddenly and we
+       send data to it before noticing. */
+    Signal(SIGPIPE, SIG_IGN);
 #endif
 
 #if HAVE_HTTP_DIGEST
@@ -145,13 +211,12 @@ int ncat_http_server(void)
     for (i = 0; i < NUM_LISTEN_ADDRS; i++)
         listen_socket[i] = -1;
 
-    /* set for selecting listening sockets */
-    fd_set listen_fds;
-    fd_list_t listen_fdlist;
-    FD_ZERO(&listen_fds);
-    init_fdlist(&listen_fdlist, num_listenaddrs);
+    poller_init();
+
+    /* Every tunnel takes two descriptors; allow for as many as we can. */
+    raise_nofile_limit(PROXY_MAX_FDS);
 
-    /* Listen on each address, set up lists for select */
+    /* Listen on each address and watch them for connections */
     num_sockets = 0;
     for (i = 0; i < num_listenaddrs; i++) {
         listen_socket[num_sockets] = do_listen(SOCK_STREAM, IPPROTO_TCP, &listenaddrs[i]);
@@ -164,9 +229,7 @@ int ncat_http_server(void)
         /* make us not block on accepts in weird cases. See ncat_listen.c:209 */
         unblock_socket(listen_socket[num_sockets]);
 
-        /* setup select sets and max fd */
-        checked_fd_set(listen_socket[num_sockets], &listen_fds);
-        add_fd(&listen_fdlist, listen_socket[num_sockets]);
+        poller_add(listen_socket[num_sockets], POLLER_READ);
 
         num_sockets++;
     }
@@ -178,92 +241,577 @@ int ncat_http_server(void)
     }
 
     for (;;) {
-        fd_set read_fds;
+        struct poller_event *events;
+        int fds_ready;
 
-        sslen = sizeof(conn.storage);
-        /*
-         * We just select to get a list of sockets which we can talk to
-         */
         if (o.debug > 1)
-            logdebug("selecting, fdmax %d\n", listen_fdlist.fdmax);
-        read_fds = listen_fds;
+            logdebug("polling for events\n");
 
-        int fds_ready = fselect(listen_fdlist.fdmax + 1, &read_fds, NULL, NULL, NULL);
+        fds_ready = poller_wait(-1, &events);
 
         if (o.debug > 1)
-            logdebug("select returned %d fds ready\n", fds_ready);
+            logdebug("poll returned %d fds ready\n", fds_ready);
 
-        if (fds_ready == 0)
-            bye("Idle timeout expired (%d ms).", o.idletimeout);
+        /* Only the descriptors that are ready are looked at, each found in
+           proxy_conns by its number. */
+        for (i = 0; i < fds_ready; i++) {
+            int fd = events[i].fd;
+            struct proxy_conn *conn;
+            unsigned int j;
 
-        for (i = 0; i <= listen_fdlist.fdmax && fds_ready > 0; i++) {
-            /* Loop through descriptors until there is something ready */
-            if (!checked_fd_isset(i, &read_fds))
+            /* Closed while handling an earlier event. */
+            if (fd < 0)
                 continue;
 
-            /* Check each listening socket */
             for (j = 0; j < num_sockets; j++) {
-                if (i == listen_socket[j]) {
-                    fds_ready--;
-                    c = accept(i, &conn.sockaddr, &sslen);
-
-                    if (c == -1) {
-                        if (errno == EINTR)
-                            continue;
-                        die("accept");
-                    }
-
-                    if (!allow_access(&conn)) {
-                        Close(c);
-                        continue;
-                    }
-                    if (o.debug > 1)
-                        logdebug("forking handler for %d\n", i);
-                    fork_handler(i, c);
+                if (fd == listen_socket[j])
+                    break;
+            }
+            if (j < num_sockets) {
+                accept_clients(fd);
+                continue;
+            }
+
+            conn = fd < proxy_conns_size ? proxy_conns[fd] : NULL;
+            if (conn == NULL)
+                continue;
+            if (events[i].events & POLLER_WRITE) {
+                if (conn->state == PROXY_CONNECTING) {
+                    finish_connect(conn);
+                    continue;
                 }
+                if (flush_conn(conn) < 0)
+                    continue;
+            }
+            if (events[i].events & POLLER_READ) {
+                if (conn->state == PROXY_REQUEST)
+                    read_request(conn);
+                else if (conn->state == PROXY_TUNNEL)
+                    relay(conn);
+            }
+        }
+    }
+
+    return 0;
+}
+
+static struct proxy_conn *new_conn(int fd, enum proxy_state state)
+{
+    struct proxy_conn *conn;
+
+    if (fd >= proxy_conns_size) {
+        int n = proxy_conns_size > 0 ? proxy_conns_size : 64;
+
+        while (n <= fd)
+            n *= 2;
+        proxy_conns = (struct proxy_conn **) safe_realloc(proxy_conns, n * sizeof(*proxy_conns));
+        zmem(proxy_conns + proxy_conns_size, (n - proxy_conns_size) * sizeof(*proxy_conns));
+        proxy_conns_size = n;
+    }
+
+    conn = (struct proxy_conn *) safe_zalloc(sizeof(*conn));
+    conn->fd = fd;
+    conn->state = state;
+    splice_pipe_init(&conn->pipe);
+    proxy_conns[fd] = conn;
+
+    return conn;
+}
+
+/* Stop handling conn, without closing its descriptor. */
+static void forget_conn(struct proxy_conn *conn)
+{
+    unsigned int i;
+
+    poller_remove(conn->fd);
+    proxy_conns[conn->fd] = NULL;
+    if (conn->peer != NULL)
+        conn->peer->peer = NULL;
+    if (conn->line_len > 0)
+        http_request_free(&conn->req);
+    free(conn->request);
+    splice_pipe_close(&conn->pipe);
+    free(conn);
+
+    /* A descriptor is free again. */
+    if (accept_paused) {
+        accept_paused = 0;
+        for (i = 0; i < num_sockets; i++)
+            poller_add(listen_socket[i], POLLER_READ);
+    }
+}
+
+static void close_conn(struct proxy_conn *conn)
+{
+    int fd = conn->fd;
+
+    forget_conn(conn);
+    Close(fd);
+}
+
+/* Close conn, and the other end of its tunnel too once that has been sent
+   what it has waiting. */
+static void end_tunnel(struct proxy_conn *conn)
+{
+    struct proxy_conn *peer = conn->peer;
+
+    close_conn(conn);
+    if (peer == NULL)
+        return;
+    if (peer->state == PROXY_TUNNEL
+        && (peer->out_start < peer->out_end || peer->pipe.len > 0)) {
+        poller_clear(peer->fd, POLLER_READ);
+        peer->close_when_sent = 1;
+    } else {
+        close_conn(peer);
+    }
+}
+
+/* Queue data to be sent on conn. It must fit in the space left in out. */
+static void queue_data(struct proxy_conn *conn, const char *data, size_t len)
+{
+    ncat_assert(len <= sizeof(conn->out) - conn->out_end);
+    memcpy(conn->out + conn->out_end, data, len);
+    conn->out_end += len;
+}
+
+/* Send what is waiting in the out buffer of conn, and then in its pipe. Once
+   it is all sent, read from the other end of the tunnel again, or close conn
+   if that was to be done. Returns -1 if conn was closed, or 0. */
+static int flush_conn(struct proxy_conn *conn)
+{
+    while (conn->out_start < conn->out_end || conn->pipe.len > 0) {
+        int n;
+
+        if (conn->out_start < conn->out_end) {
+            n = send(conn->fd, conn->out + conn->out_start, conn->out_end - conn->out_start, 0);
+            if (n > 0)
+                conn->out_start += n;
+        } else {
+            n = splice_to(&conn->pipe, conn->fd);
+        }
+        if (n < 0) {
+            int err = socket_errno();
+            if (err == EINTR)
+                continue;
+            if (err == EAGAIN || err == EWOULDBLOCK) {
+                poller_add(conn->fd, POLLER_WRITE);
+                return 0;
             }
+            if (o.debug)
+                logdebug("Error sending to fd %d: %s.\n", conn->fd, socket_strerror(err));
+            end_tunnel(conn);
+            return -1;
         }
     }
+    conn->out_start = conn->out_end = 0;
+    poller_clear(conn->fd, POLLER_WRITE);
+
+    if (conn->close_when_sent) {
+        close_conn(conn);
+        return -1;
+    }
+    if (conn->peer != NULL && conn->peer->state == PROXY_TUNNEL)
+        poller_add(conn->peer->fd, POLLER_READ);
+
     return 0;
 }
 
+/* Send an error response (or any other string) to a client that we are done
+   with, and close it. */
+static void reply_and_close(struct proxy_conn *conn, const char *s)
+{
+    poller_clear(conn->fd, POLLER_READ);
+    queue_data(conn, s, strlen(s));
+    conn->close_when_sent = 1;
+    flush_conn(conn);
+}
+
+static void accept_clients(int s)
+{
+    /* Don't let one listening socket starve the clients. */
+    int count = 0;
+
+    while (count++ < 64) {
+        union sockaddr_u conn;
+        socklen_t sslen = sizeof(conn.storage);
+        int c;
+
+        c = accept(s, &conn.sockaddr, &sslen);
+        if (c == -1) {
+            int err = socket_errno();
+
+            if (err == EINTR || err == ECONNABORTED)
+                continue;
+            if (err == EAGAIN || err == EWOULDBLOCK)
+                return;
+            if (err == EMFILE || err == ENFILE) {
+                /* Wait for a connection to be closed before accepting more;
+                   see forget_conn. */
+                unsigned int i;
+
+                if (o.verbose)
+                    loguser("Not accepting connections: %s.\n", socket_strerror(err));
+                for (i = 0; i < num_sockets; i++)
+                    poller_clear(listen_socket[i], POLLER_READ);
+                accept_paused = 1;
+                return;
+            }
+            die("accept");
+        }
+
+        if (!allow_access(&conn)) {
+            Close(c);
+            continue;
+        }
+
+#ifdef HAVE_OPENSSL
+        if (o.ssl) {
+            struct proxy_job *job;
+
+            if (o.debug > 1)
+                logdebug("forking handler for %d\n", c);
+            job = (struct proxy_job *) safe_zalloc(sizeof(*job));
+            job->fd = c;
+            fork_handler(job);
+            continue;
+        }
+#endif
+        unblock_socket(c);
+        new_conn(c, PROXY_REQUEST);
+        poller_add(c, POLLER_READ);
+    }
+}
+
+/* Is this one of the methods we can handle? */
+static int method_is_known(const char *method)
+{
+    return strcmp(method, "CONNECT") == 0
+        || strcmp(method, "GET") == 0
+        || strcmp(method, "HEAD") == 0
+        || strcmp(method, "POST") == 0;
+}
+
+static void start_connect(struct proxy_conn *client, const char *leftover, size_t len);
+static void start_job(struct proxy_conn *client, const char *leftover, size_t len);
+
+/* Read what has come of a request and act on it once the header is complete.
+   This parses the request as http_server_handler does, with the same limits,
+   but from memory. */
+static void read_request(struct proxy_conn *conn)
+{
+    char *buf;
+    size_t used;
+    int n, code;
+
+    if (conn->request_len == conn->request_size) {
+        conn->request_size = conn->request_size > 0 ? conn->request_size * 2 : BUFSIZ;
+        conn->request = (char *) safe_realloc(conn->request, conn->request_size);
+    }
+    /* Read no more than BUFSIZ at a time, so that what follows the header
+       fits in the out buffer of the other end, or in a socket_buffer. */
+    n = recv(conn->fd, conn->request + conn->request_len,
+        MIN(BUFSIZ, conn->request_size - conn->request_len), 0);
+    if (n < 0) {
+        int err = socket_errno();
+        if (err == EINTR || err == EAGAIN || err == EWOULDBLOCK)
+            return;
+    }
+    if (n <= 0) {
+        if (o.verbose)
+            logdebug("Error reading request.\n");
+        reply_and_close(conn, http_code2str(400));
+        return;
+    }
+    conn->request_len += n;
+
+    if (conn->line_len == 0) {
+        code = http_get_request_line(conn->request, conn->request_len, &buf, &used);
+        if (code == -1)
+            goto more;
+        if (code != 0) {
+            if (o.verbose)
+                logdebug("Error reading Request-Line.\n");
+            reply_and_close(conn, http_code2str(code));
+            return;
+        }
+        if (o.debug > 1)
+            logdebug("Request-Line: %s", buf);
+        code = http_parse_request_line(buf, &conn->req);
+        free(buf);
+        if (code != 0) {
+            if (o.verbose)
+                logdebug("Error parsing Request-Line.\n");
+            reply_and_close(conn, http_code2str(code));
+            return;
+        }
+        conn->line_len = used;
+
+        if (!method_is_known(conn->req.method)) {
+            if (o.debug > 1)
+                logdebug("Bad method: %s.\n", conn->req.method);
+            reply_and_close(conn, http_code2str(405));
+            return;
+        }
+    }
+
+    code = http_get_header(conn->request + conn->line_len,
+        conn->request_len - conn->line_len, &buf, &used);
+    if (code == -1)
+        goto more;
+    if (code != 0) {
+        if (o.verbose)
+            logdebug("Error reading header.\n");
+        reply_and_close(conn, http_code2str(code));
+        return;
+    }
+    if (o.debug > 1)
+        logdebug("Header:\n%s", buf);
+    code = http_request_parse_header(&conn->req, buf);
+    free(buf);
+    if (code != 0) {
+        if (o.verbose)
+            logdebug("Error parsing header.\n");
+        reply_and_close(conn, http_code2str(code));
+        return;
+    }
+    used += conn->line_len;
+
+    if (o.proxy_auth) {
+        int stale;
+
+        if (!authorize(&conn->req, &stale)) {
+            buf = proxy_authenticate_str(stale);
+            reply_and_close(conn, buf);
+            free(buf);
+            return;
+        }
+    }
+
+    if (strcmp(conn->req.method, "CONNECT") == 0)
+        start_connect(conn, conn->request + used, conn->request_len - used);
+    else
+        start_job(conn, conn->request + used, conn->request_len - used);
+    return;
+
+more:
+    if (conn->request_len == conn->request_size && conn->request_size >= 4 * BUFSIZ) {
+        /* Too many empty lines before the Request-Line. */
+        reply_and_close(conn, http_code2str(413));
+    }
+}
+
+/* Start connecting to the server named in a CONNECT request. The data the
+   client sent after the request is sent to the server first. Name resolution
+   blocks the event loop; the connection itself doesn't. */
+static void start_connect(struct proxy_conn *client, const char *leftover, size_t len)
+{
+    struct http_request *request = &client->req;
+    struct proxy_conn *server;
+    union sockaddr_u su;
+    size_t sslen = sizeof(su.storage);
+    int s, rc;
+
+    if (request->uri.port == -1) {
+        if (o.verbose)
+            logdebug("No port number in CONNECT URI.\n");
+        reply_and_close(client, http_code2str(400));
+        return;
+    }
+    if (o.debug > 1)
+        logdebug("CONNECT to %s:%d.\n", request->uri.host, request->uri.port);
+
+    rc = resolve(request->uri.host, request->uri.port, &su.storage, &sslen, o.af);
+    if (rc != 0) {
+        if (o.debug) {
+            logdebug("Can't resolve name \"%s\": %s.\n",
+                request->uri.host, gai_strerror(rc));
+        }
+        reply_and_close(client, http_code2str(504));
+        return;
+    }
+
+    s = socket(su.storage.ss_family, SOCK_STREAM, IPPROTO_TCP);
+    if (s == -1) {
+        if (o.debug)
+            logdebug("Can't create socket: %s.\n", socket_strerror(socket_errno()));
+        reply_and_close(client, http_code2str(504));
+        return;
+    }
+    unblock_socket(s);
+    if (connect(s, &su.sockaddr, sslen) == -1) {
+        int err = socket_errno();
+        if (err != EINPROGRESS && err != EWOULDBLOCK) {
+            if (o.debug)
+                logdebug("Can't connect to %s: %s.\n", socktop(&su, sslen), socket_strerror(err));
+            Close(s);
+            reply_and_close(client, http_code2str(504));
+            return;
+        }
+    }
+
+    server = new_conn(s, PROXY_CONNECTING);
+    server->peer = client;
+    client->peer = server;
+    client->state = PROXY_CONNECTING;
+    queue_data(server, leftover, len);
+    /* The request isn't needed anymore. */
+    free(client->request);
+    client->request = NULL;
+    client->request_len = client->request_size = 0;
+
+    poller_clear(client->fd, POLLER_READ);
+    poller_add(s, POLLER_WRITE);
+}
+
+static void finish_connect(struct proxy_conn *server)
+{
+    struct proxy_conn *client = server->peer;
+    int err = 0;
+    socklen_t errlen = sizeof(err);
+
+    if (getsockopt(server->fd, SOL_SOCKET, SO_ERROR, (char *) &err, &errlen) == -1)
+        err = socket_errno();
+    if (err != 0) {
+        if (o.debug) {
+            logdebug("Can't connect to %s:%d: %s.\n", client->req.uri.host,
+                client->req.uri.port, socket_strerror(err));
+        }
+        close_conn(server);
+        reply_and_close(client, http_code2str(504));
+        return;
+    }
+
+    server->state = PROXY_TUNNEL;
+    client->state = PROXY_TUNNEL;
+    queue_data(client, http_code2str(200), strlen(http_code2str(200)));
+    poller_clear(server->fd, POLLER_WRITE);
+
+    /* Sending what is waiting on each side starts reading from the other. */
+    if (flush_conn(client) < 0)
+        return;
+    flush_conn(server);
+}
+
+/* Read from one end of a tunnel and send to the other. This isn't called
+   while the other end still has data waiting to be sent. */
+static void relay(struct proxy_conn *conn)
+{
+    struct proxy_conn *peer = conn->peer;
+    int n;
+
+    ncat_assert(peer != NULL && peer->out_start == peer->out_end && peer->pipe.len == 0);
+    if (peer->pipe.fd[0] != -1)
+        n = splice_from(&peer->pipe, conn->fd);
+    else
+        n = recv(conn->fd, peer->out, sizeof(peer->out), 0);
+    if (n < 0) {
+        int err = socket_errno();
+        if (err == EINTR || err == EAGAIN || err == EWOULDBLOCK)
+            return;
+    }
+    if (n <= 0) {
+        end_tunnel(conn);
+        return;
+    }
+    if (peer->pipe.fd[0] == -1) {
+        peer->out_start = 0;
+        peer->out_end = n;
+        /* A full buffer means bulk data, which is cheaper to splice from now
+           on, where that can be done. */
+        if (n == sizeof(peer->out))
+            splice_pipe_open(&peer->pipe, 0);
+    }
+    /* Stop reading until the other end takes it. */
+    poller_clear(conn->fd, POLLER_READ);
+    flush_conn(peer);
+}
+
+/* Hand a GET, HEAD, or POST request over to a child process. */
+static void start_job(struct proxy_conn *client, const char *leftover, size_t len)
+{
+    struct proxy_job *job;
+
+    job = (struct proxy_job *) safe_zalloc(sizeof(*job));
+    job->fd = client->fd;
+    job->have_request = 1;
+    job->request = client->req;
+    ncat_assert(len <= sizeof(job->leftover));
+    memcpy(job->leftover, leftover, len);
+    job->leftover_len = len;
+    /* The job has the request now. */
+    client->line_len = 0;
+
+    forget_conn(client);
+    if (o.debug > 1)
+        logdebug("forking handler for %d\n", job->fd);
+    fork_handler(job);
+}
+
+/* Serve a client handed over to a child process or thread. */
+static void run_job(struct proxy_job *job)
+{
+    struct socket_buffer sock;
+
+    if (!job->have_request) {
+        http_server_handler(job->fd);
+        return;
+    }
+
+    block_socket(job->fd);
+    socket_buffer_init(&sock, job->fd);
+    memcpy(sock.buffer, job->leftover, job->leftover_len);
+    sock.end = sock.buffer + job->leftover_len;
+    serve_request(&sock, &job->request);
+}
+
 #ifdef WIN32
 /* On Windows we don't actually fork but rather start a thread. */
 
 static DWORD WINAPI handler_thread_func(void *data)
 {
-    http_server_handler(*((int *) data));
+    run_job((struct proxy_job *) data);
     free(data);
 
     return 0;
 }
 
-static void fork_handler(int s, int c)
+static void fork_handler(struct proxy_job *job)
 {
-    int *data;
     HANDLE thread;
 
-    data = (int *) safe_malloc(sizeof(int));
-    *data = c;
-    thread = CreateThread(NULL, 0, handler_thread_func, data, 0, NULL);
+    thread = CreateThread(NULL, 0, handler_thread_func, job, 0, NULL);
     if (thread == NULL) {
         if (o.verbose)
             logdebug("Error in CreateThread: %d\n", GetLastError());
-        free(data);
+        if (job->have_request)
+            http_request_free(&job->request);
+        Close(job->fd);
+        free(job);
         return;
     }
     CloseHandle(thread);
 }
 #else
-static void fork_handler(int s, int c)
+static void fork_handler(struct proxy_job *job)
 {
-    int rc;
+    int rc, i;
 
     rc = fork();
     if (rc == -1) {
-        return;
+        /* Fall through to close the client. */
     } else if (rc == 0) {
-        Close(s);
+        /* Leave the event loop's descriptors to the parent, or the peers of
+           its tunnels won't see them closed. */
+        for (i = 0; i < (int) num_sockets; i++)
+            Close(listen_socket[i]);
+        for (i = 0; i < proxy_conns_size; i++) {
+            if (proxy_conns[i] != NULL) {
+                splice_pipe_close(&proxy_conns[i]->pipe);
+                Close(i);
+            }
+        }
+        poller_close();
 
         if (!o.debug) {
             Close(STDIN_FILENO);
@@ -271,23 +819,16 @@ static void fork_handler(int s, int c)
             Close(STDERR_FILENO);
         }
 
-        http_server_handler(c);
+        run_job(job);
         exit(0);
-    } else {
-        Close(c);
     }
+    if (job->have_request)
+        http_request_free(&job->request);
+    Close(job->fd);
+    free(job);
 }
 #endif
 
-/* Is this one of the methods we can handle? */
-static int method_is_known(const char *method)
-{
-    return strcmp(method, "CONNECT") == 0
-        || strcmp(method, "GET") == 0
-        || strcmp(method, "HEAD") == 0
-        || strcmp(method, "POST") == 0;
-}
-
 static void http_server_handler(int c)
 {
     int code;
@@ -361,24 +902,9 @@ static void http_server_handler(int c)
 
     /* Check authentication. */
     if (o.proxy_auth) {
-        struct http_credentials credentials;
-        int ret, stale;
-
-        if (http_header_get_proxy_credentials(request.header, &credentials) == NULL) {
-            /* No credentials or a parsing error. */
-            send_proxy_authenticate(&sock.fdn, 0);
-            http_request_free(&request);
-            fdinfo_close(&sock.fdn);
-            return;
-        }
+        int stale;
 
-        ret = check_auth(&request, &credentials, &stale);
-        http_credentials_free(&credentials);
-        if (!ret) {
-            /* Password doesn't match. */
-            /* RFC 2617, section 1.2: "If a proxy does not accept the
-               credentials sent with a request, it SHOULD return a 407 (Proxy
-               Authentication Required). */
+        if (!authorize(&request, &stale)) {
             send_proxy_authenticate(&sock.fdn, stale);
             http_request_free(&request);
             fdinfo_close(&sock.fdn);
@@ -386,24 +912,54 @@ static void http_server_handler(int c)
         }
     }
 
-    if (strcmp(request.method, "CONNECT") == 0) {
-        code = handle_connect(&sock, &request);
-    } else if (strcmp(request.method, "GET") == 0
-        || strcmp(request.method, "HEAD") == 0
-        || strcmp(request.method, "POST") == 0) {
-        code = handle_method(&sock, &request);
+    serve_request(&sock, &request);
+}
+
+/* Carry out a request that has been read and authorized, then close the
+   client. */
+static void serve_request(struct socket_buffer *sock, struct http_request *request)
+{
+    int code;
+
+    if (strcmp(request->method, "CONNECT") == 0) {
+        code = handle_connect(sock, request);
+    } else if (strcmp(request->method, "GET") == 0
+        || strcmp(request->method, "HEAD") == 0
+        || strcmp(request->method, "POST") == 0) {
+        code = handle_method(sock, request);
     } else {
         code = 500;
     }
-    http_request_free(&request);
+    http_request_free(request);
 
     if (code != 0) {
-        send_string(&sock.fdn, http_code2str(code));
-        fdinfo_close(&sock.fdn);
+        send_string(&sock->fdn, http_code2str(code));
+        fdinfo_close(&sock->fdn);
         return;
     }
 
-    fdinfo_close(&sock.fdn);
+    fdinfo_close(&sock->fdn);
+}
+
+/* Check the credentials in a request against --proxy-auth. Returns nonzero if
+   they are good. *stale is set as by check_auth. */
+static int authorize(const struct http_request *request, int *stale)
+{
+    struct http_credentials credentials;
+    int ret;
+
+    *stale = 0;
+    if (http_header_get_proxy_credentials(request->header, &credentials) == NULL) {
+        /* No credentials or a parsing error. */
+        return 0;
+    }
+
+    ret = check_auth(request, &credentials, stale);
+    http_credentials_free(&credentials);
+    /* RFC 2617, section 1.2: "If a proxy does not accept the credentials sent
+       with a request, it SHOULD return a 407 (Proxy Authentication
+       Required). */
+    return ret;
 }
 
 static int handle_connect(struct socket_buffer *client_sock,
@@ -726,10 +1282,23 @@ static int do_transaction(struct http_request *request,
 
 /* Send a 407 Proxy Authenticate Required response. */
 static int send_proxy_authenticate(struct fdinfo *fdn, int stale)
+{
+    char *buf;
+    int n;
+
+    buf = proxy_authenticate_str(stale);
+    n = send_string(fdn, buf);
+    free(buf);
+
+    return n;
+}
+
+/* The 407 Proxy Authenticate Required response, in a dynamically allocated
+   string. */
+static char *proxy_authenticate_str(int stale)
 {
     char *buf = NULL;
     size_t size = 0, offset = 0;
-    int n;
 
     strbuf_append_str(&buf, &size, &offset, "HTTP/1.0 407 Proxy Authentication Required\r\n");
     strbuf_append_str(&buf, &size, &offset, "Proxy-Authenticate: Basic realm=\"Ncat\"\r\n");
@@ -747,10 +1316,7 @@ static int send_proxy_authenticate(struct fdinfo *fdn, int stale)
     if (o.debug > 1)
         logdebug("RESPONSE:\n%s", buf);
 
-    n = send_string(fdn, buf);
-    free(buf);
-
-    return n;
+    return buf;
 }
 
 static char *http_code2str(int code)
@@ -855,9 +1421,8 @@ static int check_auth(const struct http_request *request,
            been used to successfully authenticate within the last
            HTTP_DIGEST_NONCE_EXPIRY seconds. (Older than that and we don't need
            to keep it in the list, because the expiry test above will catch it.
-           This isn't supported because the fork-and-process architecture of the
-           proxy server makes it hard for us to change state in the parent
-           process from here in the child. */
+           This isn't supported because with --ssl this check is made in a
+           child process, which can't change state in the parent. */
 
         return 1;
     }
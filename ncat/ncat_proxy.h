@@ -67,8 +67,12 @@
    "used" list before forgetting them. */
 #define HTTP_DIGEST_NONCE_EXPIRY 10
 
+/* How many descriptors the proxy tries to raise its limit on open files to.
+   Each CONNECT tunnel takes two. */
+#define PROXY_MAX_FDS 65536
+
 /*
- * Simple forking HTTP proxy.
+ * Simple event-driven HTTP proxy.
  */
 extern int ncat_http_server(void);
 
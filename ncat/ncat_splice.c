@@ -0,0 +1,259 @@
+/***************************************************************************
+ * ncat_splice.c -- moving data between descriptors with splice(2).        *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+/* $Id$ */
+
+/* splice and sendfile are declared only with _GNU_SOURCE on Linux. */
+#ifndef WIN32
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include "ncat.h"
+#include "ncat_splice.h"
+
+#include <errno.h>
+
+#ifdef HAVE_SPLICE
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+
+/* Capacity assumed when the pipe can't be asked for its own. */
+#define SPLICE_DEFAULT_SIZE 65536
+
+/* The most copied at once through a descriptor that can't be spliced. */
+#define SPLICE_COPY_LEN 65536
+
+/* Set in p->copy for a descriptor that splice refused. */
+#define SPLICE_COPY_FROM 0x1
+#define SPLICE_COPY_TO   0x2
+
+void splice_pipe_init(struct splice_pipe *p)
+{
+    p->fd[0] = -1;
+    p->fd[1] = -1;
+    p->len = 0;
+    p->size = 0;
+    p->copy = 0;
+}
+
+int splice_pipe_open(struct splice_pipe *p, size_t size)
+{
+    int n;
+
+    splice_pipe_init(p);
+    if (pipe(p->fd) == -1) {
+        p->fd[0] = p->fd[1] = -1;
+        return -1;
+    }
+    fcntl(p->fd[0], F_SETFL, O_NONBLOCK);
+    fcntl(p->fd[1], F_SETFL, O_NONBLOCK);
+
+    n = -1;
+#ifdef F_SETPIPE_SZ
+    /* A bigger pipe means fewer system calls per byte. This may be refused
+       over the per-user limit on pipe memory, and the default will do. */
+    if (size > 0)
+        fcntl(p->fd[1], F_SETPIPE_SZ, (int) size);
+    n = fcntl(p->fd[1], F_GETPIPE_SZ);
+#endif
+    p->size = n > 0 ? n : SPLICE_DEFAULT_SIZE;
+
+    return 0;
+}
+
+void splice_pipe_close(struct splice_pipe *p)
+{
+    if (p->fd[0] != -1)
+        close(p->fd[0]);
+    if (p->fd[1] != -1)
+        close(p->fd[1]);
+    splice_pipe_init(p);
+}
+
+/* Write all of buf to fd, waiting if fd is nonblocking and full. */
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                struct pollfd pfd;
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+int splice_from(struct splice_pipe *p, int fd)
+{
+    char buf[SPLICE_COPY_LEN];
+    ssize_t n;
+
+    if (!(p->copy & SPLICE_COPY_FROM)) {
+        n = splice(fd, NULL, p->fd[1], NULL, p->size - p->len,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n >= 0) {
+            p->len += n;
+            return n;
+        }
+        if (errno != EINVAL)
+            return -1;
+        p->copy |= SPLICE_COPY_FROM;
+    }
+
+    /* Only an empty pipe is sure to take everything that was read. */
+    if (p->len > 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    n = read(fd, buf, MIN(sizeof(buf), p->size));
+    if (n <= 0)
+        return n;
+    if (write_all(p->fd[1], buf, n) == -1)
+        return -1;
+    p->len += n;
+
+    return n;
+}
+
+int splice_to(struct splice_pipe *p, int fd)
+{
+    char buf[SPLICE_COPY_LEN];
+    ssize_t n;
+
+    if (!(p->copy & SPLICE_COPY_TO)) {
+        n = splice(p->fd[0], NULL, fd, NULL, p->len,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n >= 0) {
+            p->len -= n;
+            return n;
+        }
+        if (errno != EINVAL)
+            return -1;
+        p->copy |= SPLICE_COPY_TO;
+    }
+
+    n = read(p->fd[0], buf, MIN(sizeof(buf), p->len));
+    if (n <= 0)
+        return -1;
+    if (write_all(fd, buf, n) == -1)
+        return -1;
+    p->len -= n;
+
+    return n;
+}
+
+int splice_sendfile(int out, int in, size_t count)
+{
+    return sendfile(out, in, NULL, count);
+}
+
+#else
+
+void splice_pipe_init(struct splice_pipe *p)
+{
+    p->fd[0] = -1;
+    p->fd[1] = -1;
+    p->len = 0;
+    p->size = 0;
+    p->copy = 0;
+}
+
+int splice_pipe_open(struct splice_pipe *p, size_t size)
+{
+    splice_pipe_init(p);
+    return -1;
+}
+
+void splice_pipe_close(struct splice_pipe *p)
+{
+}
+
+int splice_from(struct splice_pipe *p, int fd)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int splice_to(struct splice_pipe *p, int fd)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int splice_sendfile(int out, int in, size_t count)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
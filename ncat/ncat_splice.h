@@ -0,0 +1,101 @@
+/***************************************************************************
+ * ncat_splice.h -- moving data between descriptors with splice(2).        *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+/* $Id$ */
+
+#ifndef NCAT_SPLICE_H
+#define NCAT_SPLICE_H
+
+#include <stddef.h>
+
+/* A pipe that data is spliced through on its way from one descriptor to
+   another, so that the kernel moves it without copying it into Ncat and back
+   out. Where splice(2) is not available, splice_pipe_open fails and callers
+   copy the data themselves as before. */
+struct splice_pipe {
+    int fd[2];      /* Read and write ends, -1 when there is no pipe */
+    size_t len;     /* Bytes waiting in the pipe */
+    size_t size;    /* Capacity of the pipe */
+    int copy;       /* Which ends splice refused, to be copied instead */
+};
+
+/* Mark p as having no pipe. */
+void splice_pipe_init(struct splice_pipe *p);
+
+/* Open the pipe, asking for a capacity of size bytes (0 for the system
+   default). Returns 0, or -1 if splicing is not possible. */
+int splice_pipe_open(struct splice_pipe *p, size_t size);
+
+void splice_pipe_close(struct splice_pipe *p);
+
+/* Move as much as fits in the pipe from fd into it. Returns the number of
+   bytes moved, 0 at end of file, or -1 with errno set (EAGAIN if nothing was
+   ready). If fd can't be spliced from, falls back to read and write. */
+int splice_from(struct splice_pipe *p, int fd);
+
+/* Move what is waiting in the pipe to fd. Returns the number of bytes moved,
+   or -1 with errno set (EAGAIN if fd can't take any more now). If fd can't be
+   spliced to, falls back to read and write. */
+int splice_to(struct splice_pipe *p, int fd);
+
+/* Send up to count bytes from the current offset of the regular file in to
+   out with sendfile(2). Returns the number of bytes sent, 0 at end of file, or
+   -1 with errno set (ENOSYS if sendfile is not available). */
+int splice_sendfile(int out, int in, size_t count);
+
+#endif
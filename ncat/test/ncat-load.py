@@ -0,0 +1,445 @@
+#!/usr/bin/env python3
+
+# Load test of Ncat's connection brokering, chat, and HTTP proxy modes.
+#
+# Starts Ncat listening on the loopback interface, connects many clients at
+# once, checks that every message gets to every client it should, and reports
+# how long that took. Exits with a nonzero status if anything went missing.
+# The bulk mode instead sends a lot of data each way through one proxy tunnel
+# and reports the throughput.
+#
+# Usage: ./ncat-load.py [-n CLIENTS] [-m MESSAGES] [-b MEGABYTES] [--ncat PATH] [MODE...]
+# where MODE is broker, chat, proxy, or bulk (all but bulk by default).
+
+import argparse
+import errno
+import os
+import resource
+import selectors
+import socket
+import subprocess
+import sys
+import threading
+import time
+import zlib
+
+HOST = "127.0.0.1"
+TIMEOUT = 60.0
+
+
+def free_port():
+    s = socket.socket()
+    s.bind((HOST, 0))
+    port = s.getsockname()[1]
+    s.close()
+    return port
+
+
+def raise_nofile(n):
+    soft, hard = resource.getrlimit(resource.RLIMIT_NOFILE)
+    if soft != resource.RLIM_INFINITY and soft < n:
+        if hard != resource.RLIM_INFINITY:
+            n = min(n, hard)
+        resource.setrlimit(resource.RLIMIT_NOFILE, (n, hard))
+
+
+def start_ncat(ncat, args, port):
+    p = subprocess.Popen([ncat] + args + [HOST, str(port)],
+                         stdin=subprocess.PIPE, stdout=subprocess.DEVNULL)
+    # Wait until it is listening.
+    deadline = time.time() + 10
+    while time.time() < deadline:
+        try:
+            socket.create_connection((HOST, port), 1).close()
+            return p
+        except OSError:
+            if p.poll() is not None:
+                break
+            time.sleep(0.05)
+    stop_ncat(p)
+    raise RuntimeError("ncat %s didn't start listening" % " ".join(args))
+
+
+def cpu_time(p):
+    """CPU seconds used by process p so far, or None if /proc can't say."""
+    try:
+        with open("/proc/%d/stat" % p.pid) as f:
+            fields = f.read().rsplit(")", 1)[1].split()
+        return (int(fields[11]) + int(fields[12])) / os.sysconf("SC_CLK_TCK")
+    except (OSError, ValueError, IndexError):
+        return None
+
+
+def stop_ncat(p):
+    if p.poll() is None:
+        p.kill()
+    p.wait()
+
+
+class Client:
+    def __init__(self, driver, sock, index):
+        self.driver = driver
+        self.sock = sock
+        self.index = index
+        self.inbuf = b""
+        self.outbuf = b""
+        self.closed = False
+        self.lines = []
+
+    def on_line(self, line):
+        self.lines.append(line)
+
+
+class Driver:
+    """Drives many nonblocking client sockets with one selector. Lines received
+    are passed to on_line of the client."""
+
+    def __init__(self, client_class=Client):
+        self.sel = selectors.DefaultSelector()
+        self.clients = []
+        self.client_class = client_class
+
+    def connect(self, port, n):
+        for _ in range(n):
+            s = socket.socket()
+            s.setblocking(False)
+            err = s.connect_ex((HOST, port))
+            if err not in (0, errno.EINPROGRESS):
+                raise OSError(err, os.strerror(err))
+            c = self.client_class(self, s, len(self.clients))
+            self.clients.append(c)
+            self.sel.register(s, selectors.EVENT_READ, c)
+
+    def send(self, c, data):
+        if not c.outbuf and not c.closed:
+            self.sel.modify(c.sock, selectors.EVENT_READ | selectors.EVENT_WRITE, c)
+        c.outbuf += data
+
+    def run(self, done, timeout=TIMEOUT):
+        """Pump data until done() is true. Returns False on timeout."""
+        deadline = time.time() + timeout
+        while not done():
+            if time.time() > deadline:
+                return False
+            for key, mask in self.sel.select(0.1):
+                c = key.data
+                if mask & selectors.EVENT_WRITE:
+                    try:
+                        n = c.sock.send(c.outbuf)
+                        c.outbuf = c.outbuf[n:]
+                    except BlockingIOError:
+                        pass
+                    if not c.outbuf:
+                        self.sel.modify(c.sock, selectors.EVENT_READ, c)
+                if mask & selectors.EVENT_READ:
+                    try:
+                        data = c.sock.recv(65536)
+                    except BlockingIOError:
+                        continue
+                    except OSError:
+                        data = b""
+                    if not data:
+                        self.sel.unregister(c.sock)
+                        c.sock.close()
+                        c.closed = True
+                        continue
+                    c.inbuf += data
+                    *lines, c.inbuf = c.inbuf.split(b"\n")
+                    for line in lines:
+                        c.on_line(line)
+        return True
+
+    def close(self):
+        for c in self.clients:
+            if not c.closed:
+                self.sel.unregister(c.sock)
+                c.sock.close()
+        self.sel.close()
+
+
+class MessageClient(Client):
+    def __init__(self, *args):
+        super().__init__(*args)
+        self.synced = False
+        self.received = 0
+
+    def on_line(self, line):
+        if b"sync" in line:
+            if not self.synced:
+                self.synced = True
+                self.driver.synced += 1
+        elif b"message " in line:
+            self.received += 1
+            self.driver.received += 1
+
+
+def messages_test(ncat, mode, nclients, nmessages):
+    """Broker or chat: every message sent by one client must reach all of the
+    others."""
+    port = free_port()
+    args = ["-l", "--max-conns", str(nclients + 10)]
+    args.append("--chat" if mode == "chat" else "--broker")
+    p = start_ncat(ncat, args, port)
+    d = Driver(MessageClient)
+    d.synced = d.received = 0
+    try:
+        start = time.time()
+        d.connect(port, nclients)
+        # Ncat only sends to clients it has accepted, so send something until
+        # everybody has seen it.
+        sync = 0
+        while True:
+            d.send(d.clients[0], b"sync %d\n" % sync)
+            sync += 1
+            if d.run(lambda: d.synced >= nclients - 1, 0.2):
+                break
+            if time.time() - start > TIMEOUT:
+                print("%s: FAIL: only %d of %d clients connected" % (mode, d.synced + 1, nclients))
+                return False
+        connected = time.time()
+
+        for i in range(nmessages):
+            d.send(d.clients[i % nclients], b"message %d\n" % i)
+        # A client doesn't get its own messages back.
+        expected = nmessages * (nclients - 1)
+        ok = d.run(lambda: d.received >= expected)
+        elapsed = time.time() - connected
+        print("%s: %d clients connected in %.2f s; %d messages delivered in %.2f s (%.0f/s)"
+              % (mode, nclients, connected - start, d.received, elapsed,
+                 d.received / elapsed if elapsed > 0 else 0))
+        if not ok or d.received != expected:
+            print("%s: FAIL: got %d messages, not %d" % (mode, d.received, expected))
+            return False
+        return True
+    finally:
+        d.close()
+        stop_ncat(p)
+
+
+class Origin(threading.Thread):
+    """A server for the proxy to connect to. It echoes what it gets, except
+    that it answers a request beginning with "GET " and closes."""
+
+    RESPONSE = b"HTTP/1.0 200 OK\r\nContent-Length: 5\r\n\r\nhello"
+
+    def __init__(self):
+        super().__init__(daemon=True)
+        self.listener = socket.socket()
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind((HOST, 0))
+        self.listener.listen(1024)
+        self.port = self.listener.getsockname()[1]
+        self.stopping = False
+
+    def run(self):
+        sel = selectors.DefaultSelector()
+        self.listener.setblocking(False)
+        sel.register(self.listener, selectors.EVENT_READ)
+        while not self.stopping:
+            for key, _ in sel.select(0.1):
+                if key.fileobj is self.listener:
+                    try:
+                        s, _ = self.listener.accept()
+                    except BlockingIOError:
+                        continue
+                    s.setblocking(True)
+                    sel.register(s, selectors.EVENT_READ)
+                    continue
+                s = key.fileobj
+                try:
+                    data = s.recv(65536)
+                except OSError:
+                    data = b""
+                if data.startswith(b"GET "):
+                    s.sendall(self.RESPONSE)
+                    data = b""
+                if not data:
+                    sel.unregister(s)
+                    s.close()
+                    continue
+                s.sendall(data)
+        sel.close()
+        self.listener.close()
+
+
+class TunnelClient(Client):
+    def __init__(self, *args):
+        super().__init__(*args)
+        self.response = None
+        self.round = -1
+
+    def on_line(self, line):
+        if self.response is None:
+            self.response = line
+        elif line == b"tunnel %d round %d" % (self.index, self.round + 1):
+            self.round += 1
+            self.driver.echoed += 1
+
+
+def proxy_test(ncat, nclients, nmessages):
+    """HTTP proxy: many CONNECT tunnels at once, each sending data right after
+    its request, and a few GET requests."""
+    origin = Origin()
+    origin.start()
+    port = free_port()
+    p = start_ncat(ncat, ["-l", "--proxy-type", "http"], port)
+    d = Driver(TunnelClient)
+    d.echoed = 0
+    try:
+        start = time.time()
+        d.connect(port, nclients)
+        connect = b"CONNECT %s:%d HTTP/1.0\r\n\r\n" % (HOST.encode(), origin.port)
+        rounds = max(1, nmessages // nclients)
+        for r in range(rounds):
+            for c in d.clients:
+                d.send(c, (connect if r == 0 else b"") + b"tunnel %d round %d\n" % (c.index, r))
+            if not d.run(lambda: d.echoed >= nclients * (r + 1)):
+                missing = sum(1 for c in d.clients if c.round < r)
+                print("proxy: FAIL: %d tunnels didn't echo round %d" % (missing, r))
+                return False
+        elapsed = time.time() - start
+        bad = [c for c in d.clients if c.response != b"HTTP/1.0 200 OK\r"]
+        if bad:
+            print("proxy: FAIL: %d bad CONNECT responses" % len(bad))
+            return False
+        print("proxy: %d tunnels, %d round trips each, in %.2f s (%.0f round trips/s)"
+              % (nclients, rounds, elapsed, nclients * rounds / elapsed))
+        d.close()
+
+        d = Driver()
+        d.connect(port, 10)
+        for c in d.clients:
+            d.send(c, b"GET http://%s:%d/ HTTP/1.0\r\n\r\n" % (HOST.encode(), origin.port))
+        d.run(lambda: all(c.closed for c in d.clients))
+        bad = [c for c in d.clients if c.inbuf != b"hello"]
+        if bad:
+            print("proxy: FAIL: %d bad GET responses" % len(bad))
+            return False
+        return True
+    finally:
+        d.close()
+        stop_ncat(p)
+        origin.stopping = True
+        origin.join()
+
+
+class EchoOrigin(threading.Thread):
+    """Echoes everything on one connection, then closes it."""
+
+    def __init__(self):
+        super().__init__(daemon=True)
+        self.listener = socket.socket()
+        self.listener.bind((HOST, 0))
+        self.listener.listen(1)
+        self.listener.settimeout(TIMEOUT)
+        self.port = self.listener.getsockname()[1]
+
+    def run(self):
+        try:
+            s, _ = self.listener.accept()
+        except OSError:
+            return
+        buf = bytearray(1 << 20)
+        view = memoryview(buf)
+        while True:
+            n = s.recv_into(buf)
+            if not n:
+                break
+            s.sendall(view[:n])
+        s.close()
+        self.listener.close()
+
+
+def bulk_test(ncat, megabytes):
+    """HTTP proxy: one CONNECT tunnel carrying a lot of data each way."""
+    origin = EchoOrigin()
+    origin.start()
+    port = free_port()
+    p = start_ncat(ncat, ["-l", "--proxy-type", "http"], port)
+    block = os.urandom(1 << 20)
+    s = socket.create_connection((HOST, port), TIMEOUT)
+    try:
+        s.sendall(b"CONNECT %s:%d HTTP/1.0\r\n\r\n" % (HOST.encode(), origin.port))
+        response = b""
+        while b"\r\n\r\n" not in response:
+            data = s.recv(1)
+            if not data:
+                break
+            response += data
+        if not response.startswith(b"HTTP/1.0 200 "):
+            print("bulk: FAIL: bad CONNECT response %r" % response)
+            return False
+
+        # The proxy closes a tunnel when either end does, so don't shut down
+        # sending before everything has come back.
+        def send():
+            for _ in range(megabytes):
+                s.sendall(block)
+
+        start = time.time()
+        cpu_start = cpu_time(p)
+        sender = threading.Thread(target=send, daemon=True)
+        sender.start()
+        buf = bytearray(1 << 20)
+        received = 0
+        crc = 0
+        while received < megabytes << 20:
+            n = s.recv_into(buf)
+            if not n:
+                break
+            received += n
+            crc = zlib.crc32(memoryview(buf)[:n], crc)
+        elapsed = time.time() - start
+        cpu_end = cpu_time(p)
+        sender.join()
+
+        expected = 0
+        for _ in range(megabytes):
+            expected = zlib.crc32(block, expected)
+        cpu = ""
+        if cpu_start is not None and cpu_end is not None:
+            cpu = "; Ncat used %.2f s of CPU" % (cpu_end - cpu_start)
+        print("bulk: %d MB each way through a tunnel in %.2f s (%.0f MB/s each way)%s"
+              % (megabytes, elapsed, megabytes / elapsed if elapsed > 0 else 0, cpu))
+        if received != megabytes << 20 or crc != expected:
+            print("bulk: FAIL: got %d bytes back, not %d, or they differ"
+                  % (received, megabytes << 20))
+            return False
+        return True
+    finally:
+        s.close()
+        stop_ncat(p)
+        origin.join()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load test Ncat's listen modes.")
+    parser.add_argument("-n", "--clients", type=int, default=2000)
+    parser.add_argument("-m", "--messages", type=int, default=2000)
+    parser.add_argument("-b", "--megabytes", type=int, default=1024,
+                        help="data sent each way in bulk mode")
+    parser.add_argument("--chat-clients", type=int, default=200,
+                        help="clients in chat mode, where every connection is "
+                        "announced to everybody with a list of everybody")
+    parser.add_argument("--ncat", default=os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "ncat"))
+    parser.add_argument("modes", nargs="*", default=["broker", "chat", "proxy"])
+    args = parser.parse_args()
+
+    raise_nofile(2 * args.clients + 100)
+
+    ok = True
+    for mode in args.modes:
+        if mode in ("broker", "chat"):
+            n = args.clients if mode == "broker" else min(args.clients, args.chat_clients)
+            ok = messages_test(args.ncat, mode, n, args.messages) and ok
+        elif mode == "proxy":
+            ok = proxy_test(args.ncat, args.clients, args.messages) and ok
+        elif mode == "bulk":
+            ok = bulk_test(args.ncat, args.megabytes) and ok
+        else:
+            parser.error("unknown mode %s" % mode)
+    return 0 if ok else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -87,6 +87,10 @@
 #include <linux/vm_sockets.h>
 #endif
 
+#ifndef WIN32
+#include <sys/resource.h>
+#endif
+
 /* safely add 2 size_t */
 size_t sadd(size_t l, size_t r)
 {
@@ -567,15 +571,37 @@ void ms_to_timeval(struct timeval *tv, long ms)
  * ugly code to maintain our list of fds so we can have proper fdmax for
  * select().  really this should be generic list code, not this silly bit of
  * stupidity. -sean
+ *
+ * The list is indexed by descriptor, so that adding, finding, and removing a
+ * descriptor take the same time however many clients there are.
  */
 
+/* Make room in the index for descriptors up to fd. */
+static void grow_fdindex(fd_list_t *fdl, int fd)
+{
+    int n;
+
+    if (fd < fdl->indexsize)
+        return;
+    n = fdl->indexsize > 0 ? fdl->indexsize : 64;
+    while (n <= fd)
+        n *= 2;
+    fdl->index = (int *) safe_realloc(fdl->index, n * sizeof(*fdl->index));
+    memset(fdl->index + fdl->indexsize, 0, (n - fdl->indexsize) * sizeof(*fdl->index));
+    fdl->indexsize = n;
+}
+
 /* add an fdinfo to our list */
 int add_fdinfo(fd_list_t *fdl, struct fdinfo *s)
 {
     if (fdl->nfds >= fdl->maxfds)
         return -1;
 
+    ncat_assert(s->fd >= 0);
+    grow_fdindex(fdl, s->fd);
     fdl->fds[fdl->nfds] = *s;
+    /* index holds the position plus one, so that 0 means not in the list. */
+    fdl->index[s->fd] = fdl->nfds + 1;
 
     fdl->nfds++;
 
@@ -602,43 +628,34 @@ int add_fd(fd_list_t *fdl, int fd)
 /* remove a descriptor from our list */
 int rm_fd(fd_list_t *fdl, int fd)
 {
-    int x = 0, last = fdl->nfds;
-    int found = -1;
-    int newfdmax = 0;
+    int found, last = fdl->nfds;
 
     /* make sure we have a list */
     if (last == 0)
         bye("Program bug: Trying to remove fd from list with no fds.");
 
-    /* find the fd in the list */
-    for (x = 0; x < last; x++) {
-        struct fdinfo *fdi = &fdl->fds[x];
-        if (fdi->fd == fd) {
-            found = x;
-            /* If it's not the max, we can bail early. */
-            if (fd < fdl->fdmax) {
-                newfdmax = fdl->fdmax;
-                break;
-            }
-        }
-        else if (fdi->fd > newfdmax)
-            newfdmax = fdi->fd;
-    }
-    fdl->fdmax = newfdmax;
-
     /* make sure we found it */
-    if (found < 0)
+    if (fd < 0 || fd >= fdl->indexsize || fdl->index[fd] == 0)
         bye("Program bug: fd (%d) not on list.", fd);
+    found = fdl->index[fd] - 1;
 
     /* remove it, does nothing if (last == 1) */
     if (o.debug > 1)
         logdebug("Swapping fd[%d] (%d) with fd[%d] (%d)\n",
                  found, fdl->fds[found].fd, last - 1, fdl->fds[last - 1].fd);
     fdl->fds[found] = fdl->fds[last - 1];
+    fdl->index[fdl->fds[found].fd] = found + 1;
+    fdl->index[fd] = 0;
     fdl->state++;
 
     fdl->nfds--;
 
+    /* If it was the max, the new max is the next lower fd in the list. */
+    if (fd == fdl->fdmax) {
+        while (fdl->fdmax >= 0 && fdl->index[fdl->fdmax] == 0)
+            fdl->fdmax--;
+    }
+
     if (o.debug > 1)
         logdebug("Removed fd %d from list, nfds %d, maxfd %d\n", fd, fdl->nfds, fdl->fdmax);
     return 0;
@@ -647,24 +664,15 @@ int rm_fd(fd_list_t *fdl, int fd)
 /* find the max descriptor in our list */
 int get_maxfd(fd_list_t *fdl)
 {
-    int x = 0, max = -1, nfds = fdl->nfds;
-
-    for (x = 0; x < nfds; x++)
-        if (fdl->fds[x].fd > max)
-            max = fdl->fds[x].fd;
-
-    return max;
+    return fdl->fdmax;
 }
 
 struct fdinfo *get_fdinfo(const fd_list_t *fdl, int fd)
 {
-    int x;
-
-    for (x = 0; x < fdl->nfds; x++)
-        if (fdl->fds[x].fd == fd)
-            return &fdl->fds[x];
+    if (fd < 0 || fd >= fdl->indexsize || fdl->index[fd] == 0)
+        return NULL;
 
-    return NULL;
+    return &fdl->fds[fdl->index[fd] - 1];
 }
 
 void init_fdlist(fd_list_t *fdl, int maxfds)
@@ -674,6 +682,8 @@ void init_fdlist(fd_list_t *fdl, int maxfds)
     fdl->fdmax = -1;
     fdl->maxfds = maxfds;
     fdl->state = 0;
+    fdl->index = NULL;
+    fdl->indexsize = 0;
 
     if (o.debug > 1)
         logdebug("Initialized fdlist with %d maxfds\n", maxfds);
@@ -682,11 +692,34 @@ void init_fdlist(fd_list_t *fdl, int maxfds)
 void free_fdlist(fd_list_t *fdl)
 {
     free(fdl->fds);
+    free(fdl->index);
+    fdl->index = NULL;
+    fdl->indexsize = 0;
     fdl->nfds = 0;
     fdl->fdmax = -1;
     fdl->state = 0;
 }
 
+/* Raise the soft limit on open files to at least n descriptors, as far as the
+   hard limit allows, so that the number of clients is limited by --max-conns
+   and not by the default limit. */
+void raise_nofile_limit(int n)
+{
+#ifndef WIN32
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) != 0 || rl.rlim_cur == RLIM_INFINITY
+        || rl.rlim_cur >= (rlim_t) n)
+        return;
+    if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < (rlim_t) n)
+        rl.rlim_cur = rl.rlim_max;
+    else
+        rl.rlim_cur = n;
+    if (setrlimit(RLIMIT_NOFILE, &rl) != 0 && o.debug)
+        logdebug("Couldn't raise the open file limit to %d: %s\n", n, strerror(errno));
+#endif
+}
+
 
 /*  If any changes need to be made to EOL sequences to comply with --crlf
  *  then dst will be populated with the modified src, len will be adjusted
@@ -163,6 +163,8 @@ typedef struct fd_list {
     struct fdinfo *fds;
     int nfds, maxfds, fdmax;
     int state; /* incremented each time the list is modified */
+    int *index; /* 1 + the position of each fd in fds, or 0 */
+    int indexsize;
 } fd_list_t;
 
 int add_fdinfo(fd_list_t *, struct fdinfo *);
@@ -172,6 +174,7 @@ void free_fdlist(fd_list_t *);
 void init_fdlist(fd_list_t *, int);
 int get_maxfd(fd_list_t *);
 struct fdinfo *get_fdinfo(const fd_list_t *, int);
+void raise_nofile_limit(int n);
 
 int fix_line_endings(char *src, int *len, char **dst, int *state);
 
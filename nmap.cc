@@ -219,12 +219,13 @@ static void printusage() {
          "  --dns-servers <serv1[,serv2],...>: Specify custom DNS servers\n"
          "  --system-dns: Use OS's DNS resolver\n"
          "  --traceroute: Trace hop path to each host\n"
+         "  --traceroute-cache <file>: Reuse and save known paths across runs\n"
          "SCAN TECHNIQUES:\n"
          "  -sS/sT/sA/sW/sM: TCP SYN/Connect()/ACK/Window/Maimon scans\n"
          "  -sU: UDP Scan\n"
          "  -sN/sF/sX: TCP Null, FIN, and Xmas scans\n"
          "  --scanflags <flags>: Customize TCP scan flags\n"
-         "  -sI <zombie host[:probeport]>: Idle scan\n"
+         "  -sI <zombie host[:probeport][,...]>: Idle scan\n"
          "  -sY/sZ: SCTP INIT/COOKIE-ECHO scans\n"
          "  -sO: IP protocol scan\n"
          "  -b <FTP relay host>: FTP bounce scan\n"
@@ -250,6 +251,9 @@ static void printusage() {
          "  --script-args=<n1=v1,[n2=v2,...]>: provide arguments to scripts\n"
          "  --script-args-file=filename: provide NSE script args in a file\n"
          "  --script-trace: Show all data sent and received\n"
+         "  --script-workers <number>: Split host script scans across processes\n"
+         "  --script-host-sockets <number>: Limit script connections per host\n"
+         "  --script-cache <dir>: Keep compiled scripts in <dir> for faster startup\n"
          "  --script-updatedb: Update the script database.\n"
          "  --script-help=<Lua scripts>: Show help about scripts.\n"
          "           <Lua scripts> is a comma-separated list of script-files or\n"
@@ -265,6 +269,7 @@ static void printusage() {
          "  -T<0-5>: Set timing template (higher is faster)\n"
          "  --min-hostgroup/max-hostgroup <size>: Parallel host scan group sizes\n"
          "  --min-parallelism/max-parallelism <numprobes>: Probe parallelization\n"
+         "  --congestion-control <reno|cubic>: Probe window growth algorithm\n"
          "  --min-rtt-timeout/max-rtt-timeout/initial-rtt-timeout <time>: Specifies\n"
          "      probe round trip time.\n"
          "  --max-retries <tries>: Caps number of port scan probe retransmissions.\n"
@@ -542,6 +547,7 @@ void parse_options(int argc, char **argv) {
     {"max-os-tries", required_argument, 0, 0},
     {"max-parallelism", required_argument, 0, 'M'},
     {"min-parallelism", required_argument, 0, 0},
+    {"congestion-control", required_argument, 0, 0},
     {"timing", required_argument, 0, 'T'},
     {"max-rtt-timeout", required_argument, 0, 0},
     {"min-rtt-timeout", required_argument, 0, 0},
@@ -600,6 +606,7 @@ void parse_options(int argc, char **argv) {
     {"badsum", no_argument, 0, 0},
     {"ttl", required_argument, 0, 0}, /* Time to live */
     {"traceroute", no_argument, 0, 0},
+    {"traceroute-cache", required_argument, 0, 0},
     {"reason", no_argument, 0, 0},
     {"allports", no_argument, 0, 0},
     {"version-intensity", required_argument, 0, 0},
@@ -623,6 +630,9 @@ void parse_options(int argc, char **argv) {
     {"script-args-file", required_argument, 0, 0},
     {"script-help", required_argument, 0, 0},
     {"script-timeout", required_argument, 0, 0},
+    {"script-workers", required_argument, 0, 0},
+    {"script-host-sockets", required_argument, 0, 0},
+    {"script-cache", required_argument, 0, 0},
 #endif
     {"ip-options", required_argument, 0, 0},
     {"min-rate", required_argument, 0, 0},
@@ -680,6 +690,18 @@ void parse_options(int argc, char **argv) {
         if (d < 0 || d > LONG_MAX)
           fatal("Bogus --script-timeout argument specified");
         delayed_options.pre_scripttimeout = d;
+      } else if (strcmp(long_options[option_index].name, "script-workers") == 0) {
+        l = atoi(optarg);
+        if (l < 1 || l > 64)
+          fatal("Bogus --script-workers argument specified, must be between 1 and 64 (inclusive)");
+        o.scriptworkers = l;
+      } else if (strcmp(long_options[option_index].name, "script-host-sockets") == 0) {
+        l = atoi(optarg);
+        if (l < 1)
+          fatal("Bogus --script-host-sockets argument specified, must be at least 1");
+        o.scripthostsockets = l;
+      } else if (strcmp(long_options[option_index].name, "script-cache") == 0) {
+        o.scriptcache = strdup(optarg);
       } else
 #endif
         if (strcmp(long_options[option_index].name, "max-os-tries") == 0) {
@@ -746,6 +768,11 @@ void parse_options(int argc, char **argv) {
           if (o.min_parallelism > 100) {
             error("Warning: Your --min-parallelism option is pretty high!  This can hurt reliability.");
           }
+        } else if (strcmp(long_options[option_index].name, "congestion-control") == 0) {
+          int algo = cc_algorithm_from_name(optarg);
+          if (algo < 0)
+            fatal("Unknown --congestion-control algorithm \"%s\"; use \"reno\" or \"cubic\"", optarg);
+          o.cc_algo = (enum cc_algorithm) algo;
         } else if (strcmp(long_options[option_index].name, "host-timeout") == 0) {
           l = tval2msecs(optarg);
           if (l < 0)
@@ -950,8 +977,8 @@ void parse_options(int argc, char **argv) {
         } else if (strcmp(long_options[option_index].name, "sI") == 0) {
           o.idlescan = 1;
           o.idleProxy = strdup(optarg);
-          if (strlen(o.idleProxy) > FQDN_LEN) {
-            fatal("ERROR: -sI argument must be less than %d characters", FQDN_LEN);
+          if (strlen(o.idleProxy) > (FQDN_LEN + 1) * MAX_IDLE_ZOMBIES) {
+            fatal("ERROR: -sI argument must be less than %d characters", (FQDN_LEN + 1) * MAX_IDLE_ZOMBIES);
           }
         } else if (strcmp(long_options[option_index].name, "vv") == 0) {
           /* Compatibility hack ... ugly */
@@ -994,6 +1021,8 @@ void parse_options(int argc, char **argv) {
             fatal("Ip options must be multiple of 4 (read length is %i bytes)", o.ipoptionslen);
         } else if (strcmp(long_options[option_index].name, "traceroute") == 0) {
           o.traceroute = true;
+        } else if (strcmp(long_options[option_index].name, "traceroute-cache") == 0) {
+          o.traceroute_cache_file = strdup(optarg);
         } else if (strcmp(long_options[option_index].name, "reason") == 0) {
           o.reason = true;
         } else if (strcmp(long_options[option_index].name, "min-rate") == 0) {
@@ -2051,6 +2080,7 @@ int nmap_main(int argc, char *argv[]) {
     log_write(LOG_PLAIN, "  rtt-timeouts: init %d, min %d, max %d\n", o.initialRttTimeout(), o.minRttTimeout(), o.maxRttTimeout());
     log_write(LOG_PLAIN, "  max-scan-delay: TCP %d, UDP %d, SCTP %d\n", o.maxTCPScanDelay(), o.maxUDPScanDelay(), o.maxSCTPScanDelay());
     log_write(LOG_PLAIN, "  parallelism: min %d, max %d\n", o.min_parallelism, o.max_parallelism);
+    log_write(LOG_PLAIN, "  congestion-control: %s\n", cc_algorithm_name(o.cc_algo));
     log_write(LOG_PLAIN, "  max-retries: %d, host-timeout: %ld\n", o.getMaxRetransmissions(), o.host_timeout);
     log_write(LOG_PLAIN, "  min-rate: %g, max-rate: %g\n", o.min_packet_send_rate, o.max_packet_send_rate);
     log_write(LOG_PLAIN, "---------------------------------------------\n");
@@ -2424,6 +2454,9 @@ int nmap_main(int argc, char *argv[]) {
 
   addrset_free(exclude_group);
 
+  if (o.traceroute)
+    traceroute_cache_save();
+
   if (o.inputfd != NULL)
     fclose(o.inputfd);
 
@@ -224,6 +224,8 @@ int ArgParser::parseArguments(int argc, char *argv[]) {
   /* Timing and performance */
   {"delay", required_argument, 0, 0},
   {"rate", required_argument, 0, 0},
+  {"flood", no_argument, 0, 0},
+  {"batch", required_argument, 0, 0},
 
   /* Misc */
   {"help", no_argument, 0, 'h'},
@@ -874,6 +876,8 @@ int ArgParser::parseArguments(int argc, char *argv[]) {
             if(aux32==0){
                 nping_fatal(QT_3,"Invalid rate supplied. Rate can never be zero.");
             }else{
+                /* Flood mode paces to the exact rate */
+                o.setRate(aux32);
                 /* Compute delay from rate: delay= 1000ms/rate*/
                 aux32 = 1000 / aux32;
                 o.setDelay(aux32);
@@ -881,6 +885,12 @@ int ArgParser::parseArguments(int argc, char *argv[]) {
         }else{
             nping_fatal(QT_3,"Invalid rate supplied. Rate must be a valid, positive integer");
         }
+    /* Flood mode */
+    } else if (strcmp(long_options[option_index].name, "flood") == 0 ){
+        o.setFlood(true);
+    } else if (strcmp(long_options[option_index].name, "batch") == 0 ){
+        if ( parse_u32(optarg, &aux32) != OP_SUCCESS || aux32 > MAX_FLOOD_BATCH || o.setBatch(aux32) != OP_SUCCESS )
+            nping_fatal(QT_3,"Invalid batch size supplied. It must be an integer between 1 and %d.", MAX_FLOOD_BATCH);
 
 /* MISC OPTIONS **************************************************************/
     } else if (strcmp(long_options[option_index].name, "privileged") == 0 ){
@@ -1229,6 +1239,8 @@ void ArgParser::printUsage(void){
 "  's' (seconds), 'm' (minutes), or 'h' (hours) to the value (e.g. 30m, 0.25h).\n"
 "  --delay <time>                   : Adjust delay between probes.\n"
 "  --rate  <rate>                   : Send num packets per second.\n"
+"  --flood                          : Send from a pre-rendered ring in batches.\n"
+"  --batch <n>                      : Probes per send call with --flood.\n"
 "MISC:\n"
 "  -h, --help                       : Display help information.\n"
 "  -V, --version                    : Display current version number. \n"
@@ -63,6 +63,7 @@
 #include "EchoHeader.h"
 #include "NEPContext.h"
 #include <vector>
+#include <algorithm>
 #include "nsock.h"
 #include "output.h"
 #include "NpingOps.h"
@@ -73,6 +74,10 @@ extern NpingOps o;
 extern EchoServer es;
 
 EchoServer::EchoServer() {
+#ifdef HAVE_PTHREAD
+  pthread_mutex_init(&this->ctx_lock, NULL);
+  pthread_mutex_init(&this->queue_lock, NULL);
+#endif
   this->reset();
 } /* End of EchoServer constructor */
 
@@ -85,13 +90,24 @@ EchoServer::~EchoServer() {
 void EchoServer::reset() {
   this->client_ctx.clear();
   this->client_id_count=-1;
+  for(int i=0; i<NEP_MATCH_BUCKETS; i++)
+    this->match_table[i].clear();
+  this->match_cands.clear();
+  this->capture_threaded=false;
+  this->pd=NULL;
+  this->linkoff=0;
+  this->wakeup_fd=-1;
+  this->capture_queue.clear();
+  this->echo_queue.clear();
 } /* End of reset() */
 
 
 /** Adds a new client context object to the server context list */
 int EchoServer::addClientContext(NEPContext ctx){
   nping_print(DBG_4, "%s(ctx->id=%d)", __func__, ctx.getIdentifier());
-  this->client_ctx.push_back(ctx);
+  this->lockClients();
+  this->client_ctx[ctx.getIdentifier()]=ctx;
+  this->unlockClients();
   return OP_SUCCESS;
 } /* End of addClientContext() */
 
@@ -101,11 +117,10 @@ int EchoServer::addClientContext(NEPContext ctx){
   * returned when no context could be found.  */
 NEPContext *EchoServer::getClientContext(clientid_t clnt){
   nping_print(DBG_4, "%s(%d) %lu", __func__, clnt, (unsigned long)this->client_ctx.size());
-  for(unsigned int i=0; i<this->client_ctx.size(); i++){
-    if(this->client_ctx[i].getIdentifier() == clnt ){
-        nping_print(DBG_3, "Found client with ID #%d at p%d. Total clients %lu", clnt, i, (unsigned long)this->client_ctx.size());
-        return &(this->client_ctx[i]);
-    }
+  std::map<clientid_t, NEPContext>::iterator it=this->client_ctx.find(clnt);
+  if(it!=this->client_ctx.end()){
+    nping_print(DBG_3, "Found client with ID #%d. Total clients %lu", clnt, (unsigned long)this->client_ctx.size());
+    return &(it->second);
   }
   nping_print(DBG_3, "No client with ID #%d was found. Total clients %lu", clnt, (unsigned long)this->client_ctx.size());
   return NULL;
@@ -129,17 +144,14 @@ NEPContext *EchoServer::getClientContext(nsock_iod iod){
   * OP_SUCCESS if the context object was successfully deleted or OP_FAILURE if
   * the context could not be found.  */
 int EchoServer::destroyClientContext(clientid_t clnt){
-  bool deleted=false;
-  std::vector<NEPContext>::iterator it;
-  /* Iterate through the context array and delete the one that belongs to clnt */
-  for ( it=this->client_ctx.begin(); it<this->client_ctx.end(); it++){
-      if(it->getIdentifier()==clnt){
-        this->client_ctx.erase(it);
-        deleted=true;
-        break;
-      }
-  }
-  return (deleted) ? OP_SUCCESS : OP_FAILURE;
+  std::map<clientid_t, NEPContext>::iterator it=this->client_ctx.find(clnt);
+  if(it==this->client_ctx.end())
+    return OP_FAILURE;
+  this->unindexClientContext(&(it->second));
+  this->lockClients();
+  this->client_ctx.erase(it);
+  this->unlockClients();
+  return OP_SUCCESS;
 } /* End of destroyClientContext() */
 
 
@@ -176,6 +188,142 @@ clientid_t EchoServer::getNewClientID(){
 } /* End of getNewClientID() */
 
 
+/** Keeps the capture thread from matching packets while client contexts or
+  * the match table change. Only the control thread changes them, so it does
+  * not need the lock to read them. */
+void EchoServer::lockClients(){
+#ifdef HAVE_PTHREAD
+  if(this->capture_threaded)
+    pthread_mutex_lock(&this->ctx_lock);
+#endif
+} /* End of lockClients() */
+
+
+void EchoServer::unlockClients(){
+#ifdef HAVE_PTHREAD
+  if(this->capture_threaded)
+    pthread_mutex_unlock(&this->ctx_lock);
+#endif
+} /* End of unlockClients() */
+
+
+/* Kinds of match table keys */
+#define MATCH_KEY_PORTS 1  /* Transport protocol, source and destination port */
+#define MATCH_KEY_ID    2  /* IP version and IPv4 ID or IPv6 flow label       */
+
+/* Returns the match table bucket for a key. */
+static inline u32 match_bucket(u8 kind, u8 proto, u16 a, u32 b){
+  u32 h=(((u32)kind<<24) | ((u32)proto<<16) | a) * 0x9E3779B1;
+  h^=b;
+  h^=h>>15;
+  h*=0x85EBCA6B;
+  h^=h>>13;
+  return h & (NEP_MATCH_BUCKETS-1);
+} /* End of match_bucket() */
+
+
+/** Stores in keys the match table buckets that a client's packet spec puts
+  * it in: one for its ports, if it is a TCP or UDP client, and one for the IP
+  * ID or flow label it announced. A client that did not announce a
+  * destination port, because it sends to several, is indexed under port 0.
+  * Returns the number of keys. */
+int EchoServer::getMatchKeys(NEPContext *ctx, u32 *keys){
+  fspec_t *fspec;
+  int nkeys=0;
+  u8 proto=0;
+  u16 sport=0, dport=0;
+  bool have_sport=false;
+
+  for(int k=0; (fspec=ctx->getClientFieldSpec(k))!=NULL; k++){
+    switch(fspec->field){
+      case PSPEC_TCP_SPORT:
+      case PSPEC_UDP_SPORT:
+        proto=(fspec->field==PSPEC_TCP_SPORT) ? PSPEC_PROTO_TCP : PSPEC_PROTO_UDP;
+        sport=ntohs( *((u16 *)fspec->value) );
+        have_sport=true;
+      break;
+      case PSPEC_TCP_DPORT:
+      case PSPEC_UDP_DPORT:
+        dport=ntohs( *((u16 *)fspec->value) );
+      break;
+      case PSPEC_IPv4_ID:
+        keys[nkeys++]=match_bucket(MATCH_KEY_ID, 4, 0, ntohs( *((u16 *)fspec->value) ));
+      break;
+      case PSPEC_IPv6_FLOW:
+        keys[nkeys++]=match_bucket(MATCH_KEY_ID, 6, 0, ntohl( *((u32 *)fspec->value) ));
+      break;
+    }
+  }
+  if(have_sport)
+    keys[nkeys++]=match_bucket(MATCH_KEY_PORTS, proto, sport, dport);
+  return nkeys;
+} /* End of getMatchKeys() */
+
+
+/** Adds a client whose packet spec has been received to the match table, so
+  * captured packets start being matched against it. */
+int EchoServer::indexClientContext(NEPContext *ctx){
+  u32 keys[NEP_MATCH_MAX_KEYS];
+  int nkeys=this->getMatchKeys(ctx, keys);
+
+  this->lockClients();
+  for(int i=0; i<nkeys; i++){
+    std::vector<clientid_t> &b=this->match_table[keys[i]];
+    if(std::find(b.begin(), b.end(), ctx->getIdentifier())==b.end())
+      b.push_back(ctx->getIdentifier());
+  }
+  this->unlockClients();
+  nping_print(DBG_3, "Client #%d indexed under %d keys", ctx->getIdentifier(), nkeys);
+  return OP_SUCCESS;
+} /* End of indexClientContext() */
+
+
+/** Removes a client from the match table. */
+int EchoServer::unindexClientContext(NEPContext *ctx){
+  u32 keys[NEP_MATCH_MAX_KEYS];
+  int nkeys=this->getMatchKeys(ctx, keys);
+
+  this->lockClients();
+  for(int i=0; i<nkeys; i++){
+    std::vector<clientid_t> &b=this->match_table[keys[i]];
+    b.erase(std::remove(b.begin(), b.end(), ctx->getIdentifier()), b.end());
+  }
+  this->unlockClients();
+  return OP_SUCCESS;
+} /* End of unindexClientContext() */
+
+
+/** Fills match_cands with the clients indexed under the keys of a captured
+  * packet: its IPv4 ID and IPv6 flow label, and its ports, both as they are
+  * and with the destination port as a wildcard. A packet whose ports and IP
+  * ID were all rewritten in transit therefore goes unmatched. */
+void EchoServer::getMatchCandidates(IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp){
+  u32 keys[NEP_MATCH_MAX_KEYS];
+  int nkeys=0;
+
+  if(ip4!=NULL)
+    keys[nkeys++]=match_bucket(MATCH_KEY_ID, 4, 0, ip4->getIdentification());
+  if(ip6!=NULL)
+    keys[nkeys++]=match_bucket(MATCH_KEY_ID, 6, 0, ip6->getFlowLabel());
+  if(tcp!=NULL){
+    keys[nkeys++]=match_bucket(MATCH_KEY_PORTS, PSPEC_PROTO_TCP, tcp->getSourcePort(), tcp->getDestinationPort());
+    keys[nkeys++]=match_bucket(MATCH_KEY_PORTS, PSPEC_PROTO_TCP, tcp->getSourcePort(), 0);
+  }else if(udp!=NULL){
+    keys[nkeys++]=match_bucket(MATCH_KEY_PORTS, PSPEC_PROTO_UDP, udp->getSourcePort(), udp->getDestinationPort());
+    keys[nkeys++]=match_bucket(MATCH_KEY_PORTS, PSPEC_PROTO_UDP, udp->getSourcePort(), 0);
+  }
+
+  this->match_cands.clear();
+  for(int i=0; i<nkeys; i++){
+    std::vector<clientid_t> &b=this->match_table[keys[i]];
+    for(size_t j=0; j<b.size(); j++){
+      if(std::find(this->match_cands.begin(), this->match_cands.end(), b[j])==this->match_cands.end())
+        this->match_cands.push_back(b[j]);
+    }
+  }
+} /* End of getMatchCandidates() */
+
+
 /** Returns a socket suitable to be passed to accept() */
 int EchoServer::nep_listen_socket(){
   nping_print(DBG_4, "%s()", __func__);
@@ -304,11 +452,9 @@ int EchoServer::nep_listen_socket(){
 #define MIN_ACCEPTABLE_SCORE_UDP  8.0
 #define MIN_ACCEPTABLE_SCORE_ICMP 6.0
 
-clientid_t EchoServer::nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp, ICMPv4Header *icmp4, RawData *payload){
-  nping_print(DBG_4, "%s(%p,%p,%p,%p,%p,%p)", __func__, ip4, ip6, tcp, udp, icmp4, payload);
+clientid_t EchoServer::nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp, ICMPv4Header *icmp4, const u8 *payload, size_t payloadlen){
+  nping_print(DBG_4, "%s(%p,%p,%p,%p,%p,%p,%lu)", __func__, ip4, ip6, tcp, udp, icmp4, payload, (unsigned long)payloadlen);
     unsigned int i=0, k=0;
-    u8 *buff=NULL;
-    int bufflen=-1;
     NEPContext *ctx;
     fspec_t *fspec;
     float current_score=0;
@@ -316,10 +462,12 @@ clientid_t EchoServer::nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHe
     float minimum_score=0;
     clientid_t candidate=-1;
 
-    /* Iterate through the list of connected clients */
-    for(i=0; i<this->client_ctx.size(); i++ ){
+    /* Iterate through the clients indexed under the packet's ports or IP ID */
+    this->getMatchCandidates(ip4, ip6, tcp, udp);
+    for(i=0; i<this->match_cands.size(); i++ ){
         current_score=0;
-        ctx=&(this->client_ctx[i]);
+        if( (ctx=this->getClientContext(this->match_cands[i]))==NULL )
+            continue;
         nping_print(DBG_2, "%s() Trying to match packet against client #%d", __func__, ctx->getIdentifier());
         if( ctx->ready() ){
             /* Iterate through client's list of packet field specifiers */
@@ -481,10 +629,9 @@ clientid_t EchoServer::nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHe
                     case PSPEC_PAYLOAD_MAGIC:
                         if(payload==NULL)break;
                         nping_print(DBG_3, "%s() Trying to match Payload Magic value", __func__);
-                        buff=payload->getBinaryBuffer(&bufflen);
-                        if(buff==NULL || bufflen<=0 || fspec->len>bufflen)
+                        if(payloadlen==0 || fspec->len>payloadlen)
                             break;
-                        if( memcmp(buff, fspec->value, fspec->len)==0 ){
+                        if( memcmp(payload, fspec->value, fspec->len)==0 ){
                             nping_print(DBG_3|NO_NEWLINE, "[Match] Payload magic=0x");
                             for(unsigned int i=0; i<fspec->len; i++)
                                 nping_print(DBG_3|NO_NEWLINE,"%02x", fspec->value[i]);
@@ -511,7 +658,7 @@ clientid_t EchoServer::nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHe
                 nping_print(DBG_3, "%s() Found better candidate (client #%d; score=%.02f)", __func__, candidate, candidate_score);
             }
         }
-    } /* End of connected clients loop */
+    } /* End of candidate clients loop */
 
     if( tcp!=NULL )
         minimum_score=MIN_ACCEPTABLE_SCORE_TCP;
@@ -539,14 +686,17 @@ clientid_t EchoServer::nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHe
 
 clientid_t EchoServer::nep_match_packet(const u8 *pkt, size_t pktlen){
   nping_print(DBG_4, "%s(%p, %lu)", __func__, pkt, (long unsigned)pktlen);
-  int iplen=0, ip6len=0, tcplen=0, udplen=0;
-  bool payload_included=false;
-  IPv4Header ip4;
-  IPv6Header ip6;
-  TCPHeader tcp;
-  UDPHeader udp;
-  ICMPv4Header icmp4;
-  RawData payload;
+  packet_view_t view;
+  IPv4Header ip4, *ip4p=NULL;
+  IPv6Header ip6, *ip6p=NULL;
+  TCPHeader tcp, *tcpp=NULL;
+  UDPHeader udp, *udpp=NULL;
+  ICMPv4Header icmp4, *icmp4p=NULL;
+  const u8 *payload=NULL;
+  size_t payloadlen=0;
+  const u8 *hdr=NULL;
+  u32 hdrlen=0;
+  int i=0;
 
   if(this->client_id_count<0){
     nping_print(DBG_1, "Error trying to match the packet. No clients connected.");
@@ -556,249 +706,68 @@ clientid_t EchoServer::nep_match_packet(const u8 *pkt, size_t pktlen){
     return CLIENT_NOT_FOUND;
   }
 
-  /* Determine IP version */
-  if (ip4.storeRecvData(pkt, pktlen)==OP_FAILURE)
-    return CLIENT_NOT_FOUND;
-
-  if(ip4.getVersion()==0x04){
-
-    nping_print(DBG_2, "Recv packet is IPv4. Trying to find a matching client.");
-    if( (iplen=ip4.validate())==OP_FAILURE){
-        return CLIENT_NOT_FOUND;
+  /* Find the headers without copying the packet. Supported packets are IPv4 or
+   * IPv6, possibly with the other version encapsulated in it, carrying TCP,
+   * UDP or (IPv4 only) ICMP. */
+  PacketParser::parse_view(pkt, pktlen, false, &view);
+  for(i=0; i<view.count && i<2; i++){
+    hdr=pkt+view.offset[i];
+    hdrlen=view.hdr[i].length;
+    if(view.hdr[i].type==HEADER_TYPE_IPv4 && ip4p==NULL){
+      if(i==0)
+        nping_print(DBG_2, "Recv packet is IPv4. Trying to find a matching client.");
+      ip4.storeRecvData(hdr, hdrlen);
+      ip4p=&ip4;
+    }else if(view.hdr[i].type==HEADER_TYPE_IPv6 && ip6p==NULL){
+      if(i==0)
+        nping_print(DBG_2, "Recv packet is IPv6. Trying to find a matching client.");
+      ip6.storeRecvData(hdr, hdrlen);
+      ip6p=&ip6;
     }else{
-        switch( ip4.getNextProto() ){
-            case 1: // ICMP
-                if( icmp4.storeRecvData(pkt+iplen, pktlen-iplen)==OP_FAILURE )
-                    return CLIENT_NOT_FOUND;
-                else
-                    return this->nep_match_headers(&ip4, NULL, NULL, NULL, &icmp4, NULL);
-            break;
-
-            case 6: // TCP
-                if( tcp.storeRecvData(pkt+iplen, pktlen-iplen)==OP_FAILURE ){
-                    return CLIENT_NOT_FOUND;
-                }else{
-                    if( (tcplen=tcp.validate())==OP_FAILURE){
-                        return CLIENT_NOT_FOUND;
-                    }else{                        
-                        if( (int)pktlen > (iplen+tcplen) ){
-                           if( payload.storeRecvData(pkt+iplen+tcplen, pktlen-iplen-tcplen)!=OP_FAILURE)
-                               payload_included=true;
-                        }
-                        if(payload_included)
-                            return this->nep_match_headers(&ip4, NULL, &tcp, NULL, NULL, &payload);
-                        else
-                            return this->nep_match_headers(&ip4, NULL, &tcp, NULL, NULL, NULL);
-                    }
-                }
-            break;
-
-            case 17: // UDP
-                if( udp.storeRecvData(pkt+iplen, pktlen-iplen)==OP_FAILURE ){
-                    return CLIENT_NOT_FOUND;
-                }else{
-                    if( (udplen=udp.validate())==OP_FAILURE){
-                        return CLIENT_NOT_FOUND;
-                    }else{
-                        if( (int)pktlen > (iplen+udplen) ){
-                           if( payload.storeRecvData(pkt+iplen+udplen, pktlen-iplen-udplen)!=OP_FAILURE)
-                               payload_included=true;
-                        }
-                        if(payload_included)
-                            return this->nep_match_headers(&ip4, NULL, NULL, &udp, NULL, &payload);
-                        else
-                            return this->nep_match_headers(&ip4, NULL, NULL, &udp, NULL, NULL);
-                    }
-                }
-            break;
-
-            case 41: /* IPv6 encapsulated in the IPv4 datagram! */
-                if( ip6.storeRecvData(pkt+iplen, pktlen-iplen)==OP_FAILURE ){
-                    return CLIENT_NOT_FOUND;
-                }else{
-                    if( (ip6len=ip6.validate())==OP_FAILURE){
-                        return CLIENT_NOT_FOUND;
-                    }else{
-                        switch( ip6.getNextHeader() ){
-                            case 58: // ICMPv6
-                                nping_print(DBG_4, "Encapsulated IPv4{ IPv6{ ICMPv6 } } received. Not supported.");
-                                return CLIENT_NOT_FOUND;
-                            break;
-
-                            case 6: // TCP
-                                if( tcp.storeRecvData(pkt+ip6len+iplen, pktlen-ip6len-iplen)==OP_FAILURE ){
-                                    return CLIENT_NOT_FOUND;
-                                }else{
-                                    if( (tcplen=tcp.validate())==OP_FAILURE){
-                                        return CLIENT_NOT_FOUND;
-                                    }else{
-                                        if( (int)pktlen > (ip6len+iplen+tcplen) ){
-                                           if( payload.storeRecvData(pkt+ip6len+iplen+tcplen, pktlen-ip6len-iplen-tcplen)!=OP_FAILURE)
-                                               payload_included=true;
-                                        }
-                                        if(payload_included)
-                                            return this->nep_match_headers(&ip4, &ip6, &tcp, NULL, NULL, &payload);
-                                        else
-                                            return this->nep_match_headers(&ip4, &ip6, &tcp, NULL, NULL, NULL);
-                                    }
-                                }
-                            break;
-
-                            case 17: // UDP
-                                if( udp.storeRecvData(pkt+ip6len+iplen, pktlen-ip6len-iplen)==OP_FAILURE ){
-                                    return CLIENT_NOT_FOUND;
-                                }else{
-                                    if( (udplen=udp.validate())==OP_FAILURE){
-                                        return CLIENT_NOT_FOUND;
-                                    }else{
-                                        if( (int)pktlen > (ip6len+iplen+udplen) ){
-                                           if( payload.storeRecvData(pkt+ip6len+iplen+udplen, pktlen-ip6len-iplen-udplen)!=OP_FAILURE)
-                                               payload_included=true;
-                                        }
-                                        if(payload_included)
-                                            return this->nep_match_headers(&ip4, &ip6, NULL, &udp, NULL, &payload);
-                                        else
-                                            return this->nep_match_headers(&ip4, &ip6, NULL, &udp, NULL, NULL);
-                                    }
-                                }
-                            break;
-
-                            default:
-                                return CLIENT_NOT_FOUND;
-                            break;
-                        }
-                    }
-                }
-            break;
-
-            default:
-                return CLIENT_NOT_FOUND;
-            break;
-        }
+      break;
     }
-  }else if(ip4.getVersion()==0x06){
-
-    nping_print(DBG_2, "Recv packet is IPv6. Trying to find a matching client.");
-    if (ip6.storeRecvData(pkt, pktlen)==OP_FAILURE)
-        return CLIENT_NOT_FOUND;
+  }
+  if(i==0){
+    nping_print(DBG_2, "Received packet is not IP: Discarded.");
+    return CLIENT_NOT_FOUND;
+  }else if(i>=view.count){
+    return CLIENT_NOT_FOUND;
+  }
 
-    if( (ip6len=ip6.validate())==OP_FAILURE )
+  hdr=pkt+view.offset[i];
+  hdrlen=view.hdr[i].length;
+  switch(view.hdr[i].type){
+    case HEADER_TYPE_TCP:
+      tcp.storeRecvData(hdr, hdrlen);
+      tcpp=&tcp;
+    break;
+    case HEADER_TYPE_UDP:
+      udp.storeRecvData(hdr, hdrlen);
+      udpp=&udp;
+    break;
+    case HEADER_TYPE_ICMPv4:
+      if(ip6p!=NULL && ip4p==NULL)
         return CLIENT_NOT_FOUND;
+      icmp4.storeRecvData(hdr, pktlen-view.offset[i]);
+      icmp4p=&icmp4;
+    break;
+    case HEADER_TYPE_ICMPv6:
+      nping_print(DBG_4, "Received ICMPv6 packet. Not yet supported.");
+      return CLIENT_NOT_FOUND;
+    break;
+    default:
+      return CLIENT_NOT_FOUND;
+    break;
+  }
 
-    switch( ip6.getNextHeader() ){
-        case 58: // ICMPv6
-            nping_print(DBG_4, "Received ICMPv6 packet. Not yet supported.");
-            return CLIENT_NOT_FOUND;
-        break;
-
-        case 6: // TCP
-            if( tcp.storeRecvData(pkt+ip6len, pktlen-ip6len)==OP_FAILURE ){
-                return CLIENT_NOT_FOUND;
-            }else{
-                if( (tcplen=tcp.validate())==OP_FAILURE){
-                    return CLIENT_NOT_FOUND;
-                }else{
-                    if( (int)pktlen > (ip6len+tcplen) ){
-                       if( payload.storeRecvData(pkt+ip6len+tcplen, pktlen-ip6len-tcplen)!=OP_FAILURE)
-                           payload_included=true;
-                    }
-                    if(payload_included)
-                        return this->nep_match_headers(NULL, &ip6, &tcp, NULL, NULL, &payload);
-                    else
-                        return this->nep_match_headers(NULL, &ip6, &tcp, NULL, NULL, NULL);
-                }
-            }
-        break;
-
-        case 17: // UDP
-            if( udp.storeRecvData(pkt+ip6len, pktlen-ip6len)==OP_FAILURE ){
-                return CLIENT_NOT_FOUND;
-            }else{
-                if( (udplen=udp.validate())==OP_FAILURE){
-                    return CLIENT_NOT_FOUND;
-                }else{
-                    if( (int)pktlen > (ip6len+udplen) ){
-                       if( payload.storeRecvData(pkt+ip6len+udplen, pktlen-ip6len-udplen)!=OP_FAILURE)
-                           payload_included=true;
-                    }
-                    if(payload_included)
-                        return this->nep_match_headers(NULL, &ip6, NULL, &udp, NULL, &payload);
-                    else
-                        return this->nep_match_headers(NULL, &ip6, NULL, &udp, NULL, NULL);
-                }
-            }
-        break;
-
-        case 4: /* IPv4 encapsulated in the IPv6 datagram */
-            if( ip4.storeRecvData(pkt+ip6len, pktlen-ip6len)==OP_FAILURE ){
-                return CLIENT_NOT_FOUND;
-            }else{
-                if( (iplen=ip4.validate())==OP_FAILURE){
-                    return CLIENT_NOT_FOUND;
-                }else{
-                    switch( ip4.getNextProto() ){
-                        case 1: // ICMP
-                            if( icmp4.storeRecvData(pkt+ip6len+iplen, pktlen-ip6len-iplen)==OP_FAILURE )
-                                return CLIENT_NOT_FOUND;
-                            else
-                                return this->nep_match_headers(&ip4, &ip6, NULL, NULL, &icmp4, NULL);
-                        break;
-
-                        case 6: // TCP
-                            if( tcp.storeRecvData(pkt+ip6len+iplen, pktlen-ip6len-iplen)==OP_FAILURE ){
-                                return CLIENT_NOT_FOUND;
-                            }else{
-                                if( (tcplen=tcp.validate())==OP_FAILURE){
-                                    return CLIENT_NOT_FOUND;
-                                }else{
-                                    if( (int)pktlen > (ip6len+iplen+tcplen) ){
-                                       if( payload.storeRecvData(pkt+ip6len+iplen+tcplen, pktlen-ip6len-iplen-tcplen)!=OP_FAILURE)
-                                           payload_included=true;
-                                    }
-                                    if(payload_included)
-                                        return this->nep_match_headers(&ip4, &ip6, &tcp, NULL, NULL, &payload);
-                                    else
-                                        return this->nep_match_headers(&ip4, &ip6, &tcp, NULL, NULL, NULL);
-                                }
-                            }
-                        break;
-
-                        case 17: // UDP
-                            if( udp.storeRecvData(pkt+ip6len+iplen, pktlen-ip6len-iplen)==OP_FAILURE ){
-                                return CLIENT_NOT_FOUND;
-                            }else{
-                                if( (udplen=udp.validate())==OP_FAILURE){
-                                    return CLIENT_NOT_FOUND;
-                                }else{
-                                    if( (int)pktlen > (ip6len+iplen+udplen) ){
-                                       if( payload.storeRecvData(pkt+ip6len+iplen+udplen, pktlen-ip6len-iplen-udplen)!=OP_FAILURE)
-                                           payload_included=true;
-                                    }
-                                    if(payload_included)
-                                        return this->nep_match_headers(&ip4, &ip6, NULL, &udp, NULL, &payload);
-                                    else
-                                        return this->nep_match_headers(&ip4, &ip6, NULL, &udp, NULL, NULL);
-                                }
-                            }
-                        break;
-
-                        default:
-                            return CLIENT_NOT_FOUND;
-                        break;
-                    }
-                }
-            }
-        break;
-
-        default:
-            return CLIENT_NOT_FOUND;
-        break;
+  /* Whatever follows a TCP or UDP header is payload. */
+  if(tcpp!=NULL || udpp!=NULL){
+    if(view.offset[i]+hdrlen < pktlen){
+      payload=hdr+hdrlen;
+      payloadlen=pktlen-view.offset[i]-hdrlen;
     }
-  }else{
-    nping_print(DBG_2, "Received packet is not IP: Discarded.");
-    return CLIENT_NOT_FOUND;
   }
-  return CLIENT_NOT_FOUND;
+  return this->nep_match_headers(ip4p, ip6p, tcpp, udpp, icmp4p, payload, payloadlen);
 } /* End of nep_match_packet() */
 
 
@@ -809,9 +778,6 @@ int EchoServer::nep_capture_handler(nsock_pool nsp, nsock_event nse, void *param
   const unsigned char *link=NULL;
   nsock_iod nsi = nse_iod(nse);
   struct timeval pcaptime;
-  nsock_iod clnt_iod=NULL;
-  NEPContext *ctx=NULL;
-  EchoHeader pkt_out;
   size_t linklen=0;
   size_t packetlen=0;
   handler_arg_t arg;
@@ -838,6 +804,17 @@ int EchoServer::nep_capture_handler(nsock_pool nsp, nsock_event nse, void *param
   }else{
     nping_print(DBG_4, "Captured packet belongs to client #%d", clnt);
   }
+  return this->nep_echo_packet(nsp, clnt, packet, packetlen);
+} /* End of nep_capture_handler() */
+
+
+/** Sends a captured packet that matched a client back to it in a NEP_ECHO
+  * message. */
+int EchoServer::nep_echo_packet(nsock_pool nsp, clientid_t clnt, const u8 *packet, size_t packetlen){
+  nping_print(DBG_4, "%s(%d)", __func__, clnt);
+  nsock_iod clnt_iod=NULL;
+  NEPContext *ctx=NULL;
+  EchoHeader pkt_out;
 
   /* Fetch client context */
   if( (ctx=this->getClientContext(clnt)) == NULL ){
@@ -857,7 +834,148 @@ int EchoServer::nep_capture_handler(nsock_pool nsp, nsock_event nse, void *param
       o.stats.addEchoedPacket(packetlen);
   }
   return OP_SUCCESS;
-} /* End of nep_capture_handler() */
+} /* End of nep_echo_packet() */
+
+
+/* Record that precedes each packet in the capture queue */
+typedef struct capture_rec{
+  clientid_t clnt;
+  u32 len;
+}capture_rec_t;
+
+
+/** Opens a capture descriptor and starts a thread that captures packets on it
+  * and matches them against the clients. The packets that match are queued
+  * for this thread, which echoes them when nep_wakeup_handler() is called.
+  * Returns OP_FAILURE if threads are not available or the thread could not
+  * be started, in which case packets are captured through nsock. */
+int EchoServer::nep_capture_thread_start(nsock_pool nsp, const char *pcapdev){
+#ifdef HAVE_PTHREAD
+  nsock_iod wakeup_nsi;
+  pthread_t thr;
+  int sv[2];
+
+  if( (this->pd=my_pcap_open_live(pcapdev, MAX_ECHOED_PACKET_LEN, 1, 100))==NULL )
+    return OP_FAILURE;
+  if( (this->linkoff=datalink_offset(pcap_datalink(this->pd)))<0 ){
+    pcap_close(this->pd);
+    this->pd=NULL;
+    return OP_FAILURE;
+  }
+  set_pcap_filter(pcapdev, this->pd, "%s", ProbeMode::getBPFFilterString());
+
+  /* The capture thread writes to one end of the pair when it queues packets
+   * and nsock tells us when the other end is readable. */
+  if( socketpair(AF_UNIX, SOCK_STREAM, 0, sv)!=0 )
+    nping_fatal(QT_3, "Failed to create socket pair: %s", strerror(errno));
+  if( (wakeup_nsi=nsock_iod_new2(nsp, sv[0], NULL))==NULL )
+    nping_fatal(QT_3, "Failed to create new nsock_iod.  QUITTING.\n");
+  close(sv[0]); /* nsock_iod_new2() dups the socket */
+  this->wakeup_fd=sv[1];
+  nsock_readbytes(nsp, wakeup_nsi, wakeup_handler, NSOCK_INFINITE, NULL, 1);
+
+  this->capture_threaded=true;
+  if( pthread_create(&thr, NULL, capture_thread, this)!=0 ){
+    nping_warning(QT_2, "Failed to start the capture thread. Capturing packets on the main thread.");
+    this->capture_threaded=false;
+    pcap_close(this->pd);
+    this->pd=NULL;
+    return OP_FAILURE;
+  }
+  pthread_detach(thr);
+  nping_print(DBG_2, "Capturing packets on a separate thread");
+  return OP_SUCCESS;
+#else
+  return OP_FAILURE;
+#endif
+} /* End of nep_capture_thread_start() */
+
+
+/** Main loop of the capture thread. Matches captured packets against the
+  * clients and queues those that match for the control thread. Only returns
+  * if capture fails. */
+int EchoServer::nep_capture_loop(){
+  nping_print(DBG_4, "%s()", __func__);
+#ifdef HAVE_PTHREAD
+  struct pcap_pkthdr *head=NULL;
+  const u8 *link=NULL;
+  const u8 *packet=NULL;
+  size_t packetlen=0;
+  size_t off=0;
+  clientid_t clnt;
+  capture_rec_t rec;
+  bool wakeup;
+  int rc;
+
+  while( (rc=pcap_next_ex(this->pd, &head, &link))>=0 ){
+    if(rc==0)
+      continue;
+    /* Skip the link header, and the 802.1Q tag if there is one */
+    off=this->linkoff;
+    if(pcap_datalink(this->pd)==DLT_EN10MB && head->caplen>=ETH_HDR_LEN && link[12]==0x81 && link[13]==0x00)
+      off+=4;
+    if(head->caplen<=off)
+      continue;
+    packet=link+off;
+    packetlen=head->caplen-off;
+    nping_print(DBG_3, "Captured %lu bytes", (unsigned long)packetlen);
+    o.stats.addRecvPacket(packetlen);
+
+    this->lockClients();
+    clnt=this->nep_match_packet(packet, packetlen);
+    this->unlockClients();
+    if(clnt==CLIENT_NOT_FOUND)
+      continue;
+
+    rec.clnt=clnt;
+    rec.len=packetlen;
+    pthread_mutex_lock(&this->queue_lock);
+    if(this->capture_queue.size()+sizeof(rec)+packetlen > NEP_CAPTURE_QUEUE_MAX){
+      pthread_mutex_unlock(&this->queue_lock);
+      nping_print(DBG_2, "Capture queue is full. Packet for client #%d not echoed.", clnt);
+      continue;
+    }
+    wakeup=this->capture_queue.empty();
+    this->capture_queue.insert(this->capture_queue.end(), (u8 *)&rec, (u8 *)&rec+sizeof(rec));
+    this->capture_queue.insert(this->capture_queue.end(), packet, packet+packetlen);
+    pthread_mutex_unlock(&this->queue_lock);
+
+    /* The control thread empties the queue whenever it is woken up, so it
+     * only needs waking up once the queue is no longer empty. */
+    if(wakeup && send(this->wakeup_fd, "", 1, 0)<0)
+      nping_warning(QT_2, "Failed to wake up the control thread: %s", strerror(errno));
+  }
+  nping_warning(QT_2, "Packet capture failed: %s", pcap_geterr(this->pd));
+#endif
+  return OP_FAILURE;
+} /* End of nep_capture_loop() */
+
+
+/** Echoes the packets queued by the capture thread. */
+int EchoServer::nep_wakeup_handler(nsock_pool nsp, nsock_event nse, void *param){
+  nping_print(DBG_4, "%s()", __func__);
+  capture_rec_t rec;
+  size_t off=0;
+
+  if(nse_status(nse)!=NSE_STATUS_SUCCESS)
+    nping_fatal(QT_3, "Lost contact with the capture thread.");
+
+#ifdef HAVE_PTHREAD
+  pthread_mutex_lock(&this->queue_lock);
+  this->capture_queue.swap(this->echo_queue);
+  pthread_mutex_unlock(&this->queue_lock);
+#endif
+  while(off+sizeof(rec) <= this->echo_queue.size()){
+    memcpy(&rec, &this->echo_queue[off], sizeof(rec));
+    off+=sizeof(rec);
+    this->nep_echo_packet(nsp, rec.clnt, &this->echo_queue[off], rec.len);
+    off+=rec.len;
+  }
+  this->echo_queue.clear();
+
+  nsock_readbytes(nsp, nse_iod(nse), wakeup_handler, NSOCK_INFINITE, NULL, 1);
+  return OP_SUCCESS;
+} /* End of nep_wakeup_handler() */
 
 
 int EchoServer::nep_echo_handler(nsock_pool nsp, nsock_event nse, void *param){
@@ -985,6 +1103,7 @@ int EchoServer::nep_packetspec_handler(nsock_pool nsp, nsock_event nse, void *pa
       return OP_FAILURE;
   }
   ctx->setState(STATE_READY_SENT);
+  this->indexClientContext(ctx);
   nping_print(VB_1, "[%lu] NEP handshake with client #%d (%s:%d) was performed successfully", (unsigned long)time(NULL), ctx->getIdentifier(), IPtoa(ctx->getAddress()), sockaddr2port(ctx->getAddress()));
 
   /* Craft response and send it */
@@ -1370,7 +1489,7 @@ int EchoServer::start() {
   nsock_pool nsp;                  /**< Nsock pool                           */
   enum nsock_loopstatus loopret;   /**< Stores nsock_loop returned status    */
   nsock_iod client_nsi;            /**< Stores connected client IOD          */
-  nsock_iod pcap_nsi;              /**< Stores Pcap IOD                      */
+  nsock_iod pcap_nsi=NULL;         /**< Stores Pcap IOD                      */
   char pcapdev[128];               /**< Device name passed to pcap_open_live */
   struct timeval now;              /**< For timestamps                       */
   struct sockaddr_storage ss;      /**< New client socket address            */
@@ -1393,19 +1512,20 @@ int EchoServer::start() {
   else if( o.getDebugging() > DBG_5 )
     nsock_set_loglevel(NSOCK_LOG_DBG_ALL);
 
-  /* Create new IOD for pcap */
-  if ((pcap_nsi = nsock_iod_new(nsp, NULL)) == NULL)
-    nping_fatal(QT_3, "Failed to create new nsock_iod.  QUITTING.\n");
-
-  /* Open pcap */
+  /* Open pcap. Packets are captured on a thread of their own where threads
+   * are available, or through nsock otherwise. */
   nping_print(DBG_2,"Opening pcap device %s", o.getDevice());
   Strncpy(pcapdev, o.getDevice(), sizeof(pcapdev));
-  rc = nsock_pcap_open(nsp, pcap_nsi, pcapdev, MAX_ECHOED_PACKET_LEN, 1,
-                       ProbeMode::getBPFFilterString());
-  if (rc)
-    nping_fatal(QT_3, "Error opening capture device %s\n", o.getDevice());
-  else
-    nping_print(VB_0,"Packet capture will be performed using network interface %s.", o.getDevice());
+  if( this->nep_capture_thread_start(nsp, pcapdev)!=OP_SUCCESS ){
+    /* Create new IOD for pcap */
+    if ((pcap_nsi = nsock_iod_new(nsp, NULL)) == NULL)
+      nping_fatal(QT_3, "Failed to create new nsock_iod.  QUITTING.\n");
+    rc = nsock_pcap_open(nsp, pcap_nsi, pcapdev, MAX_ECHOED_PACKET_LEN, 1,
+                         ProbeMode::getBPFFilterString());
+    if (rc)
+      nping_fatal(QT_3, "Error opening capture device %s\n", o.getDevice());
+  }
+  nping_print(VB_0,"Packet capture will be performed using network interface %s.", o.getDevice());
   nping_print(VB_0,"Waiting for connections...");
 
   /* Get a socket suitable for an accept() call */
@@ -1454,7 +1574,8 @@ int EchoServer::start() {
             nsock_write(nsp, client_nsi, hs_server_handler, NSOCK_INFINITE, NULL, (const char *)h.getBufferPointer(), h.getLen() );
 
             /* For every client we schedule a packet capture event. */
-            nsock_pcap_read_packet(nsp, pcap_nsi, capture_handler, NSOCK_INFINITE, NULL);
+            if(!this->capture_threaded)
+              nsock_pcap_read_packet(nsp, pcap_nsi, capture_handler, NSOCK_INFINITE, NULL);
 
         }
         block_socket(listen_sd);
@@ -1492,6 +1613,25 @@ void capture_handler(nsock_pool nsp, nsock_event nse, void *arg){
 } /* End of capture_handler() */
 
 
+/* This handler is a wrapper for the EchoServer::nep_wakeup_handler() method.
+ * We need this because C++ does not allow to use class methods as callback
+ * functions for things like signal() or the Nsock lib. */
+void wakeup_handler(nsock_pool nsp, nsock_event nse, void *arg){
+  nping_print(DBG_4, "%s()", __func__);
+  es.nep_wakeup_handler(nsp, nse, arg);
+  return;
+} /* End of wakeup_handler() */
+
+
+#ifdef HAVE_PTHREAD
+/* Start routine of the capture thread. */
+void *capture_thread(void *arg){
+  ((EchoServer *)arg)->nep_capture_loop();
+  return NULL;
+} /* End of capture_thread() */
+#endif
+
+
 /* This handler is a wrapper for the EchoServer::nep_echo_handler() method. We
  * need this because C++ does not allow to use class methods as callback
  * functions for things like signal() or the Nsock lib. */
@@ -65,16 +65,44 @@
 #include "nping.h"
 #include "nsock.h"
 #include <vector>
+#include <map>
 #include "NEPContext.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 
 #define LISTEN_QUEUE_SIZE 10
 
+/* Buckets of the match table, which indexes ready clients by the source and
+ * destination ports and the IP ID (or flow label) of their packet specs.
+ * Must be a power of two. */
+#define NEP_MATCH_BUCKETS 1024
+
+/* Maximum number of keys a client or a captured packet is indexed under */
+#define NEP_MATCH_MAX_KEYS 4
+
+/* Bytes of matched packets the capture thread may queue for the control
+ * thread to echo. Packets captured while the queue is full are not echoed. */
+#define NEP_CAPTURE_QUEUE_MAX (4*1024*1024)
+
 class EchoServer  {
 
     private:
         /* Attributes */
-        std::vector<NEPContext> client_ctx;
+        std::map<clientid_t, NEPContext> client_ctx;
         clientid_t client_id_count;
+        std::vector<clientid_t> match_table[NEP_MATCH_BUCKETS];
+        std::vector<clientid_t> match_cands; /**< Clients to score a packet against */
+        bool capture_threaded;  /**< Packets are captured by capture_thread() */
+        pcap_t *pd;             /**< Capture descriptor of the capture thread */
+        int linkoff;            /**< Link header length of captured packets   */
+        int wakeup_fd;          /**< Written to when capture_queue fills up   */
+        std::vector<u8> capture_queue; /**< Matched packets, to be echoed     */
+        std::vector<u8> echo_queue;    /**< Packets being echoed              */
+#ifdef HAVE_PTHREAD
+        pthread_mutex_t ctx_lock;   /**< Guards client_ctx and match_table    */
+        pthread_mutex_t queue_lock; /**< Guards capture_queue                 */
+#endif
 
         /* Methods */
         int nep_listen_socket();
@@ -84,8 +112,16 @@ class EchoServer  {
         int destroyClientContext(clientid_t clnt);
         nsock_iod getClientNsockIOD(clientid_t clnt);
         clientid_t getNewClientID();
+        void lockClients();
+        void unlockClients();
+        int getMatchKeys(NEPContext *ctx, u32 *keys);
+        int indexClientContext(NEPContext *ctx);
+        int unindexClientContext(NEPContext *ctx);
+        void getMatchCandidates(IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp);
         clientid_t nep_match_packet(const u8 *pkt, size_t pktlen);
-        clientid_t nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp, ICMPv4Header *icmp4, RawData *payload);
+        clientid_t nep_match_headers(IPv4Header *ip4, IPv6Header *ip6, TCPHeader *tcp, UDPHeader *udp, ICMPv4Header *icmp4, const u8 *payload, size_t payloadlen);
+        int nep_echo_packet(nsock_pool nsp, clientid_t clnt, const u8 *pkt, size_t pktlen);
+        int nep_capture_thread_start(nsock_pool nsp, const char *pcapdev);
         int parse_hs_client(u8 *pkt, size_t pktlen, NEPContext *ctx);
         int parse_packet_spec(u8 *pkt, size_t pktlen, NEPContext *ctx);
 
@@ -103,6 +139,8 @@ class EchoServer  {
         int cleanup();
 
         int nep_capture_handler(nsock_pool nsp, nsock_event nse, void *param);
+        int nep_capture_loop();
+        int nep_wakeup_handler(nsock_pool nsp, nsock_event nse, void *param);
         int nep_echo_handler(nsock_pool nsp, nsock_event nse, void *param);
         int nep_hs_server_handler(nsock_pool nsp, nsock_event nse, void *param);
         int nep_hs_client_handler(nsock_pool nsp, nsock_event nse, void *param);
@@ -120,6 +158,10 @@ typedef struct handler_arg{
 
 /* Handler wrappers */
 void capture_handler(nsock_pool nsp, nsock_event nse, void *arg);
+void wakeup_handler(nsock_pool nsp, nsock_event nse, void *arg);
+#ifdef HAVE_PTHREAD
+void *capture_thread(void *arg);
+#endif
 void echo_handler(nsock_pool nsp, nsock_event nse, void *arg);
 void hs_server_handler(nsock_pool nsp, nsock_event nse, void *arg);
 void hs_client_handler(nsock_pool nsp, nsock_event nse, void *arg);
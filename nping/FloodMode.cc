@@ -0,0 +1,912 @@
+
+/***************************************************************************
+ * FloodMode.cc -- High-rate probe mode. The probes are rendered once into *
+ * a ring, stamped incrementally as they go out, and transmitted in        *
+ * batches through sendmmsg() or a PACKET_MMAP TX ring.                    *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "nping.h"
+#include "FloodMode.h"
+#include "ProbeMode.h"
+#include "NpingOps.h"
+#include "output.h"
+#include "../libnetutil/PacketParser.h"
+
+#ifdef LINUX
+#include <poll.h>
+#include <sys/mman.h>
+#include <net/if.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#endif
+
+#if defined(LINUX) && defined(PACKET_TX_RING) && defined(TPACKET2_HDRLEN)
+#define HAVE_TX_RING 1
+#endif
+
+/* sendmmsg() hands the probes to the kernel as they are, but some BSDs want
+ * ip_len and ip_off in host byte order on raw sockets, which only
+ * send_ip_packet_sd() takes care of. So only Linux sends batches. */
+#ifdef HAVE_SENDMMSG
+#ifdef LINUX
+#define HAVE_BATCH_SEND 1
+#endif
+#endif
+
+extern NpingOps o;
+
+
+/* Adjusts the Internet checksum sum for a 16-bit word of the checksummed data
+ * changing from oldval to newval, per RFC 1624 equation 3. All values are as
+ * they are in the packet, in network byte order. */
+static inline u16 cksum_adjust(u16 sum, u16 oldval, u16 newval){
+  u32 s = (u16) ~sum + (u16) ~oldval + (u32) newval;
+  s = (s & 0xffff) + (s >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  return (u16) ~s;
+} /* End of cksum_adjust() */
+
+
+/* Returns the IPv4 ID that probe seq is stamped with. It is never 0, which
+ * some stacks and middleboxes take as unset and replace; that leaves 65535
+ * IDs, used in turn. */
+static inline u16 ip_id_stamp(u32 seq){
+  return (u16)(seq % 0xFFFF + 1);
+} /* End of ip_id_stamp() */
+
+
+/* Writes the 16-bit word val (network byte order) at offset off of pkt and
+ * adjusts the checksums at offsets sum1 and sum2, where they are not -1. */
+static void patch16(u8 *pkt, int off, u16 val, int sum1, int sum2){
+  u16 old, sum;
+  memcpy(&old, pkt+off, 2);
+  if(old==val)
+    return;
+  memcpy(pkt+off, &val, 2);
+  if(sum1>=0){
+    memcpy(&sum, pkt+sum1, 2);
+    sum=cksum_adjust(sum, old, val);
+    memcpy(pkt+sum1, &sum, 2);
+  }
+  if(sum2>=0){
+    memcpy(&sum, pkt+sum2, 2);
+    sum=cksum_adjust(sum, old, val);
+    memcpy(pkt+sum2, &sum, 2);
+  }
+} /* End of patch16() */
+
+
+static void patch32(u8 *pkt, int off, u32 val, int sum){
+  u16 w[2];
+  val=htonl(val);
+  memcpy(w, &val, 4);
+  patch16(pkt, off, w[0], sum, -1);
+  patch16(pkt, off+2, w[1], sum, -1);
+} /* End of patch32() */
+
+
+static inline u16 get16(const u8 *p){
+  u16 v;
+  memcpy(&v, p, 2);
+  return ntohs(v);
+} /* End of get16() */
+
+
+static inline u32 get32(const u8 *p){
+  u32 v;
+  memcpy(&v, p, 4);
+  return ntohl(v);
+} /* End of get32() */
+
+
+/* Microseconds since the epoch */
+static u64 now_usec(){
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (u64)tv.tv_sec*1000000 + tv.tv_usec;
+} /* End of now_usec() */
+
+
+/* TTL or hop limit for a given round, as ProbeMode::start() sets it */
+static u8 round_ttl(u64 round){
+  if(o.issetTTL())
+    return (round%(256-o.getTTL()))+o.getTTL();
+  return (round%255)+1;
+} /* End of round_ttl() */
+
+
+FloodMode::FloodMode() {
+  this->sent=NULL;
+  this->pd=NULL;
+  this->rawfd=-1;
+  this->txfd=-1;
+  this->txring=NULL;
+  this->reset();
+} /* End of FloodMode constructor */
+
+
+FloodMode::~FloodMode() {
+  this->reset();
+} /* End of FloodMode destructor */
+
+
+/** Frees everything and sets every attribute to its default value */
+void FloodMode::reset() {
+  this->closeTxRing();
+  if(this->pd!=NULL)
+    pcap_close(this->pd);
+  if(this->rawfd>=0)
+    close(this->rawfd);
+  free(this->sent);
+  this->buf.clear();
+  this->pkts.clear();
+  this->round_len=0;
+  this->sent=NULL;
+  this->stamp=STAMP_NONE;
+  this->stamp_base=0;
+  this->stamp_adv=0;
+  this->batch=DEFAULT_FLOOD_BATCH;
+  this->rawfd=-1;
+  this->pd=NULL;
+  this->linkoff=0;
+  this->link_eth=false;
+  this->errors=0;
+  this->tx_frame_size=0;
+  this->tx_frame_nr=0;
+  this->tx_cur=0;
+  memset(&this->tx_sll, 0, sizeof(this->tx_sll));
+} /* End of reset() */
+
+
+/** Builds one round of probes (every target port of every target, in the
+  * order ProbeMode::start() sends them) with fillPacket(), and notes where
+  * the fields that change from probe to probe are.
+  * @return OP_SUCCESS on success and fatal()s in case of failure. */
+int FloodMode::render(){
+  u8 pkt[MAX_IP_PACKET_LEN];
+  int pktLen=0;
+  int numTargetPorts=0;
+  u16 *targetPorts=o.getTargetPorts(&numTargetPorts);
+  NpingTarget *target=NULL;
+  packet_view_t view;
+  flood_pkt_t fp;
+  bool ports=(o.getMode()==TCP || o.getMode()==UDP);
+  bool has_ip;
+
+  if(!ports)
+    numTargetPorts=1;
+  else if(targetPorts==NULL)
+    nping_fatal(QT_3, "FloodMode::render(): NpingOps does not contain correct target ports\n");
+
+  /* Raw IPv6 sockets take the transport header only. ICMPv6 probes come with
+   * their IPv6 header either way; see fillPacketICMP(). */
+  has_ip = o.getMode()!=ARP && !(o.ipv6UsingSocket() && ports);
+
+  o.setCurrentRound(round_ttl(0));
+  for(int p=0; p < numTargetPorts; p++){
+    o.targets.rewind();
+    while( (target=o.targets.getNextTarget()) != NULL ){
+      if( ProbeMode::fillPacket(target, ports ? targetPorts[p] : 0, pkt, MAX_IP_PACKET_LEN, &pktLen, this->rawfd) != OP_SUCCESS || pktLen<=0 )
+        nping_fatal(QT_3, "FloodMode::render(): Error in packet creation");
+
+      memset(&fp, 0, sizeof(fp));
+      fp.target=target;
+      fp.off=this->buf.size();
+      fp.len=pktLen;
+      fp.ipoff=fp.l4off=fp.sumoff=-1;
+
+      if(has_ip){
+        PacketParser::parse_view(pkt, pktLen, o.sendEth(), &view);
+        for(int i=0; i<view.count; i++){
+          u32 type=view.hdr[i].type;
+          if(fp.ipoff<0 && (type==HEADER_TYPE_IPv4 || type==HEADER_TYPE_IPv6)){
+            fp.ipoff=view.offset[i];
+          }else if(fp.ipoff>=0 && (type==HEADER_TYPE_TCP || type==HEADER_TYPE_UDP ||
+                   type==HEADER_TYPE_ICMPv4 || type==HEADER_TYPE_ICMPv6)){
+            fp.l4off=view.offset[i];
+            break;
+          }
+        }
+      }else if(o.getMode()!=ARP){
+        fp.l4off=0;
+      }
+      if(fp.l4off>=0){
+        switch(o.getMode()){
+          case TCP: fp.sumoff=fp.l4off+16; break;
+          case UDP: fp.sumoff=fp.l4off+6; break;
+          case ICMP: fp.sumoff=fp.l4off+2; break;
+        }
+      }
+
+      /* Destination for raw socket sends, as send_packet() builds it */
+      if(!o.sendEth() && o.getMode()!=ARP){
+        if(o.ipv6()){
+          struct sockaddr_in6 *s6=(struct sockaddr_in6 *)&fp.dst;
+          s6->sin6_family=AF_INET6;
+          s6->sin6_addr=target->getIPv6Address();
+          s6->sin6_port=0;
+          fp.dstlen=sizeof(struct sockaddr_in6);
+        }else{
+          fp.dstlen=sizeof(fp.dst);
+          target->getTargetSockAddr(&fp.dst, &fp.dstlen);
+        }
+      }
+
+      this->buf.insert(this->buf.end(), pkt, pkt+pktLen);
+      this->pkts.push_back(fp);
+    }
+  }
+  this->round_len=this->pkts.size();
+  if(this->round_len==0)
+    nping_fatal(QT_3, "FloodMode::render(): No probes to send.");
+
+  /* Decide how probes are told apart. Fields the user set explicitly are
+   * left alone. */
+  const flood_pkt_t *first=&this->pkts[0];
+  const u8 *hdr=&this->buf[first->off];
+  this->stamp=STAMP_NONE;
+  if(first->l4off>=0){
+    switch(o.getMode()){
+      case TCP:
+        if(hdr[first->l4off+13] & TH_ACK){
+          if(!o.issetTCPAck()){
+            this->stamp=STAMP_TCP_ACK;
+            this->stamp_base=get32(hdr+first->l4off+8);
+          }
+        }else if(!o.issetTCPSequence()){
+          this->stamp=STAMP_TCP_SEQ;
+          this->stamp_base=get32(hdr+first->l4off+4);
+          /* A reply acknowledges the payload and any SYN or FIN */
+          this->stamp_adv=first->len-first->l4off-(hdr[first->l4off+12]>>4)*4;
+          if(hdr[first->l4off+13] & TH_SYN)
+            this->stamp_adv++;
+          if(hdr[first->l4off+13] & TH_FIN)
+            this->stamp_adv++;
+        }
+      break;
+      case ICMP:
+        if(o.issetICMPSequence())
+          break;
+        if(o.ipv4() && (o.getICMPType()==ICMP_ECHO || o.getICMPType()==ICMP_TSTAMP))
+          this->stamp=STAMP_ICMP_SEQ;
+        else if(o.ipv6() && o.getICMPType()==ICMPv6_ECHO)
+          this->stamp=STAMP_ICMP_SEQ;
+      break;
+      case UDP:
+        if(o.ipv4() && first->ipoff>=0 && !o.issetIdentification())
+          this->stamp=STAMP_IP_ID;
+      break;
+    }
+  }
+  return OP_SUCCESS;
+} /* End of render() */
+
+
+/** Updates the probe p in place for its sequence number seq: the TTL for the
+  * traceroute round, and the stamp. Checksums are adjusted incrementally. */
+void FloodMode::patch(flood_pkt_t *p, u64 seq){
+  u8 *pkt=&this->buf[p->off];
+  int ipsum = (p->ipoff>=0 && o.ipv4()) ? p->ipoff+10 : -1;
+
+  if(o.issetTraceroute() && p->ipoff>=0){
+    u8 ttl=round_ttl(seq/this->round_len);
+    if(o.ipv4())
+      patch16(pkt, p->ipoff+8, htons((ttl<<8) | pkt[p->ipoff+9]), ipsum, -1);
+    else
+      pkt[p->ipoff+7]=ttl;
+  }
+
+  switch(this->stamp){
+    case STAMP_TCP_SEQ:
+      patch32(pkt, p->l4off+4, this->stamp_base+(u32)seq, p->sumoff);
+    break;
+    case STAMP_TCP_ACK:
+      patch32(pkt, p->l4off+8, this->stamp_base+(u32)seq, p->sumoff);
+    break;
+    case STAMP_ICMP_SEQ:
+      patch16(pkt, p->l4off+6, htons((u16)seq), p->sumoff, -1);
+    break;
+    case STAMP_IP_ID:
+      patch16(pkt, p->ipoff+4, htons(ip_id_stamp((u32)seq)), ipsum, -1);
+    break;
+  }
+} /* End of patch() */
+
+
+/** Remembers when probe seq, at ring index pkt, went out */
+void FloodMode::recordSent(u32 seq, u32 pkt, u64 usec){
+  u32 key = (this->stamp==STAMP_IP_ID) ? ip_id_stamp(seq) : seq;
+  flood_sent_t *s=&this->sent[key & (FLOOD_SENT_WINDOW-1)];
+  s->seq=seq;
+  s->pkt=pkt;
+  s->usec=usec;
+} /* End of recordSent() */
+
+
+/** Stamps and sends count probes, starting at ring index first, the first of
+  * which gets sequence number seq. Probes the kernel refuses are counted in
+  * this->errors and left out of the statistics.
+  * @return the number of probes sent. */
+int FloodMode::sendBatch(u32 first, int count, u64 seq){
+  u32 ring=this->pkts.size();
+  u32 idx=first;
+  int sent_ok=0;
+  u64 usec;
+
+  for(int i=0; i<count; i++){
+    this->patch(&this->pkts[idx], seq+i);
+    if(++idx==ring)
+      idx=0;
+  }
+
+  usec=now_usec();
+  if(this->txfd>=0)
+    sent_ok=this->sendBatchRing(first, count);
+  else
+    sent_ok=this->sendBatchSocket(first, count);
+
+  /* Failed sends are rare and come last in the batch, so the first sent_ok
+   * probes are the ones that went out. */
+  idx=first;
+  for(int i=0; i<sent_ok; i++){
+    flood_pkt_t *p=&this->pkts[idx];
+    p->target->sent_total++;
+    o.stats.addSentPacket(p->len);
+    if(this->stamp!=STAMP_NONE)
+      this->recordSent((u32)(seq+i), idx, usec);
+    if(++idx==ring)
+      idx=0;
+  }
+  this->errors+=count-sent_ok;
+  return sent_ok;
+} /* End of sendBatch() */
+
+
+/** Sends count probes through the raw socket (or the dnet Ethernet handle),
+  * with one sendmmsg() call per batch on Linux.
+  * @return the number of probes sent. */
+int FloodMode::sendBatchSocket(u32 first, int count){
+  u32 ring=this->pkts.size();
+  int done=0;
+
+#ifdef HAVE_BATCH_SEND
+  if(this->rawfd>=0 && !o.issetMTU()){
+    struct mmsghdr msgs[MAX_FLOOD_BATCH];
+    struct iovec iov[MAX_FLOOD_BATCH];
+    u32 idx=first;
+    int tries=0;
+
+    for(int i=0; i<count; i++){
+      flood_pkt_t *p=&this->pkts[idx];
+      iov[i].iov_base=&this->buf[p->off];
+      iov[i].iov_len=p->len;
+      memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_name=&p->dst;
+      msgs[i].msg_hdr.msg_namelen=p->dstlen;
+      msgs[i].msg_hdr.msg_iov=&iov[i];
+      msgs[i].msg_hdr.msg_iovlen=1;
+      if(++idx==ring)
+        idx=0;
+    }
+    while(done<count){
+      int res=sendmmsg(this->rawfd, msgs+done, count-done, 0);
+      if(res>0){
+        done+=res;
+        tries=0;
+        continue;
+      }
+      /* The queue is full: let it drain, then try again. Give up on a batch
+       * that makes no progress, rather than stall forever. */
+      if(res<0 && (errno==ENOBUFS || errno==EAGAIN || errno==EINTR) && ++tries<100){
+        usleep(100);
+        continue;
+      }
+      if(this->errors==0)
+        nping_warning(QT_2, "sendmmsg() failed: %s", strerror(errno));
+      break;
+    }
+    return done;
+  }
+#endif
+
+  /* One at a time, through send_packet() */
+  u32 idx=first;
+  for(int i=0; i<count; i++){
+    flood_pkt_t *p=&this->pkts[idx];
+    if(send_packet(p->target, this->rawfd, &this->buf[p->off], p->len)!=OP_SUCCESS)
+      break;
+    done++;
+    if(++idx==ring)
+      idx=0;
+  }
+  return done;
+} /* End of sendBatchSocket() */
+
+
+/** Copies count probes into free frames of the PACKET_MMAP TX ring and asks
+  * the kernel to send them, without waiting for it to finish.
+  * @return the number of probes queued. */
+int FloodMode::sendBatchRing(u32 first, int count){
+#ifdef HAVE_TX_RING
+  u32 ring=this->pkts.size();
+  u32 idx=first;
+  int done=0;
+
+  for(int i=0; i<count; i++){
+    flood_pkt_t *p=&this->pkts[idx];
+    struct tpacket2_hdr *hdr=(struct tpacket2_hdr *)(this->txring + (size_t)this->tx_cur*this->tx_frame_size);
+
+    /* Wait for the frame to be free, kicking the kernel if it is still
+     * queued. */
+    while(hdr->tp_status!=TP_STATUS_AVAILABLE){
+      if(hdr->tp_status & TP_STATUS_WRONG_FORMAT){
+        this->errors++;
+        hdr->tp_status=TP_STATUS_AVAILABLE;
+        break;
+      }
+      struct pollfd pfd;
+      pfd.fd=this->txfd;
+      pfd.events=POLLOUT;
+      pfd.revents=0;
+      sendto(this->txfd, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)&this->tx_sll, sizeof(struct sockaddr_ll));
+      poll(&pfd, 1, 10);
+    }
+    memcpy((u8 *)hdr + TPACKET2_HDRLEN - sizeof(struct sockaddr_ll), &this->buf[p->off], p->len);
+    hdr->tp_len=p->len;
+    __sync_synchronize();
+    hdr->tp_status=TP_STATUS_SEND_REQUEST;
+    if(++this->tx_cur==this->tx_frame_nr)
+      this->tx_cur=0;
+    done++;
+    if(++idx==ring)
+      idx=0;
+  }
+  if(sendto(this->txfd, NULL, 0, MSG_DONTWAIT, (struct sockaddr *)&this->tx_sll, sizeof(struct sockaddr_ll)) < 0 &&
+     errno!=EAGAIN && errno!=ENOBUFS && this->errors==0)
+    nping_warning(QT_2, "Failed to flush the TX ring: %s", strerror(errno));
+  return done;
+#else
+  return 0;
+#endif
+} /* End of sendBatchRing() */
+
+
+/** Sets up a PACKET_MMAP TX ring on the output device, for sending at the
+  * Ethernet level.
+  * @return OP_SUCCESS on success, OP_FAILURE if the ring is not available, in
+  * which case frames are sent one at a time through dnet. */
+int FloodMode::openTxRing(){
+#ifdef HAVE_TX_RING
+  struct tpacket_req req;
+  struct sockaddr_ll *sll=(struct sockaddr_ll *)&this->tx_sll;
+  int version=TPACKET_V2;
+  u32 maxlen=0;
+  u32 block_size;
+  void *ring;
+
+  for(size_t i=0; i<this->pkts.size(); i++)
+    maxlen=MAX(maxlen, this->pkts[i].len);
+
+  memset(sll, 0, sizeof(*sll));
+  sll->sll_family=AF_PACKET;
+  sll->sll_ifindex=if_nametoindex(o.getDevice());
+  /* Every probe carries the same EtherType */
+  sll->sll_protocol=htons(get16(&this->buf[12]));
+  if(sll->sll_ifindex==0)
+    return OP_FAILURE;
+
+  /* Protocol 0: this socket sends only, and sees none of the traffic */
+  if((this->txfd=socket(PF_PACKET, SOCK_RAW, 0)) < 0)
+    return OP_FAILURE;
+  if(setsockopt(this->txfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version))!=0)
+    goto fail;
+
+  /* Frames are a power of two in size, so they tile the blocks exactly */
+  this->tx_frame_size=TPACKET_ALIGNMENT;
+  while(this->tx_frame_size < TPACKET_ALIGN(TPACKET2_HDRLEN + maxlen))
+    this->tx_frame_size<<=1;
+  block_size=MAX(this->tx_frame_size, 65536);
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size=block_size;
+  req.tp_block_nr=MAX(1, (4*1024*1024)/block_size);
+  req.tp_frame_size=this->tx_frame_size;
+  req.tp_frame_nr=req.tp_block_nr*(block_size/this->tx_frame_size);
+  if(setsockopt(this->txfd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req))!=0)
+    goto fail;
+
+  this->txring_len=(size_t)req.tp_block_size*req.tp_block_nr;
+  ring=mmap(NULL, this->txring_len, PROT_READ|PROT_WRITE, MAP_SHARED, this->txfd, 0);
+  if(ring==MAP_FAILED)
+    goto fail;
+  this->txring=(u8 *)ring;
+  this->tx_frame_nr=req.tp_frame_nr;
+  this->tx_cur=0;
+  nping_print(DBG_1, "PACKET_MMAP TX ring on %s: %u frames of %u bytes", o.getDevice(), this->tx_frame_nr, this->tx_frame_size);
+  return OP_SUCCESS;
+
+fail:
+  nping_print(DBG_1, "PACKET_MMAP TX ring not available: %s", strerror(errno));
+  close(this->txfd);
+  this->txfd=-1;
+#endif
+  return OP_FAILURE;
+} /* End of openTxRing() */
+
+
+/** Waits for the TX ring to drain, then unmaps and closes it */
+void FloodMode::closeTxRing(){
+#ifdef HAVE_TX_RING
+  if(this->txfd<0)
+    return;
+  /* Without MSG_DONTWAIT, this returns once every queued frame is out */
+  sendto(this->txfd, NULL, 0, 0, (struct sockaddr *)&this->tx_sll, sizeof(struct sockaddr_ll));
+  munmap(this->txring, this->txring_len);
+  close(this->txfd);
+#endif
+  this->txfd=-1;
+  this->txring=NULL;
+} /* End of closeTxRing() */
+
+
+/** Opens a non-blocking pcap descriptor with the usual BPF filter. Replies are
+  * read straight from it between batches, rather than one nsock event each.
+  * @return OP_SUCCESS on success and fatal()s in case of failure. */
+int FloodMode::openCapture(){
+  char pcapdev[128];
+  char errbuf[PCAP_ERRBUF_SIZE];
+  char *filterstring=NULL;
+
+  #ifdef WIN32
+    if (!DnetName2PcapName(o.getDevice(), pcapdev, sizeof(pcapdev)))
+      Strncpy(pcapdev, o.getDevice(), sizeof(pcapdev));
+  #else
+    Strncpy(pcapdev, o.getDevice(), sizeof(pcapdev));
+  #endif
+
+  /* The filter is built from the first target */
+  o.targets.rewind();
+  filterstring=ProbeMode::getBPFFilterString();
+
+  /* Enough to hold the IP and transport headers quoted in ICMP errors */
+  this->pd=my_pcap_open_live(pcapdev, 256, o.spoofSource() ? 1 : 0, 1);
+  if(this->pd==NULL)
+    nping_fatal(QT_3, "Error opening capture device %s\n", o.getDevice());
+  set_pcap_filter(pcapdev, this->pd, "%s", filterstring);
+  if(pcap_setnonblock(this->pd, 1, errbuf)!=0)
+    nping_fatal(QT_3, "Failed to put capture device %s in non-blocking mode: %s", o.getDevice(), errbuf);
+
+  switch(pcap_datalink(this->pd)){
+    case DLT_EN10MB: this->linkoff=0; this->link_eth=true; break;
+    case DLT_NULL: this->linkoff=4; break;
+#ifdef DLT_LOOP
+    case DLT_LOOP: this->linkoff=4; break;
+#endif
+#ifdef DLT_LINUX_SLL
+    case DLT_LINUX_SLL: this->linkoff=16; break;
+#endif
+#ifdef DLT_LINUX_SLL2
+    case DLT_LINUX_SLL2: this->linkoff=20; break;
+#endif
+    case DLT_RAW: this->linkoff=0; break;
+    default:
+      nping_fatal(QT_3, "Unsupported datalink type %d on %s", pcap_datalink(this->pd), o.getDevice());
+    break;
+  }
+  return OP_SUCCESS;
+} /* End of openCapture() */
+
+
+/** Processes captured replies. With to_ms==0, only those already buffered;
+  * otherwise keeps reading for to_ms milliseconds. */
+void FloodMode::readReplies(int to_ms){
+  u64 deadline=now_usec()+(u64)to_ms*1000;
+  u64 now;
+
+  for(;;){
+    pcap_dispatch(this->pd, -1, FloodMode::pcap_callback, (u8 *)this);
+    if(to_ms==0 || (now=now_usec()) >= deadline)
+      break;
+    if(pcap_select(this->pd, (long)MIN(deadline-now, 100000)) < 0)
+      usleep(1000);
+  }
+} /* End of readReplies() */
+
+
+void FloodMode::pcap_callback(u8 *user, const struct pcap_pkthdr *h, const u8 *packet){
+  ((FloodMode *)user)->processReply(h, packet);
+} /* End of pcap_callback() */
+
+
+/** Counts a captured reply and, when it carries a probe's stamp back, times
+  * it against that probe's send time. */
+void FloodMode::processReply(const struct pcap_pkthdr *h, const u8 *packet){
+  packet_view_t view;
+  const u8 *pkt;
+  size_t len;
+  int l4=-1;
+  u32 value=0;
+  bool full=false;  /* value holds all 32 bits of the sequence number */
+  bool found=false;
+
+  if(h->caplen <= (u32)this->linkoff)
+    return;
+  pkt=packet+this->linkoff;
+  len=h->caplen-this->linkoff;
+  o.stats.addRecvPacket(h->len-this->linkoff);
+  if(this->stamp==STAMP_NONE)
+    return;
+
+  PacketParser::parse_view(pkt, len, this->link_eth, &view);
+  for(int i=0; i<view.count && l4<0; i++){
+    u32 type=view.hdr[i].type;
+    if(type==HEADER_TYPE_TCP || type==HEADER_TYPE_UDP || type==HEADER_TYPE_ICMPv4 || type==HEADER_TYPE_ICMPv6)
+      l4=i;
+  }
+  if(l4<0)
+    return;
+
+  const u8 *t=pkt+view.offset[l4];
+  size_t tlen=len-view.offset[l4];
+  u32 type=view.hdr[l4].type;
+
+  if(type==HEADER_TYPE_TCP && (this->stamp==STAMP_TCP_SEQ || this->stamp==STAMP_TCP_ACK)){
+    /* A SYN-ACK or RST acknowledges our sequence number; the RST sent in
+     * reply to an ACK takes our ack number as its own sequence number. */
+    if(this->stamp==STAMP_TCP_SEQ){
+      if(!(t[13] & TH_ACK))
+        return;
+      value=get32(t+8)-this->stamp_adv-this->stamp_base;
+    }else{
+      value=get32(t+4)-this->stamp_base;
+    }
+    full=found=true;
+  }else if(type==HEADER_TYPE_ICMPv4 || type==HEADER_TYPE_ICMPv6){
+    u8 icmptype=t[0];
+    bool error = (type==HEADER_TYPE_ICMPv4) ?
+      (icmptype==ICMP_UNREACH || icmptype==ICMP_TIMXCEED || icmptype==ICMP_PARAMPROB || icmptype==ICMP_SOURCEQUENCH) :
+      (icmptype<128);
+
+    if(!error){
+      /* Echo and timestamp replies return the sequence number */
+      bool reply = (type==HEADER_TYPE_ICMPv4) ?
+        (icmptype==ICMP_ECHOREPLY || icmptype==ICMP_TSTAMPREPLY) :
+        (icmptype==ICMPv6_ECHOREPLY);
+      if(this->stamp==STAMP_ICMP_SEQ && reply && tlen>=8){
+        value=get16(t+6);
+        found=true;
+      }
+    }else{
+      /* Errors quote the start of the probe */
+      int q=-1;
+      for(int i=l4+1; i<view.count && q<0; i++){
+        if(view.hdr[i].type==HEADER_TYPE_IPv4 || view.hdr[i].type==HEADER_TYPE_IPv6)
+          q=i;
+      }
+      if(q<0)
+        return;
+      const u8 *ip=pkt+view.offset[q];
+      size_t iplen=len-view.offset[q];
+      size_t qoff;
+      if(view.hdr[q].type==HEADER_TYPE_IPv4){
+        qoff=(ip[0] & 0x0F)*4;
+      }else{
+        int ql4=-1;
+        for(int i=q+1; i<view.count && ql4<0; i++){
+          if(view.hdr[i].type==HEADER_TYPE_TCP || view.hdr[i].type==HEADER_TYPE_ICMPv6)
+            ql4=i;
+        }
+        qoff=(ql4>=0) ? view.offset[ql4]-view.offset[q] : 40;
+      }
+      switch(this->stamp){
+        case STAMP_TCP_SEQ:
+          if(iplen>=qoff+8){
+            value=get32(ip+qoff+4)-this->stamp_base;
+            full=found=true;
+          }
+        break;
+        case STAMP_TCP_ACK:
+          if(iplen>=qoff+12){
+            value=get32(ip+qoff+8)-this->stamp_base;
+            full=found=true;
+          }
+        break;
+        case STAMP_ICMP_SEQ:
+          if(iplen>=qoff+8){
+            value=get16(ip+qoff+6);
+            found=true;
+          }
+        break;
+        case STAMP_IP_ID:
+          if(view.hdr[q].type==HEADER_TYPE_IPv4 && iplen>=6){
+            value=get16(ip+4);
+            found=true;
+          }
+        break;
+      }
+    }
+  }
+  if(!found)
+    return;
+
+  /* 16-bit stamps are only checked against the low bits of the sequence
+   * number, or the ID it was stamped with; the window is no larger than what
+   * they can tell apart. */
+  flood_sent_t *s=&this->sent[value & (FLOOD_SENT_WINDOW-1)];
+  bool match;
+  if(this->stamp==STAMP_IP_ID)
+    match = ip_id_stamp(s->seq)==value;
+  else if(full)
+    match = s->seq==value;
+  else
+    match = (s->seq & 0xFFFF)==(value & 0xFFFF);
+  if(s->usec==0 || !match)
+    return;
+  u64 rcvd=(u64)h->ts.tv_sec*1000000 + h->ts.tv_usec;
+  if(rcvd >= s->usec){
+    NpingTarget *trg=this->pkts[s->pkt].target;
+    u32 rtt=(u32)MIN(rcvd-s->usec, 0xFFFFFFFF);
+    trg->recv_total++;
+    trg->updateRTTs(rtt);
+  }
+  /* Time each probe once, even if it draws several replies */
+  s->usec=0;
+} /* End of processReply() */
+
+
+/** Sends o.getPacketCount() rounds of probes as fast as possible, or at
+  * o.getRate() probes per second if a rate was given, reading replies between
+  * batches.
+  * @return OP_SUCCESS on success and fatal()s in case of failure. */
+int FloodMode::start(){
+  u64 total=0;        /**< Probes to send                              */
+  u64 seq=0;          /**< Sequence number of the next probe           */
+  u32 idx=0;          /**< Ring index of the next probe                */
+  u64 round=(u64)-1;  /**< Current round, for IPv6 raw socket hop limit*/
+  u64 start_usec=0;
+  double rate = o.issetRate() ? o.getRate() : 0;
+
+  this->reset();
+  this->batch = o.issetBatch() ? o.getBatch() : DEFAULT_FLOOD_BATCH;
+
+  if( o.getMode()!=ARP && o.sendEth()==false ){
+    if ((this->rawfd = obtainRawSocket()) < 0 )
+      nping_fatal(QT_3,"Couldn't acquire raw socket. Are you root?");
+    if ( o.issetDevice() )  {
+      if (!socket_bindtodevice(this->rawfd, o.getDevice()) && errno != EPERM)
+        nping_warning(QT_2, "Error binding socket to device %s", o.getDevice() );
+    }
+  }
+
+  this->render();
+  if(o.sendEth())
+    this->openTxRing();
+  /* Send calls read the probes in place, so the ring must hold a whole batch
+   * for none of them to be stamped twice before it is sent. The TX ring
+   * takes copies instead. */
+  while(this->txfd<0 && this->pkts.size() < (size_t)this->batch){
+    for(u32 i=0; i<this->round_len; i++){
+      flood_pkt_t fp=this->pkts[i];
+      size_t off=this->buf.size();
+      this->buf.resize(off+fp.len);
+      memcpy(&this->buf[off], &this->buf[fp.off], fp.len);
+      fp.off=off;
+      this->pkts.push_back(fp);
+    }
+  }
+  if(this->stamp!=STAMP_NONE)
+    this->sent=(flood_sent_t *)safe_zalloc(FLOOD_SENT_WINDOW*sizeof(flood_sent_t));
+  if(!o.disablePacketCapture())
+    this->openCapture();
+
+  total=(u64)o.getPacketCount()*this->round_len;
+  nping_print(VB_0, "Flooding %u %s per round in batches of %d%s%s.", this->round_len,
+              (this->round_len==1) ? "probe" : "probes", this->batch,
+              (this->txfd>=0) ? " through a PACKET_MMAP TX ring" : "",
+              (this->stamp==STAMP_NONE && this->pd!=NULL) ? " (replies will not be timed)" : "");
+
+  o.stats.startClocks();
+  start_usec=now_usec();
+  while(seq < total){
+    int count=(int)MIN((u64)this->batch, total-seq);
+
+    /* Pace to the requested rate. Falling behind is made up for in full
+     * batches; running ahead means waiting until the next probe is due. */
+    if(rate>0){
+      double elapsed=(double)(now_usec()-start_usec);
+      double due=(double)seq*1000000.0/rate;
+      if(elapsed < due){
+        usleep((unsigned long)MAX(due-elapsed, 1));
+        continue;
+      }
+      u64 allowed=(u64)(elapsed*rate/1000000.0)+1;
+      if(allowed > seq)
+        count=(int)MIN((u64)count, allowed-seq);
+      else
+        count=1;
+    }
+
+    /* Raw IPv6 sockets set the hop limit per socket, so a batch may not
+     * span two traceroute rounds. */
+    if(o.issetTraceroute() && o.ipv6UsingSocket()){
+      u64 r=seq/this->round_len;
+      if(r!=round){
+        round=r;
+        o.setCurrentRound(round_ttl(r));
+        ProbeMode::doIPv6ThroughSocket(this->rawfd);
+      }
+      count=(int)MIN((u64)count, (r+1)*this->round_len-seq);
+    }
+
+    this->sendBatch(idx, count, seq);
+    seq+=count;
+    idx=(u32)((idx+count) % this->pkts.size());
+
+    if(this->pd!=NULL)
+      this->readReplies(0);
+  }
+  this->closeTxRing();
+  o.stats.stopTxClock();
+
+  if(this->pd!=NULL){
+    this->readReplies(DEFAULT_WAIT_AFTER_PROBES);
+    o.stats.stopRxClock();
+  }
+  if(this->errors>0)
+    nping_warning(QT_2, "%llu probes could not be sent.", (unsigned long long)this->errors);
+  return OP_SUCCESS;
+} /* End of start() */
@@ -0,0 +1,149 @@
+/***************************************************************************
+ * FloodMode.h -- High-rate probe mode. The probes are rendered once into  *
+ * a ring, stamped incrementally as they go out, and transmitted in        *
+ * batches through sendmmsg() or a PACKET_MMAP TX ring.                    *
+ *                                                                         *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+#ifndef __FLOODMODE_H__
+#define __FLOODMODE_H__ 1
+
+#include "nping.h"
+#include "NpingTarget.h"
+#include <vector>
+
+/* Number of send times kept for matching replies. Replies to probes that are
+ * more than this many probes old when they arrive are counted but not
+ * timed. */
+#define FLOOD_SENT_WINDOW 65536
+
+/* How each probe is stamped with its sequence number, so that a reply can be
+ * traced back to the probe that caused it. */
+#define STAMP_NONE      0  /* Nothing varies: ARP, UDP over IPv6, etc.   */
+#define STAMP_TCP_SEQ   1  /* TCP sequence number, echoed in the ACK     */
+#define STAMP_TCP_ACK   2  /* TCP ack number, echoed as the RST's seq    */
+#define STAMP_ICMP_SEQ  3  /* ICMP echo/timestamp sequence number        */
+#define STAMP_IP_ID     4  /* IPv4 ID, quoted back in ICMP errors        */
+
+/* One pre-rendered probe of the ring. */
+typedef struct flood_pkt{
+    NpingTarget *target;
+    u32 off;                     /* Start of the packet in the ring buffer */
+    u32 len;                     /* Packet length                          */
+    int ipoff;                   /* Offset of the IP header, -1 if none    */
+    int l4off;                   /* Offset of the transport header, or -1  */
+    int sumoff;                  /* Offset of the transport checksum, or -1*/
+    struct sockaddr_storage dst; /* Destination, for raw socket sends      */
+    size_t dstlen;
+}flood_pkt_t;
+
+/* Send time of a stamped probe, kept until its reply comes back. */
+typedef struct flood_sent{
+    u32 seq;                     /* Probe sequence number                  */
+    u32 pkt;                     /* Index of the probe in the ring         */
+    u64 usec;                    /* Send time, 0 once a reply was timed    */
+}flood_sent_t;
+
+
+class FloodMode {
+
+    private:
+
+        std::vector<u8> buf;            /**< Rendered packets, back to back  */
+        std::vector<flood_pkt_t> pkts;  /**< The ring of probes              */
+        u32 round_len;         /**< Probes per round (targets x ports)       */
+        flood_sent_t *sent;    /**< Send times, indexed by seq               */
+        int stamp;             /**< One of the STAMP_* methods               */
+        u32 stamp_base;        /**< TCP seq/ack the templates were built with*/
+        u32 stamp_adv;         /**< Sequence space each TCP probe takes up   */
+        int batch;             /**< Probes per send call                     */
+        int rawfd;             /**< Raw IP socket, -1 if sending at eth level*/
+        pcap_t *pd;            /**< Capture descriptor, NULL if disabled     */
+        int linkoff;           /**< Link header length of captured packets   */
+        bool link_eth;         /**< Captured packets carry an Ethernet header*/
+        u64 errors;            /**< Probes the kernel refused                */
+        int txfd;              /**< PACKET_MMAP socket, -1 if not in use     */
+        u8 *txring;            /**< Mapped TX ring                           */
+        size_t txring_len;
+        u32 tx_frame_size;
+        u32 tx_frame_nr;
+        u32 tx_cur;            /**< Next frame to fill                       */
+        struct sockaddr_storage tx_sll; /**< Device and EtherType of frames  */
+
+        int render();
+        void patch(flood_pkt_t *p, u64 seq);
+        void recordSent(u32 seq, u32 pkt, u64 usec);
+        int sendBatch(u32 first, int count, u64 seq);
+        int sendBatchSocket(u32 first, int count);
+        int sendBatchRing(u32 first, int count);
+        int openTxRing();
+        void closeTxRing();
+        int openCapture();
+        void readReplies(int to_ms);
+        void processReply(const struct pcap_pkthdr *h, const u8 *packet);
+        static void pcap_callback(u8 *user, const struct pcap_pkthdr *h, const u8 *packet);
+
+    public:
+
+        FloodMode();
+        ~FloodMode();
+        void reset();
+        int start();
+
+}; /* End of class FloodMode */
+
+#endif /* __FLOODMODE_H__ */
@@ -109,6 +109,15 @@ NpingOps::NpingOps() {
     delay=0;
     delay_set=false;
 
+    rate=0;
+    rate_set=false;
+
+    flood=false;
+    flood_set=false;
+
+    batch=0;
+    batch_set=false;
+
     memset(device, 0, MAX_DEV_LEN);
     device_set=false;
 
@@ -698,6 +707,75 @@ bool NpingOps::issetDelay(){
 } /* End of issetDelay() */
 
 
+/** Sets the transmission rate, in probes per second. Supplied parameter must
+ *  be greater than zero.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setRate(u32 val){
+  if( val == 0 )
+    nping_fatal(QT_3,"setRate(): Invalid rate supplied\n");
+  this->rate=val;
+  this->rate_set=true;
+  return OP_SUCCESS;
+} /* End of setRate() */
+
+
+/** Returns value of attribute rate */
+u32 NpingOps::getRate(){
+  return this->rate;
+} /* End of getRate() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetRate(){
+  return this->rate_set;
+} /* End of issetRate() */
+
+
+/** Enables or disables flood mode.
+ *  @return OP_SUCCESS                                                       */
+int NpingOps::setFlood(bool val){
+  this->flood=val;
+  this->flood_set=true;
+  return OP_SUCCESS;
+} /* End of setFlood() */
+
+
+/** Returns value of attribute flood */
+bool NpingOps::getFlood(){
+  return this->flood;
+} /* End of getFlood() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetFlood(){
+  return this->flood_set;
+} /* End of issetFlood() */
+
+
+/** Sets the number of probes handed to the kernel per send call in flood
+ *  mode. Supplied parameter must be between 1 and MAX_FLOOD_BATCH.
+ *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
+int NpingOps::setBatch(int val){
+  if( val < 1 || val > MAX_FLOOD_BATCH )
+    return OP_FAILURE;
+  this->batch=val;
+  this->batch_set=true;
+  return OP_SUCCESS;
+} /* End of setBatch() */
+
+
+/** Returns value of attribute batch */
+int NpingOps::getBatch(){
+  return this->batch;
+} /* End of getBatch() */
+
+
+/* Returns true if option has been set */
+bool NpingOps::issetBatch(){
+  return this->batch_set;
+} /* End of issetBatch() */
+
+
 /** Sets network device. Supplied parameter must be a valid network interface
  *  name.
  *  @return OP_SUCCESS on success and OP_FAILURE in case of error.           */
@@ -2289,6 +2367,9 @@ if (this->havePcap()==false){
   }
 
 
+  if( this->getFlood() && this->issetDelay() && !this->issetRate() )
+    nping_warning(QT_2, "Warning: --delay is ignored with --flood. Use --rate to limit the flood.");
+
   if( !this->issetDelay() )
     this->setDelay( DEFAULT_DELAY );
 
@@ -2309,6 +2390,16 @@ if (this->havePcap()==false){
     nping_fatal(QT_3,"Mode %s requires %s.", this->mode2Ascii( this->getMode() ), privreq);
 
 
+/** FLOOD MODE ****************************************************************/
+  if( this->getFlood() ){
+    if( this->getRole()!=ROLE_NORMAL )
+      nping_fatal(QT_3,"--flood cannot be used in echo mode.");
+    if( this->getMode()==TCP_CONNECT || this->getMode()==UDP_UNPRIV )
+      nping_fatal(QT_3,"--flood requires one of the raw packet modes (TCP, UDP, ICMP or ARP) and %s.", privreq);
+  }else if( this->issetBatch() ){
+    nping_warning(QT_2, "Warning: --batch has no effect without --flood.");
+  }
+
 /** DEFAULT HEADER PARAMETERS *************************************************/
   this->setDefaultHeaderValues();
 
@@ -2645,18 +2736,24 @@ void NpingOps::displayStatistics(){
   char auxbuff[256];
   memset(auxbuff, 0, 256);
   NpingTarget *target=NULL;
+  struct latency_hist rtts;
+  latency_hist_init(&rtts);
   this->targets.rewind();
 
   nping_print(VB_0," "); /* Print newline */
 
     /* Per-target statistics */
     if( this->targets.getTargetsFetched() > 1){
-        while( (target=this->targets.getNextTarget()) != NULL )
+        while( (target=this->targets.getNextTarget()) != NULL ){
             target->printStats();
+            latency_hist_merge(&rtts, target->getRTTs());
+        }
     }else{
         target=this->targets.getNextTarget();
-        if( target!= NULL)
+        if( target!= NULL){
             target->printRTTs();
+            latency_hist_merge(&rtts, target->getRTTs());
+        }
     }
 
 #ifdef WIN32
@@ -2735,13 +2832,23 @@ void NpingOps::displayStatistics(){
      }
 #endif
 
-      /* Transmission times & rates */
-      nping_print(VB_1|NO_NEWLINE,"Tx time: %.5lfs ", this->stats.elapsedTx() );
-      nping_print(VB_1|NO_NEWLINE,"| Tx bytes/s: %.2lf ", this->stats.getOverallTxByteRate() );
-      nping_print(VB_1,"| Tx pkts/s: %.2lf", this->stats.getOverallTxPacketRate() );
-      nping_print(VB_1|NO_NEWLINE,"Rx time: %.5lfs ", this->stats.elapsedRx() );
-      nping_print(VB_1|NO_NEWLINE,"| Rx bytes/s: %.2lf ", this->stats.getOverallRxByteRate() );
-      nping_print(VB_1,"| Rx pkts/s: %.2lf", this->stats.getOverallRxPacketRate() );
+      /* Transmission times & rates. They are what --flood is run for. */
+      int level = this->getFlood() ? QT_1 : VB_1;
+      nping_print(level|NO_NEWLINE,"Tx time: %.5lfs ", this->stats.elapsedTx() );
+      nping_print(level|NO_NEWLINE,"| Tx bytes/s: %.2lf ", this->stats.getOverallTxByteRate() );
+      nping_print(level,"| Tx pkts/s: %.2lf", this->stats.getOverallTxPacketRate() );
+      nping_print(level|NO_NEWLINE,"Rx time: %.5lfs ", this->stats.elapsedRx() );
+      nping_print(level|NO_NEWLINE,"| Rx bytes/s: %.2lf ", this->stats.getOverallRxByteRate() );
+      nping_print(level,"| Rx pkts/s: %.2lf", this->stats.getOverallRxPacketRate() );
+
+      /* Round trip time distribution, over all targets */
+      if( rtts.count > 0 ){
+          nping_print(level|NO_NEWLINE,"Rtt p50: %.3lfms ", latency_hist_percentile(&rtts, 50)/1000.0 );
+          nping_print(level|NO_NEWLINE,"| p90: %.3lfms ", latency_hist_percentile(&rtts, 90)/1000.0 );
+          nping_print(level|NO_NEWLINE,"| p99: %.3lfms ", latency_hist_percentile(&rtts, 99)/1000.0 );
+          nping_print(level|NO_NEWLINE,"| p99.9: %.3lfms ", latency_hist_percentile(&rtts, 99.9)/1000.0 );
+          nping_print(level,"| Max: %.3lfms", rtts.max/1000.0 );
+      }
 
 } /* End of displayStatistics() */
 
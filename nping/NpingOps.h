@@ -138,6 +138,12 @@ class NpingOps {
     bool send_eth_set;
     long delay;               /* Delay between each probe              */
     bool delay_set;
+    u32 rate;                 /* Probes per second, from --rate        */
+    bool rate_set;
+    bool flood;               /* Send through FloodMode?               */
+    bool flood_set;
+    int batch;                /* Probes per send call in FloodMode     */
+    bool batch_set;
     char device[MAX_DEV_LEN]; /* Network interface                     */
     bool device_set;
     bool spoofsource;         /* Did user request IP spoofing?         */
@@ -331,6 +337,18 @@ class NpingOps {
     long getDelay();
     bool issetDelay();
 
+    int setRate(u32 val);
+    u32 getRate();
+    bool issetRate();
+
+    int setFlood(bool val);
+    bool getFlood();
+    bool issetFlood();
+
+    int setBatch(int val);
+    int getBatch();
+    bool issetBatch();
+
     int setPacketCount(u32 val);
     u32 getPacketCount();
     bool issetPacketCount();
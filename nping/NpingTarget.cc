@@ -80,7 +80,6 @@
 #include "common_modified.h"
 
 
-
 /** Constructor */
 NpingTarget::NpingTarget() {
   this->Initialize();
@@ -123,12 +122,7 @@ void NpingTarget::Initialize() {
   total_stats=0;
   sent_total=0;
   recv_total=0;
-  max_rtt=0;
-  max_rtt_set=false;
-  min_rtt=0;
-  min_rtt_set=false;
-  avg_rtt=0;
-  avg_rtt_set=false;
+  latency_hist_init(&rtts);
 } /* End of Initialize() */
 
 
@@ -975,34 +969,24 @@ int NpingTarget::setProbeRecvARP(){
 } /* End of setProbeRecvICMP() */
 
 
-/* Assumes recv_total has already been incremented */
 int NpingTarget::updateRTTs(unsigned long int diff){
-  if( diff > max_rtt || max_rtt==0 ){
-    max_rtt=diff;
-    max_rtt_set=true;
-  }
-  if( diff < min_rtt || min_rtt==0){
-    min_rtt=diff;
-    min_rtt_set=true;
-  }
-
-  /* Update average round trip time */
-  if(!avg_rtt_set || recv_total<=1)
-    avg_rtt = diff;
-  else
-    avg_rtt = ((avg_rtt*(recv_total-1))+diff) / (recv_total);
-  avg_rtt_set=true;
-
+  latency_hist_add(&this->rtts, (u32)MIN(diff, 0xFFFFFFFF));
   return OP_SUCCESS;
 } /* End of updateRTTs() */
 
 
+const struct latency_hist *NpingTarget::getRTTs(){
+  return &this->rtts;
+} /* End of getRTTs() */
+
+
 int NpingTarget::printStats(){
   nping_print(VB_0, "Statistics for host %s:", this->getNameAndIP());
   nping_print(VB_0|NO_NEWLINE," |  ");
   this->printCounts();
   nping_print(VB_0|NO_NEWLINE," |_ ");
   this->printRTTs();
+  this->printRTTPercentiles();
   return OP_SUCCESS;
 } /* End of printStats() */
 
@@ -1030,18 +1014,22 @@ void NpingTarget::printCounts(){
 
 /* Print round trip times */
 void NpingTarget::printRTTs(){
-  if( max_rtt_set )
-    nping_print(QT_1|NO_NEWLINE,"Max rtt: %.3lfms ", this->max_rtt/1000.0 );
-  else
-    nping_print(QT_1|NO_NEWLINE,"Max rtt: N/A ");
+  if( this->rtts.count==0 ){
+    nping_print(QT_1,"Max rtt: N/A | Min rtt: N/A | Avg rtt: N/A" );
+    return;
+  }
+  nping_print(QT_1|NO_NEWLINE,"Max rtt: %.3lfms ", this->rtts.max/1000.0 );
+  nping_print(QT_1|NO_NEWLINE,"| Min rtt: %.3lfms ", this->rtts.min/1000.0 );
+  nping_print(QT_1,"| Avg rtt: %.3lfms", latency_hist_mean(&this->rtts)/1000.0 );
+} /* End of printRTTs() */
 
-  if( min_rtt_set )  
-    nping_print(QT_1|NO_NEWLINE,"| Min rtt: %.3lfms ", this->min_rtt/1000.0 );
-  else
-    nping_print(QT_1|NO_NEWLINE,"| Min rtt: N/A " );
 
-  if( avg_rtt_set)  
-    nping_print(QT_1,"| Avg rtt: %.3lfms", this->avg_rtt/1000.0 );
-  else
-    nping_print(QT_1,"| Avg rtt: N/A" );
-} /* End of printRTTs() */
+/* Print the round trip time distribution, in verbose mode */
+void NpingTarget::printRTTPercentiles(){
+  if( this->rtts.count==0 )
+    return;
+  nping_print(VB_1|NO_NEWLINE,"    Rtt p50: %.3lfms ", latency_hist_percentile(&this->rtts, 50)/1000.0 );
+  nping_print(VB_1|NO_NEWLINE,"| p90: %.3lfms ", latency_hist_percentile(&this->rtts, 90)/1000.0 );
+  nping_print(VB_1|NO_NEWLINE,"| p99: %.3lfms ", latency_hist_percentile(&this->rtts, 99)/1000.0 );
+  nping_print(VB_1,"| p99.9: %.3lfms", latency_hist_percentile(&this->rtts, 99.9)/1000.0 );
+} /* End of printRTTPercentiles() */
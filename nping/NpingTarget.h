@@ -235,12 +235,7 @@ int total_stats;
 
 unsigned long int sent_total;
 unsigned long int recv_total;
-unsigned long int max_rtt;
-bool max_rtt_set;
-unsigned long int min_rtt;
-bool min_rtt_set;
-unsigned long int avg_rtt;
-bool avg_rtt_set;
+struct latency_hist rtts; /* Round trip times, in microseconds */
 
 
 int setProbeRecvTCP(u16 sport, u16 dport);
@@ -252,9 +247,11 @@ int setProbeRecvICMP(u16 id, u16 seq);
 int setProbeSentARP();
 int setProbeRecvARP();
 int updateRTTs(unsigned long int diff);
+const struct latency_hist *getRTTs();
 int printStats();
 void printCounts();
 void printRTTs();
+void printRTTPercentiles();
 /* STATS***********************************************************************/
 
 };
@@ -62,6 +62,7 @@
 
 #include "nping.h"
 #include "ProbeMode.h"
+#include "FloodMode.h"
 #include <vector>
 #include "nsock.h"
 #include "output.h"
@@ -299,6 +300,12 @@ int ProbeMode::start(){
   case  ICMP:
   case  ARP:
 
+    /* High-rate mode sends and captures without nsock */
+    if( o.getFlood() ){
+        FloodMode flood;
+        return flood.start();
+    }
+
     if( o.getMode()!=ARP && o.sendEth()==false ){
         /* Get socket descriptor. No need for it in ARP since we send at eth level */
         if ((rawipsd = obtainRawSocket()) < 0 )
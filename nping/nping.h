@@ -292,6 +292,9 @@
  /** Milliseconds Nping waits for replies after all probes have been sent */
 #define DEFAULT_WAIT_AFTER_PROBES 1000
 
+#define DEFAULT_FLOOD_BATCH 64          /**< Probes per send call in --flood */
+#define MAX_FLOOD_BATCH 1024            /**< Largest --batch accepted        */
+
 #define DEFAULT_IP_TTL 64               /**< Default IP Time To Live         */
 #define DEFAULT_IP_TOS 0                /**< Default IP Type of Service      */
 
@@ -249,7 +249,7 @@ int NpingStats::startRuntime(){
 
 
 int NpingStats::stopRuntime(){
-  this->run_timer.start();
+  this->run_timer.stop();
   return OP_SUCCESS;
 }
 
@@ -312,9 +312,9 @@ u64_t NpingStats::getLostPackets(){
 
 
 double NpingStats::getLostPacketPercentage(){
-  u32 pkt_rcvd=this->packets_received;
-  u32 pkt_sent=this->packets_sent;
-  u32 pkt_lost=(pkt_rcvd>=pkt_sent) ? 0 : (u32)(pkt_sent-pkt_rcvd);
+  u64_t pkt_rcvd=this->packets_received;
+  u64_t pkt_sent=this->packets_sent;
+  u64_t pkt_lost=(pkt_rcvd>=pkt_sent) ? 0 : pkt_sent-pkt_rcvd;
   /* Only compute percentage if we actually sent packets, don't do divisions
    * by zero! (this could happen when user presses CTRL-C and we print the
    * stats */
@@ -339,9 +339,9 @@ u64_t NpingStats::getUnmatchedPackets(){
 
 
 double NpingStats::getUnmatchedPacketPercentage(){
-  u32 pkt_captured=this->packets_received;
-  u32 pkt_echoed=this->packets_echoed;
-  u32 pkt_unmatched=(pkt_captured<=pkt_echoed) ? 0 : (u32)(pkt_captured-pkt_echoed);
+  u64_t pkt_captured=this->packets_received;
+  u64_t pkt_echoed=this->packets_echoed;
+  u64_t pkt_unmatched=(pkt_captured<=pkt_echoed) ? 0 : pkt_captured-pkt_echoed;
   double percentunmatched=0.0;
   if( pkt_unmatched!=0 && pkt_captured!=0)
     percentunmatched=((double)pkt_unmatched)/((double)pkt_captured);
@@ -0,0 +1,351 @@
+/* Compiled chunk cache for NSE.
+ *
+ * Every run compiles nse_main.lua, the NSE libraries and the selected scripts
+ * from source, which for a large selection such as "default,safe" is most of
+ * the time NSE takes to start. With --script-cache, every chunk NSE compiles
+ * is also saved with lua_dump to a file in the cache directory named after a
+ * hash of its path, and later runs map that file into memory and load the
+ * dump instead of the source.
+ *
+ * A dump is used only if its source has the same size and modification time
+ * as when it was compiled or, failing that, the same size and checksum. The
+ * modification time alone is trusted only if the file was at least two
+ * seconds old when it was compiled, so that a file changed again within the
+ * resolution of its timestamp is still recompiled.
+ *
+ * Lua does not verify bytecode when it loads it, so anyone who can write to
+ * the cache can run code as the user. The cache directory and its files must
+ * belong to the user and must not be writable by anyone else.
+ */
+
+#include <nbase.h>
+
+#include "nse_lua.h"
+#include "nse_main.h"
+#include "nse_bytecode.h"
+
+#include "NmapOps.h"
+#include "output.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <string>
+
+extern NmapOps o;
+
+#define BYTECODE_MAGIC "NSEBC\r\n\032"
+#define BYTECODE_VERSION 1
+
+/* The header of a cache file. The key (the path, prefix and suffix of the
+ * chunk, separated by NULs) follows it, and then the dump. */
+struct bc_header {
+  char magic[8];
+  u32 version;
+  u32 lua_version;
+  u32 key_len;
+  u32 crc;           /* Checksum of the source */
+  u64 size;          /* Size of the source */
+  s64 mtime_sec;
+  s64 mtime_nsec;
+  s64 cached_at;     /* When the dump was written */
+};
+
+/* A chunk to compile: prefix, source and suffix, read in turn. */
+struct source_reader {
+  const char *pieces[3];
+  size_t lens[3];
+  int next;
+};
+
+static const char *read_source (lua_State *L, void *data, size_t *size)
+{
+  struct source_reader *r = (struct source_reader *) data;
+
+  while (r->next < 3) {
+    int i = r->next++;
+    if (r->lens[i] > 0) {
+      *size = r->lens[i];
+      return r->pieces[i];
+    }
+  }
+  *size = 0;
+  return NULL;
+}
+
+/* Reads a whole file into s. Returns an errno value. */
+static int read_file (const char *path, std::string &s)
+{
+  char buf[32768];
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1)
+    return errno;
+  s.clear();
+  for (;;) {
+    int n = read(fd, buf, sizeof(buf));
+    if (n == 0)
+      break;
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      int err = errno;
+      close(fd);
+      return err;
+    }
+    s.append(buf, n);
+  }
+  close(fd);
+  return 0;
+}
+
+/* Compiles prefix .. source .. suffix and pushes the function, or returns
+ * the error from lua_load with the message pushed. */
+static int compile (lua_State *L, const char *chunkname, const std::string &source,
+    const char *prefix, size_t prefix_len, const char *suffix, size_t suffix_len)
+{
+  struct source_reader r;
+
+  r.pieces[0] = prefix;
+  r.lens[0] = prefix_len;
+  r.pieces[1] = source.data();
+  r.lens[1] = source.size();
+  r.pieces[2] = suffix;
+  r.lens[2] = suffix_len;
+  r.next = 0;
+  return lua_load(L, read_source, &r, chunkname, "t");
+}
+
+#ifndef WIN32
+
+static int writer (lua_State *L, const void *p, size_t sz, void *ud)
+{
+  ((std::string *) ud)->append((const char *) p, sz);
+  return 0;
+}
+
+/* Returns the cache directory, creating it if need be, or NULL if there is
+ * none or it is not safe to use. */
+static const char *cache_dir (void)
+{
+  static int checked = 0;
+  static bool usable = false;
+  struct stat st;
+
+  if (o.scriptcache == NULL)
+    return NULL;
+  if (checked)
+    return usable ? o.scriptcache : NULL;
+  checked = 1;
+
+  if (mkdir(o.scriptcache, 0700) == -1 && errno != EEXIST) {
+    log_write(LOG_STDOUT, "%s: Cannot create script cache %s: %s\n",
+        SCRIPT_ENGINE, o.scriptcache, strerror(errno));
+    return NULL;
+  }
+  if (stat(o.scriptcache, &st) == -1 || !S_ISDIR(st.st_mode)) {
+    log_write(LOG_STDOUT, "%s: Script cache %s is not a directory\n",
+        SCRIPT_ENGINE, o.scriptcache);
+    return NULL;
+  }
+  if (st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    log_write(LOG_STDOUT, "%s: Not using script cache %s, which is writable by other users\n",
+        SCRIPT_ENGINE, o.scriptcache);
+    return NULL;
+  }
+  usable = true;
+  return o.scriptcache;
+}
+
+/* Loads the dump in the cache file at path if it is still good for the
+ * source described by st and key; reads the source into source if it has to
+ * compare checksums. Pushes the function and returns true on success. */
+static bool load_cached (lua_State *L, const char *path, const char *chunkname,
+    const struct stat *src_st, const char *filename, const std::string &key,
+    std::string &source, bool &have_source)
+{
+  struct stat st;
+  struct bc_header h;
+  bool fresh, ok = false;
+  int fd = open(path, O_RDONLY);
+
+  if (fd == -1)
+    return false;
+  if (fstat(fd, &st) == -1 || st.st_uid != geteuid()
+      || (st.st_mode & (S_IWGRP | S_IWOTH))
+      || (size_t) st.st_size < sizeof(h) + key.size()) {
+    close(fd);
+    return false;
+  }
+  void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const char *data = (const char *) map;
+  memcpy(&h, data, sizeof(h));
+  if (memcmp(h.magic, BYTECODE_MAGIC, sizeof(h.magic)) != 0
+      || h.version != BYTECODE_VERSION || h.lua_version != LUA_VERSION_NUM
+      || h.key_len != key.size() || memcmp(data + sizeof(h), key.data(), key.size()) != 0
+      || h.size != (u64) src_st->st_size)
+    goto done;
+
+#ifdef __APPLE__
+  fresh = h.mtime_sec == src_st->st_mtimespec.tv_sec
+    && h.mtime_nsec == src_st->st_mtimespec.tv_nsec;
+#else
+  fresh = h.mtime_sec == src_st->st_mtim.tv_sec
+    && h.mtime_nsec == src_st->st_mtim.tv_nsec;
+#endif
+  fresh = fresh && h.mtime_sec < h.cached_at - 1;
+  if (!fresh) {
+    if (!have_source) {
+      if (read_file(filename, source) != 0)
+        goto done;
+      have_source = true;
+    }
+    fresh = source.size() == h.size
+      && nbase_crc32c((unsigned char *) source.data(), (int) source.size()) == h.crc;
+  }
+
+  if (fresh) {
+    size_t off = sizeof(h) + key.size();
+    if (luaL_loadbufferx(L, data + off, st.st_size - off, chunkname, "b") == LUA_OK)
+      ok = true;
+    else
+      lua_pop(L, 1);
+  }
+
+done:
+  munmap(map, st.st_size);
+  return ok;
+}
+
+/* Writes the function on top of the stack to the cache file at path, by way
+ * of a temporary file. Failures only cost the next run a compilation, so
+ * they are ignored. */
+static void store (lua_State *L, const char *dir, const char *path,
+    const struct stat *src_st, const std::string &key, const std::string &source)
+{
+  struct bc_header h;
+  std::string out;
+  char tmp[4096];
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, BYTECODE_MAGIC, sizeof(h.magic));
+  h.version = BYTECODE_VERSION;
+  h.lua_version = LUA_VERSION_NUM;
+  h.key_len = key.size();
+  h.crc = nbase_crc32c((unsigned char *) source.data(), (int) source.size());
+  h.size = source.size();
+#ifdef __APPLE__
+  h.mtime_sec = src_st->st_mtimespec.tv_sec;
+  h.mtime_nsec = src_st->st_mtimespec.tv_nsec;
+#else
+  h.mtime_sec = src_st->st_mtim.tv_sec;
+  h.mtime_nsec = src_st->st_mtim.tv_nsec;
+#endif
+  h.cached_at = time(NULL);
+  out.append((const char *) &h, sizeof(h));
+  out.append(key);
+  if (lua_dump(L, writer, &out, 0) != 0)
+    return;
+
+  if (Snprintf(tmp, sizeof(tmp), "%s/.tmp.XXXXXX", dir) >= (int) sizeof(tmp))
+    return;
+  int fd = mkstemp(tmp);
+  if (fd == -1)
+    return;
+  size_t done = 0;
+  while (done < out.size()) {
+    ssize_t n = write(fd, out.data() + done, out.size() - done);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  if (close(fd) != 0 || done != out.size() || rename(tmp, path) != 0)
+    unlink(tmp);
+}
+
+#endif /* !WIN32 */
+
+int nse_loadfile_cached (lua_State *L, const char *filename,
+    const char *prefix, size_t prefix_len, const char *suffix, size_t suffix_len)
+{
+  std::string source;
+  bool have_source = false;
+  int err;
+
+  lua_pushfstring(L, "@%s", filename);
+  const char *chunkname = lua_tostring(L, -1);
+
+#ifndef WIN32
+  const char *dir = cache_dir();
+  struct stat src_st;
+  char path[4096];
+  std::string key;
+
+  if (dir != NULL && stat(filename, &src_st) == 0) {
+    key.append(filename);
+    key.append(1, '\0');
+    key.append(prefix, prefix_len);
+    key.append(1, '\0');
+    key.append(suffix, suffix_len);
+    unsigned long h1 = nbase_crc32c((unsigned char *) key.data(), (int) key.size());
+    unsigned long h2 = nbase_crc32((unsigned char *) key.data(), (int) key.size());
+    if (Snprintf(path, sizeof(path), "%s/%08lx%08lx.luac", dir, h1 & 0xffffffffUL, h2 & 0xffffffffUL) >= (int) sizeof(path))
+      dir = NULL;
+    else if (load_cached(L, path, chunkname, &src_st, filename, key, source, have_source)) {
+      lua_remove(L, -2); /* chunkname */
+      return LUA_OK;
+    }
+  } else {
+    dir = NULL;
+  }
+#endif
+
+  if (!have_source && (err = read_file(filename, source)) != 0) {
+    lua_pop(L, 1);
+    lua_pushfstring(L, "cannot open %s: %s", filename, strerror(err));
+    return LUA_ERRFILE;
+  }
+  err = compile(L, chunkname, source, prefix, prefix_len, suffix, suffix_len);
+  lua_remove(L, -2); /* chunkname */
+  if (err != LUA_OK)
+    return err;
+
+#ifndef WIN32
+  if (dir != NULL)
+    store(L, dir, path, &src_st, key, source);
+#endif
+  return LUA_OK;
+}
+
+/* loadfile_cached(filename [, prefix [, suffix]])
+ *
+ * Like loadfile(filename, "t"), except that the chunk is compiled from
+ * prefix .. contents .. suffix and may come from the cache. */
+int l_loadfile_cached (lua_State *L)
+{
+  size_t prefix_len, suffix_len;
+  const char *filename = luaL_checkstring(L, 1);
+  const char *prefix = luaL_optlstring(L, 2, "", &prefix_len);
+  const char *suffix = luaL_optlstring(L, 3, "", &suffix_len);
+
+  if (nse_loadfile_cached(L, filename, prefix, prefix_len, suffix, suffix_len) != LUA_OK) {
+    lua_pushnil(L);
+    lua_insert(L, -2);
+    return 2;
+  }
+  return 1;
+}
@@ -0,0 +1,12 @@
+#ifndef NSE_BYTECODE
+#define NSE_BYTECODE
+
+/* Pushes the function compiled from prefix .. the contents of filename ..
+ * suffix, taking it from the script cache when there is a good copy there.
+ * Returns a lua_load status, with an error message pushed on failure. */
+int nse_loadfile_cached (lua_State *L, const char *filename,
+    const char *prefix, size_t prefix_len, const char *suffix, size_t suffix_len);
+
+int l_loadfile_cached (lua_State *L);
+
+#endif
@@ -0,0 +1,860 @@
+/* Persistent, content-addressed cache for NSE.
+ *
+ * A cache is a directory with an index file and a blobs/ subdirectory. Every
+ * entry maps a key to two blobs, the metadata the caller stored with it and a
+ * body. Blobs are files named after a 128-bit hash of their contents and are
+ * reference counted, so a body stored under many keys, such as a script
+ * served by many hosts, is on disk once.
+ *
+ * The index file is mapped into memory. It holds two open-addressing hash
+ * tables, one of entries and one of blobs. When the cache is over its size
+ * limit, entries are evicted with the CLOCK algorithm: a lookup sets the
+ * reference bit of an entry, and the hand clears the bits it passes until it
+ * finds an entry whose bit is clear.
+ *
+ * Several nmap processes may share a cache; every operation holds an flock
+ * on the index. An operation sets the dirty flag while it changes the tables,
+ * so a process that dies half way leaves the flag set, and the next one to
+ * lock the index empties the cache instead of trusting it.
+ */
+
+#include <nbase.h>
+
+#include "nse_lua.h"
+#include "nse_diskcache.h"
+
+#ifndef WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DISKCACHE_METATABLE "nmapdiskcache.cache"
+#define DISKCACHE_MAGIC "NMAPDC\r\n"
+#define DISKCACHE_VERSION 1
+/* Table sizes, powers of two. The index file is sparse until the tables fill
+ * up. */
+#define NUM_ENTRIES (1 << 16)
+#define NUM_BLOBS (1 << 17)
+#define BLOB_PATH_MAX 4096
+
+struct dc_header {
+  char magic[8];
+  u32 version;
+  u32 num_entries;
+  u32 num_blobs;
+  u32 used_entries;
+  u32 used_blobs;
+  u32 hand;          /* CLOCK hand, an index into the entries */
+  u32 dirty;
+  u32 pad;
+  u64 bytes;         /* Total size of all blobs */
+};
+
+struct dc_entry {
+  u64 key[2];
+  u64 meta[2];
+  u64 body[2];       /* All zero for an empty body */
+  s64 stored;
+  u32 used;
+  u32 ref;
+};
+
+struct dc_blob {
+  u64 hash[2];
+  u64 len;
+  u32 refs;
+  u32 used;
+};
+
+struct dc_cache {
+  int fd;
+  char *map;
+  size_t map_len;
+  struct dc_header *hdr;
+  struct dc_entry *entries;
+  struct dc_blob *blobs;
+  u64 max_bytes;
+  char *dir;
+  pid_t pid;         /* Process that opened fd */
+};
+
+static const size_t INDEX_SIZE = sizeof(struct dc_header)
+  + NUM_ENTRIES * sizeof(struct dc_entry) + NUM_BLOBS * sizeof(struct dc_blob);
+
+/* MurmurHash3, x64 128-bit variant. It only has to spread keys and bodies
+ * well; blobs are compared byte for byte before one is shared. */
+static inline u64 rotl64 (u64 x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline u64 fmix64 (u64 k)
+{
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static void hash128 (const char *data, size_t len, u64 out[2])
+{
+  const u8 *p = (const u8 *) data;
+  const u8 *tail = p + (len & ~(size_t) 15);
+  const u64 c1 = 0x87c37b91114253d5ULL, c2 = 0x4cf5ad432745937fULL;
+  u64 h1 = 0x9368e53c2f6af274ULL, h2 = 0x586dcd208f7cd3fdULL;
+  u64 k1, k2;
+  size_t rem = len & 15, i;
+
+  for (; p < tail; p += 16) {
+    memcpy(&k1, p, 8);
+    memcpy(&k2, p + 8, 8);
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  k1 = k2 = 0;
+  for (i = rem; i > 8; i--)
+    k2 ^= (u64) tail[i - 1] << ((i - 9) * 8);
+  if (rem > 8) {
+    k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+  }
+  for (i = rem < 8 ? rem : 8; i > 0; i--)
+    k1 ^= (u64) tail[i - 1] << ((i - 1) * 8);
+  if (rem > 0) {
+    k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+  }
+
+  h1 ^= len; h2 ^= len;
+  h1 += h2; h2 += h1;
+  h1 = fmix64(h1); h2 = fmix64(h2);
+  h1 += h2; h2 += h1;
+  out[0] = h1;
+  out[1] = h2;
+}
+
+static void blob_path (const struct dc_cache *c, const u64 hash[2], char *path)
+{
+  Snprintf(path, BLOB_PATH_MAX, "%s/blobs/%016llx%016llx", c->dir,
+      (unsigned long long) hash[0], (unsigned long long) hash[1]);
+}
+
+static inline u64 slot_hash (const struct dc_entry &e)
+{
+  return e.key[0];
+}
+
+static inline u64 slot_hash (const struct dc_blob &b)
+{
+  return b.hash[0];
+}
+
+/* Finds the slot of hash in an open-addressing table, or the free slot where
+ * it would go. */
+template <class T>
+static u32 table_find (T *t, u32 size, const u64 hash[2], bool *found,
+    const u64 *(*id)(const T &))
+{
+  u32 mask = size - 1;
+  u32 i = (u32) hash[0] & mask;
+
+  while (t[i].used) {
+    const u64 *h = id(t[i]);
+    if (h[0] == hash[0] && h[1] == hash[1]) {
+      *found = true;
+      return i;
+    }
+    i = (i + 1) & mask;
+  }
+  *found = false;
+  return i;
+}
+
+/* Removes slot i from a linear-probing table, moving later slots of the same
+ * cluster back so that lookups need no tombstones. */
+template <class T>
+static void table_delete (T *t, u32 size, u32 i)
+{
+  u32 mask = size - 1;
+  u32 j = i;
+
+  for (;;) {
+    j = (j + 1) & mask;
+    if (!t[j].used)
+      break;
+    u32 home = (u32) slot_hash(t[j]) & mask;
+    /* t[j] may fill the hole unless its home slot lies cyclically in (i, j]. */
+    if (j > i ? (home <= i || home > j) : (home <= i && home > j)) {
+      t[i] = t[j];
+      i = j;
+    }
+  }
+  memset(&t[i], 0, sizeof(T));
+}
+
+static const u64 *entry_id (const struct dc_entry &e)
+{
+  return e.key;
+}
+
+static const u64 *blob_id (const struct dc_blob &b)
+{
+  return b.hash;
+}
+
+static u32 find_entry (struct dc_cache *c, const u64 key[2], bool *found)
+{
+  return table_find(c->entries, c->hdr->num_entries, key, found, entry_id);
+}
+
+static u32 find_blob (struct dc_cache *c, const u64 hash[2], bool *found)
+{
+  return table_find(c->blobs, c->hdr->num_blobs, hash, found, blob_id);
+}
+
+static void wipe_blobs (struct dc_cache *c)
+{
+  char path[BLOB_PATH_MAX];
+  struct dirent *ent;
+  DIR *d;
+
+  Snprintf(path, sizeof(path), "%s/blobs", c->dir);
+  d = opendir(path);
+  if (d == NULL)
+    return;
+  while ((ent = readdir(d)) != NULL) {
+    if (strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    Snprintf(path, sizeof(path), "%s/blobs/%s", c->dir, ent->d_name);
+    unlink(path);
+  }
+  closedir(d);
+}
+
+/* Empties the cache. Called with the index locked. */
+static void reset_index (struct dc_cache *c)
+{
+  memset(c->map, 0, c->map_len);
+  wipe_blobs(c);
+  memcpy(c->hdr->magic, DISKCACHE_MAGIC, sizeof(c->hdr->magic));
+  c->hdr->version = DISKCACHE_VERSION;
+  c->hdr->num_entries = NUM_ENTRIES;
+  c->hdr->num_blobs = NUM_BLOBS;
+}
+
+static bool index_valid (const struct dc_cache *c)
+{
+  return memcmp(c->hdr->magic, DISKCACHE_MAGIC, sizeof(c->hdr->magic)) == 0
+    && c->hdr->version == DISKCACHE_VERSION
+    && c->hdr->num_entries == NUM_ENTRIES
+    && c->hdr->num_blobs == NUM_BLOBS
+    && !c->hdr->dirty;
+}
+
+static int lock_index (struct dc_cache *c)
+{
+  if (c->pid != getpid()) {
+    /* A forked child, such as a script worker, shares the parent's open file
+     * description and with it the parent's lock, so it needs its own. */
+    char path[BLOB_PATH_MAX];
+    int fd;
+
+    Snprintf(path, sizeof(path), "%s/index", c->dir);
+    fd = open(path, O_RDWR);
+    if (fd == -1)
+      return -1;
+    close(c->fd);
+    c->fd = fd;
+    c->pid = getpid();
+  }
+  while (flock(c->fd, LOCK_EX) == -1) {
+    if (errno != EINTR)
+      return -1;
+  }
+  if (!index_valid(c))
+    reset_index(c);
+  return 0;
+}
+
+static void unlock_index (struct dc_cache *c)
+{
+  flock(c->fd, LOCK_UN);
+}
+
+static int write_file (const struct dc_cache *c, const char *path,
+    const char *data, size_t len)
+{
+  char tmp[BLOB_PATH_MAX];
+  int fd;
+
+  /* Write under a temporary name, so that a blob file is always complete. */
+  Snprintf(tmp, sizeof(tmp), "%s/blobs/.tmp%ld", c->dir, (long) getpid());
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (fd == -1)
+    return -1;
+  while (len > 0) {
+    ssize_t n = write(fd, data, len);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      close(fd);
+      unlink(tmp);
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  if (close(fd) == -1 || rename(tmp, path) == -1) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* Returns 1 if the file holds exactly data, 0 if it holds something else,
+ * and -1 if it can't be read. */
+static int file_equals (const char *path, const char *data, size_t len)
+{
+  char buf[16384];
+  int fd = open(path, O_RDONLY);
+  int result = 1;
+
+  if (fd == -1)
+    return -1;
+  for (;;) {
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      result = -1;
+      break;
+    }
+    if (n == 0) {
+      if (len != 0)
+        result = 0;
+      break;
+    }
+    if ((size_t) n > len || memcmp(buf, data, n) != 0) {
+      result = 0;
+      break;
+    }
+    data += n;
+    len -= n;
+  }
+  close(fd);
+  return result;
+}
+
+/* Takes a reference to the blob with the given contents, writing it out if
+ * it is not in the cache yet. */
+static const char *blob_ref (struct dc_cache *c, const u64 hash[2],
+    const char *data, size_t len)
+{
+  char path[BLOB_PATH_MAX];
+  bool found;
+  u32 i = find_blob(c, hash, &found);
+
+  blob_path(c, hash, path);
+  if (found) {
+    int same = c->blobs[i].len == len ? file_equals(path, data, len) : 0;
+    if (same == 0)
+      return "hash collision";
+    if (same == -1 && write_file(c, path, data, len) == -1)
+      return strerror(errno);
+    c->blobs[i].refs++;
+    return NULL;
+  }
+
+  if (write_file(c, path, data, len) == -1)
+    return strerror(errno);
+  c->blobs[i].hash[0] = hash[0];
+  c->blobs[i].hash[1] = hash[1];
+  c->blobs[i].len = len;
+  c->blobs[i].refs = 1;
+  c->blobs[i].used = 1;
+  c->hdr->used_blobs++;
+  c->hdr->bytes += len;
+  return NULL;
+}
+
+static void blob_unref (struct dc_cache *c, const u64 hash[2])
+{
+  char path[BLOB_PATH_MAX];
+  bool found;
+  u32 i = find_blob(c, hash, &found);
+
+  if (!found || --c->blobs[i].refs > 0)
+    return;
+  blob_path(c, hash, path);
+  unlink(path);
+  c->hdr->bytes -= c->blobs[i].len;
+  c->hdr->used_blobs--;
+  table_delete(c->blobs, c->hdr->num_blobs, i);
+}
+
+static inline bool has_body (const struct dc_entry *e)
+{
+  return e->body[0] != 0 || e->body[1] != 0;
+}
+
+static void entry_remove (struct dc_cache *c, u32 i)
+{
+  struct dc_entry e = c->entries[i];
+
+  table_delete(c->entries, c->hdr->num_entries, i);
+  c->hdr->used_entries--;
+  blob_unref(c, e.meta);
+  if (has_body(&e))
+    blob_unref(c, e.body);
+}
+
+/* Evicts one entry with the CLOCK algorithm. */
+static void evict_one (struct dc_cache *c)
+{
+  u32 mask = c->hdr->num_entries - 1;
+
+  while (c->hdr->used_entries > 0) {
+    u32 i = c->hdr->hand;
+    struct dc_entry *e = &c->entries[i];
+
+    c->hdr->hand = (i + 1) & mask;
+    if (!e->used)
+      continue;
+    if (e->ref) {
+      e->ref = 0;
+      continue;
+    }
+    entry_remove(c, i);
+    return;
+  }
+}
+
+/* Makes room for a new entry of len bytes. The tables are kept at most three
+ * quarters full so that probe sequences stay short. */
+static void make_room (struct dc_cache *c, u64 len)
+{
+  struct dc_header *h = c->hdr;
+
+  while (h->used_entries > 0 && (h->bytes + len > c->max_bytes
+        || h->used_entries + 1 > h->num_entries / 4 * 3
+        || h->used_blobs + 2 > h->num_blobs / 4 * 3))
+    evict_one(c);
+}
+
+/* Reads the contents of a blob into a malloc'd buffer, which the caller must
+ * free. Returns 0, -1 if the blob can't be read, or -2 if there is not enough
+ * memory. Nothing here can raise a Lua error, so it is safe to call with the
+ * index locked. */
+static int read_blob (struct dc_cache *c, const u64 hash[2], char **data,
+    size_t *len)
+{
+  char path[BLOB_PATH_MAX];
+  bool found;
+  u32 i = find_blob(c, hash, &found);
+  size_t got = 0;
+  char *p;
+  int fd;
+
+  if (!found)
+    return -1;
+  *len = c->blobs[i].len;
+  blob_path(c, hash, path);
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return -1;
+  p = (char *) malloc(*len > 0 ? *len : 1);
+  if (p == NULL) {
+    close(fd);
+    return -2;
+  }
+  while (got < *len) {
+    ssize_t n = read(fd, p + got, *len - got);
+    if (n == -1 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    got += n;
+  }
+  close(fd);
+  if (got != *len) {
+    free(p);
+    return -1;
+  }
+  *data = p;
+  return 0;
+}
+
+static struct dc_cache *check_cache (lua_State *L, int idx)
+{
+  struct dc_cache *c = (struct dc_cache *) luaL_checkudata(L, idx, DISKCACHE_METATABLE);
+  if (c->map == NULL)
+    luaL_argerror(L, idx, "cache is closed");
+  return c;
+}
+
+static int push_errno (lua_State *L, const char *what)
+{
+  lua_pushnil(L);
+  lua_pushfstring(L, "%s: %s", what, strerror(errno));
+  return 2;
+}
+
+static void close_cache (struct dc_cache *c)
+{
+  if (c->map != NULL)
+    munmap(c->map, c->map_len);
+  if (c->fd != -1)
+    close(c->fd);
+  free(c->dir);
+  c->map = NULL;
+  c->fd = -1;
+  c->dir = NULL;
+}
+
+/* open(dir, max_bytes)
+ *
+ * Opens the cache in directory dir, creating it if needed. Storing an entry
+ * evicts others while the blobs take up more than max_bytes. */
+static int l_open (lua_State *L)
+{
+  size_t dirlen;
+  const char *dir = luaL_checklstring(L, 1, &dirlen);
+  lua_Integer max_bytes = luaL_checkinteger(L, 2);
+  char path[BLOB_PATH_MAX];
+  struct dc_cache *c;
+  struct stat st;
+  void *map;
+
+  if (dirlen + 64 > sizeof(path))
+    return luaL_argerror(L, 1, "path too long");
+  luaL_argcheck(L, max_bytes > 0, 2, "size must be positive");
+
+  c = (struct dc_cache *) lua_newuserdatauv(L, sizeof(struct dc_cache), 0);
+  memset(c, 0, sizeof(*c));
+  c->fd = -1;
+  luaL_setmetatable(L, DISKCACHE_METATABLE);
+  c->dir = strdup(dir);
+  if (c->dir == NULL)
+    return luaL_error(L, "out of memory");
+  c->max_bytes = (u64) max_bytes;
+
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST)
+    return push_errno(L, dir);
+  Snprintf(path, sizeof(path), "%s/blobs", dir);
+  if (mkdir(path, 0700) == -1 && errno != EEXIST)
+    return push_errno(L, path);
+  Snprintf(path, sizeof(path), "%s/index", dir);
+  c->fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (c->fd == -1)
+    return push_errno(L, path);
+  c->pid = getpid();
+  while (flock(c->fd, LOCK_EX) == -1) {
+    if (errno != EINTR)
+      return push_errno(L, path);
+  }
+  if (fstat(c->fd, &st) == -1)
+    return push_errno(L, path);
+  if ((size_t) st.st_size != INDEX_SIZE
+      && (ftruncate(c->fd, 0) == -1 || ftruncate(c->fd, INDEX_SIZE) == -1))
+    return push_errno(L, path);
+  map = mmap(NULL, INDEX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+  if (map == MAP_FAILED)
+    return push_errno(L, path);
+  c->map = (char *) map;
+  c->map_len = INDEX_SIZE;
+  c->hdr = (struct dc_header *) c->map;
+  c->entries = (struct dc_entry *) (c->hdr + 1);
+  c->blobs = (struct dc_blob *) (c->entries + NUM_ENTRIES);
+  if (!index_valid(c))
+    reset_index(c);
+  unlock_index(c);
+  return 1;
+}
+
+/* cache:get(key)
+ *
+ * Returns the metadata and body stored under key and the time they were
+ * stored, or nil. */
+static int l_get (lua_State *L)
+{
+  struct dc_cache *c = check_cache(L, 1);
+  size_t klen, mlen;
+  const char *key = luaL_checklstring(L, 2, &klen);
+  char *meta = NULL, *body = NULL;
+  size_t blen = 0;
+  struct dc_entry e;
+  bool found;
+  u64 k[2];
+  u32 i;
+  int res;
+
+  hash128(key, klen, k);
+  if (lock_index(c) == -1)
+    return push_errno(L, "flock");
+  i = find_entry(c, k, &found);
+  if (!found) {
+    unlock_index(c);
+    lua_pushnil(L);
+    return 1;
+  }
+  c->entries[i].ref = 1;
+  e = c->entries[i];
+
+  /* The blobs are read into C buffers and only handed to Lua once the index
+   * is unlocked: a Lua allocation may raise an error, which would leave the
+   * lock held, and may run a garbage collection cycle, which other processes
+   * should not have to wait for. */
+  res = read_blob(c, e.meta, &meta, &mlen);
+  /* The metadata blob starts with the key, which rules out a collision of key
+   * hashes. */
+  if (res == 0 && !(mlen > klen && memcmp(meta, key, klen) == 0
+        && meta[klen] == '\0'))
+    res = -1;
+  if (res == 0 && has_body(&e))
+    res = read_blob(c, e.body, &body, &blen);
+  if (res == -1) {
+    /* The entry is unusable; drop it. */
+    c->hdr->dirty = 1;
+    entry_remove(c, i);
+    c->hdr->dirty = 0;
+  }
+  unlock_index(c);
+
+  if (res != 0) {
+    free(meta);
+    free(body);
+    if (res == -2)
+      return luaL_error(L, "out of memory");
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_pushlstring(L, meta + klen + 1, mlen - klen - 1);
+  free(meta);
+  if (body != NULL) {
+    lua_pushlstring(L, body, blen);
+    free(body);
+  } else {
+    lua_pushliteral(L, "");
+  }
+  lua_pushinteger(L, (lua_Integer) e.stored);
+  return 3;
+}
+
+/* cache:put(key, meta [, body])
+ *
+ * Stores meta and body under key, replacing what was there. Returns true, or
+ * nil and an error message. */
+static int l_put (lua_State *L)
+{
+  struct dc_cache *c = check_cache(L, 1);
+  size_t klen, mlen, blen = 0;
+  const char *key = luaL_checklstring(L, 2, &klen);
+  const char *meta = luaL_checklstring(L, 3, &mlen);
+  const char *body = luaL_optlstring(L, 4, "", &blen);
+  const char *metablob, *err;
+  luaL_Buffer b;
+  u64 k[2], mh[2], bh[2] = {0, 0};
+  struct dc_entry *e;
+  bool found;
+  u32 i;
+
+  /* Everything that may raise an error is done before the index is locked. */
+  luaL_buffinit(L, &b);
+  luaL_addlstring(&b, key, klen);
+  luaL_addchar(&b, '\0');
+  luaL_addlstring(&b, meta, mlen);
+  luaL_pushresult(&b);
+  metablob = lua_tolstring(L, -1, &mlen);
+
+  if ((u64) mlen + blen > c->max_bytes) {
+    lua_pushnil(L);
+    lua_pushliteral(L, "entry is larger than the cache");
+    return 2;
+  }
+  hash128(key, klen, k);
+  hash128(metablob, mlen, mh);
+  if (blen > 0)
+    hash128(body, blen, bh);
+
+  if (lock_index(c) == -1)
+    return push_errno(L, "flock");
+  c->hdr->dirty = 1;
+  i = find_entry(c, k, &found);
+  if (found)
+    entry_remove(c, i);
+  make_room(c, (u64) mlen + blen);
+
+  err = blen > 0 ? blob_ref(c, bh, body, blen) : NULL;
+  if (err == NULL) {
+    err = blob_ref(c, mh, metablob, mlen);
+    if (err != NULL && blen > 0)
+      blob_unref(c, bh);
+  }
+  if (err == NULL) {
+    i = find_entry(c, k, &found);
+    e = &c->entries[i];
+    e->key[0] = k[0];
+    e->key[1] = k[1];
+    e->meta[0] = mh[0];
+    e->meta[1] = mh[1];
+    e->body[0] = bh[0];
+    e->body[1] = bh[1];
+    e->stored = (s64) time(NULL);
+    e->used = 1;
+    e->ref = 1;
+    c->hdr->used_entries++;
+  }
+  c->hdr->dirty = 0;
+  unlock_index(c);
+
+  if (err != NULL) {
+    lua_pushnil(L);
+    lua_pushstring(L, err);
+    return 2;
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+/* cache:touch(key)
+ *
+ * Marks the entry under key as stored now, as when a server has confirmed
+ * that it is still current. Returns whether there was such an entry. */
+static int l_touch (lua_State *L)
+{
+  struct dc_cache *c = check_cache(L, 1);
+  size_t klen;
+  const char *key = luaL_checklstring(L, 2, &klen);
+  bool found;
+  u64 k[2];
+  u32 i;
+
+  hash128(key, klen, k);
+  if (lock_index(c) == -1)
+    return push_errno(L, "flock");
+  i = find_entry(c, k, &found);
+  if (found) {
+    c->entries[i].stored = (s64) time(NULL);
+    c->entries[i].ref = 1;
+  }
+  unlock_index(c);
+  lua_pushboolean(L, found);
+  return 1;
+}
+
+/* cache:remove(key) */
+static int l_remove (lua_State *L)
+{
+  struct dc_cache *c = check_cache(L, 1);
+  size_t klen;
+  const char *key = luaL_checklstring(L, 2, &klen);
+  bool found;
+  u64 k[2];
+  u32 i;
+
+  hash128(key, klen, k);
+  if (lock_index(c) == -1)
+    return push_errno(L, "flock");
+  i = find_entry(c, k, &found);
+  if (found) {
+    c->hdr->dirty = 1;
+    entry_remove(c, i);
+    c->hdr->dirty = 0;
+  }
+  unlock_index(c);
+  lua_pushboolean(L, found);
+  return 1;
+}
+
+/* cache:stats()
+ *
+ * Returns a table with the number of entries and blobs and the bytes used. */
+static int l_stats (lua_State *L)
+{
+  struct dc_cache *c = check_cache(L, 1);
+
+  if (lock_index(c) == -1)
+    return push_errno(L, "flock");
+  lua_createtable(L, 0, 4);
+  lua_pushinteger(L, c->hdr->used_entries);
+  lua_setfield(L, -2, "entries");
+  lua_pushinteger(L, c->hdr->used_blobs);
+  lua_setfield(L, -2, "blobs");
+  lua_pushinteger(L, (lua_Integer) c->hdr->bytes);
+  lua_setfield(L, -2, "bytes");
+  lua_pushinteger(L, (lua_Integer) c->max_bytes);
+  lua_setfield(L, -2, "max_bytes");
+  unlock_index(c);
+  return 1;
+}
+
+static int l_close (lua_State *L)
+{
+  struct dc_cache *c = (struct dc_cache *) luaL_checkudata(L, 1, DISKCACHE_METATABLE);
+  close_cache(c);
+  return 0;
+}
+
+#else /* WIN32 */
+
+#define DISKCACHE_METATABLE "nmapdiskcache.cache"
+
+static int l_open (lua_State *L)
+{
+  lua_pushnil(L);
+  lua_pushliteral(L, "disk cache is not supported on this platform");
+  return 2;
+}
+
+static int l_unsupported (lua_State *L)
+{
+  return luaL_error(L, "disk cache is not supported on this platform");
+}
+
+#define l_get l_unsupported
+#define l_put l_unsupported
+#define l_touch l_unsupported
+#define l_remove l_unsupported
+#define l_stats l_unsupported
+#define l_close l_unsupported
+
+#endif /* WIN32 */
+
+LUALIB_API int luaopen_diskcache (lua_State *L)
+{
+  static const luaL_Reg diskcachelib[] = {
+    {"open", l_open},
+    {NULL, NULL}
+  };
+  static const luaL_Reg cache_methods[] = {
+    {"get", l_get},
+    {"put", l_put},
+    {"touch", l_touch},
+    {"remove", l_remove},
+    {"stats", l_stats},
+    {"close", l_close},
+    {"__gc", l_close},
+    {NULL, NULL}
+  };
+
+  luaL_newmetatable(L, DISKCACHE_METATABLE);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, cache_methods, 0);
+  lua_pop(L, 1);
+
+  luaL_newlib(L, diskcachelib);
+  return 1;
+}
@@ -0,0 +1,7 @@
+#ifndef NSE_DISKCACHE
+#define NSE_DISKCACHE
+
+#define NSE_DISKCACHELIBNAME "nmapdiskcache"
+LUALIB_API int luaopen_diskcache (lua_State *L);
+
+#endif
@@ -0,0 +1,1013 @@
+/* JSON parser and generator backing nselib/json.lua.
+ *
+ * The parser is a byte-at-a-time state machine rather than a recursive
+ * descent, so that a document can be fed to it in pieces (json.parser) as
+ * well as all at once (json.parse). Containers under construction are kept
+ * on the Lua stack while a piece is being parsed and are parked in the
+ * decoder's user value between pieces. A token that is cut off by the end of
+ * a piece is carried over and parsed once more input arrives; the decoder
+ * remembers how far into it the scan for its end got, so that a long token
+ * fed in many small pieces is still only scanned once.
+ *
+ * Whitespace runs and string bodies are scanned 16 bytes at a time with SSE2
+ * where it is available; everything else falls back to plain loops.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "nbase.h"
+
+#include "nse_lua.h"
+#include "nse_json.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#define JSON_SSE2 1
+#endif
+
+/* Deeper nesting than this is rejected, both when parsing and generating. It
+ * bounds the C stack used by the generator and the Lua stack used by the
+ * parser, and turns a reference cycle into an error. */
+#define JSON_MAXDEPTH 512
+
+/* Upvalues of every function in the library. */
+#define JSON_NULL lua_upvalueindex(1)
+
+#define DECODER_METATABLE "nmapjson.decoder"
+#define BUFFER_METATABLE "nmapjson.buffer"
+
+enum json_state {
+  ST_VALUE,       /* Expecting a value */
+  ST_FIRST_ELEM,  /* After '[': a value or ']' */
+  ST_FIRST_KEY,   /* After '{': a key or '}' */
+  ST_KEY,         /* After ',' in an object: a key */
+  ST_COLON,       /* After a key */
+  ST_NEXT,        /* After a value in a container: ',' or the closing bracket */
+  ST_DONE         /* The top-level value is complete */
+};
+
+typedef struct json_decoder {
+  int state;
+  int depth;
+  int failed;
+  int saved;          /* Stack slots parked in the user value table */
+  char *buf;          /* Unconsumed input carried over between pieces */
+  size_t len, size;
+  size_t scanned;     /* Bytes at the start of buf already searched for the
+                         end of the token that begins there */
+  int escaped;        /* Whether those bytes had an escape (strings only) */
+  unsigned char kind[JSON_MAXDEPTH];  /* '[' or '{' for each open container */
+  lua_Integer n[JSON_MAXDEPTH];       /* Elements so far in each open array */
+} json_decoder;
+
+typedef struct json_buffer {
+  char *b;
+  size_t n, size;
+} json_buffer;
+
+static int syntax_error (lua_State *L)
+{
+  lua_pushliteral(L, "syntax error");
+  return lua_error(L);
+}
+
+static inline int is_space (unsigned char c)
+{
+  return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+static inline int is_digit (unsigned char c)
+{
+  return c >= '0' && c <= '9';
+}
+
+static inline int hex_value (unsigned char c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c |= 0x20;
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+static inline int is_xdigit (unsigned char c)
+{
+  return hex_value(c) >= 0;
+}
+
+static inline int is_alnum (unsigned char c)
+{
+  return is_digit(c) || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+#ifdef JSON_SSE2
+static inline int first_bit (unsigned int mask)
+{
+#if defined(__GNUC__)
+  return __builtin_ctz(mask);
+#elif defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward(&i, mask);
+  return (int) i;
+#else
+  int i = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    i++;
+  }
+  return i;
+#endif
+}
+#endif
+
+/* Returns the first non-whitespace byte at or after p. */
+static const char *skip_space (const char *p, const char *end)
+{
+  /* Compact documents rarely have more than one space in a row. */
+  if (p >= end || !is_space(*p))
+    return p;
+  p++;
+#ifdef JSON_SSE2
+  {
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i four = _mm_set1_epi8(4);
+    while (end - p >= 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *) p);
+      /* '\t' through '\r' are the bytes with x - '\t' <= 4 unsigned. */
+      __m128i d = _mm_sub_epi8(x, tab);
+      __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(x, space),
+          _mm_cmpeq_epi8(_mm_min_epu8(d, four), d));
+      unsigned int mask = ~_mm_movemask_epi8(ws) & 0xFFFF;
+      if (mask)
+        return p + first_bit(mask);
+      p += 16;
+    }
+  }
+#endif
+  while (p < end && is_space(*p))
+    p++;
+  return p;
+}
+
+/* Returns the first '"' or '\\' at or after p, or end. */
+static const char *scan_string (const char *p, const char *end)
+{
+#ifdef JSON_SSE2
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  while (end - p >= 16) {
+    __m128i x = _mm_loadu_si128((const __m128i *) p);
+    unsigned int mask = _mm_movemask_epi8(_mm_or_si128(
+          _mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)));
+    if (mask)
+      return p + first_bit(mask);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != '"' && *p != '\\')
+    p++;
+  return p;
+}
+
+/* Finds the closing quote of a string whose body starts at p. Returns NULL if
+ * it is not in the buffer yet, with *stop set to where the search should
+ * resume once there is more. Sets *escaped if the body has any escapes. */
+static const char *string_end (const char *p, const char *end, int *escaped,
+                               const char **stop)
+{
+  for (;;) {
+    p = scan_string(p, end);
+    if (p >= end)
+      break;
+    if (*p == '"')
+      return p;
+    *escaped = 1;
+    if (end - p < 2)
+      break;
+    p += 2;
+  }
+  *stop = p;
+  return NULL;
+}
+
+static int hex4 (const char *p)
+{
+  int v = 0;
+  for (int i = 0; i < 4; i++) {
+    int h = hex_value(p[i]);
+    if (h < 0)
+      return -1;
+    v = (v << 4) | h;
+  }
+  return v;
+}
+
+static void add_utf8 (luaL_Buffer *b, unsigned long cp)
+{
+  char s[4];
+  size_t n;
+
+  if (cp < 0x80) {
+    s[0] = (char) cp;
+    n = 1;
+  } else if (cp < 0x800) {
+    s[0] = (char) (0xC0 | (cp >> 6));
+    s[1] = (char) (0x80 | (cp & 0x3F));
+    n = 2;
+  } else if (cp < 0x10000) {
+    s[0] = (char) (0xE0 | (cp >> 12));
+    s[1] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    s[2] = (char) (0x80 | (cp & 0x3F));
+    n = 3;
+  } else {
+    s[0] = (char) (0xF0 | (cp >> 18));
+    s[1] = (char) (0x80 | ((cp >> 12) & 0x3F));
+    s[2] = (char) (0x80 | ((cp >> 6) & 0x3F));
+    s[3] = (char) (0x80 | (cp & 0x3F));
+    n = 4;
+  }
+  luaL_addlstring(b, s, n);
+}
+
+/* Decodes the escapes in the string body [p, q) and pushes the result. A
+ * backslash before any character other than the JSON escapes stands for that
+ * character, as does "\u" without four hex digits after it. */
+static void push_unescaped (lua_State *L, const char *p, const char *q)
+{
+  luaL_Buffer b;
+
+  luaL_buffinit(L, &b);
+  while (p < q) {
+    const char *e = scan_string(p, q);
+    luaL_addlstring(&b, p, e - p);
+    if (e >= q)
+      break;
+    e++;
+    switch (*e) {
+      case 'b': luaL_addchar(&b, '\b'); break;
+      case 'f': luaL_addchar(&b, '\f'); break;
+      case 'n': luaL_addchar(&b, '\n'); break;
+      case 'r': luaL_addchar(&b, '\r'); break;
+      case 't': luaL_addchar(&b, '\t'); break;
+      case 'u': {
+        int cp = q - e > 4 ? hex4(e + 1) : -1;
+        char hex[5], lowhex[5];
+        if (cp < 0) {
+          luaL_addchar(&b, 'u');
+          break;
+        }
+        memcpy(hex, e + 1, 4);
+        hex[4] = '\0';
+        e += 4;
+        if (cp >= 0xDC00 && cp <= 0xDFFF) {
+          char msg[64];
+          Snprintf(msg, sizeof(msg), "Not a Unicode character: U+%04X", cp);
+          luaL_error(L, "%s", msg);
+        } else if (cp >= 0xD800 && cp <= 0xDBFF) {
+          /* Beginning of a UTF-16 surrogate pair (RFC 2781). */
+          int low = q - e > 6 && e[1] == '\\' && e[2] == 'u' ? hex4(e + 3) : -1;
+          if (low < 0)
+            luaL_error(L, "Bad unicode escape \\u%s (missing low surrogate)", hex);
+          memcpy(lowhex, e + 3, 4);
+          lowhex[4] = '\0';
+          if (low < 0xDC00 || low > 0xDFFF)
+            luaL_error(L, "Bad unicode escape \\u%s\\u%s (bad low surrogate)", hex, lowhex);
+          e += 6;
+          add_utf8(&b, 0x10000 + ((cp & 0x3FF) << 10) + (low & 0x3FF));
+        } else {
+          add_utf8(&b, cp);
+        }
+        break;
+      }
+      default: luaL_addchar(&b, *e); break;
+    }
+    p = e + 1;
+  }
+  luaL_pushresult(&b);
+}
+
+/* Parses a string starting at the opening quote p and pushes it. Returns the
+ * position after the closing quote, or NULL if the string is not complete.
+ * The first d->scanned bytes from p are known not to hold the closing quote;
+ * if the string is not complete, d->scanned is updated. */
+static const char *parse_string (lua_State *L, json_decoder *d, const char *p, const char *end)
+{
+  int escaped = d->scanned > 0 && d->escaped;
+  const char *from = d->scanned > 0 ? p + d->scanned : p + 1;
+  const char *q = string_end(from, end, &escaped, &from);
+
+  if (q == NULL) {
+    d->scanned = from - p;
+    d->escaped = escaped;
+    return NULL;
+  }
+  if (escaped)
+    push_unescaped(L, p + 1, q);
+  else
+    lua_pushlstring(L, p + 1, q - p - 1);
+  return q + 1;
+}
+
+static const char *skip_digits (const char *p, const char *end)
+{
+  while (p < end && is_digit(*p))
+    p++;
+  return p;
+}
+
+/* Parses a number starting at p and pushes it. Accepts an optional minus
+ * sign followed by hexadecimal (0x1F), decimal with an optional fraction
+ * (1, 1.5, .5, 5.) and an optional exponent. Returns the position after it,
+ * or NULL if more input is needed to tell where it ends, in which case
+ * d->scanned is updated as for parse_string. Numbers are converted by Lua
+ * itself, so they come out exactly as tonumber() would give them. */
+static const char *parse_number (lua_State *L, json_decoder *d, const char *p, const char *end, int final)
+{
+  const char *s = p, *t;
+  char tmp[64];
+  size_t len;
+
+  if (!final) {
+    /* A number ends at the first byte that could not continue it. */
+    t = p + d->scanned;
+    while (t < end && (is_alnum(*t) || *t == '.' || *t == '+' || *t == '-'))
+      t++;
+    if (t == end) {
+      d->scanned = t - p;
+      return NULL;
+    }
+    end = t;
+  }
+
+  if (s < end && *s == '-')
+    s++;
+  if (end - s >= 3 && s[0] == '0' && s[1] == 'x' && is_xdigit(s[2])) {
+    s += 3;
+    while (s < end && is_xdigit(*s))
+      s++;
+  } else {
+    const char *digits = s;
+    s = skip_digits(s, end);
+    if (s < end && *s == '.') {
+      s = skip_digits(s + 1, end);
+      if (s - digits == 1)
+        syntax_error(L);
+    } else if (s == digits) {
+      syntax_error(L);
+    }
+    if (s < end && (*s == 'e' || *s == 'E')) {
+      t = s + 1;
+      if (t < end && (*t == '+' || *t == '-'))
+        t++;
+      if (t < end && is_digit(*t))
+        s = skip_digits(t, end);
+    }
+  }
+
+  len = s - p;
+  if (len < sizeof(tmp)) {
+    memcpy(tmp, p, len);
+    tmp[len] = '\0';
+    if (lua_stringtonumber(L, tmp) == 0)
+      syntax_error(L);
+  } else {
+    lua_pushlstring(L, p, len);
+    if (lua_stringtonumber(L, lua_tostring(L, -1)) == 0)
+      syntax_error(L);
+    lua_remove(L, -2);
+  }
+  return s;
+}
+
+/* Parses true, false or null. As with numbers, a literal running up to the
+ * end of the input may be the prefix of something longer. */
+static const char *parse_literal (lua_State *L, const char *p, const char *end, int final)
+{
+  static const char *const names[] = {"true", "false", "null"};
+  const char *name = names[*p == 't' ? 0 : *p == 'f' ? 1 : 2];
+  size_t n = strlen(name);
+  size_t avail = end - p;
+
+  if (memcmp(p, name, avail < n ? avail : n) != 0)
+    syntax_error(L);
+  if (avail < n || (avail == n && !final)) {
+    if (final)
+      syntax_error(L);
+    return NULL;
+  }
+  if (avail > n && (is_alnum(p[n]) || p[n] == '_'))
+    syntax_error(L);
+
+  if (*p == 'n')
+    lua_pushvalue(L, JSON_NULL);
+  else
+    lua_pushboolean(L, *p == 't');
+  return p + n;
+}
+
+/* Stack layout while parsing: base holds the top-level value once it is
+ * complete, then each open container has two slots, its table and the key
+ * waiting for a value (objects only). */
+#define LEVEL_TABLE(base, level) ((base) + 2 * (level) - 1)
+#define LEVEL_KEY(base, level) ((base) + 2 * (level))
+
+/* Stores the value on top of the stack into the innermost open container. */
+static void store (lua_State *L, json_decoder *d, int base)
+{
+  if (d->depth == 0) {
+    lua_replace(L, base);
+    d->state = ST_DONE;
+  } else if (d->kind[d->depth - 1] == '[') {
+    lua_rawseti(L, LEVEL_TABLE(base, d->depth), ++d->n[d->depth - 1]);
+    d->state = ST_NEXT;
+  } else {
+    lua_pushvalue(L, LEVEL_KEY(base, d->depth));
+    lua_insert(L, -2);
+    lua_rawset(L, LEVEL_TABLE(base, d->depth));
+    d->state = ST_NEXT;
+  }
+}
+
+static void open_container (lua_State *L, json_decoder *d, char kind)
+{
+  if (d->depth >= JSON_MAXDEPTH)
+    luaL_error(L, "JSON nested too deeply");
+  luaL_checkstack(L, 4, "JSON nested too deeply");
+  lua_newtable(L);
+  /* Each table gets its own metatable, as json.make_array and
+   * json.make_object give, since callers may change it. */
+  lua_createtable(L, 0, 1);
+  if (kind == '[')
+    lua_pushliteral(L, "array");
+  else
+    lua_pushliteral(L, "object");
+  lua_setfield(L, -2, "json");
+  lua_setmetatable(L, -2);
+  lua_pushnil(L);
+  d->kind[d->depth] = kind;
+  d->n[d->depth] = 0;
+  d->depth++;
+  d->state = kind == '[' ? ST_FIRST_ELEM : ST_FIRST_KEY;
+}
+
+static void close_container (lua_State *L, json_decoder *d, int base)
+{
+  lua_settop(L, LEVEL_TABLE(base, d->depth));
+  d->depth--;
+  store(L, d, base);
+}
+
+/* Runs the parser over len bytes at s. Unless final is set, a token cut off
+ * by the end of the input is left alone. Returns the number of bytes
+ * consumed; the rest must be passed in again with more input after it. */
+static size_t run (lua_State *L, json_decoder *d, int base, const char *s, size_t len, int final)
+{
+  const char *p = s, *end = s + len, *next;
+
+  for (;;) {
+    p = skip_space(p, end);
+    if (p >= end) {
+      d->scanned = 0;
+      return p - s;
+    }
+    /* What d->scanned says is only about a token at the start of s. */
+    if (p != s)
+      d->scanned = 0;
+    switch (d->state) {
+      case ST_DONE:
+        syntax_error(L);
+        break;
+      case ST_NEXT:
+        if (*p == ',') {
+          d->state = d->kind[d->depth - 1] == '[' ? ST_VALUE : ST_KEY;
+          p++;
+        } else if (*p == (d->kind[d->depth - 1] == '[' ? ']' : '}')) {
+          close_container(L, d, base);
+          p++;
+        } else {
+          syntax_error(L);
+        }
+        break;
+      case ST_COLON:
+        if (*p != ':')
+          syntax_error(L);
+        d->state = ST_VALUE;
+        p++;
+        break;
+      case ST_FIRST_KEY:
+        if (*p == '}') {
+          close_container(L, d, base);
+          p++;
+          break;
+        }
+        /* fall through */
+      case ST_KEY:
+        if (*p != '"')
+          syntax_error(L);
+        next = parse_string(L, d, p, end);
+        if (next == NULL)
+          goto incomplete;
+        lua_replace(L, LEVEL_KEY(base, d->depth));
+        d->state = ST_COLON;
+        p = next;
+        break;
+      case ST_FIRST_ELEM:
+        if (*p == ']') {
+          close_container(L, d, base);
+          p++;
+          break;
+        }
+        /* fall through */
+      case ST_VALUE:
+        switch (*p) {
+          case '[':
+          case '{':
+            open_container(L, d, *p);
+            p++;
+            continue;
+          case '"':
+            next = parse_string(L, d, p, end);
+            break;
+          case 't':
+          case 'f':
+          case 'n':
+            next = parse_literal(L, p, end, final);
+            break;
+          default:
+            if (*p != '-' && *p != '.' && !is_digit(*p))
+              syntax_error(L);
+            next = parse_number(L, d, p, end, final);
+            break;
+        }
+        if (next == NULL)
+          goto incomplete;
+        store(L, d, base);
+        p = next;
+        break;
+    }
+  }
+
+incomplete:
+  if (final)
+    syntax_error(L);
+  return p - s;
+}
+
+static void decoder_init (json_decoder *d)
+{
+  d->state = ST_VALUE;
+  d->depth = 0;
+  d->failed = 0;
+  d->saved = 0;
+  d->buf = NULL;
+  d->len = d->size = 0;
+  d->scanned = 0;
+  d->escaped = 0;
+}
+
+/* decode(data)
+ *
+ * Parses a complete document and returns its value. Raises an error if it
+ * is not valid JSON. */
+static int l_decode (lua_State *L)
+{
+  size_t len;
+  const char *s = luaL_checklstring(L, 1, &len);
+  json_decoder d;
+
+  decoder_init(&d);
+  lua_settop(L, 1);
+  lua_pushnil(L);
+  run(L, &d, 2, s, len, 1);
+  if (d.state != ST_DONE)
+    syntax_error(L);
+  lua_settop(L, 2);
+  return 1;
+}
+
+static json_decoder *check_decoder (lua_State *L)
+{
+  json_decoder *d = (json_decoder *) luaL_checkudata(L, 1, DECODER_METATABLE);
+  if (d->failed)
+    syntax_error(L);
+  return d;
+}
+
+/* Moves the containers parked in the user value table back onto the stack.
+ * Returns the base index for run(). */
+static int decoder_restore (lua_State *L, json_decoder *d)
+{
+  int uv;
+
+  lua_getiuservalue(L, 1, 1);
+  uv = lua_gettop(L);
+  luaL_checkstack(L, d->saved + 4, "JSON nested too deeply");
+  if (d->saved == 0)
+    lua_pushnil(L);
+  for (int i = 1; i <= d->saved; i++)
+    lua_rawgeti(L, uv, i);
+  return uv + 1;
+}
+
+static void decoder_park (lua_State *L, json_decoder *d, int base)
+{
+  int uv = base - 1;
+  int n = lua_gettop(L) - base + 1;
+
+  for (int i = 1; i <= n; i++) {
+    lua_pushvalue(L, base + i - 1);
+    lua_rawseti(L, uv, i);
+  }
+  for (int i = n + 1; i <= d->saved; i++) {
+    lua_pushnil(L);
+    lua_rawseti(L, uv, i);
+  }
+  d->saved = n;
+  lua_settop(L, uv - 1);
+}
+
+/* Parses as much of the carried-over input plus data as possible and keeps
+ * whatever is left for next time. */
+static void decoder_run (lua_State *L, json_decoder *d, const char *data, size_t len, int final)
+{
+  int base;
+  size_t used;
+
+  d->failed = 1;
+  base = decoder_restore(L, d);
+  if (d->len == 0) {
+    used = run(L, d, base, data, len, final);
+    data += used;
+    len -= used;
+  } else {
+    if (d->size - d->len < len) {
+      size_t size = d->size;
+      char *buf;
+      while (size - d->len < len)
+        size = size ? 2 * size : 4096;
+      buf = (char *) realloc(d->buf, size);
+      if (buf == NULL)
+        luaL_error(L, "out of memory");
+      d->buf = buf;
+      d->size = size;
+    }
+    memcpy(d->buf + d->len, data, len);
+    d->len += len;
+    used = run(L, d, base, d->buf, d->len, final);
+    data = d->buf + used;
+    len = d->len - used;
+    d->len = 0;
+  }
+  if (len > 0) {
+    if (d->size < len) {
+      char *buf = (char *) realloc(d->buf, len);
+      if (buf == NULL)
+        luaL_error(L, "out of memory");
+      d->buf = buf;
+      d->size = len;
+    }
+    if (data != d->buf)
+      memmove(d->buf, data, len);
+    d->len = len;
+  }
+  decoder_park(L, d, base);
+  d->failed = 0;
+}
+
+/* decoder()
+ *
+ * Returns a decoder for a document that arrives in pieces. */
+static int l_decoder (lua_State *L)
+{
+  json_decoder *d = (json_decoder *) lua_newuserdatauv(L, sizeof(json_decoder), 1);
+
+  decoder_init(d);
+  luaL_setmetatable(L, DECODER_METATABLE);
+  lua_newtable(L);
+  lua_setiuservalue(L, -2, 1);
+  return 1;
+}
+
+/* decoder:feed(data)
+ *
+ * Parses the next piece of the document. Raises an error as soon as the input
+ * cannot be valid JSON; after that the decoder keeps failing. */
+static int decoder_feed (lua_State *L)
+{
+  json_decoder *d = check_decoder(L);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+
+  decoder_run(L, d, data, len, 0);
+  return 0;
+}
+
+/* decoder:finish()
+ *
+ * Parses whatever input is still pending and returns the document's value. */
+static int decoder_finish (lua_State *L)
+{
+  json_decoder *d = check_decoder(L);
+
+  lua_settop(L, 1);
+  decoder_run(L, d, "", 0, 1);
+  if (d->state != ST_DONE) {
+    d->failed = 1;
+    syntax_error(L);
+  }
+  lua_getiuservalue(L, 1, 1);
+  lua_rawgeti(L, -1, 1);
+  return 1;
+}
+
+static int decoder_gc (lua_State *L)
+{
+  json_decoder *d = (json_decoder *) luaL_checkudata(L, 1, DECODER_METATABLE);
+  free(d->buf);
+  d->buf = NULL;
+  d->len = d->size = 0;
+  return 0;
+}
+
+/* Generator output goes to a malloc'd buffer owned by a userdata, so that it
+ * is released by the garbage collector if generation raises an error. */
+static void buffer_reserve (lua_State *L, json_buffer *B, size_t n)
+{
+  if (B->size - B->n < n) {
+    size_t size = B->size ? B->size : 1024;
+    char *b;
+    while (size - B->n < n)
+      size *= 2;
+    b = (char *) realloc(B->b, size);
+    if (b == NULL)
+      luaL_error(L, "out of memory");
+    B->b = b;
+    B->size = size;
+  }
+}
+
+static inline void buffer_add (lua_State *L, json_buffer *B, const char *s, size_t n)
+{
+  buffer_reserve(L, B, n);
+  memcpy(B->b + B->n, s, n);
+  B->n += n;
+}
+
+#define buffer_addliteral(L, B, s) buffer_add(L, B, "" s, sizeof(s) - 1)
+
+static int buffer_gc (lua_State *L)
+{
+  json_buffer *B = (json_buffer *) luaL_checkudata(L, 1, BUFFER_METATABLE);
+  free(B->b);
+  B->b = NULL;
+  return 0;
+}
+
+/* The escape letter for each byte that has one. Other control characters are
+ * passed through as they are. */
+static const char escapes[256] = {
+  0, 0, 0, 0, 0, 0, 0, 0, 'b', 't', 'n', 0, 'f', 'r', 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, '"', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '/',
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, '\\', 0, 0, 0,
+};
+
+static void encode_string (lua_State *L, json_buffer *B, const char *s, size_t len)
+{
+  const char *end = s + len;
+  char *o;
+
+  buffer_reserve(L, B, 2 * len + 2);
+  o = B->b + B->n;
+  *o++ = '"';
+  while (s < end) {
+#ifdef JSON_SSE2
+    const __m128i quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i ctl = _mm_set1_epi8(0x1F);
+    while (end - s >= 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *) s);
+      __m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, quote),
+            _mm_cmpeq_epi8(x, backslash)), _mm_or_si128(_mm_cmpeq_epi8(x, slash),
+            _mm_cmpeq_epi8(_mm_min_epu8(x, ctl), x)));
+      unsigned int mask = _mm_movemask_epi8(m);
+      int n = mask ? first_bit(mask) : 16;
+      memcpy(o, s, n);
+      o += n;
+      s += n;
+      if (mask)
+        break;
+    }
+#endif
+    for (; s < end; s++) {
+      char e = escapes[(unsigned char) *s];
+      if (e) {
+        *o++ = '\\';
+        *o++ = e;
+      } else {
+        *o++ = *s;
+      }
+#ifdef JSON_SSE2
+      /* Back to the vector loop if there is a full block left. */
+      if (end - s > 16) {
+        s++;
+        break;
+      }
+#endif
+    }
+  }
+  *o++ = '"';
+  B->n = o - B->b;
+}
+
+static void encode_value (lua_State *L, json_buffer *B, int idx, int depth);
+
+static int is_array (lua_State *L, int idx)
+{
+  if (lua_getmetatable(L, idx)) {
+    int kind = 0;
+    lua_pushliteral(L, "json");
+    if (lua_rawget(L, -2) == LUA_TSTRING) {
+      const char *s = lua_tostring(L, -1);
+      if (strcmp(s, "array") == 0)
+        kind = 1;
+      else if (strcmp(s, "object") == 0)
+        kind = -1;
+    }
+    lua_pop(L, 2);
+    if (kind)
+      return kind > 0;
+  }
+  return luaL_len(L, idx) > 0;
+}
+
+static void encode_pair (lua_State *L, json_buffer *B, int first, int depth)
+{
+  size_t len;
+  const char *s;
+
+  if (!first)
+    buffer_addliteral(L, B, ", ");
+  /* Numeric keys are written as strings, as string.gsub would have. */
+  if (lua_type(L, -2) != LUA_TSTRING && lua_type(L, -2) != LUA_TNUMBER)
+    luaL_error(L, "Unknown key type in generate");
+  lua_pushvalue(L, -2);
+  s = lua_tolstring(L, -1, &len);
+  encode_string(L, B, s, len);
+  lua_pop(L, 1);
+  buffer_addliteral(L, B, ": ");
+  encode_value(L, B, lua_gettop(L), depth);
+}
+
+static void encode_table (lua_State *L, json_buffer *B, int idx, int depth)
+{
+  int first = 1;
+
+  if (depth >= JSON_MAXDEPTH)
+    luaL_error(L, "JSON nested too deeply");
+  luaL_checkstack(L, 8, "JSON nested too deeply");
+
+  if (is_array(L, idx)) {
+    buffer_addliteral(L, B, "[");
+    for (lua_Integer i = 1; lua_geti(L, idx, i) != LUA_TNIL; i++) {
+      if (i > 1)
+        buffer_addliteral(L, B, ", ");
+      encode_value(L, B, lua_gettop(L), depth + 1);
+      lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    buffer_addliteral(L, B, "]");
+    return;
+  }
+
+  buffer_addliteral(L, B, "{");
+  if (luaL_getmetafield(L, idx, "__pairs") != LUA_TNIL) {
+    /* Iterate the way pairs() would, e.g. for stdnse.output_table. */
+    lua_pushvalue(L, idx);
+    lua_call(L, 1, 3);
+    for (;;) {
+      lua_pushvalue(L, -3);
+      lua_pushvalue(L, -3);
+      lua_pushvalue(L, -3);
+      lua_call(L, 2, 2);
+      if (lua_isnil(L, -2)) {
+        lua_pop(L, 2);
+        break;
+      }
+      encode_pair(L, B, first, depth + 1);
+      first = 0;
+      lua_pop(L, 1);
+      lua_replace(L, -2);
+    }
+    lua_pop(L, 3);
+  } else {
+    lua_pushnil(L);
+    while (lua_next(L, idx)) {
+      encode_pair(L, B, first, depth + 1);
+      first = 0;
+      lua_pop(L, 1);
+    }
+  }
+  buffer_addliteral(L, B, "}");
+}
+
+static void encode_value (lua_State *L, json_buffer *B, int idx, int depth)
+{
+  size_t len;
+  const char *s;
+
+  switch (lua_type(L, idx)) {
+    case LUA_TBOOLEAN:
+      if (lua_toboolean(L, idx))
+        buffer_addliteral(L, B, "true");
+      else
+        buffer_addliteral(L, B, "false");
+      break;
+    case LUA_TNUMBER:
+      /* Same formatting as tostring(). */
+      lua_pushvalue(L, idx);
+      s = lua_tolstring(L, -1, &len);
+      buffer_add(L, B, s, len);
+      lua_pop(L, 1);
+      break;
+    case LUA_TSTRING:
+      s = lua_tolstring(L, idx, &len);
+      encode_string(L, B, s, len);
+      break;
+    case LUA_TTABLE:
+      if (lua_rawequal(L, idx, JSON_NULL))
+        buffer_addliteral(L, B, "null");
+      else
+        encode_table(L, B, idx, depth);
+      break;
+    default:
+      luaL_error(L, "Unknown data type in generate");
+  }
+}
+
+/* encode(value)
+ *
+ * Returns the JSON text for value. Tables are arrays or objects according to
+ * the same rules as json.typeof. */
+static int l_encode (lua_State *L)
+{
+  json_buffer *B;
+
+  luaL_checkany(L, 1);
+  lua_settop(L, 1);
+  B = (json_buffer *) lua_newuserdatauv(L, sizeof(json_buffer), 0);
+  B->b = NULL;
+  B->n = B->size = 0;
+  luaL_setmetatable(L, BUFFER_METATABLE);
+  encode_value(L, B, 1, 0);
+  lua_pushlstring(L, B->b, B->n);
+  free(B->b);
+  B->b = NULL;
+  return 1;
+}
+
+LUALIB_API int luaopen_json (lua_State *L)
+{
+  static const luaL_Reg jsonlib[] = {
+    {"decode", l_decode},
+    {"decoder", l_decoder},
+    {"encode", l_encode},
+    {NULL, NULL}
+  };
+  static const luaL_Reg decoder_methods[] = {
+    {"feed", decoder_feed},
+    {"finish", decoder_finish},
+    {"__gc", decoder_gc},
+    {NULL, NULL}
+  };
+
+  luaL_newmetatable(L, BUFFER_METATABLE);
+  lua_pushcfunction(L, buffer_gc);
+  lua_setfield(L, -2, "__gc");
+  lua_pop(L, 1);
+
+  luaL_newlibtable(L, jsonlib);
+  lua_newtable(L); /* NULL */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -3, "NULL");
+
+  luaL_newmetatable(L, DECODER_METATABLE);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  lua_pushvalue(L, -2);
+  luaL_setfuncs(L, decoder_methods, 1);
+  lua_pop(L, 1);
+
+  luaL_setfuncs(L, jsonlib, 1);
+  return 1;
+}
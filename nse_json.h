@@ -0,0 +1,7 @@
+#ifndef NSE_JSON
+#define NSE_JSON
+
+#define NSE_JSONLIBNAME "nmapjson"
+LUALIB_API int luaopen_json (lua_State *L);
+
+#endif
@@ -18,11 +18,20 @@
 #include "nse_openssl.h"
 #include "nse_debug.h"
 #include "nse_lpeg.h"
+#include "nse_json.h"
+#include "nse_strmatch.h"
+#include "nse_diskcache.h"
+#include "nse_wordlist.h"
+#include "nse_bytecode.h"
 #include "nse_libssh2.h"
 #include "nse_zlib.h"
 
 #include <math.h>
 
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+
 #define NSE_MAIN "NSE_MAIN" /* the main function */
 
 /* Script Scan phases */
@@ -37,11 +46,15 @@
 #define NSE_WAITING_TO_RUNNING "NSE_WAITING_TO_RUNNING"
 #define NSE_DESTRUCTOR "NSE_DESTRUCTOR"
 #define NSE_SELECTED_BY_NAME "NSE_SELECTED_BY_NAME"
+#define NSE_HOST_KEY "NSE_HOST_KEY"
 #define NSE_CURRENT_HOSTS "NSE_CURRENT_HOSTS"
 
 #define NSE_FORMAT_TABLE "NSE_FORMAT_TABLE"
 #define NSE_FORMAT_XML "NSE_FORMAT_XML"
 #define NSE_PARALLELISM "NSE_PARALLELISM"
+#define NSE_WORKER_BEGIN "NSE_WORKER_BEGIN"
+#define NSE_WORKER_DUMP "NSE_WORKER_DUMP"
+#define NSE_WORKER_MERGE "NSE_WORKER_MERGE"
 
 #ifndef MAXPATHLEN
 #  define MAXPATHLEN 2048
@@ -162,6 +175,7 @@ static int scp (lua_State *L)
   {
     case 0: /* printStats */
       progress->printStats((double) luaL_checknumber(L, 2), NULL);
+      connect_governor.printStats("NSE");
       break;
     case 1:
       progress->printStatsIfNecessary((double) luaL_checknumber(L, 2), NULL);
@@ -364,6 +378,7 @@ static void open_cnse (lua_State *L)
     {"xml_write_escaped", l_xml_write_escaped},
     {"xml_newline", l_xml_newline},
     {"protect_xml", l_protect_xml},
+    {"loadfile_cached", l_loadfile_cached},
     {NULL, NULL}
   };
 
@@ -565,6 +580,10 @@ static void set_nmap_libraries (lua_State *L)
     {NSE_DBLIBNAME, luaopen_db},
     {LFSLIBNAME, luaopen_lfs},
     {LPEGLIBNAME, luaopen_lpeg},
+    {NSE_JSONLIBNAME, luaopen_json},
+    {NSE_STRMATCHLIBNAME, luaopen_strmatch},
+    {NSE_DISKCACHELIBNAME, luaopen_diskcache},
+    {NSE_WORDLISTLIBNAME, luaopen_wordlist},
 #ifdef HAVE_LIBSSH2
     {LIBSSH2LIBNAME, luaopen_libssh2},
 #endif
@@ -598,7 +617,7 @@ static int init_main (lua_State *L)
 
   if (nmap_fetchfile(path, sizeof(path), "nse_main.lua") != 1)
     luaL_error(L, "could not locate nse_main.lua");
-  if (luaL_loadfile(L, path) != 0)
+  if (nse_loadfile_cached(L, path, "", 0, "", 0) != LUA_OK)
     luaL_error(L, "could not load nse_main.lua: %s", lua_tostring(L, -1));
 
   /* The first argument to the NSE Main Lua code is the private nse
@@ -624,21 +643,13 @@ static int init_main (lua_State *L)
   return 0;
 }
 
-static int run_main (lua_State *L)
+/* Start a new host group: index the targets in NSE_CURRENT_HOSTS and push a
+ * list of their host tables. */
+static void push_current_hosts (lua_State *L, std::vector<Target *> *targets)
 {
-  std::vector<Target *> *targets = (std::vector<Target*> *)
-      lua_touserdata(L, 1);
-
-  /* New host group */
   lua_newtable(L);
   lua_setfield(L, LUA_REGISTRYINDEX, NSE_CURRENT_HOSTS);
 
-  lua_getfield(L, LUA_REGISTRYINDEX, NSE_MAIN);
-  assert(lua_isfunction(L, -1));
-
-  /* The first argument to the NSE main function is the list of targets.  This
-   * has all the target names, 1-N, in a list.
-   */
   lua_createtable(L, targets->size(), 0);
   int targets_table = lua_gettop(L);
   lua_getfield(L, LUA_REGISTRYINDEX, NSE_CURRENT_HOSTS);
@@ -666,6 +677,20 @@ static int run_main (lua_State *L)
     lua_rawset(L, current_hosts); /* add to NSE_CURRENT_HOSTS */
   }
   lua_settop(L, targets_table);
+}
+
+static int run_main (lua_State *L)
+{
+  std::vector<Target *> *targets = (std::vector<Target*> *)
+      lua_touserdata(L, 1);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, NSE_MAIN);
+  assert(lua_isfunction(L, -1));
+
+  /* The first argument to the NSE main function is the list of targets.  This
+   * has all the target names, 1-N, in a list.
+   */
+  push_current_hosts(L, targets);
 
   /* Push script scan phase type. Second argument to NSE main function */
   switch (o.current_scantype)
@@ -783,6 +808,18 @@ void nse_selectedbyname (lua_State *L)
   }
 }
 
+/* void nse_hostkey (lua_State *L)                        [-0, +1, e]
+ *
+ * Returns a string identifying the host the running thread is scanning (its
+ * IP address), or nil for prerule and postrule scripts.
+ */
+void nse_hostkey (lua_State *L)
+{
+  lua_getfield(L, LUA_REGISTRYINDEX, NSE_HOST_KEY);
+  if (!lua_isnil(L, -1))
+    lua_call(L, 0, 1);
+}
+
 /* void nse_gettarget (lua_State *L)                  [-0, +1, -]
  *
  * Given the index to a string on the stack identifying the host, an ip or a
@@ -831,11 +868,8 @@ void open_nse (void)
   }
 }
 
-void script_scan (std::vector<Target *> &targets, stype scantype)
+static void script_scan_group (std::vector<Target *> &targets)
 {
-  o.current_scantype = scantype;
-
-  assert(L_NSE != NULL);
   lua_settop(L_NSE, 0); /* clear the stack */
 
   lua_pushcfunction(L_NSE, nseU_traceback);
@@ -847,6 +881,240 @@ void script_scan (std::vector<Target *> &targets, stype scantype)
   lua_settop(L_NSE, 0);
 }
 
+#ifndef WIN32
+/* One --script-workers child process and its share of the host group. */
+struct ScriptWorker {
+  std::vector<Target *> targets;
+  pid_t pid;
+  int fd; /* read end of the pipe carrying the worker's journal */
+  std::string journal;
+  bool ok;
+};
+
+/* Runs in the child: scan the worker's hosts, then return the journal of
+ * side effects for the parent to replay (see nse_main.lua). */
+static int run_worker (lua_State *L)
+{
+  lua_getfield(L, LUA_REGISTRYINDEX, NSE_WORKER_BEGIN);
+  lua_call(L, 0, 0);
+  lua_pushcfunction(L, run_main);
+  lua_pushvalue(L, 1);
+  lua_call(L, 1, 0);
+  lua_getfield(L, LUA_REGISTRYINDEX, NSE_WORKER_DUMP);
+  lua_call(L, 0, 1);
+  return 1;
+}
+
+static void worker_main (ScriptWorker *w, unsigned int nworkers)
+{
+  const char *journal;
+  size_t len;
+  ssize_t n;
+  int status = 1;
+
+  nse_nsock_detach_pool();
+  nse_nsock_share_sockets(nworkers);
+  lua_settop(L_NSE, 0);
+  lua_pushcfunction(L_NSE, nseU_traceback);
+  lua_pushcfunction(L_NSE, run_worker);
+  lua_pushlightuserdata(L_NSE, &w->targets);
+  if (lua_pcall(L_NSE, 1, 1, 1) != 0) {
+    error("%s: Script scan worker %ld failed: %s", SCRIPT_ENGINE,
+          (long) getpid(), lua_tostring(L_NSE, -1));
+  } else {
+    journal = lua_tolstring(L_NSE, -1, &len);
+    while (len > 0 && (n = write(w->fd, journal, len)) != 0) {
+      if (n < 0) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      journal += n;
+      len -= n;
+    }
+    status = len == 0 ? 0 : 1;
+  }
+  log_flush_all();
+  fflush(stdout);
+  fflush(stderr);
+  /* Don't run atexit handlers or Lua finalizers that belong to the parent. */
+  _exit(status);
+}
+
+/* Replays the journals of the successful workers in the parent. Workers whose
+ * journal could not be loaded are marked as failed. */
+static int merge_workers (lua_State *L)
+{
+  std::vector<Target *> *targets = (std::vector<Target *> *) lua_touserdata(L, 1);
+  std::vector<ScriptWorker> *workers = (std::vector<ScriptWorker> *) lua_touserdata(L, 2);
+  std::vector<ScriptWorker *> merged;
+
+  push_current_hosts(L, targets);
+  lua_pop(L, 1);
+
+  lua_getfield(L, LUA_REGISTRYINDEX, NSE_WORKER_MERGE);
+  lua_newtable(L);
+  for (std::vector<ScriptWorker>::iterator w = workers->begin(); w != workers->end(); w++) {
+    if (!w->ok)
+      continue;
+    merged.push_back(&*w);
+    lua_pushlstring(L, w->journal.data(), w->journal.size());
+    lua_rawseti(L, -2, merged.size());
+  }
+  lua_call(L, 1, 1);
+  for (lua_Integer i = 1; i <= (lua_Integer) lua_rawlen(L, -1); i++) {
+    lua_rawgeti(L, -1, i);
+    merged[lua_tointeger(L, -1) - 1]->ok = false;
+    lua_pop(L, 1);
+  }
+  return 0;
+}
+
+/* Split a host script scan over o.scriptworkers forked processes. NSE (and
+ * the rest of nmap) is single-threaded, so parallelism comes from separate
+ * processes, each with its own copy of the Lua state. Hosts are dealt out
+ * round-robin; all the scripts for a given host run in the same worker, so
+ * host.registry behaves as usual. The socket slots of --max-parallelism are
+ * divided among the workers. Hosts of a worker that fails are scanned again
+ * in this process. */
+static void script_scan_workers (std::vector<Target *> &targets)
+{
+  std::vector<ScriptWorker> workers;
+  std::vector<Target *> retry;
+  unsigned int nworkers = MIN((unsigned int) o.scriptworkers, targets.size());
+  unsigned int i, running = 0;
+  char buf[8192];
+
+  workers.resize(nworkers);
+  for (i = 0; i < targets.size(); i++)
+    workers[i % nworkers].targets.push_back(targets[i]);
+
+  /* Anything still buffered would be written once by each child. */
+  log_flush_all();
+  fflush(stdout);
+  fflush(stderr);
+
+  for (i = 0; i < nworkers; i++) {
+    ScriptWorker *w = &workers[i];
+    int fds[2];
+
+    w->pid = -1;
+    w->fd = -1;
+    w->ok = false;
+    if (pipe(fds) == -1) {
+      error("%s: pipe() failed for script scan worker: %s", SCRIPT_ENGINE, strerror(errno));
+      continue;
+    }
+    w->pid = fork();
+    if (w->pid == -1) {
+      error("%s: fork() failed for script scan worker: %s", SCRIPT_ENGINE, strerror(errno));
+      close(fds[0]);
+      close(fds[1]);
+      continue;
+    }
+    if (w->pid == 0) {
+      for (unsigned int j = 0; j < i; j++) {
+        if (workers[j].fd != -1)
+          close(workers[j].fd);
+      }
+      close(fds[0]);
+      w->fd = fds[1];
+      worker_main(w, nworkers);
+    }
+    close(fds[1]);
+    w->fd = fds[0];
+    running++;
+  }
+
+  if (o.verbose)
+    log_write(LOG_STDOUT, "%s: Script scanning %u hosts in %u worker processes.\n",
+              SCRIPT_ENGINE, (unsigned int) targets.size(), running);
+
+  ScanProgressMeter progress(SCRIPT_ENGINE);
+  while (running > 0) {
+    struct timeval tv;
+    fd_set fds;
+    int maxfd = -1;
+
+    FD_ZERO(&fds);
+    for (i = 0; i < nworkers; i++) {
+      if (workers[i].fd != -1) {
+        checked_fd_set(workers[i].fd, &fds);
+        maxfd = MAX(maxfd, workers[i].fd);
+      }
+    }
+    tv.tv_sec = 1;
+    tv.tv_usec = 0;
+    if (select(maxfd + 1, &fds, NULL, NULL, &tv) == -1) {
+      if (errno == EINTR)
+        continue;
+      fatal("%s: select() failed waiting for script scan workers: %s", SCRIPT_ENGINE, strerror(errno));
+    }
+    for (i = 0; i < nworkers; i++) {
+      ScriptWorker *w = &workers[i];
+      if (w->fd == -1 || !checked_fd_isset(w->fd, &fds))
+        continue;
+      ssize_t n = read(w->fd, buf, sizeof(buf));
+      if (n > 0) {
+        w->journal.append(buf, n);
+      } else if (n == 0 || errno != EINTR) {
+        int status;
+        close(w->fd);
+        w->fd = -1;
+        running--;
+        while (waitpid(w->pid, &status, 0) == -1 && errno == EINTR)
+          ;
+        w->ok = n == 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+      }
+    }
+    double done = 1.0 - (double) running / nworkers;
+    if (keyWasPressed())
+      progress.printStats(done, NULL);
+    else
+      progress.printStatsIfNecessary(done, NULL);
+  }
+  progress.endTask(NULL, NULL);
+
+  lua_settop(L_NSE, 0);
+  lua_pushcfunction(L_NSE, nseU_traceback);
+  lua_pushcfunction(L_NSE, merge_workers);
+  lua_pushlightuserdata(L_NSE, &targets);
+  lua_pushlightuserdata(L_NSE, &workers);
+  if (lua_pcall(L_NSE, 2, 0, 1))
+    error("%s: Could not merge script scan worker results: %s", SCRIPT_ENGINE,
+          lua_tostring(L_NSE, -1));
+  lua_settop(L_NSE, 0);
+
+  unsigned int failed = 0;
+  for (i = 0; i < nworkers; i++) {
+    if (!workers[i].ok) {
+      retry.insert(retry.end(), workers[i].targets.begin(), workers[i].targets.end());
+      failed++;
+    }
+  }
+  if (!retry.empty()) {
+    error("%s: %u of %u script scan workers failed; scanning their %u hosts in-process.",
+          SCRIPT_ENGINE, failed, nworkers, (unsigned int) retry.size());
+    script_scan_group(retry);
+  }
+}
+#endif
+
+void script_scan (std::vector<Target *> &targets, stype scantype)
+{
+  o.current_scantype = scantype;
+
+  assert(L_NSE != NULL);
+
+#ifndef WIN32
+  if (scantype == SCRIPT_SCAN && o.scriptworkers > 1 && targets.size() > 1) {
+    script_scan_workers(targets);
+    return;
+  }
+#endif
+  script_scan_group(targets);
+}
+
 void close_nse (void)
 {
   if (L_NSE != NULL)
@@ -46,6 +46,7 @@ void nse_restore (lua_State *, int);
 void nse_destructor (lua_State *, char);
 void nse_base (lua_State *);
 void nse_selectedbyname (lua_State *);
+void nse_hostkey (lua_State *);
 void nse_gettarget (lua_State *, int);
 
 void open_nse (void);
@@ -52,6 +52,10 @@ local SELECTED_BY_NAME = "NSE_SELECTED_BY_NAME";
 local FORMAT_TABLE = "NSE_FORMAT_TABLE";
 local FORMAT_XML = "NSE_FORMAT_XML";
 local PARALLELISM = "NSE_PARALLELISM";
+local HOST_KEY = "NSE_HOST_KEY";
+local WORKER_BEGIN = "NSE_WORKER_BEGIN";
+local WORKER_DUMP = "NSE_WORKER_DUMP";
+local WORKER_MERGE = "NSE_WORKER_MERGE";
 
 -- Unique value indicating the action function is going to run.
 local ACTION_STARTING = {};
@@ -61,6 +65,27 @@ local ACTION_STARTING = {};
 -- count worker threads started by scripts.
 local CONCURRENCY_LIMIT = 1000;
 
+-- Scheduling weights of script categories (see schedule in run). A script
+-- gets the lowest weight of its categories, or DEFAULT_WEIGHT. Lower weights
+-- yield to other scripts on the same host.
+local CATEGORY_WEIGHTS = {
+  brute = 1,
+  dos = 1,
+  fuzzer = 1,
+  intrusive = 2,
+};
+local DEFAULT_WEIGHT = 4;
+
+-- Threads with less than this fraction of --script-timeout left are resumed
+-- before all others, earliest deadline first.
+local DEADLINE_FRACTION = 0.1;
+
+-- CPU seconds that one pass of the main loop may spend resuming threads. The
+-- threads that did not get a turn stay runnable for the next pass, in which
+-- they are ordered again, so a thread's weight decides how often it runs when
+-- there is more work than CPU.
+local SCHEDULE_SLICE = 0.01;
+
 -- Table of different supported rules.
 local NSE_SCRIPT_RULES = {
   prerule = "prerule",
@@ -103,11 +128,11 @@ local traceback = debug.traceback;
 local _R = debug.getregistry();
 
 local io = require "io";
-local lines = io.lines;
 local open = io.open;
 
 local math = require "math";
 local max = math.max;
+local min = math.min;
 
 local package = require "package";
 
@@ -130,6 +155,7 @@ local sort = table.sort;
 local unpack = table.unpack;
 
 local os = require "os"
+local clock = os.clock
 local time = os.time
 local difftime = os.difftime
 
@@ -139,7 +165,7 @@ do -- Add loader to look in nselib/?.lua (nselib/ can be in multiple places)
     local name = "nselib/"..lib..".lua";
     local type, path = cnse.fetchfile_absolute(name);
     if type == "file" then
-      return assert(loadfile(path));
+      return assert(cnse.loadfile_cached(path));
     else
       return "\n\tNSE failed to find "..name.." in search paths.";
     end
@@ -251,19 +277,9 @@ local function table_size (t)
 end
 
 local function loadscript (filename)
-  local source = "@"..filename;
-  local function ld ()
-    -- header for scripts to allow setting the environment
-    yield [[return function (_ENV) return function (...)]];
-    -- actual script
-    for line in lines(filename, 2^15) do
-      yield(line);
-    end
-    -- footer...
-    yield [[ end end]];
-    return nil;
-  end
-  return assert(load(wrap(ld), source, "t"))();
+  -- The header and footer allow setting the environment of the script.
+  return assert(cnse.loadfile_cached(filename,
+      [[return function (_ENV) return function (...)]], [[ end end]]))();
 end
 
 -- recursively copy a table, for host/port tables
@@ -288,6 +304,26 @@ local function K (a)
   return kw
 end
 
+-- In a --script-workers child process, this is the list of side effects
+-- (script output, port state and version changes, new targets) that the
+-- parent nmap process must replay. It is nil in the parent.
+local worker_journal;
+
+-- Per-script resource use for the --stats-every report, keyed by script id:
+-- number of script instances (threads) started and finished, CPU time spent
+-- resuming them (including their stdnse.new_thread workers), and wall time
+-- from start to finish. Reset for each scan phase.
+local script_stats = {};
+local function get_script_stats (id)
+  local stats = script_stats[id];
+  if not stats then
+    stats = {id = id, threads = 0, done = 0, cpu = 0, wall = 0,
+        running_since = 0};
+    script_stats[id] = stats;
+  end
+  return stats;
+end
+
 local REQUIRE_ERROR = {};
 rawset(stdnse, "silent_require", function (...)
   local status, mod = pcall(require, ...);
@@ -384,6 +420,16 @@ do
 
       if self.type == "prerule" or self.type == "postrule" then
         cnse.script_set_output(self.id, tab, str);
+      elseif worker_journal then
+        insert(worker_journal, {
+          op = "output",
+          host = {ip = self.host.ip, targetname = self.host.targetname},
+          port = self.type == "portrule" and
+            {number = self.port.number, protocol = self.port.protocol} or nil,
+          id = self.id,
+          tab = tab,
+          str = str,
+        });
       elseif self.type == "hostrule" then
         cnse.host_set_output(self.host, self.id, tab, str);
       elseif self.type == "portrule" then
@@ -430,6 +476,11 @@ do
       self.start_time = self.parent.start_time
     else
       self.start_time = time()
+      local stats = get_script_stats(self.id);
+      self.started_at = nmap.clock();
+      stats.threads = stats.threads + 1;
+      -- Sum of start times of running instances, for their wall time so far.
+      stats.running_since = stats.running_since + self.started_at;
     end
   end
 
@@ -437,6 +488,13 @@ do
   -- destructor handles.
   function Thread:close (timeouts, result)
     self.error = result;
+    if not self.worker and self.started_at then
+      local stats = get_script_stats(self.id);
+      stats.done = stats.done + 1;
+      stats.wall = stats.wall + nmap.clock() - self.started_at;
+      stats.running_since = stats.running_since - self.started_at;
+      self.started_at = nil;
+    end
     if self.host then
       timeouts[self.host][self.co] = nil;
       -- Any more threads running for this script/host?
@@ -686,11 +744,16 @@ do
       author = rawget(env, "author"),
       license = rawget(env, "license"),
       dependencies = rawget(env, "dependencies"),
+      weight = DEFAULT_WEIGHT,
       threads = {},
       -- Make sure that the following are boolean types.
       selected_by_name = not not script_params.verbosity,
       forced_to_run = not not script_params.forced,
     };
+    for _, category in ipairs(script.categories) do
+      script.weight = min(script.weight,
+          CATEGORY_WEIGHTS[lower(category)] or DEFAULT_WEIGHT);
+    end
     return setmetatable(script, Script)
   end
 
@@ -731,19 +794,49 @@ local function get_chosen_scripts (rules)
     end
   end
 
-  local pre_T = locale {
+  -- Each rule is parsed once into a function of the script database entry
+  -- being considered. A word is true if it names one of the entry's
+  -- categories (or is "all"), and otherwise is a glob matched against the
+  -- entry's file name. Every word is evaluated, even where "and" or "or"
+  -- have already decided the result, so that a rule naming a script selects
+  -- it by name. A word that begins with a category but continues past a
+  -- comma fails the whole rule for that entry, as it always has.
+  local function binop (f)
+    return function (a, b)
+      return function (e)
+        local x, y = a(e), b(e);
+        return f(x, y);
+      end
+    end
+  end
+  local function word (w)
+    local category = lower(match(w, "^[^,]*"));
+    local complete = #category == #w;
+    return function (e)
+      if category == "all" or e.categories[category] then
+        e.abort = e.abort or not complete;
+        return true;
+      end
+      return e.match_script(w);
+    end
+  end
+  local T = P(locale {
     V "space"^0 * V "expression" * V "space"^0 * P(-1);
 
     expression = V "disjunct" + V "conjunct" + V "value";
-    disjunct = (V "conjunct" + V "value") * V "space"^0 * K "or" * V "space"^0 * V "expression" / function (a, b) return a or b end;
-    conjunct = V "value" * V "space"^0 * K "and" * V "space"^0 * V "expression" / function (a, b) return a and b end;
-    value = K "not" * V "space"^0 * V "value" / function (a) return not a end +
+    disjunct = (V "conjunct" + V "value") * V "space"^0 * K "or" * V "space"^0 * V "expression" / binop(function (a, b) return a or b end);
+    conjunct = V "value" * V "space"^0 * K "and" * V "space"^0 * V "expression" / binop(function (a, b) return a and b end);
+    value = K "not" * V "space"^0 * V "value" / function (a) return function (e) return not a(e) end end +
     P "(" * V "space"^0 * V "expression" * V "space"^0 * P ")" +
-    K "true" * Cc(true) +
-    K "false" * Cc(false) +
-    V "category" +
-    V "path";
-  }
+    K "true" * Cc(function () return true end) +
+    K "false" * Cc(function () return false end) +
+    R("\033\039", "\042\126")^1 / word; -- all graphical characters not '(', ')'
+  });
+  local compiled = {};
+  for i, rule in ipairs(rules) do
+    compiled[i] = T:match(rule) or false;
+  end
+
   -- cache/memoize result of "glob-izing" a word in a rule.
   local globs = {}
   setmetatable(globs, {
@@ -774,20 +867,18 @@ local function get_chosen_scripts (rules)
       return found;
     end
 
-    local my_cats = K "all" * Cc(true) -- pseudo-category "all" matches everything
+    local my_cats = {};
     for i, category in ipairs(categories) do
       assert(type(category) == "string", "bad entry in script database");
-      my_cats = my_cats + K(category) * Cc(true);
+      my_cats[lower(category)] = true;
     end
-
-    pre_T.path = R("\033\039", "\042\126")^1 / match_script; -- all graphical characters not '(', ')'
-    pre_T.category = my_cats
-
-    local T = P(pre_T)
+    local e = {categories = my_cats, match_script = match_script};
 
     for i, rule in ipairs(rules) do
       selected_by_name = false;
-      if T:match(rule) then
+      e.abort = false;
+      local f = compiled[i];
+      if f and f(e) and not e.abort then
         used_rules[rule] = true;
         script_params.forced = not not forced_rules[rule];
         if selected_by_name then
@@ -885,6 +976,59 @@ local function get_chosen_scripts (rules)
   return chosen_scripts;
 end
 
+-- Returns the threads in running in the order they should be resumed.
+-- Threads that are close to their --script-timeout come first, earliest
+-- deadline first, so that they get a chance to finish. The others are ordered
+-- by weighted fair queuing: first by the CPU time already spent on their
+-- host, then by the CPU time the thread itself has used divided by its
+-- script's weight. The main loop only resumes a slice's worth of threads from
+-- the front of this order before ordering them again, so hosts get an equal
+-- share of the CPU, and on one host a thread gets a share in proportion to
+-- its weight: fast discovery scripts are not starved by brute-force scripts.
+-- Free socket slots (see socket_lock in nse_nsock.cc) go to whichever thread
+-- asks first, so this order also decides who gets them.
+local function schedule (running, host_usage, thread_usage)
+  local order, keys, shares = {}, {}, {};
+  local timeout = cnse.script_timeout;
+  local now = time();
+  for co, thread in pairs(running) do
+    local host = thread.host;
+    local key = host and host_usage[host] or 0;
+    if timeout and timeout > 0 then
+      local left = timeout - difftime(now, thread.start_time);
+      if left < timeout * DEADLINE_FRACTION then
+        key = left - timeout; -- negative: ahead of all fair-queued threads
+      end
+    end
+    order[#order+1], keys[thread] = thread, key;
+    shares[thread] = (thread_usage[thread] or 0) / thread.weight;
+  end
+  sort(order, function (a, b)
+    if keys[a] ~= keys[b] then
+      return keys[a] < keys[b];
+    end
+    return shares[a] < shares[b];
+  end);
+  return order;
+end
+
+-- Print the per-script accounting of script_stats, heaviest CPU users first.
+local function print_script_stats ()
+  local list, now = {}, nmap.clock();
+  for id, stats in pairs(script_stats) do
+    list[#list+1] = stats;
+  end
+  sort(list, function (a, b) return a.cpu > b.cpu end);
+  for i = 1, min(#list, 10) do
+    local stats = list[i];
+    local running = stats.threads - stats.done;
+    log_write("stdout", format(
+        "Script %s: %d of %d threads done, %.2fs CPU, %.2fs wall",
+        stats.id, stats.done, stats.threads, stats.cpu,
+        stats.wall + running * now - stats.running_since));
+  end
+end
+
 -- run(threads)
 -- The main loop function for NSE. It handles running all the script threads.
 -- Arguments:
@@ -901,6 +1045,8 @@ local function run (threads_iter)
   local total = 0; -- Number of threads, for record keeping.
   local timeouts = {}; -- A list to save and to track scripts timeout.
   local num_threads = 0; -- Number of script instances currently running.
+  local host_usage = setmetatable({}, {__mode = "k"}); -- host to CPU seconds
+  local thread_usage = setmetatable({}, {__mode = "k"}); -- Thread to CPU seconds
 
   -- Map of yielded threads to the base Thread
   local yielded_base = setmetatable({}, {__mode = "kv"});
@@ -941,6 +1087,11 @@ local function run (threads_iter)
   _R[SELECTED_BY_NAME] = function()
     return current and current.selected_by_name;
   end
+  -- _R[HOST_KEY] is called by socket_lock in nse_nsock.cc
+  _R[HOST_KEY] = function()
+    local host = current and current.host;
+    return host and (host.ip or host.targetname);
+  end
   rawset(stdnse, "new_thread", function (main, ...)
     assert(type(main) == "function", "function expected");
     if current == nil then
@@ -973,7 +1124,10 @@ local function run (threads_iter)
     return current and current.worker;
   end);
 
-  local progress = cnse.scan_progress_meter(NAME);
+  -- Worker processes leave progress reporting (and the keyboard) to the
+  -- parent.
+  local progress = worker_journal and function () end or
+      cnse.scan_progress_meter(NAME);
 
   -- Loop while any thread is running or waiting.
   while next(running) or next(waiting) or threads_iter do
@@ -991,10 +1145,11 @@ local function run (threads_iter)
 
     local nr, nw = table_size(running), table_size(waiting);
     -- total may be 0 if no scripts are running in this phase
-    if total > 0 and cnse.key_was_pressed() then
+    if total > 0 and not worker_journal and cnse.key_was_pressed() then
       print_verbose(1, "Active NSE Script Threads: %d (%d waiting)",
           nr+nw, nw);
       progress("printStats", 1-(nr+nw)/total);
+      print_script_stats();
       if debugging() >= 2 then
         for co, thread in pairs(running) do
           thread:d("Running: %THREAD_AGAINST\n\t%s",
@@ -1060,11 +1215,36 @@ local function run (threads_iter)
       end
     end
 
+    -- Threads left runnable from the last pass may have timed out since.
     for co, thread in pairs(running) do
+      if thread:timed_out() then
+        running[co], all[co], num_threads = nil, nil, num_threads-1;
+        thread:d("%THREAD_AGAINST timed out")
+        thread:close(timeouts, "timed out");
+      end
+    end
+
+    local slice = 0;
+    for _, thread in ipairs(schedule(running, host_usage, thread_usage)) do
+      if slice >= SCHEDULE_SLICE then
+        break; -- The rest stay in running for the next pass.
+      end
+      local co = thread.co;
       current, running[co] = thread, nil;
       thread:start_time_out_clock();
 
-      if thread:resume(timeouts) then
+      local start = clock();
+      local alive = thread:resume(timeouts);
+      local cpu = clock() - start;
+      local stats = get_script_stats(thread.id);
+      stats.cpu = stats.cpu + cpu;
+      slice = slice + cpu;
+      thread_usage[thread] = (thread_usage[thread] or 0) + cpu;
+      if thread.host then
+        host_usage[thread.host] = (host_usage[thread.host] or 0) + cpu;
+      end
+
+      if alive then
         waiting[co] = thread;
         if not thread.worker then
           orphans = false
@@ -1074,8 +1254,16 @@ local function run (threads_iter)
       end
       current = nil;
     end
+    for co, thread in pairs(running) do
+      if not thread.worker then
+        orphans = false
+        break
+      end
+    end
 
-    loop(50); -- Allow nsock to perform any pending callbacks
+    -- Allow nsock to perform any pending callbacks, without waiting if some
+    -- threads are still runnable.
+    loop(next(running) and 0 or 50);
     -- Move pending threads back to running.
     for co, thread in pairs(pending) do
       pending[co], running[co] = nil, thread;
@@ -1170,6 +1358,229 @@ function format_xml(obj, key)
 end
 _R[FORMAT_XML] = format_xml
 
+-- Host script scans may be split across several nmap processes with
+-- --script-workers (see script_scan in nse_main.cc). Each worker is a fork of
+-- the parent that runs the hostrule and portrule scripts for a share of the
+-- host group. Instead of touching its (private) copy of the Target objects, a
+-- worker journals every side effect, and the parent replays the journals once
+-- all workers have finished. nmap.registry is copied back the same way, so
+-- anything a script leaves there is visible to postrule scripts as usual.
+-- Registry data is only shared within one worker while the scan runs;
+-- nmap.mutex and nmap.condvar likewise coordinate threads of one worker only.
+do
+  -- Called in the child after the fork, before it runs its share of hosts.
+  _R[WORKER_BEGIN] = function ()
+    worker_journal = {};
+    local set_port_state = nmap.set_port_state;
+    local set_port_version = nmap.set_port_version;
+    local add_targets = nmap.add_targets;
+    local function host_ref (host)
+      return {ip = host.ip, targetname = host.targetname};
+    end
+    nmap.set_port_state = function (host, port, state)
+      set_port_state(host, port, state);
+      insert(worker_journal, {op = "port_state", host = host_ref(host),
+          port = {number = port.number, protocol = port.protocol},
+          state = state});
+    end
+    nmap.set_port_version = function (host, port, probestate)
+      set_port_version(host, port, probestate);
+      insert(worker_journal, {op = "port_version", host = host_ref(host),
+          port = tcopy(port), probestate = probestate});
+    end
+    nmap.add_targets = function (...)
+      if select("#", ...) > 0 then
+        insert(worker_journal, {op = "add_targets", targets = pack(...)});
+      end
+      return add_targets(...);
+    end
+  end
+
+  -- Write obj to the buffer out as a Lua expression. Tables become calls to
+  -- T({k1, v1, k2, v2, ...}, tostring_value) so that key order (e.g. of
+  -- stdnse.output_table) and __tostring output survive the trip. Anything
+  -- that cannot be rebuilt in another process (functions, userdata,
+  -- coroutines, cycles) is left out.
+  local function dumpable (v, seen)
+    local t = type(v);
+    return t == "string" or t == "number" or t == "boolean" or
+        (t == "table" and seen and not seen[v]);
+  end
+  local function dump (obj, out, seen)
+    if type(obj) ~= "table" then
+      out[#out+1] = format("%q", obj);
+      return;
+    end
+    seen[obj] = true;
+    out[#out+1] = "T({";
+    for k, v in pairs(obj) do
+      if dumpable(k) and dumpable(v, seen) then
+        dump(k, out, seen);
+        out[#out+1] = ",";
+        dump(v, out, seen);
+        out[#out+1] = ",\n";
+      end
+    end
+    out[#out+1] = "}";
+    local mt = getmetatable(obj);
+    if type(mt) == "table" and rawget(mt, "__tostring") then
+      out[#out+1] = ",";
+      out[#out+1] = format("%q", tostring(obj));
+    end
+    out[#out+1] = ")";
+    seen[obj] = nil;
+  end
+
+  -- Returns why v cannot be sent to the parent whole, or nil if it can. A
+  -- table qualifies if everything in it does and its metatable, if any, only
+  -- holds __tostring.
+  local function undumpable (v, seen)
+    local t = type(v);
+    if t == "string" or t == "number" or t == "boolean" then
+      return nil;
+    elseif t ~= "table" then
+      return t;
+    elseif seen[v] then
+      return "cycle";
+    end
+    local mt = getmetatable(v);
+    if mt ~= nil then
+      if type(mt) ~= "table" then return "protected metatable" end
+      for k in next, mt do
+        if k ~= "__tostring" then return "metatable with "..tostring(k) end
+      end
+    end
+    seen[v] = true;
+    for k, x in next, v do
+      local why = undumpable(k, seen) or undumpable(x, seen);
+      if why then
+        seen[v] = nil;
+        return why;
+      end
+    end
+    seen[v] = nil;
+  end
+
+  -- Called in the child when its scan is finished. Returns the journal and
+  -- the registry as a Lua chunk. Registry entries that hold anything dump
+  -- would leave out are not sent at all, so that the parent keeps its own
+  -- copy (or the next host group's scripts rebuild it) rather than getting a
+  -- stripped one.
+  _R[WORKER_DUMP] = function ()
+    local out = {"return "};
+    local registry = {};
+    for k, v in pairs(nmap.registry) do
+      local why = undumpable(k, {}) or undumpable(v, {});
+      if why then
+        print_debug(1, "Not returning nmap.registry[%s] from NSE worker: it holds a %s",
+            tostring(k), why);
+      else
+        registry[k] = v;
+      end
+    end
+    dump({journal = worker_journal, registry = registry}, out, {});
+    return concat(out);
+  end
+
+  -- Rebuild a value loaded from a worker chunk, restoring key order and
+  -- __tostring output.
+  local function rebuild (v, layout)
+    local l = type(v) == "table" and layout[v];
+    if not l then return v end
+    local t = stdnse.output_table();
+    for i = 1, #l.kv, 2 do
+      t[l.kv[i]] = rebuild(l.kv[i+1], layout);
+    end
+    if l.str then
+      getmetatable(t).__tostring = function () return l.str end
+    end
+    return t;
+  end
+
+  -- Merge a registry table loaded from a worker into dst. In tables that
+  -- existed before the workers started (base maps those to their original
+  -- length), new array entries are appended, so that lists extended by
+  -- several workers are concatenated rather than overwritten. A table that
+  -- is new in several workers was most likely built from scratch by each
+  -- (like a list of fingerprints loaded once per process), so its array
+  -- entries are not appended again. Other keys are assigned, the last worker
+  -- winning.
+  local function merge (dst, src, base)
+    local n, len = base[dst], #src;
+    for k, v in pairs(src) do
+      if n and math.type(k) == "integer" and k > n and k <= len then
+        dst[#dst+1] = v;
+      elseif type(v) == "table" and type(dst[k]) == "table" then
+        merge(dst[k], v, base);
+      else
+        dst[k] = v;
+      end
+    end
+  end
+  local function snapshot (t, base)
+    if type(t) ~= "table" or base[t] then return end
+    base[t] = #t;
+    for _, v in pairs(t) do
+      snapshot(v, base);
+    end
+  end
+
+  local replay = {
+    output = function (e, layout)
+      if e.port then
+        cnse.port_set_output(e.host, e.port, e.id, rebuild(e.tab, layout), e.str);
+      else
+        cnse.host_set_output(e.host, e.id, rebuild(e.tab, layout), e.str);
+      end
+    end,
+    port_state = function (e)
+      nmap.set_port_state(e.host, e.port, e.state);
+    end,
+    port_version = function (e)
+      nmap.set_port_version(e.host, e.port, e.probestate);
+    end,
+    add_targets = function (e)
+      nmap.add_targets(unpack(e.targets, 1, e.targets.n));
+    end,
+  };
+
+  -- Called in the parent with the list of chunks returned by the workers,
+  -- after NSE_CURRENT_HOSTS has been set for the whole host group. Returns a
+  -- list of the indices of chunks that could not be loaded; the caller
+  -- rescans those hosts itself.
+  _R[WORKER_MERGE] = function (chunks)
+    local failed = {};
+    local base = setmetatable({}, {__mode = "k"});
+    snapshot(nmap.registry, base);
+    for i, chunk in ipairs(chunks) do
+      local layout = {};
+      local function T (kv, str)
+        local t = {};
+        for j = 1, #kv, 2 do
+          t[kv[j]] = kv[j+1];
+        end
+        layout[t] = {kv = kv, str = str};
+        return t;
+      end
+      local f, err = load(chunk, "=NSE worker "..i, "t", {T = T});
+      local status, result = pcall(f or error, err);
+      if not status then
+        print_debug(1, "Could not load results of NSE worker %d: %s", i, result);
+        failed[#failed+1] = i;
+      else
+        for _, e in ipairs(result.journal) do
+          local status, err = pcall(replay[e.op], e, layout);
+          if not status then
+            log_error("Could not replay NSE worker %s result: %s", e.op, err);
+          end
+        end
+        merge(nmap.registry, result.registry, base);
+      end
+    end
+    return failed;
+  end
+end
+
 -- Format NSEDoc markup (e.g., including bullet lists and <code> sections) into
 -- a display string at the given indentation level. Currently this only indents
 -- the string and doesn't interpret any other markup.
@@ -1461,6 +1872,7 @@ local function main (hosts, scantype)
   --          will be nil for Pre-scanning and Post-scanning scripts.
 
   local runlevels = {};
+  script_stats = {};
   for i, script in ipairs(chosen_scripts) do
     runlevels[script.runlevel] = runlevels[script.runlevel] or {};
     insert(runlevels[script.runlevel], script);
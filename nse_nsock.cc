@@ -3,6 +3,7 @@
 #include "NmapOps.h"
 #include "tcpip.h"
 #include "protocols.h"
+#include "timing.h"
 
 #ifdef WIN32
 /* Need DnetName2PcapName */
@@ -35,6 +36,7 @@ enum {
   NSOCK_SOCKET = lua_upvalueindex(2), /* nsock socket metatable */
   THREAD_SOCKETS = lua_upvalueindex(3), /* <Thread, Table of Sockets (keys)> */
   CONNECT_WAITING = lua_upvalueindex(4), /* Threads waiting to lock */
+  THREAD_HOST = lua_upvalueindex(5), /* <Thread, host key> */
 };
 
 /* Integer keys in the Nsock userdata environments */
@@ -64,19 +66,44 @@ typedef struct nse_nsock_udata
   struct sockaddr_storage source_addr;
   size_t source_addrlen;
 
+  struct timeval connect_start; /* for connect_governor */
+
 } nse_nsock_udata;
 
 static const char *NU_ACTION_IMMEDIATE = "returned immediately";
 
+/* The NSOCK_POOL upvalue, for nse_nsock_detach_pool. */
+static nsock_pool *pool_ud = NULL;
+
 static int gc_pool (lua_State *L)
 {
   nsock_pool *nsp = (nsock_pool *) lua_touserdata(L, 1);
   assert(*nsp != NULL);
   nsock_pool_delete(*nsp);
   *nsp = NULL;
+  if (nsp == pool_ud)
+    pool_ud = NULL;
   return 0;
 }
 
+static nsock_pool configure_pool (nsock_pool nsp)
+{
+  if (*o.device)
+    nsock_pool_set_device(nsp, o.device);
+
+  if (o.proxy_chain)
+    nsock_pool_set_proxychain(nsp, o.proxy_chain);
+
+  nsock_pool_set_broadcast(nsp, true);
+
+#if HAVE_OPENSSL
+  /* Value speed over security in SSL connections. */
+  nsock_pool_ssl_init(nsp, NSOCK_SSL_MAX_SPEED);
+#endif
+
+  return nsp;
+}
+
 static nsock_pool new_pool (lua_State *L)
 {
   nsock_pool nsp = nsock_pool_new(NULL);
@@ -86,16 +113,11 @@ static nsock_pool new_pool (lua_State *L)
   nmap_set_nsock_logger();
   nmap_adjust_loglevel(o.scriptTrace());
 
-  if (*o.device)
-    nsock_pool_set_device(nsp, o.device);
-
-  if (o.proxy_chain)
-    nsock_pool_set_proxychain(nsp, o.proxy_chain);
-
-  nsock_pool_set_broadcast(nsp, true);
+  configure_pool(nsp);
 
   nspp = (nsock_pool *) lua_newuserdatauv(L, sizeof(nsock_pool), 0);
   *nspp = nsp;
+  pool_ud = nspp;
   lua_newtable(L);
   lua_pushcfunction(L, gc_pool);
   lua_setfield(L, -2, "__gc");
@@ -162,10 +184,85 @@ static std::string hexify (const unsigned char *str, size_t len)
  * socket userdata structure is not NULL.
  *
  * CONNECT_WAITING is a weak keyed table of <Thread, Garbage Value> pairs.
- * The table contains threads waiting to make a socket connection.
+ * The table contains threads waiting to make a socket connection. A thread
+ * leaves it when it gets a lock, when it is restored because a lock was
+ * released (it is added again if it still can't get one), or when it ends
+ * while waiting, for instance by timing out.
+ *
+ * THREAD_HOST is a weak keyed table of <Thread, host key> pairs (see
+ * nse_hostkey) for threads that hold or wait for a lock. When threads of
+ * several hosts compete for the slots, a host that already has its fair share
+ * (the slots divided by the number of competing hosts) must wait for threads
+ * of other hosts. --script-host-sockets puts a fixed cap on the threads of one
+ * host that may hold a lock.
+ *
+ * The limit is further reduced by connect_governor, which is shared with
+ * service scan. Scripts only feed it connect latency and local resource
+ * errors; refused or timed out connections are an ordinary result for many
+ * scripts and say nothing about congestion.
  */
 #define MAX_PARALLELISM   20
 
+/* Whether a thread scanning the host whose key is at index hidx may take a
+ * free slot, out of p. */
+static bool host_may_lock (lua_State *L, int hidx, unsigned p)
+{
+  unsigned held = 0, nhosts;
+  bool others_waiting = false;
+
+  if (lua_isnil(L, hidx))
+    return true; /* prerule and postrule scripts are not limited */
+
+  lua_newtable(L); /* set of competing hosts */
+  int hosts = lua_gettop(L);
+  for (lua_pushnil(L); lua_next(L, THREAD_SOCKETS); lua_pop(L, 1))
+  {
+    lua_pushvalue(L, -2); /* thread */
+    lua_rawget(L, THREAD_HOST);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      continue;
+    }
+    if (lua_rawequal(L, -1, hidx))
+      held++;
+    lua_pushboolean(L, true);
+    lua_rawset(L, hosts);
+  }
+  for (lua_pushnil(L); lua_next(L, CONNECT_WAITING); lua_pop(L, 1))
+  {
+    /* Skip dead threads and the running one, which is not yielded. */
+    if (lua_status(lua_tothread(L, -2)) != LUA_YIELD)
+      continue;
+    lua_pushvalue(L, -2); /* thread */
+    lua_rawget(L, THREAD_HOST);
+    if (lua_isnil(L, -1)) {
+      lua_pop(L, 1);
+      continue;
+    }
+    if (!lua_rawequal(L, -1, hidx))
+      others_waiting = true;
+    lua_pushboolean(L, true);
+    lua_rawset(L, hosts);
+  }
+  nhosts = MAX(1, nseU_tablen(L, hosts));
+  lua_pop(L, 1); /* hosts */
+
+  if (o.scripthostsockets > 0 && held >= (unsigned) o.scripthostsockets)
+    return false;
+  return !(others_waiting && held >= MAX(1, p / nhosts));
+}
+
+/* Destructor of a thread waiting for a lock: a thread that ends while it
+ * waits must not keep counting as a waiter in host_may_lock. The upvalues are
+ * CONNECT_WAITING and the waiting base thread. */
+static int waiting_destructor (lua_State *L)
+{
+  lua_pushvalue(L, lua_upvalueindex(2));
+  lua_pushnil(L);
+  lua_rawset(L, lua_upvalueindex(1));
+  return 0;
+}
+
 /* int socket_lock (lua_State *L)
  *
  * This function is called by l_connect to get a "lock" on a socket.
@@ -175,7 +272,15 @@ static std::string hexify (const unsigned char *str, size_t len)
 static int socket_lock (lua_State *L, int idx)
 {
   unsigned p = o.max_parallelism == 0 ? MAX_PARALLELISM : o.max_parallelism;
+  p = connect_governor.limit(p, p);
   int top = lua_gettop(L);
+  nse_hostkey(L);
+  int hidx = lua_gettop(L);
+  if (!lua_isnil(L, hidx)) {
+    nse_base(L);
+    lua_pushvalue(L, hidx);
+    lua_rawset(L, THREAD_HOST);
+  }
   nse_base(L);
   lua_rawget(L, THREAD_SOCKETS);
   if (lua_istable(L, -1))
@@ -185,7 +290,7 @@ static int socket_lock (lua_State *L, int idx)
     lua_pushvalue(L, idx);
     lua_pushboolean(L, true);
     lua_rawset(L, -3);
-  } else if (nseU_tablen(L, THREAD_SOCKETS) <= p)
+  } else if (nseU_tablen(L, THREAD_SOCKETS) <= p && host_may_lock(L, hidx, p))
   {
     /* There is room for this thread to open sockets */
     nse_base(L);
@@ -195,11 +300,21 @@ static int socket_lock (lua_State *L, int idx)
     lua_rawset(L, -3); /* add to sockets table */
     lua_rawset(L, THREAD_SOCKETS); /* add new <Thread, Sockets Table> Pair
                                     * to THREAD_SOCKETS */
+    nse_base(L);
+    lua_pushnil(L);
+    lua_rawset(L, CONNECT_WAITING); /* no longer waiting, if it was */
+    lua_pushvalue(L, CONNECT_WAITING); /* destructor key */
+    nse_destructor(L, 'r');
   } else
   {
     nse_base(L);
     lua_pushboolean(L, true);
     lua_rawset(L, CONNECT_WAITING);
+    lua_pushvalue(L, CONNECT_WAITING); /* destructor key */
+    lua_pushvalue(L, CONNECT_WAITING);
+    nse_base(L);
+    lua_pushcclosure(L, waiting_destructor, 2);
+    nse_destructor(L, 'a');
     lua_settop(L, top); /* restore stack to original condition for l_connect */
     return 0;
   }
@@ -242,7 +357,9 @@ static void socket_unlock (lua_State *L)
 
       for (lua_pushnil(L); lua_next(L, CONNECT_WAITING); lua_pop(L, 1))
       {
-        nse_restore(lua_tothread(L, -2), 0);
+        if (lua_status(lua_tothread(L, -2)) == LUA_YIELD)
+          nse_restore(lua_tothread(L, -2), 0);
+        /* Restored threads try again for a lock when they are resumed. */
         lua_pushvalue(L, -2);
         lua_pushnil(L);
         lua_rawset(L, CONNECT_WAITING);
@@ -351,6 +468,18 @@ static void status (lua_State *L, enum nse_status status)
   }
 }
 
+/* Report the outcome of a TCP connect to connect_governor. */
+static void governor_update (nse_nsock_udata *nu, nsock_event nse)
+{
+  if (nu->proto != IPPROTO_TCP)
+    return;
+  if (nse_status(nse) == NSE_STATUS_SUCCESS)
+    connect_governor.connectSucceeded(&nu->connect_start, nsock_gettimeofday());
+  else if (nse_status(nse) == NSE_STATUS_ERROR
+      && ConnectGovernor::isResourceError(nse_errorcode(nse)))
+    connect_governor.connectFailed(nse_errorcode(nse), 0, nsock_gettimeofday());
+}
+
 /* callback for connect and write events */
 static void callback (nsock_pool nsp, nsock_event nse, void *ud)
 {
@@ -358,6 +487,8 @@ static void callback (nsock_pool nsp, nsock_event nse, void *ud)
   lua_State *L = nu->thread;
   if (nse_status(nse) == NSE_STATUS_KILL)
       return;
+  if (nse_type(nse) == NSE_TYPE_CONNECT || nse_type(nse) == NSE_TYPE_CONNECT_SSL)
+    governor_update(nu, nse);
   assert(nse_type(nse) != NSE_TYPE_READ);
   if (lua_status(L) == LUA_OK && nse_status(nse) == NSE_STATUS_ERROR) {
     // Sometimes Nsock fails immediately and callback is called before
@@ -552,6 +683,7 @@ static int connect (lua_State *L, int status, lua_KContext ctx)
   nu->thread = L;
   nu->action = "PRECONNECT";
   nu->direction = TO;
+  nu->connect_start = *nsock_gettimeofday();
 
   switch (what)
   {
@@ -1161,6 +1293,7 @@ LUALIB_API int luaopen_nsock (lua_State *L)
   lua_newtable(L); /* NSOCK_SOCKET */
   nseU_weaktable(L, 0, MAX_PARALLELISM, "k"); /* THREAD_SOCKETS */
   nseU_weaktable(L, 0, 1000, "k"); /* CONNECT_WAITING */
+  nseU_weaktable(L, 0, 1000, "k"); /* THREAD_HOST */
   int nupvals = lua_gettop(L)-top;
 
   /* Create the nsock metatable for sockets */
@@ -1181,12 +1314,7 @@ LUALIB_API int luaopen_nsock (lua_State *L)
   nse_nsock_init_ssl_cert(L);
 #endif
 
-#if HAVE_OPENSSL
-  /* Value speed over security in SSL connections. */
-  nsock_pool_ssl_init(nsp, NSOCK_SSL_MAX_SPEED);
-#else
   (void) nsp; //variable is unused, avoid warning.
-#endif
 
   luaL_newlibtable(L, l_nsock);
   for (i = top+1; i <= top+nupvals; i++) lua_pushvalue(L, i);
@@ -1194,3 +1322,26 @@ LUALIB_API int luaopen_nsock (lua_State *L)
 
   return 1;
 }
+
+/* Give a forked script scan worker an nsock pool of its own. The inherited
+ * pool's event engine (an epoll or kqueue descriptor, for instance) is shared
+ * with the parent and the other workers, so the old pool is abandoned rather
+ * than deleted: deleting it would unregister descriptors the parent still
+ * uses. */
+void nse_nsock_detach_pool (void)
+{
+  assert(pool_ud != NULL);
+  *pool_ud = configure_pool(nsock_pool_new(NULL));
+}
+
+/* Limit a forked script scan worker to its share of the socket slots. Every
+ * worker enforces the limit on its own, so without this nworkers workers
+ * would together open nworkers times --max-parallelism sockets. Each gets at
+ * least one slot, so with more workers than slots the total is the number of
+ * workers. */
+void nse_nsock_share_sockets (unsigned int nworkers)
+{
+  unsigned int p = o.max_parallelism == 0 ? MAX_PARALLELISM : o.max_parallelism;
+
+  o.max_parallelism = MAX(1, p / MAX(1, nworkers));
+}
@@ -4,6 +4,8 @@
 #include "nse_lua.h"
 
 LUALIB_API int luaopen_nsock (lua_State *);
+void nse_nsock_detach_pool (void);
+void nse_nsock_share_sockets (unsigned int nworkers);
 
 #endif
 
@@ -33,9 +33,123 @@ extern NmapOps o;
 
 #include "nse_openssl.h"
 
+#include <map>
+#include <string>
+
 #define NSE_SSL_LUA_ERR(_L) \
     luaL_error(_L, "OpenSSL error: %s", ERR_error_string(ERR_get_error(), NULL))
 
+#define DIGEST_CTX_METATABLE "EVP_MD_CTX"
+#define CIPHER_CTX_METATABLE "EVP_CIPHER_CTX"
+
+/* Largest digest block size HMAC is computed for; SHA3-224 has the largest
+ * block of the digests OpenSSL offers, at 144 bytes. */
+#define HMAC_MAX_BLOCK 256
+
+/* Brute-force scripts hash and encrypt millions of short strings, so the
+ * per-call costs matter more than the cost of the primitives themselves.
+ * Algorithms are looked up by name once (with OpenSSL 3, explicitly fetched
+ * from their provider rather than implicitly on every init), and the
+ * one-shot functions share one digest context, one cipher context and one
+ * BN_CTX instead of allocating their own each time. */
+static std::map<std::string, const EVP_MD *> digests;
+static std::map<std::string, const EVP_CIPHER *> ciphers;
+static EVP_MD_CTX *shared_md_ctx = NULL;
+static BN_CTX *shared_bn_ctx = NULL;
+#if HAVE_OPAQUE_STRUCTS
+static EVP_CIPHER_CTX *shared_cipher_ctx = NULL;
+#else
+static EVP_CIPHER_CTX shared_cipher_stack_ctx;
+static EVP_CIPHER_CTX *shared_cipher_ctx = NULL;
+#endif
+
+static const EVP_MD *get_digest( lua_State *L, const char *algorithm )
+{
+  std::map<std::string, const EVP_MD *>::iterator it = digests.find(algorithm);
+  if (it != digests.end())
+    return it->second;
+
+  const EVP_MD *evp_md = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined LIBRESSL_VERSION_NUMBER
+  evp_md = EVP_MD_fetch( NULL, algorithm, NULL );
+  if (!evp_md)
+    ERR_clear_error();
+#endif
+  if (!evp_md)
+    evp_md = EVP_get_digestbyname( algorithm );
+  if (!evp_md) {
+    luaL_error( L, "Unknown digest algorithm: %s", algorithm );
+    return NULL;
+  }
+  digests[algorithm] = evp_md;
+  return evp_md;
+}
+
+static const EVP_CIPHER *get_cipher( lua_State *L, const char *algorithm )
+{
+  std::map<std::string, const EVP_CIPHER *>::iterator it = ciphers.find(algorithm);
+  if (it != ciphers.end())
+    return it->second;
+
+  const EVP_CIPHER *evp_cipher = NULL;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined LIBRESSL_VERSION_NUMBER
+  evp_cipher = EVP_CIPHER_fetch( NULL, algorithm, NULL );
+  if (!evp_cipher)
+    ERR_clear_error();
+#endif
+  if (!evp_cipher)
+    evp_cipher = EVP_get_cipherbyname( algorithm );
+  if (!evp_cipher) {
+    luaL_error( L, "Unknown cipher algorithm: %s", algorithm );
+    return NULL;
+  }
+  ciphers[algorithm] = evp_cipher;
+  return evp_cipher;
+}
+
+static EVP_MD_CTX *get_md_ctx( lua_State *L )
+{
+  if (!shared_md_ctx) {
+    shared_md_ctx = EVP_MD_CTX_new();
+    if (!shared_md_ctx) NSE_SSL_LUA_ERR(L);
+  }
+  return shared_md_ctx;
+}
+
+static EVP_CIPHER_CTX *get_cipher_ctx( lua_State *L )
+{
+  if (!shared_cipher_ctx) {
+#if HAVE_OPAQUE_STRUCTS
+    shared_cipher_ctx = EVP_CIPHER_CTX_new();
+    if (!shared_cipher_ctx) NSE_SSL_LUA_ERR(L);
+#else
+    shared_cipher_ctx = &shared_cipher_stack_ctx;
+    EVP_CIPHER_CTX_init( shared_cipher_ctx );
+#endif
+  }
+  return shared_cipher_ctx;
+}
+
+static BN_CTX *get_bn_ctx( lua_State *L )
+{
+  if (!shared_bn_ctx) {
+    shared_bn_ctx = BN_CTX_new();
+    if (!shared_bn_ctx) NSE_SSL_LUA_ERR(L);
+  }
+  return shared_bn_ctx;
+}
+
+#ifdef NSE_TEST_HOOKS
+void nse_openssl_cache_info( size_t *ndigests, size_t *nciphers,
+    const void **md_ctx, const void **cipher_ctx )
+{
+  *ndigests = digests.size();
+  *nciphers = ciphers.size();
+  *md_ctx = shared_md_ctx;
+  *cipher_ctx = shared_cipher_ctx;
+}
+#endif
+
 typedef struct bignum_data {
   BIGNUM * bn;
   bool should_free;
@@ -91,9 +205,7 @@ static int l_bignum_mod_exp( lua_State *L ) /** bignum_mod_exp( BIGNUM a, BIGNUM
   bignum_data_t * p = (bignum_data_t *) luaL_checkudata(L, 2, "BIGNUM");
   bignum_data_t * m = (bignum_data_t *) luaL_checkudata(L, 3, "BIGNUM");
   BIGNUM * result = BN_new();
-  BN_CTX * ctx = BN_CTX_new();
-  BN_mod_exp( result, a->bn, p->bn, m->bn, ctx );
-  BN_CTX_free( ctx );
+  BN_mod_exp( result, a->bn, p->bn, m->bn, get_bn_ctx( L ) );
   return nse_pushbn(L, result, true);
 }
 
@@ -103,9 +215,7 @@ static int l_bignum_div( lua_State *L ) /* bignum_div( BIGNUM a, BIGNUM d ) */
   bignum_data_t * d = (bignum_data_t *) luaL_checkudata(L, 2, "BIGNUM");
   BIGNUM * dv = BN_new();
   BIGNUM * rem = BN_new();
-  BN_CTX * ctx = BN_CTX_new();
-  BN_div(dv, rem, a->bn, d->bn, ctx);
-  BN_CTX_free( ctx );
+  BN_div(dv, rem, a->bn, d->bn, get_bn_ctx( L ));
   nse_pushbn(L, dv, true);
   nse_pushbn(L, rem, true);
   return 2;
@@ -161,14 +271,13 @@ static int l_bignum_is_bit_set( lua_State *L ) /** bignum_set_bit( BIGNUM bn, nu
 static int l_bignum_is_prime( lua_State *L ) /** bignum_is_prime( BIGNUM p ) */
 {
   bignum_data_t * p = (bignum_data_t *) luaL_checkudata( L, 1, "BIGNUM" );
-  BN_CTX * ctx = BN_CTX_new();
+  BN_CTX * ctx = get_bn_ctx( L );
   int is_prime =
 #if OPENSSL_VERSION_NUMBER < 0x30000000L
     BN_is_prime_ex( p->bn, BN_prime_checks, ctx, NULL );
 #else
     BN_check_prime( p->bn, ctx, NULL );
 #endif
-  BN_CTX_free( ctx );
   lua_pushboolean( L, is_prime );
   return 1;
 }
@@ -176,7 +285,7 @@ static int l_bignum_is_prime( lua_State *L ) /** bignum_is_prime( BIGNUM p ) */
 static int l_bignum_is_safe_prime( lua_State *L ) /** bignum_is_safe_prime( BIGNUM p ) */
 {
   bignum_data_t * p = (bignum_data_t *) luaL_checkudata( L, 1, "BIGNUM" );
-  BN_CTX * ctx = BN_CTX_new();
+  BN_CTX * ctx = get_bn_ctx( L );
   int is_prime =
 #if OPENSSL_VERSION_NUMBER < 0x30000000L
     BN_is_prime_ex( p->bn, BN_prime_checks, ctx, NULL );
@@ -196,7 +305,6 @@ static int l_bignum_is_safe_prime( lua_State *L ) /** bignum_is_safe_prime( BIGN
 #endif
     BN_clear_free( n );
   }
-  BN_CTX_free( ctx );
   lua_pushboolean( L, is_safe );
   lua_pushboolean( L, is_prime );
   return 2;
@@ -279,6 +387,67 @@ static int l_rand_pseudo_bytes( lua_State *L ) /** rand_pseudo_bytes( number byt
   return 1;
 }
 
+static int do_digest( EVP_MD_CTX *ctx, const EVP_MD *md,
+    const unsigned char *msg, size_t msg_len,
+    unsigned char *out, unsigned int *out_len )
+{
+  return EVP_DigestInit_ex( ctx, md, NULL ) &&
+    EVP_DigestUpdate( ctx, msg, msg_len ) &&
+    EVP_DigestFinal_ex( ctx, out, out_len );
+}
+
+/* Fills ipad and opad with the HMAC key, hashed first if it is longer than a
+ * block, xored with the inner and outer pads. Returns the block size of the
+ * digest, or 0 if it cannot be used for HMAC. */
+static int hmac_pads( EVP_MD_CTX *ctx, const EVP_MD *md,
+    const unsigned char *key, size_t key_len,
+    unsigned char *ipad, unsigned char *opad )
+{
+  unsigned char hashed[EVP_MAX_MD_SIZE];
+  unsigned int hashed_len;
+  int block = EVP_MD_block_size( md );
+
+  if (block <= 0 || block > HMAC_MAX_BLOCK)
+    return 0;
+  if (key_len > (size_t) block) {
+    if (!do_digest( ctx, md, key, key_len, hashed, &hashed_len ))
+      return 0;
+    key = hashed;
+    key_len = hashed_len;
+  }
+  memset( ipad, 0x36, block );
+  memset( opad, 0x5c, block );
+  for (size_t i = 0; i < key_len; i++) {
+    ipad[i] ^= key[i];
+    opad[i] ^= key[i];
+  }
+  OPENSSL_cleanse( hashed, sizeof(hashed) );
+  return block;
+}
+
+/* The outer HMAC pass: replaces the inner digest in out with the HMAC. */
+static int hmac_outer( EVP_MD_CTX *ctx, const EVP_MD *md,
+    const unsigned char *opad, int block,
+    unsigned char *out, unsigned int *out_len )
+{
+  return EVP_DigestInit_ex( ctx, md, NULL ) &&
+    EVP_DigestUpdate( ctx, opad, block ) &&
+    EVP_DigestUpdate( ctx, out, *out_len ) &&
+    EVP_DigestFinal_ex( ctx, out, out_len );
+}
+
+static int do_hmac( EVP_MD_CTX *ctx, const EVP_MD *md,
+    const unsigned char *ipad, const unsigned char *opad, int block,
+    const unsigned char *msg, size_t msg_len,
+    unsigned char *out, unsigned int *out_len )
+{
+  return EVP_DigestInit_ex( ctx, md, NULL ) &&
+    EVP_DigestUpdate( ctx, ipad, block ) &&
+    EVP_DigestUpdate( ctx, msg, msg_len ) &&
+    EVP_DigestFinal_ex( ctx, out, out_len ) &&
+    hmac_outer( ctx, md, opad, block, out, out_len );
+}
+
 static int l_digest(lua_State *L)     /** digest(string algorithm, string message) */
 {
   size_t msg_len;
@@ -286,24 +455,10 @@ static int l_digest(lua_State *L)     /** digest(string algorithm, string messag
   const char *algorithm = luaL_checkstring( L, 1 );
   const unsigned char *msg = (unsigned char *) luaL_checklstring( L, 2, &msg_len );
   unsigned char digest[EVP_MAX_MD_SIZE];
-  const EVP_MD * evp_md;
-  EVP_MD_CTX *mdctx = NULL;
+  const EVP_MD * evp_md = get_digest( L, algorithm );
 
-  evp_md = EVP_get_digestbyname( algorithm );
-
-  if (!evp_md) return luaL_error( L, "Unknown digest algorithm: %s", algorithm );
-
-  mdctx = EVP_MD_CTX_new();
-  if (!mdctx) return NSE_SSL_LUA_ERR(L);
-
-  if (!(
-      EVP_DigestInit_ex( mdctx, evp_md, NULL ) &&
-      EVP_DigestUpdate( mdctx, msg, msg_len ) &&
-      EVP_DigestFinal_ex( mdctx, digest, &digest_len ))) {
-    EVP_MD_CTX_free( mdctx );
+  if (!do_digest( get_md_ctx( L ), evp_md, msg, msg_len, digest, &digest_len ))
     return NSE_SSL_LUA_ERR(L);
-  }
-  EVP_MD_CTX_free( mdctx );
 
   lua_pushlstring( L, (char *) digest, digest_len );
   return 1;
@@ -331,17 +486,180 @@ static int l_hmac(lua_State *L)     /** hmac(string algorithm, string key, strin
   const unsigned char *key = (unsigned char *) luaL_checklstring( L, 2, &key_len );
   const unsigned char *msg = (unsigned char *) luaL_checklstring( L, 3, &msg_len );
   unsigned char digest[EVP_MAX_MD_SIZE];
-  const EVP_MD * evp_md;
-  evp_md = EVP_get_digestbyname( algorithm );
+  unsigned char ipad[HMAC_MAX_BLOCK], opad[HMAC_MAX_BLOCK];
+  const EVP_MD * evp_md = get_digest( L, algorithm );
+  EVP_MD_CTX *mdctx = get_md_ctx( L );
+  int block = hmac_pads( mdctx, evp_md, key, key_len, ipad, opad );
+
+  if (!block)
+    return luaL_error( L, "Cannot compute HMAC with %s", algorithm );
+  if (!do_hmac( mdctx, evp_md, ipad, opad, block, msg, msg_len, digest, &digest_len ))
+    return NSE_SSL_LUA_ERR(L);
+
+  lua_pushlstring( L, (char *) digest, digest_len );
+  return 1;
+}
+
+/* Pushes the message at index i of the table at index idx, checking that it
+ * is a string. */
+static const unsigned char *batch_message( lua_State *L, int idx, lua_Integer i, size_t *len )
+{
+  lua_rawgeti( L, idx, i );
+  const char *msg = lua_tolstring( L, -1, len );
+  if (!msg)
+    luaL_error( L, "bad message #%d (string expected, got %s)", (int) i, luaL_typename( L, -1 ) );
+  return (const unsigned char *) msg;
+}
+
+static int l_digest_many(lua_State *L) /** digest_many(string algorithm, table messages) */
+{
+  const EVP_MD * evp_md = get_digest( L, luaL_checkstring( L, 1 ) );
+  EVP_MD_CTX *mdctx = get_md_ctx( L );
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+
+  luaL_checktype( L, 2, LUA_TTABLE );
+  lua_Integer n = luaL_len( L, 2 );
+  lua_createtable( L, (int) n, 0 );
+  for (lua_Integer i = 1; i <= n; i++) {
+    size_t msg_len;
+    const unsigned char *msg = batch_message( L, 2, i, &msg_len );
+    if (!do_digest( mdctx, evp_md, msg, msg_len, digest, &digest_len ))
+      return NSE_SSL_LUA_ERR(L);
+    lua_pop( L, 1 );
+    lua_pushlstring( L, (char *) digest, digest_len );
+    lua_rawseti( L, -2, i );
+  }
+  return 1;
+}
+
+static int l_hmac_many(lua_State *L) /** hmac_many(string algorithm, string key, table messages) */
+{
+  size_t key_len;
+  const char *algorithm = luaL_checkstring( L, 1 );
+  const unsigned char *key = (unsigned char *) luaL_checklstring( L, 2, &key_len );
+  const EVP_MD * evp_md = get_digest( L, algorithm );
+  EVP_MD_CTX *mdctx = get_md_ctx( L );
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+  unsigned char ipad[HMAC_MAX_BLOCK], opad[HMAC_MAX_BLOCK];
+  int block = hmac_pads( mdctx, evp_md, key, key_len, ipad, opad );
+
+  if (!block)
+    return luaL_error( L, "Cannot compute HMAC with %s", algorithm );
+  luaL_checktype( L, 3, LUA_TTABLE );
+  lua_Integer n = luaL_len( L, 3 );
+  lua_createtable( L, (int) n, 0 );
+  for (lua_Integer i = 1; i <= n; i++) {
+    size_t msg_len;
+    const unsigned char *msg = batch_message( L, 3, i, &msg_len );
+    if (!do_hmac( mdctx, evp_md, ipad, opad, block, msg, msg_len, digest, &digest_len ))
+      return NSE_SSL_LUA_ERR(L);
+    lua_pop( L, 1 );
+    lua_pushlstring( L, (char *) digest, digest_len );
+    lua_rawseti( L, -2, i );
+  }
+  return 1;
+}
+
+/* A digest or HMAC context that can be fed a message in pieces, and reused
+ * for the next message once it is finished. */
+typedef struct digest_ctx {
+  const EVP_MD *md;
+  EVP_MD_CTX *ctx;
+  int block;     /* HMAC block size, or 0 for a plain digest */
+  unsigned char ipad[HMAC_MAX_BLOCK];
+  unsigned char opad[HMAC_MAX_BLOCK];
+} digest_ctx_t;
+
+static int digest_ctx_start( digest_ctx_t *dc )
+{
+  return EVP_DigestInit_ex( dc->ctx, dc->md, NULL ) &&
+    (dc->block == 0 || EVP_DigestUpdate( dc->ctx, dc->ipad, dc->block ));
+}
+
+static digest_ctx_t *new_digest_ctx( lua_State *L, const EVP_MD *md )
+{
+  digest_ctx_t *dc = (digest_ctx_t *) lua_newuserdatauv( L, sizeof(digest_ctx_t), 0 );
+  dc->md = md;
+  dc->block = 0;
+  dc->ctx = NULL;
+  luaL_setmetatable( L, DIGEST_CTX_METATABLE );
+  dc->ctx = EVP_MD_CTX_new();
+  if (!dc->ctx) NSE_SSL_LUA_ERR(L);
+  return dc;
+}
+
+static int l_digest_context(lua_State *L) /** digest_context(string algorithm) */
+{
+  digest_ctx_t *dc = new_digest_ctx( L, get_digest( L, luaL_checkstring( L, 1 ) ) );
+  if (!digest_ctx_start( dc ))
+    return NSE_SSL_LUA_ERR(L);
+  return 1;
+}
 
-  if (!evp_md) return luaL_error( L, "Unknown digest algorithm: %s", algorithm );
+static int l_hmac_context(lua_State *L) /** hmac_context(string algorithm, string key) */
+{
+  size_t key_len;
+  const char *algorithm = luaL_checkstring( L, 1 );
+  const unsigned char *key = (unsigned char *) luaL_checklstring( L, 2, &key_len );
+  digest_ctx_t *dc = new_digest_ctx( L, get_digest( L, algorithm ) );
 
-  HMAC( evp_md, key, key_len, msg, msg_len, digest, &digest_len );
+  dc->block = hmac_pads( dc->ctx, dc->md, key, key_len, dc->ipad, dc->opad );
+  if (!dc->block)
+    return luaL_error( L, "Cannot compute HMAC with %s", algorithm );
+  if (!digest_ctx_start( dc ))
+    return NSE_SSL_LUA_ERR(L);
+  return 1;
+}
 
+static int l_digest_ctx_update(lua_State *L) /** ctx:update(string ...) */
+{
+  digest_ctx_t *dc = (digest_ctx_t *) luaL_checkudata( L, 1, DIGEST_CTX_METATABLE );
+  int top = lua_gettop( L );
+  for (int i = 2; i <= top; i++) {
+    size_t len;
+    const char *data = luaL_checklstring( L, i, &len );
+    if (!EVP_DigestUpdate( dc->ctx, data, len ))
+      return NSE_SSL_LUA_ERR(L);
+  }
+  lua_settop( L, 1 );
+  return 1;
+}
+
+static int l_digest_ctx_final(lua_State *L) /** ctx:final() */
+{
+  digest_ctx_t *dc = (digest_ctx_t *) luaL_checkudata( L, 1, DIGEST_CTX_METATABLE );
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int digest_len;
+
+  if (!EVP_DigestFinal_ex( dc->ctx, digest, &digest_len ) ||
+      (dc->block && !hmac_outer( dc->ctx, dc->md, dc->opad, dc->block, digest, &digest_len )) ||
+      !digest_ctx_start( dc ))
+    return NSE_SSL_LUA_ERR(L);
   lua_pushlstring( L, (char *) digest, digest_len );
   return 1;
 }
 
+static int l_digest_ctx_digest(lua_State *L) /** ctx:digest(string message) */
+{
+  luaL_checkstring( L, 2 );
+  lua_settop( L, 2 );
+  l_digest_ctx_update( L );
+  return l_digest_ctx_final( L );
+}
+
+static int l_digest_ctx_gc(lua_State *L)
+{
+  digest_ctx_t *dc = (digest_ctx_t *) luaL_checkudata( L, 1, DIGEST_CTX_METATABLE );
+  if (dc->ctx)
+    EVP_MD_CTX_free( dc->ctx );
+  dc->ctx = NULL;
+  OPENSSL_cleanse( dc->ipad, sizeof(dc->ipad) );
+  OPENSSL_cleanse( dc->opad, sizeof(dc->opad) );
+  return 0;
+}
+
 struct enumerator_data {
   lua_State * L;
   int index;
@@ -379,128 +697,140 @@ static int l_supported_ciphers(lua_State *L) /** supported_ciphers() */
   return 1;
 }
 
-static int l_encrypt(lua_State *L) /** encrypt( string algorithm, string key, string iv, string data, bool padding = false ) */
+/* Sets up cipher_ctx for algorithm: first the cipher, then the key length
+ * and padding, then the key and iv once the length of the iv is checked. */
+static void cipher_init( lua_State *L, EVP_CIPHER_CTX *cipher_ctx, int enc,
+    const char *algorithm, int key_idx, int iv_idx, int padding )
 {
-  const char *algorithm = luaL_checkstring( L, 1 );
-  const EVP_CIPHER * evp_cipher = EVP_get_cipherbyname( algorithm );
-  if (!evp_cipher) return luaL_error( L, "Unknown cipher algorithm: %s", algorithm );
-
-  size_t key_len, iv_len, data_len;
-  const unsigned char *key = (unsigned char *) luaL_checklstring( L, 2, &key_len );
-  const unsigned char *iv = (unsigned char *) luaL_optlstring( L, 3, NULL, &iv_len );
-  const unsigned char *data = (unsigned char *) luaL_checklstring( L, 4, &data_len );
-  int padding = lua_toboolean( L, 5 );
+  const EVP_CIPHER * evp_cipher = get_cipher( L, algorithm );
+  size_t key_len, iv_len;
+  const unsigned char *key = (unsigned char *) luaL_checklstring( L, key_idx, &key_len );
+  const unsigned char *iv = (unsigned char *) luaL_optlstring( L, iv_idx, NULL, &iv_len );
   if (!iv_len)
     iv = NULL;
 
-#if HAVE_OPAQUE_STRUCTS
-  EVP_CIPHER_CTX *cipher_ctx = EVP_CIPHER_CTX_new();
-#else
-  EVP_CIPHER_CTX stack_ctx;
-  EVP_CIPHER_CTX *cipher_ctx = &stack_ctx;
-  EVP_CIPHER_CTX_init( cipher_ctx );
-#endif
-
-  /* First create the cipher context, then set the key length and padding, and
-     check the iv length. Below we set the key and iv. */
   if (!(
-      EVP_EncryptInit_ex( cipher_ctx, evp_cipher, NULL, NULL, NULL ) &&
+      EVP_CipherInit_ex( cipher_ctx, evp_cipher, NULL, NULL, NULL, enc ) &&
       EVP_CIPHER_CTX_set_key_length( cipher_ctx, key_len ) &&
       EVP_CIPHER_CTX_set_padding( cipher_ctx, padding ))) {
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    return NSE_SSL_LUA_ERR(L);
+    NSE_SSL_LUA_ERR(L);
   }
 
   if (iv != NULL && (int) iv_len != EVP_CIPHER_CTX_iv_length( cipher_ctx )) {
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    return luaL_error( L, "Length of iv is %d; should be %d",
+    luaL_error( L, "Length of iv is %d; should be %d",
       (int) iv_len, EVP_CIPHER_CTX_iv_length( cipher_ctx ));
   }
 
-  int out_len, final_len;
-  unsigned char * out = (unsigned char *) malloc( data_len + EVP_MAX_BLOCK_LENGTH );
-  if (!out) {
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    return luaL_error( L, "Couldn't allocate memory.");
-  }
+  if (!EVP_CipherInit_ex( cipher_ctx, NULL, NULL, key, iv, enc ))
+    NSE_SSL_LUA_ERR(L);
+}
 
-  if (!(
-      EVP_EncryptInit_ex( cipher_ctx, NULL, NULL, key, iv ) &&
-      EVP_EncryptUpdate( cipher_ctx, out, &out_len, data, data_len ) &&
-      EVP_EncryptFinal_ex( cipher_ctx, out + out_len, &final_len ) )) {
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    free( out );
-    return NSE_SSL_LUA_ERR(L);
-  }
+/* Runs data (at index data_idx) through cipher_ctx and pushes the result; if
+ * final is set, the cipher is finished as well. */
+static int cipher_push( lua_State *L, EVP_CIPHER_CTX *cipher_ctx, int data_idx, bool final )
+{
+  size_t data_len = 0;
+  const unsigned char *data = NULL;
+  int out_len = 0, final_len = 0;
+  luaL_Buffer b;
 
-  lua_pushlstring( L, (char *) out, out_len + final_len );
+  if (data_idx)
+    data = (unsigned char *) luaL_checklstring( L, data_idx, &data_len );
+  unsigned char *out = (unsigned char *) luaL_buffinitsize( L, &b, data_len + EVP_MAX_BLOCK_LENGTH );
 
-  EVP_CIPHER_CTX_free( cipher_ctx );
-  free( out );
+  if (data_idx && !EVP_CipherUpdate( cipher_ctx, out, &out_len, data, data_len ))
+    return NSE_SSL_LUA_ERR(L);
+  if (final && !EVP_CipherFinal_ex( cipher_ctx, out + out_len, &final_len ))
+    return NSE_SSL_LUA_ERR(L);
 
+  luaL_pushresultsize( &b, out_len + final_len );
   return 1;
 }
 
+static int l_encrypt(lua_State *L) /** encrypt( string algorithm, string key, string iv, string data, bool padding = false ) */
+{
+  EVP_CIPHER_CTX *cipher_ctx = get_cipher_ctx( L );
+  cipher_init( L, cipher_ctx, 1, luaL_checkstring( L, 1 ), 2, 3, lua_toboolean( L, 5 ) );
+  return cipher_push( L, cipher_ctx, 4, true );
+}
+
 static int l_decrypt(lua_State *L) /** decrypt( string algorithm, string key, string iv, string data, bool padding = false ) */
 {
-  const char *algorithm = luaL_checkstring( L, 1 );
-  const EVP_CIPHER * evp_cipher = EVP_get_cipherbyname( algorithm );
-  if (!evp_cipher) return luaL_error( L, "Unknown cipher algorithm: %s", algorithm );
+  EVP_CIPHER_CTX *cipher_ctx = get_cipher_ctx( L );
+  cipher_init( L, cipher_ctx, 0, luaL_checkstring( L, 1 ), 2, 3, lua_toboolean( L, 5 ) );
+  return cipher_push( L, cipher_ctx, 4, true );
+}
 
-  size_t key_len, iv_len, data_len;
-  const unsigned char *key = (unsigned char *) luaL_checklstring( L, 2, &key_len );
-  const unsigned char *iv = (unsigned char *) luaL_optlstring( L, 3, NULL, &iv_len );
-  const unsigned char *data = (unsigned char *) luaL_checklstring( L, 4, &data_len );
-  int padding = lua_toboolean( L, 5 );
-  if (!iv_len)
-    iv = NULL;
+/* A cipher context keeps its key schedule and state between calls, for
+ * messages that arrive in pieces and for many messages under one key. */
+typedef struct cipher_ctx {
+  EVP_CIPHER_CTX *ctx;
+#if !HAVE_OPAQUE_STRUCTS
+  EVP_CIPHER_CTX stack_ctx;
+#endif
+} cipher_ctx_t;
 
+static cipher_ctx_t *check_cipher_ctx( lua_State *L, int idx )
+{
+  cipher_ctx_t *cc = (cipher_ctx_t *) luaL_checkudata( L, idx, CIPHER_CTX_METATABLE );
+  if (!cc->ctx)
+    luaL_argerror( L, idx, "cipher context has been freed" );
+  return cc;
+}
+
+static int l_cipher_context(lua_State *L) /** cipher_context( string algorithm, string key, string iv, bool encrypt, bool padding = false ) */
+{
+  const char *algorithm = luaL_checkstring( L, 1 );
+  cipher_ctx_t *cc = (cipher_ctx_t *) lua_newuserdatauv( L, sizeof(cipher_ctx_t), 0 );
+  cc->ctx = NULL;
+  luaL_setmetatable( L, CIPHER_CTX_METATABLE );
 #if HAVE_OPAQUE_STRUCTS
-  EVP_CIPHER_CTX *cipher_ctx = EVP_CIPHER_CTX_new();
+  cc->ctx = EVP_CIPHER_CTX_new();
+  if (!cc->ctx) return NSE_SSL_LUA_ERR(L);
 #else
-  EVP_CIPHER_CTX stack_ctx;
-  EVP_CIPHER_CTX *cipher_ctx = &stack_ctx;
-  EVP_CIPHER_CTX_init( cipher_ctx );
+  cc->ctx = &cc->stack_ctx;
+  EVP_CIPHER_CTX_init( cc->ctx );
 #endif
+  cipher_init( L, cc->ctx, lua_toboolean( L, 4 ), algorithm, 2, 3, lua_toboolean( L, 5 ) );
+  return 1;
+}
 
-  if (!(
-      EVP_DecryptInit_ex( cipher_ctx, evp_cipher, NULL, NULL, NULL ) &&
-      EVP_CIPHER_CTX_set_key_length( cipher_ctx, key_len ) &&
-      EVP_CIPHER_CTX_set_padding( cipher_ctx, padding ))) {
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    return NSE_SSL_LUA_ERR(L);
-  }
+static int l_cipher_ctx_update(lua_State *L) /** ctx:update(string data) */
+{
+  return cipher_push( L, check_cipher_ctx( L, 1 )->ctx, 2, false );
+}
 
-  if (iv != NULL && (int) iv_len != EVP_CIPHER_CTX_iv_length( cipher_ctx )) {
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    return luaL_error( L, "Length of iv is %d; should be %d",
-      (int) iv_len, EVP_CIPHER_CTX_iv_length( cipher_ctx ));
-  }
+static int l_cipher_ctx_final(lua_State *L) /** ctx:final() */
+{
+  return cipher_push( L, check_cipher_ctx( L, 1 )->ctx, 0, true );
+}
 
-  int out_len, final_len;
-  unsigned char * out = (unsigned char *) malloc( data_len );
-  if (!out) {
-    EVP_CIPHER_CTX_free(cipher_ctx);
-    return luaL_error( L, "Couldn't allocate memory.");
-  }
+static int l_cipher_ctx_reset(lua_State *L) /** ctx:reset(string iv) */
+{
+  EVP_CIPHER_CTX *cipher_ctx = check_cipher_ctx( L, 1 )->ctx;
+  size_t iv_len;
+  const unsigned char *iv = (unsigned char *) luaL_optlstring( L, 2, NULL, &iv_len );
+  if (!iv_len)
+    iv = NULL;
 
-  if (!(
-      EVP_DecryptInit_ex( cipher_ctx, NULL, NULL, key, iv ) &&
-      EVP_DecryptUpdate( cipher_ctx, out, &out_len, data, data_len ) &&
-      EVP_DecryptFinal_ex( cipher_ctx, out + out_len, &final_len ) )) {
-    EVP_CIPHER_CTX_free( cipher_ctx );
-    free( out );
+  if (iv != NULL && (int) iv_len != EVP_CIPHER_CTX_iv_length( cipher_ctx ))
+    return luaL_error( L, "Length of iv is %d; should be %d",
+      (int) iv_len, EVP_CIPHER_CTX_iv_length( cipher_ctx ));
+  if (!EVP_CipherInit_ex( cipher_ctx, NULL, NULL, NULL, iv, -1 ))
     return NSE_SSL_LUA_ERR(L);
-  }
-
-  lua_pushlstring( L, (char *) out, out_len + final_len );
-
-  EVP_CIPHER_CTX_free( cipher_ctx );
-  free( out );
-
+  lua_settop( L, 1 );
   return 1;
 }
 
+static int l_cipher_ctx_gc(lua_State *L)
+{
+  cipher_ctx_t *cc = (cipher_ctx_t *) luaL_checkudata( L, 1, CIPHER_CTX_METATABLE );
+  if (cc->ctx)
+    EVP_CIPHER_CTX_free( cc->ctx );
+  cc->ctx = NULL;
+  return 0;
+}
+
 static int l_DES_string_to_key(lua_State *L) /** DES_string_to_key( string data ) */
 {
   size_t len;
@@ -540,6 +870,22 @@ static const struct luaL_Reg bignum_methods[] = {
   { NULL, NULL }
 };
 
+static const struct luaL_Reg digest_ctx_methods[] = {
+  { "update", l_digest_ctx_update },
+  { "final", l_digest_ctx_final },
+  { "digest", l_digest_ctx_digest },
+  { "__gc", l_digest_ctx_gc },
+  { NULL, NULL }
+};
+
+static const struct luaL_Reg cipher_ctx_methods[] = {
+  { "update", l_cipher_ctx_update },
+  { "final", l_cipher_ctx_final },
+  { "reset", l_cipher_ctx_reset },
+  { "__gc", l_cipher_ctx_gc },
+  { NULL, NULL }
+};
+
 static const struct luaL_Reg openssllib[] = {
   { "bignum_num_bits", l_bignum_num_bits },
   { "bignum_num_bytes", l_bignum_num_bytes },
@@ -570,8 +916,13 @@ static const struct luaL_Reg openssllib[] = {
 
   { "digest", l_digest },
   { "hmac", l_hmac },
+  { "digest_many", l_digest_many },
+  { "hmac_many", l_hmac_many },
+  { "digest_context", l_digest_context },
+  { "hmac_context", l_hmac_context },
   { "encrypt", l_encrypt },
   { "decrypt", l_decrypt },
+  { "cipher_context", l_cipher_context },
   { "DES_string_to_key", l_DES_string_to_key },
   { "supported_digests", l_supported_digests },
   { "supported_ciphers", l_supported_ciphers },
@@ -611,5 +962,17 @@ LUALIB_API int luaopen_openssl(lua_State *L) {
 
   lua_pop( L, 1 ); // BIGNUM
 
+  luaL_newmetatable( L, DIGEST_CTX_METATABLE );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  luaL_setfuncs( L, digest_ctx_methods, 0 );
+  lua_pop( L, 1 );
+
+  luaL_newmetatable( L, CIPHER_CTX_METATABLE );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" );
+  luaL_setfuncs( L, cipher_ctx_methods, 0 );
+  lua_pop( L, 1 );
+
   return 1;
 }
@@ -8,6 +8,13 @@ LUALIB_API int luaopen_openssl(lua_State *L);
 #if HAVE_OPENSSL
 #include <openssl/bn.h>
 int nse_pushbn( lua_State *L, BIGNUM *num, bool should_free);
+
+#ifdef NSE_TEST_HOOKS
+/* For tests/nse_openssl_test: how many digests and ciphers have been looked
+ * up, and the contexts shared by the one-shot functions (NULL until used). */
+void nse_openssl_cache_info( size_t *ndigests, size_t *nciphers,
+    const void **md_ctx, const void **cipher_ctx );
+#endif
 #endif
 #endif
 
@@ -104,6 +104,7 @@
 
 #include "nse_nsock.h"
 #include "nse_openssl.h"
+#include "nse_utility.h"
 
 struct cert_userdata {
   X509 *cert;
@@ -117,6 +118,48 @@ SSL *nse_nsock_get_ssl(lua_State *L);
    global table of certificate functions like digest. */
 static int ssl_cert_methods_index_ref = LUA_NOREF;
 
+/* Parsed certificates are cached by the SHA-256 digest of their DER encoding,
+   so that a certificate served by many hosts, or fetched again by another
+   script, is converted to Lua only once. cert_cache_ref is a weak-valued table
+   of digest -> SSL_CERT userdata; the last CERT_CACHE_RECENT certificates are
+   also held in the ring cert_recent_ref so that they stay cached while no
+   script has a reference. Cached objects are shared, so scripts must treat
+   them (including their subtables) as read-only. */
+#define CERT_CACHE_RECENT 256
+static int cert_cache_ref = LUA_NOREF;
+static int cert_recent_ref = LUA_NOREF;
+static unsigned int cert_recent_next = 0;
+
+/* If a certificate with the given digest is cached, push it and return true. */
+static bool cert_cache_get(lua_State *L, const unsigned char *digest, unsigned int len)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cert_cache_ref);
+  lua_pushlstring(L, (const char *) digest, len);
+  lua_rawget(L, -2);
+  lua_remove(L, -2);
+  if (lua_isnil(L, -1)) {
+    lua_pop(L, 1);
+    return false;
+  }
+  return true;
+}
+
+/* Cache the certificate userdata on top of the stack. */
+static void cert_cache_put(lua_State *L, const unsigned char *digest, unsigned int len)
+{
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cert_cache_ref);
+  lua_pushlstring(L, (const char *) digest, len);
+  lua_pushvalue(L, -3);
+  lua_rawset(L, -3);
+  lua_pop(L, 1);
+
+  lua_rawgeti(L, LUA_REGISTRYINDEX, cert_recent_ref);
+  lua_pushvalue(L, -2);
+  lua_rawseti(L, -2, cert_recent_next % CERT_CACHE_RECENT + 1);
+  lua_pop(L, 1);
+  cert_recent_next++;
+}
+
 /* Calculate the digest of the certificate using the given algorithm. */
 static int ssl_cert_digest(lua_State *L)
 {
@@ -519,6 +562,9 @@ int l_parse_ssl_certificate(lua_State *L)
   X509 *cert;
   size_t l;
   const char *der;
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int n = 0;
+  int nret;
 
   der = luaL_checklstring(L, 1, &l);
   if (der == NULL) {
@@ -526,12 +572,21 @@ int l_parse_ssl_certificate(lua_State *L)
     return 1;
   }
 
+  /* The DER encoding is what X509_digest hashes, so look the certificate up
+     before spending any time decoding it. */
+  if (EVP_Digest(der, l, digest, &n, EVP_sha256(), NULL) == 1
+      && cert_cache_get(L, digest, n))
+    return 1;
+
   cert = d2i_X509(NULL, (const unsigned char **) &der, l);
   if (cert == NULL) {
     lua_pushnil(L);
     return 1;
   }
-  return parse_ssl_cert(L, cert);
+  nret = parse_ssl_cert(L, cert);
+  if (nret == 1 && n > 0)
+    cert_cache_put(L, digest, n);
+  return nret;
 }
 
 int l_get_ssl_certificate(lua_State *L)
@@ -539,13 +594,25 @@ int l_get_ssl_certificate(lua_State *L)
   SSL *ssl;
   X509 *cert;
 
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int n = 0;
+  int nret;
+
   ssl = nse_nsock_get_ssl(L);
   cert = SSL_get_peer_certificate(ssl);
   if (cert == NULL) {
     lua_pushnil(L);
     return 1;
   }
-  return parse_ssl_cert(L, cert);
+  if (X509_digest(cert, EVP_sha256(), digest, &n) == 1
+      && cert_cache_get(L, digest, n)) {
+    X509_free(cert);
+    return 1;
+  }
+  nret = parse_ssl_cert(L, cert);
+  if (nret == 1 && n > 0)
+    cert_cache_put(L, digest, n);
+  return nret;
 }
 
 static int parse_ssl_cert(lua_State *L, X509 *cert)
@@ -711,4 +778,9 @@ void nse_nsock_init_ssl_cert(lua_State *L)
   luaL_setfuncs(L, ssl_cert_methods, 0);
   lua_setfield(L, -2, "__index");
   ssl_cert_methods_index_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  nseU_weaktable(L, 0, CERT_CACHE_RECENT, "v");
+  cert_cache_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+  lua_createtable(L, CERT_CACHE_RECENT, 0);
+  cert_recent_ref = luaL_ref(L, LUA_REGISTRYINDEX);
 }
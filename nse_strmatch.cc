@@ -0,0 +1,364 @@
+/* Multi-string search for NSE.
+ *
+ * Scripts such as http-enum test every response against hundreds of Lua
+ * patterns. Most of those patterns can only match if some literal substring
+ * occurs in the subject, so this module offers two pieces:
+ *
+ *   literal(pattern) extracts the longest run of characters that every match
+ *   of a Lua pattern must contain.
+ *
+ *   new(strings [, nocase]) builds an Aho-Corasick automaton over a list of
+ *   strings; matcher:scan(subject) then reports which of them occur in the
+ *   subject in a single pass, however many strings there are.
+ *
+ * Together they let a caller skip the patterns that cannot match and run
+ * string.match only on the rest.
+ */
+
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "nse_lua.h"
+#include "nse_strmatch.h"
+
+#define MATCHER_METATABLE "nmapstrmatch.matcher"
+
+static bool is_alnum (unsigned char c)
+{
+  return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z');
+}
+
+/* Returns the index just past the set that starts at p[i] == '['. */
+static size_t skip_set (const char *p, size_t len, size_t i)
+{
+  i++;
+  if (i < len && p[i] == '^')
+    i++;
+  /* A ']' right at the start is part of the set. */
+  if (i < len && p[i] == ']')
+    i++;
+  while (i < len && p[i] != ']') {
+    if (p[i] == '%')
+      i++;
+    i++;
+  }
+  return i + 1;
+}
+
+/* literal(pattern)
+ *
+ * Returns the longest string that must appear in anything the Lua pattern
+ * matches, or nil if there is none. Only single characters that are neither
+ * optional nor part of a class count; captures do not break a run, anything
+ * else does. */
+static int l_literal (lua_State *L)
+{
+  size_t len;
+  const char *p = luaL_checklstring(L, 1, &len);
+  std::string best, cur;
+  size_t i = 0;
+
+  if (len > 0 && p[0] == '^')
+    i++;
+  while (i < len) {
+    char c = p[i];
+    bool literal = false;
+    char ch = c;
+    size_t item;
+
+    if (c == '(' || c == ')') {
+      i++;
+      continue;
+    }
+    if (c == '$' && i + 1 == len)
+      break;
+    if (c == '%') {
+      if (i + 1 >= len)
+        break;
+      char d = p[i + 1];
+      if (d == 'b') {
+        /* %bxy */
+        if (cur.size() > best.size())
+          best = cur;
+        cur.clear();
+        i += 4;
+        continue;
+      } else if (d == 'f') {
+        if (cur.size() > best.size())
+          best = cur;
+        cur.clear();
+        i = i + 2 < len && p[i + 2] == '[' ? skip_set(p, len, i + 2) : len;
+        continue;
+      }
+      literal = !is_alnum(d);
+      ch = d;
+      item = 2;
+    } else if (c == '[') {
+      item = skip_set(p, len, i) - i;
+    } else {
+      literal = c != '.';
+      item = 1;
+    }
+
+    i += item;
+    if (i < len && (p[i] == '*' || p[i] == '?' || p[i] == '-')) {
+      literal = false;
+      i++;
+    } else if (i < len && p[i] == '+') {
+      /* One occurrence is required, but the run ends after it. */
+      if (literal)
+        cur += ch;
+      literal = false;
+      i++;
+    }
+    if (literal) {
+      cur += ch;
+    } else {
+      if (cur.size() > best.size())
+        best = cur;
+      cur.clear();
+    }
+  }
+  if (cur.size() > best.size())
+    best = cur;
+
+  if (best.empty())
+    lua_pushnil(L);
+  else
+    lua_pushlstring(L, best.data(), best.size());
+  return 1;
+}
+
+/* The automaton is built as a trie with failure links and then flattened.
+ * The root has a full transition table, since most bytes of a subject leave
+ * the automaton there; every other state keeps its outgoing edges sorted by
+ * byte in one shared array. */
+struct Matcher {
+  bool nocase;
+  int root_next[256];
+  std::vector<int> edge_start;     /* First edge of each state */
+  std::vector<int> edge_count;
+  std::vector<unsigned char> edge_byte;
+  std::vector<int> edge_target;
+  std::vector<int> fail;
+  std::vector<int> dict;           /* Nearest state on the failure chain with output, or -1 */
+  std::vector<int> out_first;      /* First string ending at each state, or -1 */
+  std::vector<int> out_next;       /* Next string ending at the same state, or -1 */
+  std::vector<int> empty;          /* Empty strings, which are in every subject */
+};
+
+static inline unsigned char fold (const Matcher *m, unsigned char c)
+{
+  return m->nocase && c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+static inline int step (const Matcher *m, int s, unsigned char c)
+{
+  while (s != 0) {
+    const unsigned char *b = &m->edge_byte[m->edge_start[s]];
+    const unsigned char *e = b + m->edge_count[s];
+    const unsigned char *f = std::lower_bound(b, e, c);
+    if (f != e && *f == c)
+      return m->edge_target[m->edge_start[s] + (f - b)];
+    s = m->fail[s];
+  }
+  return m->root_next[c];
+}
+
+static Matcher *build (const std::vector<std::string> &strings, bool nocase)
+{
+  std::vector< std::map<unsigned char, int> > trie(1);
+  Matcher *m = new Matcher;
+
+  m->nocase = nocase;
+  m->out_first.push_back(-1);
+  m->out_next.assign(strings.size(), -1);
+  for (size_t i = 0; i < strings.size(); i++) {
+    int s = 0;
+    for (size_t j = 0; j < strings[i].size(); j++) {
+      unsigned char c = fold(m, strings[i][j]);
+      std::map<unsigned char, int>::iterator it = trie[s].find(c);
+      if (it == trie[s].end()) {
+        trie[s][c] = (int) trie.size();
+        s = (int) trie.size();
+        trie.push_back(std::map<unsigned char, int>());
+        m->out_first.push_back(-1);
+      } else {
+        s = it->second;
+      }
+    }
+    if (s == 0) {
+      m->empty.push_back((int) i);
+    } else {
+      m->out_next[i] = m->out_first[s];
+      m->out_first[s] = (int) i;
+    }
+  }
+
+  size_t n = trie.size();
+  m->edge_start.resize(n);
+  m->edge_count.resize(n);
+  m->fail.assign(n, 0);
+  m->dict.assign(n, -1);
+  for (size_t s = 0; s < n; s++) {
+    m->edge_start[s] = (int) m->edge_byte.size();
+    m->edge_count[s] = (int) trie[s].size();
+    for (std::map<unsigned char, int>::iterator it = trie[s].begin(); it != trie[s].end(); it++) {
+      m->edge_byte.push_back(it->first);
+      m->edge_target.push_back(it->second);
+    }
+  }
+  for (int c = 0; c < 256; c++) {
+    std::map<unsigned char, int>::iterator it = trie[0].find((unsigned char) c);
+    m->root_next[c] = it == trie[0].end() ? 0 : it->second;
+  }
+
+  /* Breadth-first, so that failure links point at states already done. */
+  std::vector<int> queue;
+  queue.reserve(n);
+  for (std::map<unsigned char, int>::iterator it = trie[0].begin(); it != trie[0].end(); it++)
+    queue.push_back(it->second);
+  for (size_t q = 0; q < queue.size(); q++) {
+    int s = queue[q];
+    for (std::map<unsigned char, int>::iterator it = trie[s].begin(); it != trie[s].end(); it++) {
+      int t = it->second;
+      int f = step(m, m->fail[s], it->first);
+      m->fail[t] = f;
+      m->dict[t] = m->out_first[f] >= 0 ? f : m->dict[f];
+      queue.push_back(t);
+    }
+  }
+  return m;
+}
+
+static Matcher *check_matcher (lua_State *L, int idx)
+{
+  Matcher **mp = (Matcher **) luaL_checkudata(L, idx, MATCHER_METATABLE);
+  if (*mp == NULL)
+    luaL_argerror(L, idx, "matcher has been freed");
+  return *mp;
+}
+
+/* new(strings [, nocase])
+ *
+ * Builds a matcher for an array of strings. If nocase is true, ASCII letters
+ * match regardless of case. */
+static int l_new (lua_State *L)
+{
+  std::vector<std::string> *strings;
+  Matcher **mp;
+  bool nocase = lua_toboolean(L, 2);
+  lua_Integer n;
+  const char *err = NULL;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  n = luaL_len(L, 1);
+  mp = (Matcher **) lua_newuserdatauv(L, sizeof(Matcher *), 0);
+  *mp = NULL;
+  luaL_setmetatable(L, MATCHER_METATABLE);
+
+  /* Copy the strings out first, so that nothing below can raise a Lua error
+   * while C++ objects are alive. */
+  strings = new std::vector<std::string>();
+  for (lua_Integer i = 1; i <= n; i++) {
+    size_t len;
+    const char *s;
+    lua_rawgeti(L, 1, i);
+    s = lua_tolstring(L, -1, &len);
+    if (s == NULL) {
+      lua_pop(L, 1);
+      delete strings;
+      return luaL_error(L, "bad string #%d in matcher list", (int) i);
+    }
+    strings->push_back(std::string(s, len));
+    lua_pop(L, 1);
+  }
+  try {
+    *mp = build(*strings, nocase);
+  } catch (std::bad_alloc &) {
+    err = "out of memory";
+  }
+  delete strings;
+  if (err)
+    return luaL_error(L, "%s", err);
+  return 1;
+}
+
+/* matcher:scan(subject [, hits])
+ *
+ * Returns a table with hits[i] = true for every string i of the matcher that
+ * occurs in subject. If a table is passed as hits, the strings are added to
+ * it, which lets one table collect the strings found in several subjects. */
+static int l_scan (lua_State *L)
+{
+  const Matcher *m = check_matcher(L, 1);
+  size_t len;
+  const unsigned char *s = (const unsigned char *) luaL_checklstring(L, 2, &len);
+  const unsigned char *end = s + len;
+  unsigned char *seen;
+  int state = 0;
+
+  if (lua_isnoneornil(L, 3)) {
+    lua_settop(L, 2);
+    lua_newtable(L);
+  } else {
+    luaL_checktype(L, 3, LUA_TTABLE);
+    lua_settop(L, 3);
+  }
+
+  for (size_t i = 0; i < m->empty.size(); i++) {
+    lua_pushboolean(L, 1);
+    lua_rawseti(L, 3, m->empty[i] + 1);
+  }
+  /* States whose strings have been reported already. */
+  seen = (unsigned char *) lua_newuserdatauv(L, m->out_first.size(), 0);
+  memset(seen, 0, m->out_first.size());
+  for (; s < end; s++) {
+    state = step(m, state, fold(m, *s));
+    for (int t = m->out_first[state] >= 0 ? state : m->dict[state]; t >= 0 && !seen[t]; t = m->dict[t]) {
+      seen[t] = 1;
+      for (int i = m->out_first[t]; i >= 0; i = m->out_next[i]) {
+        lua_pushboolean(L, 1);
+        lua_rawseti(L, 3, i + 1);
+      }
+    }
+  }
+  lua_settop(L, 3);
+  return 1;
+}
+
+static int l_matcher_gc (lua_State *L)
+{
+  Matcher **mp = (Matcher **) luaL_checkudata(L, 1, MATCHER_METATABLE);
+  delete *mp;
+  *mp = NULL;
+  return 0;
+}
+
+LUALIB_API int luaopen_strmatch (lua_State *L)
+{
+  static const luaL_Reg strmatchlib[] = {
+    {"literal", l_literal},
+    {"new", l_new},
+    {NULL, NULL}
+  };
+  static const luaL_Reg matcher_methods[] = {
+    {"scan", l_scan},
+    {"__gc", l_matcher_gc},
+    {NULL, NULL}
+  };
+
+  luaL_newmetatable(L, MATCHER_METATABLE);
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_setfuncs(L, matcher_methods, 0);
+  lua_pop(L, 1);
+
+  luaL_newlib(L, strmatchlib);
+  return 1;
+}
@@ -0,0 +1,7 @@
+#ifndef NSE_STRMATCH
+#define NSE_STRMATCH
+
+#define NSE_STRMATCHLIBNAME "nmapstrmatch"
+LUALIB_API int luaopen_strmatch (lua_State *L);
+
+#endif
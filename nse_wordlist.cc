@@ -0,0 +1,272 @@
+/* Word lists for NSE.
+ *
+ * Brute-force scripts read the same username and password lists for every
+ * host they attack. A list opened here is mapped into memory once per
+ * process, along with an array of the offsets at which its lines start, and
+ * every later open of the same file gets the same list. Lines are turned into
+ * Lua strings only when they are asked for, so a list of millions of
+ * passwords costs four bytes of memory per line, and any line can be fetched
+ * by its number.
+ */
+
+#include <nbase.h>
+
+#include "nse_lua.h"
+#include "nse_wordlist.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+#include <new>
+#include <vector>
+
+#define WORDLIST_METATABLE "nmapwordlist.list"
+/* Registry key of the table of open lists, indexed by file name and comment
+ * prefix. */
+#define WORDLIST_CACHE "nmapwordlist.cache"
+
+struct wordlist {
+  const char *data;
+  size_t size;
+  bool mapped;
+  u32 *starts;       /* Offset of each line that is not a comment */
+  u32 count;
+};
+
+static void free_list (struct wordlist *wl)
+{
+#ifndef WIN32
+  if (wl->mapped)
+    munmap((void *) wl->data, wl->size);
+  else
+#endif
+    free((void *) wl->data);
+  free(wl->starts);
+  wl->data = NULL;
+  wl->starts = NULL;
+  wl->count = 0;
+}
+
+/* Maps (or, where that is not possible, reads) the whole file. Returns an
+ * errno value. */
+static int load_file (struct wordlist *wl, const char *filename)
+{
+  struct stat st;
+  int fd = open(filename, O_RDONLY);
+  int err = 0;
+
+  if (fd == -1)
+    return errno;
+  if (fstat(fd, &st) == -1) {
+    err = errno;
+    close(fd);
+    return err;
+  }
+  if ((u64) st.st_size > 0xffffffffULL) {
+    close(fd);
+    return EFBIG;
+  }
+  wl->size = (size_t) st.st_size;
+  if (wl->size == 0) {
+    close(fd);
+    return 0;
+  }
+
+#ifndef WIN32
+  void *map = mmap(NULL, wl->size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map != MAP_FAILED) {
+    wl->data = (const char *) map;
+    wl->mapped = true;
+    close(fd);
+    return 0;
+  }
+#endif
+
+  char *buf = (char *) malloc(wl->size);
+  size_t got = 0;
+  if (buf == NULL) {
+    close(fd);
+    return ENOMEM;
+  }
+  while (got < wl->size) {
+    int n = read(fd, buf + got, wl->size - got);
+    if (n <= 0) {
+      err = n == 0 ? EIO : errno;
+      if (err == EINTR)
+        continue;
+      free(buf);
+      close(fd);
+      return err;
+    }
+    got += n;
+  }
+  close(fd);
+  wl->data = buf;
+  return 0;
+}
+
+/* Records where each line starts, leaving out lines that begin with
+ * comment. Lines end at "\n"; like file:lines, a newline at the end of the
+ * file does not start another line. */
+static int index_lines (struct wordlist *wl, const char *comment, size_t clen)
+{
+  std::vector<u32> starts;
+  size_t pos = 0;
+
+  try {
+    while (pos < wl->size) {
+      const char *line = wl->data + pos;
+      const char *nl = (const char *) memchr(line, '\n', wl->size - pos);
+      size_t len = nl ? (size_t) (nl - line) : wl->size - pos;
+      if (clen == 0 || len < clen || memcmp(line, comment, clen) != 0)
+        starts.push_back((u32) pos);
+      pos += len + 1;
+    }
+  } catch (std::bad_alloc &) {
+    return ENOMEM;
+  }
+
+  wl->count = (u32) starts.size();
+  if (wl->count > 0) {
+    wl->starts = (u32 *) malloc(wl->count * sizeof(u32));
+    if (wl->starts == NULL)
+      return ENOMEM;
+    memcpy(wl->starts, &starts[0], wl->count * sizeof(u32));
+  }
+  return 0;
+}
+
+static struct wordlist *check_list (lua_State *L, int idx)
+{
+  return (struct wordlist *) luaL_checkudata(L, idx, WORDLIST_METATABLE);
+}
+
+/* open(filename [, comment])
+ *
+ * Returns the list of lines of a file, without the lines that start with the
+ * string comment, or nil and an error message. Opening the same file again
+ * returns the same list. */
+static int l_open (lua_State *L)
+{
+  const char *filename = luaL_checkstring(L, 1);
+  size_t clen;
+  const char *comment = luaL_optlstring(L, 2, "", &clen);
+  struct wordlist *wl;
+  int err;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, WORDLIST_CACHE);
+  lua_pushvalue(L, 1);
+  lua_pushlstring(L, "\0", 1);
+  lua_pushlstring(L, comment, clen);
+  lua_concat(L, 3);
+  lua_pushvalue(L, -1);
+  if (lua_rawget(L, -3) != LUA_TNIL)
+    return 1;
+  lua_pop(L, 1);
+
+  wl = (struct wordlist *) lua_newuserdatauv(L, sizeof(struct wordlist), 0);
+  memset(wl, 0, sizeof(*wl));
+  luaL_setmetatable(L, WORDLIST_METATABLE);
+  err = load_file(wl, filename);
+  if (err == 0)
+    err = index_lines(wl, comment, clen);
+  if (err != 0) {
+    free_list(wl);
+    lua_pushnil(L);
+    lua_pushfstring(L, "%s: %s", filename, strerror(err));
+    return 2;
+  }
+
+  /* cache[key] = list */
+  lua_pushvalue(L, -2);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -5);
+  return 1;
+}
+
+/* Pushes line i (1-based) of the list, or nil. */
+static int push_line (lua_State *L, const struct wordlist *wl, lua_Integer i)
+{
+  if (i < 1 || i > (lua_Integer) wl->count) {
+    lua_pushnil(L);
+    return 1;
+  }
+  size_t start = wl->starts[i - 1];
+  const char *line = wl->data + start;
+  const char *nl = (const char *) memchr(line, '\n', wl->size - start);
+  size_t len = nl ? (size_t) (nl - line) : wl->size - start;
+  /* As unpwdb always did, drop carriage returns at the end. */
+  while (len > 0 && line[len - 1] == '\r')
+    len--;
+  lua_pushlstring(L, line, len);
+  return 1;
+}
+
+/* list:get(i) */
+static int l_get (lua_State *L)
+{
+  return push_line(L, check_list(L, 1), luaL_checkinteger(L, 2));
+}
+
+/* list:count() */
+static int l_count (lua_State *L)
+{
+  lua_pushinteger(L, check_list(L, 1)->count);
+  return 1;
+}
+
+/* list[i] is line i; other keys are methods. */
+static int l_index (lua_State *L)
+{
+  struct wordlist *wl = check_list(L, 1);
+  int isnum;
+  lua_Integer i = lua_tointegerx(L, 2, &isnum);
+
+  if (isnum)
+    return push_line(L, wl, i);
+  luaL_getmetatable(L, WORDLIST_METATABLE);
+  lua_pushvalue(L, 2);
+  lua_rawget(L, -2);
+  return 1;
+}
+
+static int l_gc (lua_State *L)
+{
+  free_list(check_list(L, 1));
+  return 0;
+}
+
+LUALIB_API int luaopen_wordlist (lua_State *L)
+{
+  static const luaL_Reg wordlistlib[] = {
+    {"open", l_open},
+    {NULL, NULL}
+  };
+  static const luaL_Reg list_methods[] = {
+    {"get", l_get},
+    {"count", l_count},
+    {"__len", l_count},
+    {"__index", l_index},
+    {"__gc", l_gc},
+    {NULL, NULL}
+  };
+
+  luaL_newmetatable(L, WORDLIST_METATABLE);
+  luaL_setfuncs(L, list_methods, 0);
+  lua_pop(L, 1);
+
+  lua_newtable(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, WORDLIST_CACHE);
+
+  luaL_newlib(L, wordlistlib);
+  return 1;
+}
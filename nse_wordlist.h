@@ -0,0 +1,7 @@
+#ifndef NSE_WORDLIST
+#define NSE_WORDLIST
+
+#define NSE_WORDLISTLIBNAME "nmapwordlist"
+LUALIB_API int luaopen_wordlist (lua_State *L);
+
+#endif
@@ -63,9 +63,26 @@
     #define LZ_BUFFER_SIZE 8192
 #endif
 
+/* Sizes of the pieces lz_read_chars inflates straight into its result: the
+   first is LZ_BUFFER_SIZE and each one after that is twice as big, up to
+   LZ_CHUNK_MAX. */
+#define LZ_CHUNK_MAX (1024 * 1024)
+
+/* Everything a z_stream was set up with. Inflate streams only use
+   windowBits; the other fields are 0. */
+typedef struct {
+    int state;
+    int level;
+    int method;
+    int windowBits;
+    int memLevel;
+    int strategy;
+} lz_params;
+
 typedef struct {
-    /* zlib structures */
-    z_stream zstream;
+    /* zlib structures, from the pool */
+    z_stream *zstream;
+    lz_params params;
     /* stream state. LZ_DEFLATE | LZ_INFLATE */
     int state;
     int error;
@@ -92,6 +109,99 @@ typedef struct {
 static int lzstream_docompress(lua_State *L, lz_stream *s, int from, int to, int flush);
 
 
+/*
+** =========================================================================
+** pool of zlib streams
+** =========================================================================
+*/
+
+/* Setting up a z_stream allocates its window and state: tens of kilobytes
+   for inflate and a few hundred for deflate. Scripts decompress a body or
+   two per HTTP response, so streams that are done with are kept here and
+   reset for the next user with the same parameters. The pool holds pointers
+   because zlib's internal state points back at its z_stream, which therefore
+   cannot move. */
+#define LZ_POOL_SIZE 8
+
+static struct {
+    z_stream *zs;
+    lz_params params;
+} lz_pool[LZ_POOL_SIZE];
+static int lz_pool_len = 0;
+
+static int lz_params_equal(const lz_params *a, const lz_params *b) {
+    return a->state == b->state && a->level == b->level && a->method == b->method
+        && a->windowBits == b->windowBits && a->memLevel == b->memLevel
+        && a->strategy == b->strategy;
+}
+
+/* Returns a stream ready to use with the given parameters, or NULL and the
+   zlib error in *err. */
+static z_stream *lz_pool_get(const lz_params *p, int *err) {
+    z_stream *zs;
+    int i;
+
+    for (i = lz_pool_len - 1; i >= 0; i--) {
+        if (lz_params_equal(&lz_pool[i].params, p)) {
+            zs = lz_pool[i].zs;
+            lz_pool[i] = lz_pool[--lz_pool_len];
+            *err = Z_OK;
+            return zs;
+        }
+    }
+
+    zs = (z_stream*)calloc(1, sizeof(z_stream));
+    if (zs == NULL) {
+        *err = Z_MEM_ERROR;
+        return NULL;
+    }
+    zs->zalloc = Z_NULL;
+    zs->zfree = Z_NULL;
+    zs->opaque = Z_NULL;
+    if (p->state == LZ_INFLATE) {
+        *err = inflateInit2(zs, p->windowBits);
+    } else {
+        *err = deflateInit2(zs, p->level, p->method, p->windowBits, p->memLevel, p->strategy);
+    }
+    if (*err != Z_OK) {
+        free(zs);
+        return NULL;
+    }
+    return zs;
+}
+
+/* Resets a stream that is no longer needed and keeps it for the next caller,
+   or frees it when the pool is full. */
+static void lz_pool_put(z_stream *zs, const lz_params *p) {
+    int r;
+
+    if (p->state == LZ_INFLATE) {
+        r = inflateReset(zs);
+    } else {
+        r = deflateReset(zs);
+    }
+    if (r == Z_OK && lz_pool_len < LZ_POOL_SIZE) {
+        lz_pool[lz_pool_len].zs = zs;
+        lz_pool[lz_pool_len].params = *p;
+        lz_pool_len++;
+        return;
+    }
+
+    if (p->state == LZ_INFLATE) {
+        inflateEnd(zs);
+    } else {
+        deflateEnd(zs);
+    }
+    free(zs);
+}
+
+#ifdef NSE_TEST_HOOKS
+int nse_zlib_pool_len(void) {
+    return lz_pool_len;
+}
+#endif
+
+
 static lz_stream *lzstream_new(lua_State *L, int src) {
     lz_stream *s = (lz_stream*)lua_newuserdatauv(L, sizeof(lz_stream), 0);
 
@@ -112,8 +222,9 @@ static lz_stream *lzstream_new(lua_State *L, int src) {
     s->o_buffer_len = 0;
     s->o_buffer_max = sizeof(s->o_buffer) / sizeof(s->o_buffer[0]);
 
-    s->zstream.zalloc = Z_NULL;
-    s->zstream.zfree = Z_NULL;
+    s->zstream = NULL;
+    s->dictionary = NULL;
+    s->dictionary_len = 0;
 
     /* prepare source */
     if (lua_isstring(L, src)) {
@@ -130,12 +241,8 @@ static lz_stream *lzstream_new(lua_State *L, int src) {
 
 static void lzstream_cleanup(lua_State *L, lz_stream *s) {
     if (s && s->state != LZ_NONE) {
-        if (s->state == LZ_INFLATE) {
-            inflateEnd(&s->zstream);
-        }
-        if (s->state == LZ_DEFLATE) {
-            deflateEnd(&s->zstream);
-        }
+        lz_pool_put(s->zstream, &s->params);
+        s->zstream = NULL;
 
         luaL_unref(L, LUA_REGISTRYINDEX, s->io_cb);
         luaL_unref(L, LUA_REGISTRYINDEX, s->i_buffer_ref);
@@ -206,7 +313,7 @@ static int lzstream_close(lua_State *L) {
 
 static int lzstream_adler(lua_State *L) {
     lz_stream *s = lzstream_check(L, 1, LZ_ANY);
-    lua_pushnumber(L, s->zstream.adler);
+    lua_pushnumber(L, s->zstream->adler);
     return 1;
 }
 
@@ -225,6 +332,7 @@ static int lzstream_adler(lua_State *L) {
 */
 static int lzlib_deflate(lua_State *L) {
     int level, method, windowBits, memLevel, strategy;
+    int ret;
     lz_stream *s;
     const char *dictionary;
     size_t dictionary_len;
@@ -250,19 +358,27 @@ static int lzlib_deflate(lua_State *L) {
 
     s = lzstream_new(L, 1);
 
-    if (deflateInit2(&s->zstream, level, method, windowBits, memLevel, strategy) != Z_OK) {
+    s->params.state = LZ_DEFLATE;
+    s->params.level = level;
+    s->params.method = method;
+    s->params.windowBits = windowBits;
+    s->params.memLevel = memLevel;
+    s->params.strategy = strategy;
+    s->zstream = lz_pool_get(&s->params, &ret);
+    if (s->zstream == NULL) {
         lua_pushliteral(L, "call to deflateInit2 failed");
         lua_error(L);
     }
+    s->state = LZ_DEFLATE;
 
     if (dictionary) {
-        if (deflateSetDictionary(&s->zstream, (const Bytef *) dictionary, dictionary_len) != Z_OK) {
+        if (deflateSetDictionary(s->zstream, (const Bytef *) dictionary, dictionary_len) != Z_OK) {
+            lzstream_cleanup(L, s);
             lua_pushliteral(L, "call to deflateSetDictionnary failed");
             lua_error(L);
         }
     }
 
-    s->state = LZ_DEFLATE;
     return 1;
 }
 
@@ -276,6 +392,7 @@ static int lzlib_deflate(lua_State *L) {
 static int lzlib_inflate(lua_State *L)
 {
     int windowBits;
+    int ret;
     lz_stream *s;
     int have_peek = 0;
     const char *dictionary;
@@ -306,7 +423,11 @@ static int lzlib_inflate(lua_State *L)
         windowBits |= 32;
     }
 
-    if (inflateInit2(&s->zstream, windowBits) != Z_OK) {
+    memset(&s->params, 0, sizeof(s->params));
+    s->params.state = LZ_INFLATE;
+    s->params.windowBits = windowBits;
+    s->zstream = lz_pool_get(&s->params, &ret);
+    if (s->zstream == NULL) {
         lua_pushliteral(L, "call to inflateInit2 failed");
         lua_error(L);
     }
@@ -379,23 +500,29 @@ static const char* lzstream_fetch_block(lua_State *L, lz_stream *s, int hint) {
     return s->i_buffer;
 }
 
-static int lzstream_inflate_block(lua_State *L, lz_stream *s) {
+/*
+** Inflate at most avail bytes into out, which may be the stream's own output
+** buffer or the caller's. Returns the number of bytes written.
+*/
+static size_t lzstream_inflate_into(lua_State *L, lz_stream *s, char *out, size_t avail) {
+    size_t written = 0;
+
     if (lzstream_fetch_block(L, s, LZ_BUFFER_SIZE) || !s->eos) {
         int r;
 
         if (s->i_buffer_len == s->i_buffer_pos) {
-            s->zstream.next_in = NULL;
-            s->zstream.avail_in = 0;
+            s->zstream->next_in = NULL;
+            s->zstream->avail_in = 0;
         } else {
-            s->zstream.next_in = (unsigned char*)(s->i_buffer + s->i_buffer_pos);
-            s->zstream.avail_in = s->i_buffer_len - s->i_buffer_pos;
+            s->zstream->next_in = (unsigned char*)(s->i_buffer + s->i_buffer_pos);
+            s->zstream->avail_in = s->i_buffer_len - s->i_buffer_pos;
         }
 
-        s->zstream.next_out = (unsigned char*)s->o_buffer + s->o_buffer_len;
-        s->zstream.avail_out = s->o_buffer_max - s->o_buffer_len;
+        s->zstream->next_out = (unsigned char*)out;
+        s->zstream->avail_out = avail;
 
         /* munch some more */
-        r = inflate(&s->zstream, Z_SYNC_FLUSH);
+        r = inflate(s->zstream, Z_SYNC_FLUSH);
 
         if (r == Z_NEED_DICT) {
             if (s->dictionary == NULL) {
@@ -403,12 +530,12 @@ static int lzstream_inflate_block(lua_State *L, lz_stream *s) {
                 lua_error(L);
             }
 
-            if (inflateSetDictionary(&s->zstream, s->dictionary, s->dictionary_len) != Z_OK) {
+            if (inflateSetDictionary(s->zstream, s->dictionary, s->dictionary_len) != Z_OK) {
                 lua_pushliteral(L, "call to inflateSetDictionnary failed");
                 lua_error(L);
             }
 
-            r = inflate(&s->zstream, Z_SYNC_FLUSH);
+            r = inflate(s->zstream, Z_SYNC_FLUSH);
         }
 
         if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
@@ -430,7 +557,7 @@ static int lzstream_inflate_block(lua_State *L, lz_stream *s) {
 
         /* number of processed bytes */
         if (s->peek) {
-            size_t processed = s->i_buffer_len - s->i_buffer_pos - s->zstream.avail_in;
+            size_t processed = s->i_buffer_len - s->i_buffer_pos - s->zstream->avail_in;
 
             lua_rawgeti(L, LUA_REGISTRYINDEX, s->io_cb);
             lua_getfield(L, -1, "read");
@@ -439,10 +566,16 @@ static int lzstream_inflate_block(lua_State *L, lz_stream *s) {
             lua_call(L, 2, 0);
         }
 
-        s->i_buffer_pos = s->i_buffer_len - s->zstream.avail_in;
-        s->o_buffer_len = s->o_buffer_max - s->zstream.avail_out;
+        s->i_buffer_pos = s->i_buffer_len - s->zstream->avail_in;
+        written = avail - s->zstream->avail_out;
     }
 
+    return written;
+}
+
+static int lzstream_inflate_block(lua_State *L, lz_stream *s) {
+    s->o_buffer_len += lzstream_inflate_into(L, s, s->o_buffer + s->o_buffer_len,
+                                             s->o_buffer_max - s->o_buffer_len);
     return s->o_buffer_len;
 }
 
@@ -465,9 +598,7 @@ static int lzstream_flush_buffer(lua_State *L, lz_stream *s, size_t n, luaL_Buff
     }
 
     if (n > 0) {
-        lua_pushlstring(L, s->o_buffer, n);
-        luaL_addvalue(b);
-
+        luaL_addlstring(b, s->o_buffer, n);
         lzstream_remove(s, n);
     }
 
@@ -533,13 +664,24 @@ static int lz_read_line(lua_State *L, lz_stream *s) {
 
 static int lz_read_chars(lua_State *L, lz_stream *s, size_t n) {
     size_t len;
+    size_t chunk = LZ_BUFFER_SIZE;
     luaL_Buffer b;
     luaL_buffinit(L, &b);
 
-    if (s->o_buffer_len > 0 || !s->eos) do {
-        size_t rlen = lzstream_flush_buffer(L, s, n, &b);
-        n -= rlen;
-    } while (n > 0 && lzstream_inflate_block(L, s));
+    n -= lzstream_flush_buffer(L, s, n, &b);
+
+    /* Inflate the rest straight into the result instead of going through
+       o_buffer. */
+    while (n > 0) {
+        size_t want = n < chunk ? n : chunk;
+        size_t got = lzstream_inflate_into(L, s, luaL_prepbuffsize(&b, want), want);
+        if (got == 0)
+            break;
+        luaL_addsize(&b, got);
+        n -= got;
+        if (chunk < LZ_CHUNK_MAX)
+            chunk *= 2;
+    }
 
     luaL_pushresult(&b);
     lua_tolstring(L, -1, &len);
@@ -635,15 +777,17 @@ static int lzstream_docompress(lua_State *L, lz_stream *s, int from, int to, int
         lua_getfield(L, -1, "write");
     }
 
-    for (arg = from; arg <= to; arg++) {
-        s->zstream.next_in = (unsigned char*)luaL_checklstring(L, arg, (size_t*)&s->zstream.avail_in);
+    for (arg = from; arg <= to && s->state != LZ_NONE; arg++) {
+        size_t len;
+        s->zstream->next_in = (unsigned char*)luaL_checklstring(L, arg, &len);
+        s->zstream->avail_in = (uInt)len;
 
         do {
-            s->zstream.next_out = b;
-            s->zstream.avail_out = b_size;
+            s->zstream->next_out = b;
+            s->zstream->avail_out = b_size;
 
             /* bake some more */
-            r = deflate(&s->zstream, flush);
+            r = deflate(s->zstream, flush);
             if (r != Z_OK && r != Z_STREAM_END && r != Z_BUF_ERROR) {
                 lzstream_cleanup(L, s);
                 lua_pushboolean(L, 0);
@@ -651,11 +795,11 @@ static int lzstream_docompress(lua_State *L, lz_stream *s, int from, int to, int
                 return 2;
             }
 
-            if (s->zstream.avail_out != b_size) {
+            if (s->zstream->avail_out != b_size) {
                 /* write output */
                 lua_pushvalue(L, -1); /* function */
                 if (self) lua_pushvalue(L, -3); /* self */
-                lua_pushlstring(L, (char*)b, b_size - s->zstream.avail_out); /* data */
+                lua_pushlstring(L, (char*)b, b_size - s->zstream->avail_out); /* data */
                 lua_call(L, (self ? 2 : 1), 0);
             }
 
@@ -665,7 +809,7 @@ static int lzstream_docompress(lua_State *L, lz_stream *s, int from, int to, int
             }
 
             /* process all input */
-        } while (s->zstream.avail_in > 0 || s->zstream.avail_out == 0);
+        } while (s->zstream->avail_in > 0 || s->zstream->avail_out == 0);
     }
 
     lua_pushboolean(L, 1);
@@ -747,51 +891,56 @@ static int lzlib_crc32(lua_State *L)
 /* ====================================================================== */
 
 
+/* Largest single piece of output the one-shot functions ask Lua for, and
+   the most that decompress allocates on a guess. */
+#define LZ_ONESHOT_MAX (1 << 30)
+#define LZ_HINT_MAX (64 * 1024 * 1024)
+
 static int lzlib_compress(lua_State *L) {
     size_t avail_in;
     const char *next_in = luaL_checklstring(L, 1, &avail_in);
-    int level = (int) luaL_optinteger(L, 2, Z_DEFAULT_COMPRESSION);
-    int method = (int) luaL_optinteger(L, 3, Z_DEFLATED);
-    int windowBits = (int) luaL_optinteger(L, 4, 15);
-    int memLevel = (int) luaL_optinteger(L, 5, 8);
-    int strategy = (int) luaL_optinteger(L, 6, Z_DEFAULT_STRATEGY);
+    lz_params params;
 
     int ret;
     luaL_Buffer b;
-    z_stream zs;
+    z_stream *zs;
+    size_t want;
 
-    luaL_buffinit(L, &b);
+    params.state = LZ_DEFLATE;
+    params.level = (int) luaL_optinteger(L, 2, Z_DEFAULT_COMPRESSION);
+    params.method = (int) luaL_optinteger(L, 3, Z_DEFLATED);
+    params.windowBits = (int) luaL_optinteger(L, 4, 15);
+    params.memLevel = (int) luaL_optinteger(L, 5, 8);
+    params.strategy = (int) luaL_optinteger(L, 6, Z_DEFAULT_STRATEGY);
 
-    zs.zalloc = Z_NULL;
-    zs.zfree = Z_NULL;
-
-    zs.next_out = Z_NULL;
-    zs.avail_out = 0;
-    zs.next_in = Z_NULL;
-    zs.avail_in = 0;
-
-    ret = deflateInit2(&zs, level, method, windowBits, memLevel, strategy);
+    luaL_buffinit(L, &b);
 
-    if (ret != Z_OK)
+    zs = lz_pool_get(&params, &ret);
+    if (zs == NULL)
     {
         lua_pushnil(L);
         lua_pushnumber(L, ret);
         return 2;
     }
 
-    zs.next_in = (unsigned char*)next_in;
-    zs.avail_in = avail_in;
+    zs->next_in = (unsigned char*)next_in;
+    zs->avail_in = avail_in;
 
+    /* deflateBound is enough for the whole output, so this normally takes a
+       single call to deflate. */
+    want = deflateBound(zs, avail_in);
     for(;;)
     {
-        zs.next_out = (unsigned char*)luaL_prepbuffer(&b);
-        zs.avail_out = LUAL_BUFFERSIZE;
+        if (want > LZ_ONESHOT_MAX)
+            want = LZ_ONESHOT_MAX;
+        zs->next_out = (unsigned char*)luaL_prepbuffsize(&b, want);
+        zs->avail_out = want;
 
         /* munch some more */
-        ret = deflate(&zs, Z_FINISH);
+        ret = deflate(zs, Z_FINISH);
 
         /* push gathered data */
-        luaL_addsize(&b, LUAL_BUFFERSIZE - zs.avail_out);
+        luaL_addsize(&b, want - zs->avail_out);
 
         /* done processing? */
         if (ret == Z_STREAM_END)
@@ -800,73 +949,97 @@ static int lzlib_compress(lua_State *L) {
         /* error condition? */
         if (ret != Z_OK)
             break;
+
+        want = LUAL_BUFFERSIZE + zs->avail_in;
     }
 
     /* cleanup */
-    deflateEnd(&zs);
+    lz_pool_put(zs, &params);
 
     luaL_pushresult(&b);
     lua_pushnumber(L, ret);
     return 2;
 }
 
-/* ====================================================================== */
+/* A first guess at the size of the inflated data. A gzip member ends with
+   the size of its contents, which is used when deflate could have produced
+   the input from that much data (about 1032:1 at best); otherwise a few
+   times the size of the input. */
+static size_t lz_inflate_hint(const unsigned char *in, size_t len, int windowBits) {
+    size_t hint = len * 4;
+
+    if (windowBits > 15 && len >= 18 && in[0] == 0x1f && in[1] == 0x8b) {
+        size_t isize = (size_t)in[len - 4] | (size_t)in[len - 3] << 8
+            | (size_t)in[len - 2] << 16 | (size_t)in[len - 1] << 24;
+        if (isize > 0 && isize / 1032 <= len)
+            hint = isize;
+    }
+    if (hint > LZ_HINT_MAX)
+        hint = LZ_HINT_MAX;
+    if (hint < LUAL_BUFFERSIZE)
+        hint = LUAL_BUFFERSIZE;
+    return hint;
+}
 
 static int lzlib_decompress(lua_State *L)
 {
     size_t avail_in;
     const char *next_in = luaL_checklstring(L, 1, &avail_in);
-    int windowBits = (int) luaL_optinteger(L, 2, 15);
+    lz_params params;
 
     int ret;
     luaL_Buffer b;
-    z_stream zs;
-
-    luaL_buffinit(L, &b);
-
-    zs.zalloc = Z_NULL;
-    zs.zfree = Z_NULL;
+    z_stream *zs;
+    size_t want;
 
-    zs.next_out = Z_NULL;
-    zs.avail_out = 0;
-    zs.next_in = Z_NULL;
-    zs.avail_in = 0;
+    memset(&params, 0, sizeof(params));
+    params.state = LZ_INFLATE;
+    params.windowBits = (int) luaL_optinteger(L, 2, 15);
 
-    ret = inflateInit2(&zs, windowBits);
+    luaL_buffinit(L, &b);
 
-    if (ret != Z_OK) {
+    zs = lz_pool_get(&params, &ret);
+    if (zs == NULL) {
         lua_pushliteral(L, "failed to initialize zstream structures");
         lua_error(L);
     }
 
-    zs.next_in = (unsigned char*)next_in;
-    zs.avail_in = avail_in;
+    zs->next_in = (unsigned char*)next_in;
+    zs->avail_in = avail_in;
 
+    /* Inflate straight into the result, doubling it whenever it fills. */
+    want = lz_inflate_hint((const unsigned char*)next_in, avail_in, params.windowBits);
     for (;;) {
-        zs.next_out = (unsigned char*)luaL_prepbuffer(&b);
-        zs.avail_out = LUAL_BUFFERSIZE;
+        if (want > LZ_ONESHOT_MAX)
+            want = LZ_ONESHOT_MAX;
+        zs->next_out = (unsigned char*)luaL_prepbuffsize(&b, want);
+        zs->avail_out = want;
 
         /* bake some more */
-        ret = inflate(&zs, Z_FINISH);
+        ret = inflate(zs, Z_FINISH);
 
         /* push gathered data */
-        luaL_addsize(&b, LUAL_BUFFERSIZE - zs.avail_out);
+        luaL_addsize(&b, want - zs->avail_out);
 
         /* done processing? */
         if (ret == Z_STREAM_END)
             break;
 
-        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        /* Output space left over means that the input ran out before the end
+           of the stream. */
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || zs->avail_out != 0) {
             /* cleanup */
-            inflateEnd(&zs);
+            lz_pool_put(zs, &params);
 
             lua_pushliteral(L, "failed to process zlib stream");
             lua_error(L);
         }
+
+        want = luaL_bufflen(&b);
     }
 
     /* cleanup */
-    inflateEnd(&zs);
+    lz_pool_put(zs, &params);
 
     luaL_pushresult(&b);
     return 1;
@@ -5,5 +5,10 @@
 
 LUALIB_API int luaopen_zlib(lua_State *L);
 
+#ifdef NSE_TEST_HOOKS
+/* Number of idle streams kept for reuse, for tests/nse_zlib_test. */
+int nse_zlib_pool_len(void);
+#endif
+
 #endif
 
@@ -1319,44 +1319,53 @@ Iterators = {
 
   --- Iterates over each user and password
   --
-  -- @param users table/function containing list of users
-  -- @param pass table/function containing list of passwords
+  -- @param users table, word list or function containing list of users
+  -- @param pass table, word list or function containing list of passwords
   -- @param mode string, should be either 'user' or 'pass' and controls
   --        whether the users or passwords are in the 'outer' loop
   -- @return function iterator
   account_iterator = function (users, pass, mode)
-    local function next_credential ()
-      local outer, inner
-      if "table" == type(users) then
-        users = unpwdb.table_iterator(users)
-      end
-      if "table" == type(pass) then
-        pass = unpwdb.table_iterator(pass)
-      end
+    if "function" ~= type(users) then
+      users = unpwdb.table_iterator(users)
+    end
+    if "function" ~= type(pass) then
+      pass = unpwdb.table_iterator(pass)
+    end
 
-      if mode == 'pass' then
-        outer, inner = pass, users
-      elseif mode == 'user' then
-        outer, inner = users, pass
-      else
-        return
-      end
+    local outer, inner
+    if mode == 'pass' then
+      outer, inner = pass, users
+    elseif mode == 'user' then
+      outer, inner = users, pass
+    else
+      return function () return nil, nil end
+    end
 
-      for o in outer do
-        for i in inner do
+    -- This is called for every credential, so it keeps its place in plain
+    -- upvalues rather than in a coroutine.
+    local o, done
+    return function ()
+      while not done do
+        if o == nil then
+          o = outer()
+          if o == nil then
+            done = true
+            break
+          end
+        end
+        local i = inner()
+        if i ~= nil then
           if mode == 'pass' then
-            coroutine.yield(i, o)
+            return i, o
           else
-            coroutine.yield(o, i)
+            return o, i
           end
         end
         inner "reset"
+        o = nil
       end
-      while true do
-        coroutine.yield(nil, nil)
-      end
+      return nil, nil
     end
-    return coroutine.wrap(next_credential)
   end,
 
 
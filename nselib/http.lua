@@ -96,6 +96,29 @@
 --
 -- @args http.max-cache-size The maximum memory size (in bytes) of the cache.
 --
+-- @args http.cache-dir A directory in which to keep responses to GET and HEAD
+-- requests across scans. Later scans that use the same directory ask the
+-- server whether a stored response has changed, with If-None-Match or
+-- If-Modified-Since, and use the stored copy if it has not. Only responses
+-- with an ETag or Last-Modified header are kept, unless
+-- <code>http.cache-max-age</code> is set. A body received from several hosts
+-- is stored once. Not supported on Windows. Default: no directory.
+--
+-- @args http.cache-dir-size The maximum size (in bytes) of the responses kept
+-- in <code>http.cache-dir</code>. Default: 100000000.
+--
+-- @args http.cache-max-age The number of seconds for which a response kept in
+-- <code>http.cache-dir</code> is used without asking the server whether it has
+-- changed. Default: 0.
+--
+-- @args http.share-vhosts If set, host names that resolve to the same address
+-- are made to share cache entries when they seem to reach the same site. The
+-- test is only that the root page and the page for a nonexistent path (as
+-- found by <code>identify_404</code>) come back byte for byte the same for
+-- both, without a redirect naming the host. Name-based virtual hosts that
+-- share those pages but differ below them then get each other's responses,
+-- so this is off unless asked for. Default: false.
+--
 -- @args http.useragent The value of the User-Agent header field sent with
 -- requests. By default it is
 -- <code>"Mozilla/5.0 (compatible; Nmap Scripting Engine; https://nmap.org/book/nse.html)"</code>.
@@ -125,14 +148,11 @@
 -- truncated.) This argument can be overridden case-by-case with request option
 -- <code>truncated_ok</code>.
 
--- TODO
--- Implement cache system for http pipelines
---
-
 
 local base64 = require "base64"
 local comm = require "comm"
 local coroutine = require "coroutine"
+local json = require "json"
 local math = require "math"
 local nmap = require "nmap"
 local os = require "os"
@@ -146,6 +166,8 @@ local table = require "table"
 local tableaux = require "tableaux"
 local url = require "url"
 local ascii_hostname = url.ascii_hostname
+local nmapdiskcache = require "nmapdiskcache"
+local nmapstrmatch = require "nmapstrmatch"
 local smbauth = require "smbauth"
 local unicode = require "unicode"
 
@@ -1023,18 +1045,23 @@ local function buildCookies(cookies, path)
   return table.concat(cookie, "; ")
 end
 
+-- Unique value to signal value is being retrieved.
+-- Also holds <mutex, thread> pairs, working thread is value
+local WORKING = setmetatable({}, {__mode = "v"});
+
 -- HTTP cache.
 -- Cache of GET and HEAD requests. Uses <"host:port:path", record>.
 -- record is in the format:
 --   result: The result from http.get or http.head
---   last_used: The time the record was last accessed or made.
---   get: Was the result received from a request to get or recently wiped?
+--   method: The method of the request that got the result.
+--   key: The key of the record in the cache.
+--   referenced: Was the record used since the eviction hand last passed it?
 --   size: The size of the record, equal to #record.result.body.
 local cache = {size = 0};
-
-local function cmp_last_used (r1, r2)
-      return (r1.last_used or 0) < (r2.last_used or 0);
-end
+-- Records with a body, in the order the eviction hand visits them. Records
+-- are evicted with the CLOCK algorithm, so that each one costs O(1) on
+-- average however large the cache is.
+local clock, clock_hand = {}, 1;
 
 local arg_max_cache_size = tonumber(stdnse.get_script_args({'http.max-cache-size', 'http-max-cache-size'}) or 1e6);
 local function check_size (cache)
@@ -1045,14 +1072,24 @@ local function check_size (cache)
     stdnse.debug1(
         "Current http cache size (%d bytes) exceeds max size of %d",
         size, arg_max_cache_size);
-    table.sort(cache, cmp_last_used);
 
-    for i, record in ipairs(cache) do
-      if size <= arg_max_cache_size then break end
-      local result = record.result;
-      if type(result.body) == "string" then
+    while size > arg_max_cache_size and #clock > 0 do
+      if clock_hand > #clock then
+        clock_hand = 1;
+      end
+      local record = clock[clock_hand];
+      if record.referenced then
+        record.referenced = false;
+        clock_hand = clock_hand + 1;
+      else
+        -- Fill the hole with the last record, which the hand then looks at.
+        clock[clock_hand] = clock[#clock];
+        clock[#clock] = nil;
         size = size - record.size;
-        record.size, record.get, result.body = 0, false, "";
+        record.size, record.evicted = 0, true;
+        if cache[record.key] == record then
+          cache[record.key] = nil;
+        end
       end
     end
     cache.size = size;
@@ -1062,9 +1099,81 @@ local function check_size (cache)
   return size;
 end
 
--- Unique value to signal value is being retrieved.
--- Also holds <mutex, thread> pairs, working thread is value
-local WORKING = setmetatable({}, {__mode = "v"});
+-- Puts a new record in the cache, in place of old, if any.
+local function cache_record (key, record, old)
+  if type(old) == "table" and old ~= WORKING and old.size and old.size > 0 then
+    -- The hand drops it from the clock without counting it again.
+    cache.size = cache.size - old.size;
+    old.size = 0;
+  end
+  record.key, record.referenced = key, true;
+  record.size = type(record.result.body) == "string" and #record.result.body or 0;
+  cache[key] = record;
+  if record.size > 0 then
+    clock[#clock + 1] = record;
+    cache.size = cache.size + record.size;
+    check_size(cache);
+  end
+end
+
+-- Host names that reach the same web server and get the same content from it
+-- share cache entries. Maps "name:port" to the first such name seen, or to
+-- false if the name has been checked and shares with nothing.
+local vhost_alias = {};
+-- The content signature and canonical name of each group, by "ip:port".
+local vhost_groups = {};
+local SHARE_VHOSTS = string.lower(stdnse.get_script_args('http.share-vhosts') or "false") ~= "false"
+
+local function cache_key (host, port, path)
+  if type(port) == "table" then port = port.number end
+  local name = ascii_hostname(host);
+  return (vhost_alias[name..":"..port] or name)..":"..port..":"..path;
+end
+
+-- Works out whether host is another name for a web server that has been seen
+-- under a different name, so that the two can share cache entries. Names are
+-- only merged if they have the same address and the root page and the 404
+-- page come back exactly the same for both. Pages that mention the host name,
+-- such as redirects, keep the names apart.
+local function find_vhost_alias (host, port)
+  if not SHARE_VHOSTS or type(host) ~= "table" or not host.ip then
+    return
+  end
+  local portnum = type(port) == "table" and port.number or port;
+  local name = ascii_hostname(host);
+  if vhost_alias[name..":"..portnum] ~= nil then
+    return
+  end
+
+  local group_key = host.ip..":"..portnum;
+  local mutex = nmap.mutex(tostring(find_vhost_alias)..group_key);
+  mutex "lock";
+  if vhost_alias[name..":"..portnum] == nil then
+    local root = get(host, port, "/", {redirect_ok=false});
+    local status_404, result_404, known_404 = identify_404(host, port);
+    local alias = false;
+    if root.status and status_404 then
+      local signature = table.concat({root.status, root.header.location or "",
+          root.header["content-type"] or "", root.body or "", result_404,
+          known_404 or ""}, "\0");
+      local groups = vhost_groups[group_key] or {};
+      vhost_groups[group_key] = groups;
+      for _, group in ipairs(groups) do
+        if group.signature == signature then
+          alias = group.name;
+          break
+        end
+      end
+      if not alias then
+        groups[#groups+1] = {signature = signature, name = name};
+      elseif alias ~= name then
+        stdnse.debug1("HTTP: %s shares content with %s on port %d", name, alias, portnum);
+      end
+    end
+    vhost_alias[name..":"..portnum] = alias;
+  end
+  mutex "done";
+end
 
 local function lookup_cache (method, host, port, path, options)
   if(not(validate_options(options))) then
@@ -1076,9 +1185,7 @@ local function lookup_cache (method, host, port, path, options)
   local no_cache = options.no_cache; -- do not save result
   local no_cache_body = options.no_cache_body; -- do not save body
 
-  if type(port) == "table" then port = port.number end
-
-  local key = ascii_hostname(host)..":"..port..":"..path;
+  local key = cache_key(host, port, path);
   local mutex = nmap.mutex(tostring(lookup_cache)..key);
 
   local state = {
@@ -1106,7 +1213,7 @@ local function lookup_cache (method, host, port, path, options)
       mutex "done";
     else
       mutex "done";
-      record.last_used = os.time();
+      record.referenced = true;
       return tableaux.tcopy(record.result), state;
     end
   end
@@ -1151,29 +1258,214 @@ end
 local function insert_cache (state, response)
   local key = assert(state.key);
   local mutex = assert(state.mutex);
+  local old_record = state.old_record;
 
   if response == nil or state.no_cache or not response_is_cacheable(response) then
-    cache[key] = state.old_record;
+    if old_record and old_record.evicted then
+      old_record = nil;
+    end
+    cache[key] = old_record;
   else
     local record = {
       result = tableaux.tcopy(response),
-      last_used = os.time(),
       method = state.method,
-      size = type(response.body) == "string" and #response.body or 0,
     };
-    response = record.result; -- only modify copy
-    cache[key], cache[#cache+1] = record, record;
     if state.no_cache_body then
-      response.body = "";
-    end
-    if type(response.body) == "string" then
-      cache.size = cache.size + #response.body;
-      check_size(cache);
+      record.result.body = "";
     end
+    cache_record(key, record, old_record);
   end
   mutex "done";
 end
 
+-- Returns true if the response to a request can only depend on its method,
+-- target and path. Requests with their own headers, credentials or content
+-- are never cached, since their responses may depend on them.
+local function is_plain_request (method, options)
+  if (method ~= "GET" and method ~= "HEAD") or options.cookies
+    or options.auth or options.digest or options.content then
+    return false;
+  end
+  for h in pairs(options.header or {}) do
+    if string.lower(h) ~= "connection" then
+      return false;
+    end
+  end
+  return true;
+end
+
+-- Returns the cache key for a pipelined request, or nil if its response should
+-- not come from or go to the cache.
+local function pipeline_cache_key (host, port, req)
+  if req.options.bypass_cache or not is_plain_request(req.method, req.options) then
+    return nil;
+  end
+  return cache_key(host, port, req.path);
+end
+
+-- Pipelined requests take what is already in the cache but do not wait for
+-- requests that other threads have in progress.
+local function pipeline_lookup_cache (key, method)
+  local record = cache[key];
+  if record == nil or record == WORKING or record.method ~= method then
+    return nil;
+  end
+  record.referenced = true;
+  return tableaux.tcopy(record.result);
+end
+
+local function pipeline_insert_cache (key, req, response)
+  if cache[key] == WORKING or req.options.no_cache
+    or not response_is_cacheable(response) then
+    return;
+  end
+  local record = {
+    result = tableaux.tcopy(response),
+    method = req.method,
+  };
+  if req.options.no_cache_body then
+    record.result.body = "";
+  end
+  cache_record(key, record, cache[key]);
+end
+
+-- Persistent HTTP cache, kept in the directory given by the http.cache-dir
+-- script argument and shared by every scan that uses the same directory.
+-- Responses are stored with nmapdiskcache, which keeps one copy of each body
+-- however many hosts and paths it was received from. A stored response is
+-- used as is for http.cache-max-age seconds, and after that only once the
+-- server has confirmed with "304 Not Modified" that it is still current.
+local DISK_CACHE_DIR = stdnse.get_script_args("http.cache-dir");
+local DISK_CACHE_SIZE = math.floor(tonumber(stdnse.get_script_args("http.cache-dir-size")) or 100e6);
+local DISK_MAX_AGE = tonumber(stdnse.get_script_args("http.cache-max-age")) or 0;
+local disk_cache;
+
+local function get_disk_cache ()
+  if disk_cache == nil then
+    disk_cache = false;
+    if DISK_CACHE_DIR then
+      local err;
+      disk_cache, err = nmapdiskcache.open(DISK_CACHE_DIR, DISK_CACHE_SIZE);
+      if not disk_cache then
+        stdnse.debug1("HTTP: Can't use cache directory %s: %s", DISK_CACHE_DIR, err);
+        disk_cache = false;
+      end
+    end
+  end
+  return disk_cache;
+end
+
+-- Returns the key of a request in the disk cache, or nil if it does not go
+-- through the disk cache. Unlike cache_key, it includes the address, which
+-- may have changed since an earlier scan.
+local function disk_cache_key (host, port, method, path, options)
+  if not get_disk_cache() or not is_plain_request(method, options) then
+    return nil;
+  end
+  local ip = type(host) == "table" and host.ip or "";
+  if type(port) == "table" then port = port.number end
+  return table.concat({method, options.scheme or "", ascii_hostname(host), ip,
+      port, path}, " ");
+end
+
+-- Returns the headers that ask the server whether a stored response is still
+-- current, or nil if the response has no validator.
+local function revalidation_headers (response)
+  local etag, modified = response.header.etag, response.header["last-modified"];
+  if not etag and not modified then
+    return nil;
+  end
+  return {["If-None-Match"] = etag, ["If-Modified-Since"] = modified};
+end
+
+-- Looks a request up in the disk cache. Returns a stored response that is
+-- still fresh; otherwise nil, the options to send the request with, and the
+-- stored response that they ask the server to confirm, if any.
+local function disk_lookup (key, options)
+  if options.bypass_cache then
+    return nil, options;
+  end
+  local meta, body, stored = disk_cache:get(key);
+  if not meta then
+    return nil, options;
+  end
+  local status, response = json.parse(meta);
+  if not status or type(response) ~= "table" or type(response.header) ~= "table" then
+    disk_cache:remove(key);
+    return nil, options;
+  end
+  response.body = body;
+  if os.time() - stored < DISK_MAX_AGE then
+    return response;
+  end
+
+  local validators = revalidation_headers(response);
+  if not validators then
+    return nil, options;
+  end
+  local req_options = tableaux.tcopy(options);
+  req_options.header = req_options.header or {};
+  for name, value in pairs(validators) do
+    req_options.header[name] = value;
+  end
+  return nil, req_options, response;
+end
+
+-- Stores a response in the disk cache, unless it should not outlive the scan.
+local function disk_store (key, options, response)
+  local header = response.header or {};
+  if options.no_cache or options.no_cache_body or not response_is_cacheable(response)
+    or type(response.body) ~= "string" or header["set-cookie"]
+    or string.find(string.lower(header["cache-control"] or ""), "no-store", 1, true) then
+    return;
+  end
+  -- Without a validator, the response could never be used again after it
+  -- expires.
+  if DISK_MAX_AGE <= 0 and not revalidation_headers(response) then
+    return;
+  end
+  local meta = {};
+  for k, v in pairs(response) do
+    if k ~= "body" then
+      meta[k] = v;
+    end
+  end
+  local status, encoded = pcall(json.generate, meta);
+  if status then
+    local ok, err = disk_cache:put(key, encoded, response.body);
+    if not ok then
+      stdnse.debug1("HTTP: Can't store %s in the cache: %s", key, err);
+    end
+  end
+end
+
+-- Finishes a request that disk_lookup let through: replaces a "304 Not
+-- Modified" answer to a revalidation with the stored response, and stores
+-- anything else. Returns the response to use.
+local function disk_update (key, options, stored, response)
+  if stored and response.status == 304 then
+    stdnse.debug2("HTTP: %s not modified, using the cached response", key);
+    disk_cache:touch(key);
+    return stored;
+  end
+  disk_store(key, options, response);
+  return response;
+end
+
+-- Performs a request through the disk cache if there is one.
+local function disk_request (host, port, method, path, options)
+  local key = disk_cache_key(host, port, method, path, options);
+  if not key then
+    return generic_request(host, port, method, path, options);
+  end
+  local fresh, req_options, stored = disk_lookup(key, options);
+  if fresh then
+    return fresh;
+  end
+  local response = generic_request(host, port, method, path, req_options);
+  return disk_update(key, options, stored, response);
+end
+
 -- Return true if the given method requires a body in the request. In case no
 -- body was supplied we must send "Content-Length: 0".
 local function request_method_needs_content_length(method)
@@ -1775,7 +2067,7 @@ function get(host, port, path, options)
   repeat
     response, state = lookup_cache("GET", u.host, u.port, u.path, options);
     if ( response == nil ) then
-      response = generic_request(u.host, u.port, "GET", u.path, options)
+      response = disk_request(u.host, u.port, "GET", u.path, options)
       insert_cache(state, response);
     end
     u = parse_redirect(host, port, path, response)
@@ -1854,7 +2146,7 @@ function head(host, port, path, options)
   repeat
     response, state = lookup_cache("HEAD", u.host, u.port, u.path, options);
     if response == nil then
-      response = generic_request(u.host, u.port, "HEAD", u.path, options)
+      response = disk_request(u.host, u.port, "HEAD", u.path, options)
       insert_cache(state, response);
     end
     u = parse_redirect(host, port, path, response)
@@ -1973,28 +2265,9 @@ local function force_header (headers, header, value)
 end
 
 local pipeline_comm_opts = {recv_before=false, request_timeout=10000}
----Performs all queued requests in the all_requests variable (created by the
--- <code>pipeline_add</code> function).
---
--- Returns an array of responses, each of which is a table as defined in the
--- module documentation above.
---
--- @param host The host to connect to.
--- @param port The port to connect to.
--- @param all_requests A table with all the previously built pipeline requests
--- @return A list of responses, in the same order as the requests were queued.
---         Each response is a table as described in the module documentation.
---         The response list may be either nil or shorter than expected (up to
---         and including being completely empty) due to communication issues or
---         other errors.
-function pipeline_go(host, port, all_requests)
+-- Sends a set of requests on as few connections as the server allows.
+local function pipeline_send(host, port, all_requests)
   local responses = {}
-
-  -- Check for an empty set
-  if (not all_requests or #all_requests == 0) then
-    stdnse.debug1("Warning: empty set of requests passed to http.pipeline_go()")
-    return responses
-  end
   stdnse.debug1("HTTP pipeline: Total number of requests: %d", #all_requests)
 
   -- We'll try a first request with keep-alive, just to check if the server
@@ -2079,6 +2352,108 @@ function pipeline_go(host, port, all_requests)
   return responses
 end
 
+-- Pipelines at least this long are worth a couple of extra requests to find
+-- out whether the host shares its content with a host name seen before.
+local VHOST_MIN_REQUESTS = 32
+
+---Performs all queued requests in the all_requests variable (created by the
+-- <code>pipeline_add</code> function).
+--
+-- Returns an array of responses, each of which is a table as defined in the
+-- module documentation above.
+--
+-- GET and HEAD requests are answered from the HTTP cache when possible, and
+-- their responses are added to it, subject to the same request options as
+-- <code>http.get</code>. This includes the cache directory given by
+-- <code>http.cache-dir</code>. Requests that set their own headers, cookies,
+-- credentials or content always go to the server. Long pipelines to host
+-- names that turn out to serve the same content can share their cached
+-- responses (see the <code>http.share-vhosts</code> script argument, off by
+-- default), and run one at a time so that the second one finds what the first
+-- one fetched.
+--
+-- @param host The host to connect to.
+-- @param port The port to connect to.
+-- @param all_requests A table with all the previously built pipeline requests
+-- @return A list of responses, in the same order as the requests were queued.
+--         Each response is a table as described in the module documentation.
+--         The response list may be either nil or shorter than expected (up to
+--         and including being completely empty) due to communication issues or
+--         other errors.
+function pipeline_go(host, port, all_requests)
+  -- Check for an empty set
+  if (not all_requests or #all_requests == 0) then
+    stdnse.debug1("Warning: empty set of requests passed to http.pipeline_go()")
+    return {}
+  end
+
+  local mutex
+  if #all_requests >= VHOST_MIN_REQUESTS then
+    find_vhost_alias(host, port)
+    mutex = nmap.mutex(tostring(pipeline_go)..cache_key(host, port, ""))
+    mutex "lock"
+  end
+
+  local keys, cached, pending = {}, {}, {}
+  local disk_keys, stored = {}, {}
+  for i, req in ipairs(all_requests) do
+    keys[i] = pipeline_cache_key(host, port, req)
+    cached[i] = keys[i] and pipeline_lookup_cache(keys[i], req.method)
+    if not cached[i] then
+      disk_keys[i] = keys[i] and disk_cache_key(host, port, req.method, req.path, req.options)
+      if disk_keys[i] then
+        local options
+        cached[i], options, stored[i] = disk_lookup(disk_keys[i], req.options)
+        if cached[i] then
+          pipeline_insert_cache(keys[i], req, cached[i])
+        elseif options ~= req.options then
+          req = {method=req.method, path=req.path, options=options}
+        end
+      end
+    end
+    if not cached[i] then
+      pending[#pending + 1] = req
+    end
+  end
+  if #pending < #all_requests then
+    stdnse.debug1("HTTP pipeline: %d of %d responses found in cache",
+      #all_requests - #pending, #all_requests)
+  end
+
+  local sent = {}
+  if #pending > 0 then
+    sent = pipeline_send(host, port, pending)
+    if not sent then
+      if mutex then mutex "done" end
+      return nil
+    end
+  end
+
+  -- Put the responses back in request order. As without the cache, the list
+  -- ends where the first response that could not be received would be.
+  local responses, j = {}, 1
+  for i, req in ipairs(all_requests) do
+    local resp = cached[i]
+    if not resp then
+      resp = sent[j]
+      j = j + 1
+      if not resp then
+        break
+      end
+      if disk_keys[i] then
+        resp = disk_update(disk_keys[i], req.options, stored[i], resp)
+      end
+      if keys[i] then
+        pipeline_insert_cache(keys[i], req, resp)
+      end
+    end
+    responses[i] = resp
+  end
+
+  if mutex then mutex "done" end
+  return responses
+end
+
 -- Parsing of specific headers. skip_space and the read_* functions return the
 -- byte index following whatever they have just read, or nil on error.
 
@@ -2841,6 +3216,84 @@ function response_contains(response, pattern, case_sensitive)
   return false
 end
 
+local PatternIndex = {}
+PatternIndex.__index = PatternIndex
+
+---Compiles a list of patterns for <code>response_contains</code> into an
+-- index that finds, in one pass over a response, which of them can possibly
+-- match it.
+--
+-- Each pattern is reduced to the longest literal string that all of its
+-- matches contain, and all of those strings are searched for at once. A
+-- pattern whose string is missing from a response cannot match it, so
+-- scripts that try many patterns on each response, such as http-enum, only
+-- need to call <code>response_contains</code> for the rest. Patterns without
+-- any such string, like <code>(.*)</code>, can always match.
+--
+-- @usage
+-- local index = http.pattern_index(patterns)
+-- local found = index:scan(response)
+-- for i, pattern in ipairs(patterns) do
+--   if index:may_match(found, i) and http.response_contains(response, pattern) then
+--     ...
+--   end
+-- end
+--@param patterns An array of patterns, as for <code>response_contains</code>.
+--@param case_sensitive [optional] As for <code>response_contains</code>.
+--@return An index object with <code>scan</code> and <code>may_match</code>
+--        methods.
+--@see http.response_contains
+function pattern_index(patterns, case_sensitive)
+  local case = case_sensitive and safe_string or lowercase
+  local literals, literal_ids, literal_of = {}, {}, {}
+
+  for i, pattern in ipairs(patterns) do
+    local literal = pattern ~= '' and nmapstrmatch.literal(case(pattern))
+    if literal then
+      local id = literal_ids[literal]
+      if not id then
+        id = #literals + 1
+        literals[id] = literal
+        literal_ids[literal] = id
+      end
+      literal_of[i] = id
+    end
+  end
+
+  return setmetatable({
+    matcher = nmapstrmatch.new(literals, not case_sensitive),
+    literal_of = literal_of,
+  }, PatternIndex)
+end
+
+---Searches a response for the literal strings of a pattern index.
+--
+-- The status line, headers and body are searched, as
+-- <code>response_contains</code> does.
+--@param response The full response table from a HTTP request.
+--@return A value to pass to <code>may_match</code>.
+function PatternIndex:scan(response)
+  local found = self.matcher:scan(response['status-line'] or '')
+  for _, header in pairs(response['rawheader'] or {}) do
+    self.matcher:scan(header, found)
+  end
+  if type(response['body']) == "string" then
+    self.matcher:scan(response['body'], found)
+  end
+  return found
+end
+
+---Tells whether a pattern of the index can match a scanned response.
+--
+--@param found The return value of <code>scan</code> for the response.
+--@param i The index of the pattern in the list given to
+--         <code>pattern_index</code>.
+--@return False if the pattern cannot match the response, true if it may.
+function PatternIndex:may_match(found, i)
+  local id = self.literal_of[i]
+  return id == nil or found[id] == true
+end
+
 ---This function should be called whenever a valid path (a path that doesn't
 -- contain a known 404 page) is discovered.
 --
@@ -3317,6 +3770,63 @@ do
     test_suite:add_test(unittest.equal(redirect_url.port, test.redirect_port))
     test_suite:add_test(unittest.equal(redirect_url.path, test.redirect_path))
   end
+
+  test_suite:add_test(unittest.is_true(is_plain_request("GET", {header={Connection="close"}})),
+    "plain GET request")
+  test_suite:add_test(unittest.is_false(is_plain_request("GET", {header={Range="bytes=0-1"}})),
+    "GET request with a header")
+  test_suite:add_test(unittest.is_false(is_plain_request("POST", {})),
+    "POST request")
+  test_suite:add_test(unittest.is_nil(revalidation_headers({header={}})),
+    "no validators")
+  test_suite:add_test(unittest.identical(revalidation_headers({header={etag='"abc"'}}),
+    {["If-None-Match"]='"abc"'}), "ETag validator")
+  test_suite:add_test(unittest.identical(
+    revalidation_headers({header={["last-modified"]="Sat, 17 Oct 2026 10:00:00 GMT"}}),
+    {["If-Modified-Since"]="Sat, 17 Oct 2026 10:00:00 GMT"}), "Last-Modified validator")
+
+  local literal_tests = {
+    { "<title>Index of", "<title>Index of" },
+    { "^Server: Apache/(%d+)", "Server: Apache/" },
+    { "(.*)", nil },
+    { "a.b%.phpx?", "b.php" },
+    { "ab+cde", "cde" },
+    { "[Ww]eb ?[Ss]erver$", "erver" },
+    { "%bxy1234", "1234" },
+  }
+  for _, test in ipairs(literal_tests) do
+    test_suite:add_test(unittest.equal(nmapstrmatch.literal(test[1]), test[2]),
+      "literal of " .. test[1])
+  end
+
+  local index_patterns = {
+    "<title>index of",
+    "Server: Apache/(%d+)",
+    "(.*)",
+    "",
+    "X%-Powered%-By: PHP",
+    "not present",
+    "Wiki",
+  }
+  local index_response = {
+    ["status-line"] = "HTTP/1.1 200 OK\r\n",
+    rawheader = { "Server: Apache/2.4", "Content-Type: text/html" },
+    body = "<html><TITLE>Index of /</TITLE>mediawiki</html>",
+  }
+  for _, case_sensitive in ipairs({false, true}) do
+    local index = pattern_index(index_patterns, case_sensitive)
+    local found = index:scan(index_response)
+    for i, pattern in ipairs(index_patterns) do
+      local name = ("pattern index %q (case sensitive: %s)"):format(pattern, case_sensitive)
+      local matched = response_contains(index_response, pattern, case_sensitive)
+      -- The index may give false positives, never false negatives.
+      if matched then
+        test_suite:add_test(unittest.is_true(index:may_match(found, i)), name)
+      end
+    end
+    test_suite:add_test(unittest.is_false(index:may_match(found, 6)),
+      "pattern index skips missing literal")
+  end
 end
 
 return _ENV;
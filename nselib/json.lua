@@ -20,35 +20,14 @@
 -- Modified 02/27/2010 - v0.4 Added unicode handling (written by David Fifield). Renamed toJson
 -- and fromJson into generate() and parse(), implemented more proper numeric parsing and added some more error checking.
 
+local nmapjson = require "nmapjson"
 local stdnse = require "stdnse"
-local string = require "string"
-local table = require "table"
-local unicode = require "unicode"
 local unittest = require "unittest"
 _ENV = stdnse.module("json", stdnse.seeall)
 
-local lpeg = require "lpeg";
-local locale = lpeg.locale;
-local P = lpeg.P;
-local R = lpeg.R;
-local S = lpeg.S;
-local V = lpeg.V;
-local C = lpeg.C;
-local Cb = lpeg.Cb;
-local Cc = lpeg.Cc;
-local Cf = lpeg.Cf;
-local Cg = lpeg.Cg;
-local Cp = lpeg.Cp;
-local Cs = lpeg.Cs;
-local Ct = lpeg.Ct;
-local Cmt = lpeg.Cmt;
+-- Parsing and generating are done by the nmapjson C module (nse_json.cc).
 
--- case sensitive keyword
-local function K (a)
-  return P(a) * -(locale().alnum + "_");
-end
-
-local NULL = {};
+local NULL = nmapjson.NULL;
 _M.NULL = NULL;
 
 --- Makes a table be treated as a JSON Array when generating JSON
@@ -72,77 +51,6 @@ function make_object(t)
   return t
 end
 
--- Decode a Unicode escape, assuming that self.pos starts just after the
--- initial \u. May consume an additional escape in the case of a UTF-16
--- surrogate pair. See RFC 2781 for UTF-16.
-local unicode_esc = P [[\u]] * C(locale().xdigit * locale().xdigit * locale().xdigit * locale().xdigit);
-local function unicode16 (subject, position, hex)
-  local cp = assert(tonumber(hex, 16));
-
-  if cp < 0xD800 or cp > 0xDFFF then
-    return position, unicode.utf8_enc(cp);
-  elseif cp >= 0xDC00 and cp <= 0xDFFF then
-    error(("Not a Unicode character: U+%04X"):format(cp));
-  end
-
-  -- Beginning of a UTF-16 surrogate.
-  local lowhex = unicode_esc:match(subject, position);
-
-  if not lowhex then
-    error(("Bad unicode escape \\u%s (missing low surrogate)"):format(hex))
-  else
-    local cp2 = assert(tonumber(lowhex, 16));
-    if not (cp2 >= 0xDC00 and cp2 <= 0xDFFF) then
-      error(("Bad unicode escape \\u%s\\u%s (bad low surrogate)"):format(hex, lowhex))
-    end
-    position = position+6 -- consume '\uXXXX'
-    cp = 0x10000 + (cp & 0x3FF) * 0x400 + (cp2 & 0x3FF)
-    return position, unicode.utf8_enc(cp);
-  end
-end
-
--- call lpeg.locale on the grammar to add V "space"
-local json = locale {
-  V "json";
-
-  json = V "space"^0 * V "value" * V "space"^0 * P(-1); -- FIXME should be 'V "object" + V "array"' instead of 'V "value"' ?
-
-  value = V "string" +
-          V "number" +
-          V "object" +
-          V "array" +
-          K "true" * Cc(true)+
-          K "false" * Cc(false)+
-          K "null" * Cc(NULL);
-
-  object = Cf(Ct "" * P "{" * V "space"^0 * (V "members")^-1 * V "space"^0 * P "}", rawset) / make_object;
-  members = V "pair" * (V "space"^0 * P "," * V "space"^0 * V "pair")^0;
-  pair = Cg(V "string" * V "space"^0 * P ":" * V "space"^0 * V "value");
-
-  array = Ct(P "[" * V "space"^0 * (V "elements")^-1 * V "space"^0 * P "]") / make_array;
-  elements = V "value" * V "space"^0 * (P "," * V "space"^0 * V "value")^0;
-
-  string = Ct(P [["]] * (V "char")^0 * P [["]]) / table.concat;
-  char = P [[\"]] * Cc [["]] +
-         P [[\\]] * Cc [[\]] +
-         P [[\b]] * Cc "\b" +
-         P [[\f]] * Cc "\f" +
-         P [[\n]] * Cc "\n" +
-         P [[\r]] * Cc "\r" +
-         P [[\t]] * Cc "\t" +
-         P [[\u]] * Cmt(C(V "xdigit" * V "xdigit" * V "xdigit" * V "xdigit"), unicode16) +
-         P [[\]] * C(1) +
-         (C(1) - P [["]]);
-
-  number = C((P "-")^-1 * V "space"^0 * (V "hexadecimal" + V "floating" + V "integer")) / function (a) return assert(tonumber(a)) end;
-  hexadecimal = P "0x" * V "xdigit"^1;
-  floating = (V "digit"^1 * P "." * V "digit"^0 + V "digit"^0 * P "." * V "digit"^1) * (V "exponent")^-1;
-  integer = V "digit"^1 * (V "exponent")^-1;
-  exponent = S "eE" * (S "-+")^-1 * V "digit"^1;
-};
-json = P(json); -- compile the grammar
-
-
 --- Parses JSON data into a Lua object.
 --
 -- This is the method you probably want to use if you use this library from a
@@ -151,50 +59,55 @@ json = P(json); -- compile the grammar
 --@return status true if ok, false if bad
 --@return an object representing the json, or error message
 function parse (data)
-  local status, object = pcall(json.match, json, data);
+  local status, object = pcall(nmapjson.decode, data);
 
   if not status then
     return false, object;
-  elseif object then
-    return true, object;
   else
-    return false, "syntax error";
+    return true, object;
   end
 end
 
---Some local shortcuts
-local function dbg(str,...)
-  stdnse.debug1("Json:"..str, ...)
-end
-
--- See section 2.5 for escapes.
--- For convenience, ESCAPE_TABLE maps to escape sequences complete with
--- backslash, and REVERSE_ESCAPE_TABLE maps from single escape characters
--- (no backslash).
-local ESCAPE_TABLE = {}
-local REVERSE_ESCAPE_TABLE = {}
-do
-  local escapes = {
-    ["\x22"] = "\"",
-    ["\x5C"] = "\\",
-    ["\x2F"] = "/",
-    ["\x08"] = "b",
-    ["\x0C"] = "f",
-    ["\x0A"] = "n",
-    ["\x0D"] = "r",
-    ["\x09"] = "t",
-  }
-  for k, v in pairs(escapes) do
-    ESCAPE_TABLE[k] = "\\" .. v
-    REVERSE_ESCAPE_TABLE[v] = k
-  end
-end
+local Parser = {
+  --- Parses the next piece of the document.
+  --
+  -- Pieces may be split anywhere, even in the middle of a string or number.
+  --@param data the next piece of the document
+  --@return status true if ok, false if the data cannot be valid JSON
+  --@return error message if status is false
+  feed = function (self, data)
+    local status, err = pcall(self.decoder.feed, self.decoder, data);
+    if not status then
+      return false, err;
+    end
+    return true;
+  end,
+
+  --- Finishes parsing once all of the document has been fed.
+  --
+  --@return status true if ok, false if bad
+  --@return an object representing the json, or error message
+  finish = function (self)
+    return pcall(self.decoder.finish, self.decoder);
+  end,
+}
+Parser.__index = Parser
 
--- Escapes a string
---@param str the string
---@return a string where the special chars have been escaped
-local function escape(str)
-  return "\"" .. string.gsub(str, ".", ESCAPE_TABLE) .. "\""
+--- Creates a parser for JSON data that arrives in pieces.
+--
+-- This avoids having to collect a large document into one string before
+-- parsing it, for example when reading a chunked HTTP response. The result is
+-- the same as that of <code>parse</code> on the whole document.
+--@usage
+-- local p = json.parser()
+-- for _, chunk in ipairs(chunks) do
+--   local status, err = p:feed(chunk)
+--   if not status then return nil, err end
+-- end
+-- local status, obj = p:finish()
+--@return a parser object with <code>feed</code> and <code>finish</code> methods
+function parser ()
+  return setmetatable({decoder = nmapjson.decoder()}, Parser);
 end
 
 --- Checks what JSON type a variable will be treated as when generating JSON
@@ -222,36 +135,7 @@ end
 --@param obj a table containing data
 --@return a string containing valid json
 function generate(obj)
-  -- NULL-check must be performed before
-  -- checking type == table, since the NULL-object
-  -- is a table
-  if obj == NULL then
-    return "null"
-  elseif obj == false then
-    return "false"
-  elseif obj == true then
-    return "true"
-  elseif type(obj) == "number" then
-    return tostring(obj)
-  elseif type(obj) == "string" then
-    return escape(obj)
-  elseif type(obj) == "table" then
-    local k, v, elems, jtype
-    elems = {}
-    jtype = typeof(obj)
-    if jtype == "array" then
-      for _, v in ipairs(obj) do
-        elems[#elems + 1] = generate(v)
-      end
-      return "[" .. table.concat(elems, ", ") .. "]"
-    elseif jtype == "object" then
-      for k, v in pairs(obj) do
-        elems[#elems + 1] = escape(k) .. ": " .. generate(v)
-      end
-      return "{" .. table.concat(elems, ", ") .. "}"
-    end
-  end
-  error("Unknown data type in generate")
+  return nmapjson.encode(obj)
 end
 
 if not unittest.testing() then
@@ -440,4 +324,40 @@ for _, test in ipairs(TESTS) do
   end
 end
 
+-- The same documents fed to a parser one byte at a time
+for _, test in ipairs(TESTS) do
+  local p = parser()
+  local status, val = true
+  for i = 1, #test[1] do
+    status, val = p:feed(test[1]:sub(i, i))
+    if not status then
+      break
+    end
+  end
+  if status then
+    status, val = p:finish()
+  end
+  if test.valid == false then
+    test_suite:add_test(is_false(status), "Streaming syntax error status is false")
+  else
+    test_suite:add_test(is_true(status), "Streaming parse")
+    if test.generates then
+      test_suite:add_test(equal(generate(val), test.generates), "Streaming generate")
+    end
+  end
+end
+
+do
+  -- Each parsed table has its own metatable; retyping or changing one must
+  -- not affect the others
+  local _, a = parse('[[1], [2], {}]')
+  make_object(a[1])
+  getmetatable(a[3]).__index = {x = 1}
+  test_suite:add_test(equal(typeof(a[1]), "object"), "make_object on parsed array")
+  test_suite:add_test(equal(typeof(a[2]), "array"), "Other parsed arrays unchanged")
+  test_suite:add_test(equal(a[2].x, nil), "Parsed metatables not shared")
+  test_suite:add_test(equal(generate(make_array({})), "[]"), "Generate empty array")
+  test_suite:add_test(equal(generate({["a/b"]="\0\n"}), '{"a\\/b": "\0\\n"}'), "Generate escapes")
+end
+
 return _ENV;
@@ -65,16 +65,13 @@
 -- @author Kris Katterjohn 06/2008
 -- @copyright Same as Nmap--See https://nmap.org/book/man-legal.html
 
-local io = require "io"
 local nmap = require "nmap"
+local nmapwordlist = require "nmapwordlist"
 local os = require "os"
 local stdnse = require "stdnse"
 local datetime = require "datetime"
 _ENV = stdnse.module("unpwdb", stdnse.seeall)
 
-local usertable = {}
-local passtable = {}
-
 local customdata = false
 
 -- So I don't have to type as much :)
@@ -98,36 +95,43 @@ local passfile = function()
   return nmap.fetchfile("nselib/data/passwords.lst")
 end
 
-local filltable = function(filename, table)
-  if #table ~= 0 then
-    return true
-  end
-
-  local file, err = io.open(filename, "r")
-
-  if not file then
-    return false, err
-  end
-
-  for l in file:lines() do
-    -- Comments takes up a whole line
-    if not l:match("^#!comment:") then
-      table[#table + 1] = l:gsub("[\r\n]+$", "")
-    end
-  end
-
-  file:close()
-
-  return true
+--- Opens a word list file, such as a username or password database.
+--
+-- The file is mapped into memory the first time it is opened and shared by
+-- every script and thread that opens it later, so large lists are read only
+-- once per scan. Lines starting with <code>"#!comment:"</code> are left out,
+-- as are carriage returns at the end of lines.
+--
+-- The list can be indexed like an array of strings (<code>list[i]</code>,
+-- <code>#list</code>) and passed to <code>table_iterator</code>.
+-- @param filename The name of the file.
+-- @return The list, or nil on error.
+-- @return An error message if the file could not be read.
+wordlist = function(filename)
+  return nmapwordlist.open(filename, "#!comment:")
 end
 
+--- Returns an iterator over an array or a word list.
+--
+-- Besides <code>"reset"</code>, the iterator accepts the commands
+-- <code>"position"</code>, which returns the number of elements returned so
+-- far, and <code>"seek"</code>, which takes such a number as a second argument
+-- and continues from there. Together they let a brute-force run be resumed or
+-- split up.
+-- @param table An array or a list returned by <code>wordlist</code>.
+-- @return function The iterator.
 table_iterator = function(table)
   local i = 1
 
-  return function(cmd)
+  return function(cmd, pos)
     if cmd == "reset" then
       i = 1
       return
+    elseif cmd == "position" then
+      return i - 1
+    elseif cmd == "seek" then
+      i = pos + 1
+      return
     end
     local elem = table[i]
     if elem then i = i + 1 end
@@ -185,12 +189,12 @@ local usernames_raw = function()
     return false, "Cannot find username list"
   end
 
-  local status, err = filltable(path, usertable)
-  if not status then
+  local list, err = wordlist(path)
+  if not list then
     return false, ("Error parsing username list: %s"):format(err)
   end
 
-  return true, table_iterator(usertable)
+  return true, table_iterator(list)
 end
 
 --- Returns a function closure which returns a new password with every call
@@ -205,18 +209,19 @@ local passwords_raw = function()
     return false, "Cannot find password list"
   end
 
-  local status, err = filltable(path, passtable)
-  if not status then
+  local list, err = wordlist(path)
+  if not list then
     return false, ("Error parsing password list: %s"):format(err)
   end
 
-  return true, table_iterator(passtable)
+  return true, table_iterator(list)
 end
 
 --- Wraps time and count limits around an iterator.
 --
 -- When either limit expires, starts returning <code>nil</code>. Calling the
--- iterator with an argument of "reset" resets the count.
+-- iterator with an argument of "reset" resets the count, and "seek" sets it to
+-- the new position.
 -- @param time_limit Time limit in seconds. Use 0 or <code>nil</code> for no limit.
 -- @param count_limit Count limit in seconds. Use 0 or <code>nil</code> for no limit.
 -- @param label A string describing the iterator, to be used in verbose print messages.
@@ -229,9 +234,14 @@ limited_iterator = function(iterator, time_limit, count_limit, label)
   local start = os.time()
   local count = 0
   label = label or "limited_iterator"
-  return function(cmd)
+  return function(cmd, pos)
     if cmd == "reset" then
       count = 0
+    elseif cmd == "position" then
+      return iterator(cmd)
+    elseif cmd == "seek" then
+      count = pos
+      return iterator(cmd, pos)
     else
       count = count + 1
     end
@@ -335,4 +345,39 @@ function filter_iterator (iterator, filter)
   end
 end
 
+local unittest = require "unittest"
+
+if not unittest.testing() then
+  return _ENV
+end
+
+test_suite = unittest.TestSuite:new()
+
+local io = require "io"
+local path = os.tmpname()
+local file = assert(io.open(path, "wb"))
+file:write("root\r\n#!comment: skipped\nadmin\n\nguest")
+file:close()
+local list = wordlist(path)
+os.remove(path)
+
+test_suite:add_test(unittest.not_nil(list), "wordlist opens")
+test_suite:add_test(unittest.equal(#list, 4), "wordlist length")
+test_suite:add_test(unittest.equal(list[1], "root"), "trailing CR removed")
+test_suite:add_test(unittest.equal(list[2], "admin"), "comment skipped")
+test_suite:add_test(unittest.equal(list[3], ""), "empty line kept")
+test_suite:add_test(unittest.equal(list[4], "guest"), "last line without newline")
+test_suite:add_test(unittest.is_nil(list[5]), "past the end")
+test_suite:add_test(unittest.is_nil(wordlist(path .. ".missing")), "missing file")
+
+local iter = table_iterator(list)
+iter()
+iter()
+test_suite:add_test(unittest.equal(iter("position"), 2), "iterator position")
+iter("seek", 3)
+test_suite:add_test(unittest.equal(iter(), "guest"), "iterator seek")
+test_suite:add_test(unittest.is_nil(iter()), "iterator end")
+iter("reset")
+test_suite:add_test(unittest.equal(iter(), "root"), "iterator reset")
+
 return _ENV;
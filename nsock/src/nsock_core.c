@@ -372,6 +372,7 @@ void handle_connect_result(struct npool *ms, struct nevent *nse, enum nse_status
         iod->ssl = SSL_new(sslctx);
         if (!iod->ssl)
           fatal("SSL_new failed: %s", ERR_error_string(ERR_get_error(), NULL));
+        nsi_ssl_session_cache_attach(iod);
       }
 
       /* Avoid sending SNI extension with DTLS because many servers don't allow
@@ -491,6 +492,7 @@ void handle_connect_result(struct npool *ms, struct nevent *nse, enum nse_status
         iod->ssl = SSL_new(ms->sslctx);
         if (!iod->ssl)
           fatal("SSL_new failed: %s", ERR_error_string(ERR_get_error(), NULL));
+        SSL_set_app_data(iod->ssl, iod);
 
         SSL_set_options(iod->ssl, options | SSL_OP_NO_SSLv2);
         socket_count_read_inc(nse->iod);
@@ -501,6 +503,7 @@ void handle_connect_result(struct npool *ms, struct nevent *nse, enum nse_status
       } else {
         nsock_log_info("EID %li %s",
                        nse->id, ERR_error_string(ERR_get_error(), NULL));
+        nsi_ssl_session_cache_drop(iod);
         nse->event_done = 1;
         nse->status = NSE_STATUS_ERROR;
         nse->errnum = EIO;
@@ -251,6 +251,9 @@ void nsock_iod_delete(nsock_iod nsockiod, enum nsock_del_mode pending_response)
 #if HAVE_OPENSSL
   /* Close any SSL resources */
   if (nsi->ssl) {
+    /* The IOD is going away; don't let late session tickets refer to it. */
+    SSL_set_app_data(nsi->ssl, NULL);
+
     /* No longer free session because copy nsi stores is not reference counted */
 #if 0
     if (nsi->ssl_session)
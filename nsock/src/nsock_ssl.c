@@ -105,6 +105,136 @@ void nsp_ssl_cleanup(struct npool *nsp)
 #endif
 }
 
+/* Process-wide client session cache, shared by all pools. New sessions are
+ * stored by ssl_new_session_cb, which also catches TLS 1.3 tickets that arrive
+ * after the handshake, and offered to later connections to the same address,
+ * port, and SNI name whose caller did not supply a session of its own. The
+ * cache is direct-mapped on a hash of that key: a new session evicts whatever
+ * shared its slot, which bounds memory use without any LRU bookkeeping. */
+#define SSL_SESSION_CACHE_SLOTS 1024
+
+struct ssl_session_slot {
+  unsigned char *key;
+  size_t keylen;
+  SSL_SESSION *session;
+};
+
+static struct ssl_session_slot session_cache[SSL_SESSION_CACHE_SLOTS];
+
+/* Build the cache key of an IOD (address family, port, address, and SNI host
+ * name) in buf, which must hold at least SSL_SESSION_KEY_MAX bytes. Returns the
+ * key length, or 0 if the IOD can't be cached. */
+#define SSL_SESSION_KEY_MAX (1 + 2 + 16 + 256)
+static size_t ssl_session_key(const struct niod *iod, unsigned char *buf) {
+  const struct sockaddr_storage *ss = &iod->peer;
+  size_t len = 0;
+
+  if (iod->lastproto == IPPROTO_UDP)
+    return 0;
+  buf[len++] = (unsigned char) ss->ss_family;
+  if (ss->ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) ss;
+    memcpy(buf + len, &sin->sin_port, 2);
+    memcpy(buf + len + 2, &sin->sin_addr, 4);
+    len += 6;
+  }
+#if HAVE_IPV6
+  else if (ss->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) ss;
+    memcpy(buf + len, &sin6->sin6_port, 2);
+    memcpy(buf + len + 2, &sin6->sin6_addr, 16);
+    len += 18;
+  }
+#endif
+  else {
+    return 0;
+  }
+  if (iod->hostname != NULL) {
+    size_t n = strlen(iod->hostname);
+    if (n > 255)
+      return 0;
+    memcpy(buf + len, iod->hostname, n);
+    len += n;
+  }
+  return len;
+}
+
+static struct ssl_session_slot *ssl_session_slot(const unsigned char *key, size_t keylen) {
+  /* FNV-1a */
+  unsigned int h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < keylen; i++)
+    h = (h ^ key[i]) * 16777619U;
+  return &session_cache[h % SSL_SESSION_CACHE_SLOTS];
+}
+
+static int ssl_new_session_cb(SSL *ssl, SSL_SESSION *session) {
+  struct niod *iod = (struct niod *) SSL_get_app_data(ssl);
+  struct ssl_session_slot *slot;
+  unsigned char key[SSL_SESSION_KEY_MAX];
+  size_t keylen;
+
+  if (iod == NULL)
+    return 0;
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L && !defined LIBRESSL_VERSION_NUMBER
+  if (!SSL_SESSION_is_resumable(session))
+    return 0;
+#endif
+  keylen = ssl_session_key(iod, key);
+  if (keylen == 0)
+    return 0;
+
+  slot = ssl_session_slot(key, keylen);
+  if (slot->session != NULL)
+    SSL_SESSION_free(slot->session);
+  free(slot->key);
+  slot->key = (unsigned char *) safe_malloc(keylen);
+  memcpy(slot->key, key, keylen);
+  slot->keylen = keylen;
+  slot->session = session;
+
+  return 1; /* we keep the reference */
+}
+
+/* Prepare a new SSL object of iod for session caching, and if the caller did
+ * not give a session to resume, offer the cached one for the same peer. */
+void nsi_ssl_session_cache_attach(struct niod *iod) {
+  struct ssl_session_slot *slot;
+  unsigned char key[SSL_SESSION_KEY_MAX];
+  size_t keylen;
+
+  SSL_set_app_data(iod->ssl, iod);
+  if (iod->ssl_session != NULL)
+    return;
+  keylen = ssl_session_key(iod, key);
+  if (keylen == 0)
+    return;
+  slot = ssl_session_slot(key, keylen);
+  if (slot->session != NULL && slot->keylen == keylen
+      && memcmp(slot->key, key, keylen) == 0) {
+    if (SSL_set_session(iod->ssl, slot->session) == 1)
+      nsock_log_debug("Offering cached SSL session for IOD #%li", iod->id);
+  }
+}
+
+/* Forget the cached session of iod's peer, after a failed handshake. */
+void nsi_ssl_session_cache_drop(struct niod *iod) {
+  struct ssl_session_slot *slot;
+  unsigned char key[SSL_SESSION_KEY_MAX];
+  size_t keylen;
+
+  keylen = ssl_session_key(iod, key);
+  if (keylen == 0)
+    return;
+  slot = ssl_session_slot(key, keylen);
+  if (slot->session != NULL && slot->keylen == keylen
+      && memcmp(slot->key, key, keylen) == 0) {
+    SSL_SESSION_free(slot->session);
+    slot->session = NULL;
+  }
+}
+
 static SSL_CTX *ssl_init_helper(const SSL_METHOD *method) {
   SSL_CTX *ctx;
 
@@ -137,11 +267,12 @@ static SSL_CTX *ssl_init_helper(const SSL_METHOD *method) {
           ERR_error_string(ERR_get_error(), NULL));
   }
 
-  /* Our SSL* will always have the SSL_SESSION* inside it, so we neither need to
-   * use nor waste memory for the session cache.  (Use '1' because '0' means
-   * 'infinite'.)   */
-  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF|SSL_SESS_CACHE_NO_AUTO_CLEAR);
+  /* Client sessions are kept in our own process-wide cache (see
+   * ssl_new_session_cb), not in the per-context internal store, so they are
+   * shared between pools.  (Use '1' because '0' means 'infinite'.)   */
+  SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE|SSL_SESS_CACHE_NO_AUTO_CLEAR);
   SSL_CTX_sess_set_cache_size(ctx, 1);
+  SSL_CTX_sess_set_new_cb(ctx, ssl_new_session_cb);
   SSL_CTX_set_timeout(ctx, 3600); /* pretty unnecessary */
 
   return ctx;
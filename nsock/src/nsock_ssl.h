@@ -80,6 +80,8 @@ struct sslinfo {
 int nsi_ssl_post_connect_verify(const nsock_iod nsockiod);
 
 void nsp_ssl_cleanup(struct npool *nsp);
+void nsi_ssl_session_cache_attach(struct niod *iod);
+void nsi_ssl_session_cache_drop(struct niod *iod);
 #endif /* HAVE_OPENSSL */
 #endif /* NSOCK_SSL_H */
 
@@ -1000,6 +1000,9 @@ HostOsScanStats::HostOsScanStats(Target * t) {
   timing.num_replies_expected = 0;
   timing.num_replies_received = 0;
   timing.num_updates = 0;
+  timing.w_max = 0;
+  timing.epoch_start.tv_sec = 0;
+  timing.epoch_start.tv_usec = 0;
   gettimeofday(&timing.last_drop, NULL);
 
   for (i = 0; i < NUM_FPTESTS; i++)
@@ -1325,8 +1328,8 @@ void HostOsScan::adjust_times(HostOsScanStats *hss, const OFProbe *probe, const
   /* Increase the window for a positive reply. This can overlap with case (1)
      above. */
   if (rcvdtime != NULL) {
-    stats->timing.ack(&perf);
-    hss->timing.ack(&perf);
+    stats->timing.ack(&perf, 1.0, &now, stats->to.srtt);
+    hss->timing.ack(&perf, 1.0, &now, hss->target->to.srtt);
   }
 }
 
@@ -2240,6 +2243,9 @@ ScanStats::ScanStats() {
   timing.num_replies_expected = 0;
   timing.num_replies_received = 0;
   timing.num_updates = 0;
+  timing.w_max = 0;
+  timing.epoch_start.tv_sec = 0;
+  timing.epoch_start.tv_usec = 0;
   gettimeofday(&timing.last_drop, NULL);
 
   initialize_timeout_info(&to);
@@ -2415,7 +2415,43 @@ void printtraceroute(const Target *currenths) {
   printtraceroute_xml(currenths);
 }
 
+/* Writes the attributes summarizing a latency histogram, in microseconds. */
+static void xml_latency_attributes(const struct latency_hist *h) {
+  xml_attribute("count", "%llu", (unsigned long long) h->count);
+  xml_attribute("min", "%lu", (unsigned long) h->min);
+  xml_attribute("mean", "%.0f", latency_hist_mean(h));
+  xml_attribute("p50", "%lu", (unsigned long) latency_hist_percentile(h, 50));
+  xml_attribute("p90", "%lu", (unsigned long) latency_hist_percentile(h, 90));
+  xml_attribute("p99", "%lu", (unsigned long) latency_hist_percentile(h, 99));
+  xml_attribute("max", "%lu", (unsigned long) h->max);
+}
+
+/* Writes a latency element for the whole of latency, containing a phase
+   element for each scan phase. Nothing is written if no times were
+   measured. */
+static void print_xml_latency(const LatencyStats *latency) {
+  std::vector<std::pair<stype, struct latency_hist> >::const_iterator it;
+
+  if (latency->all.count == 0)
+    return;
+  xml_open_start_tag("latency");
+  xml_latency_attributes(&latency->all);
+  xml_close_start_tag();
+  xml_newline();
+  for (it = latency->phases.begin(); it != latency->phases.end(); it++) {
+    xml_open_start_tag("phase");
+    xml_attribute("task", "%s", scantype2str(it->first));
+    xml_latency_attributes(&it->second);
+    xml_close_empty_tag();
+    xml_newline();
+  }
+  xml_end_tag();
+  xml_newline();
+}
+
 void printtimes(const Target *currenths) {
+  const struct latency_hist *rtts = &currenths->latency.all;
+
   if (currenths->to.srtt != -1 || currenths->to.rttvar != -1) {
     if (o.debugging) {
       log_write(LOG_STDOUT, "Final times for host: srtt: %d rttvar: %d  to: %d\n",
@@ -2428,6 +2464,15 @@ void printtimes(const Target *currenths) {
     xml_close_empty_tag();
     xml_newline();
   }
+  if (o.debugging && rtts->count > 0) {
+    log_write(LOG_STDOUT, "Round-trip times for host: %llu probes, p50: %lu p90: %lu p99: %lu max: %lu\n",
+      (unsigned long long) rtts->count,
+      (unsigned long) latency_hist_percentile(rtts, 50),
+      (unsigned long) latency_hist_percentile(rtts, 90),
+      (unsigned long) latency_hist_percentile(rtts, 99),
+      (unsigned long) rtts->max);
+  }
+  print_xml_latency(&currenths->latency);
 }
 
 /* Prints a status message while the program is running */
@@ -2531,6 +2576,7 @@ void printfinaloutput() {
   xml_close_empty_tag();
   print_xml_hosts();
   xml_newline();
+  print_xml_latency(&scan_latencies);
   xml_end_tag();
   xml_newline();
 
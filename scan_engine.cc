@@ -96,6 +96,8 @@ extern NmapOps o;
 #define RLD_TIME_MS 1000
 /* Keep a completed host around for a standard TCP MSL (2 min) */
 #define COMPL_HOST_LIFETIME_MS 120000
+/* How many seconds' worth of sends --max-rate lets us make up at once */
+#define MAX_RATE_BURST 0.01
 
 int HssPredicate::operator() (const HostScanStats *lhs, const HostScanStats *rhs) const {
   const struct sockaddr_storage *lss, *rss;
@@ -272,8 +274,20 @@ GroupScanStats::GroupScanStats(UltraScanInfo *UltraSI) {
   else CSI = NULL;
   probes_sent = probes_sent_at_last_wait = 0;
   lastping_sent = lastrcvd = USI->now;
-  send_no_earlier_than = USI->now;
-  send_no_later_than = USI->now;
+  /* Let the sending rate catch up on up to MAX_RATE_BURST of lost time, so
+     that scheduling jitter in the rest of the engine doesn't cost throughput,
+     but no more, so that a long stall doesn't turn into a burst. */
+  if (o.max_packet_send_rate != 0.0)
+    max_rate_bucket.init(o.max_packet_send_rate,
+                         MAX(1.0, o.max_packet_send_rate * MAX_RATE_BURST),
+                         -MAX(1.0, o.max_packet_send_rate * MAX_RATE_BURST),
+                         &USI->now);
+  /* We may get at most one probe ahead of the minimum-rate schedule, and fall
+     at most one second behind it. */
+  if (o.min_packet_send_rate != 0.0)
+    min_rate_bucket.init(o.min_packet_send_rate,
+                         MAX(1.0, o.min_packet_send_rate), -1.0, &USI->now);
+  pacing_updated_at = 0;
   lastping_sent_numprobes = 0;
   pinghost = NULL;
   gettimeofday(&last_wait, NULL);
@@ -289,32 +303,51 @@ GroupScanStats::~GroupScanStats() {
 void GroupScanStats::probeSent(unsigned int nbytes) {
   USI->send_rate_meter.update(nbytes, &USI->now);
 
-  /* Find a new scheduling interval for minimum- and maximum-rate sending.
-     Recall that these have effect only when --min-rate or --max-rate is
-     given. */
-
-  static time_t max_rate_add = o.max_packet_send_rate != 0.0 ?
-    (1000000.0 / o.max_packet_send_rate) : 0;
-  static time_t min_rate_add = o.min_packet_send_rate != 0.0 ?
-    (1000000.0 / o.min_packet_send_rate) : 0;
+  /* Account for the probe in the minimum- and maximum-rate buckets. Recall
+     that these have effect only when --min-rate or --max-rate is given. */
+  if (max_rate_bucket.isSet()) {
+    max_rate_bucket.take(&USI->now);
+    update_kernel_pacing();
+  }
+  if (min_rate_bucket.isSet())
+    min_rate_bucket.take(&USI->now);
+}
+
+/* On systems with SO_MAX_PACING_RATE (Linux with the fq qdisc), ask the
+   kernel to spread the probes we send on a raw socket out over time. The
+   token bucket only decides how many probes may be sent; the engine still
+   sends them in batches between waits, and the kernel can space the packets
+   out much more precisely than we can. The pacing rate is in bytes per
+   second, so it is derived from the average probe size seen so far, with some
+   headroom so that the kernel never becomes the bottleneck. */
+void GroupScanStats::update_kernel_pacing() {
+#ifdef SO_MAX_PACING_RATE
+  unsigned long long packets, bytes;
+  unsigned int pacing_rate;
+  double rate;
+
+  if (USI->rawsd < 0)
+    return;
+  packets = USI->send_rate_meter.getNumPackets();
+  /* Recompute on the first probe and every thousand after that. */
+  if (pacing_updated_at != 0 && packets - pacing_updated_at < 1000)
+    return;
+  pacing_updated_at = packets;
+  bytes = USI->send_rate_meter.getNumBytes();
+  if (packets == 0 || bytes == 0)
+    return;
 
-  if (o.max_packet_send_rate != 0.0)
-      TIMEVAL_ADD(send_no_earlier_than, send_no_earlier_than, max_rate_add);
-  /* Allow send_no_earlier_than to slip into the past. This allows the sending
-     scheduler to catch up and make up for delays in other parts of the scan
-     engine. If we were to update send_no_earlier_than to the present the
-     sending rate could be much less than the maximum requested, even if the
-     connection is capable of the maximum. */
-
-  if (o.min_packet_send_rate != 0.0) {
-      if (TIMEVAL_AFTER(send_no_later_than, USI->now)) {
-        /* The next scheduled send is in the future. That means there's slack time
-           during which the sending rate could drop. Pull the time back to the
-           present to prevent that. */
-        send_no_later_than = USI->now;
-      }
-      TIMEVAL_ADD(send_no_later_than, send_no_later_than, min_rate_add);
+  rate = o.max_packet_send_rate * ((double) bytes / packets) * 1.25;
+  pacing_rate = (unsigned int) MIN(rate, (double) UINT_MAX);
+  if (setsockopt(USI->rawsd, SOL_SOCKET, SO_MAX_PACING_RATE,
+                 (const char *) &pacing_rate, sizeof(pacing_rate)) != 0) {
+    if (o.debugging)
+      log_write(LOG_PLAIN, "Could not set SO_MAX_PACING_RATE: %s\n",
+                strerror(socket_errno()));
+    /* Don't try again. */
+    pacing_updated_at = ULLONG_MAX;
   }
+#endif
 }
 
 /* Returns true if the GLOBAL system says that sending is OK.*/
@@ -344,10 +377,10 @@ bool GroupScanStats::sendOK(struct timeval *when) const {
   /* Enforce a maximum scanning rate, if necessary. If it's too early to send,
      return false. If not, mark now as a good time to send and allow the
      congestion control to override it. */
-  if (o.max_packet_send_rate != 0.0) {
-    if (TIMEVAL_AFTER(send_no_earlier_than, USI->now)) {
+  if (max_rate_bucket.isSet()) {
+    if (max_rate_bucket.available(&USI->now) < 1.0) {
       if (when)
-        *when = send_no_earlier_than;
+        max_rate_bucket.nextAvailable(&USI->now, when);
       return false;
     } else {
       if (when)
@@ -359,10 +392,10 @@ bool GroupScanStats::sendOK(struct timeval *when) const {
      record the time of the next scheduled send and submit to congestion
      control. If we're behind schedule, return true to indicate that we need to
      send right now. */
-  if (o.min_packet_send_rate != 0.0) {
-    if (TIMEVAL_AFTER(send_no_later_than, USI->now)) {
+  if (min_rate_bucket.isSet()) {
+    if (min_rate_bucket.available(&USI->now) < 1.0) {
       if (when)
-        *when = send_no_later_than;
+        min_rate_bucket.nextAvailable(&USI->now, when);
     } else {
       if (when)
         *when = USI->now;
@@ -460,6 +493,7 @@ HostScanStats::HostScanStats(Target *t, UltraScanInfo *UltraSI) {
   numprobes_sent = 0;
   memset(&completiontime, 0, sizeof(completiontime));
   init_ultra_timing_vals(&timing, TIMING_HOST, 1, &(USI->perf), &USI->now);
+  latency_hist_init(&rtts);
   bench_tryno = 0;
   memset(&sdn, 0, sizeof(sdn));
   sdn.last_boost = USI->now;
@@ -488,6 +522,9 @@ HostScanStats::~HostScanStats() {
     next++;
     destroyOutstandingProbe(probeI);
   }
+
+  target->latency.add(USI->scantype, &rtts);
+  scan_latencies.add(USI->scantype, &rtts);
 }
 
 /* Called whenever a probe is sent to this host. Takes care of updating scan
@@ -550,8 +587,8 @@ bool HostScanStats::sendOK(struct timeval *when) const {
 
   /* If the group stats say we need to send a probe to enforce a minimum
      scanning rate, then we need to step up and send a probe. */
-  if (o.min_packet_send_rate != 0.0) {
-    if (!TIMEVAL_AFTER(USI->gstats->send_no_later_than, USI->now)) {
+  if (USI->gstats->min_rate_bucket.isSet()) {
+    if (USI->gstats->min_rate_bucket.available(&USI->now) >= 1.0) {
       if (when)
         *when = USI->now;
       return true;
@@ -1058,9 +1095,10 @@ bool UltraScanInfo::sendOK(struct timeval *when) const {
 
   /* Defer to the group stats if they need a shorter delay to enforce a minimum
      packet sending rate. */
-  if (o.min_packet_send_rate != 0.0) {
-    if (TIMEVAL_BEFORE(gstats->send_no_later_than, lowhtime))
-      lowhtime = gstats->send_no_later_than;
+  if (gstats->min_rate_bucket.isSet()) {
+    gstats->min_rate_bucket.nextAvailable(&now, &tmptv);
+    if (TIMEVAL_BEFORE(tmptv, lowhtime))
+      lowhtime = tmptv;
   }
 
   if (TIMEVAL_BEFORE(lowhtime, now))
@@ -1255,6 +1293,9 @@ static void init_ultra_timing_vals(ultra_timing_vals *timing,
   timing->num_replies_expected = 0;
   timing->num_replies_received = 0;
   timing->num_updates = 0;
+  timing->w_max = 0;
+  timing->epoch_start.tv_sec = 0;
+  timing->epoch_start.tv_usec = 0;
   if (now)
     timing->last_drop = *now;
   else gettimeofday(&timing->last_drop, NULL);
@@ -1585,9 +1626,17 @@ void HostScanStats::destroyAllOutstandingProbes() {
 static void ultrascan_adjust_timeouts(UltraScanInfo *USI, HostScanStats *hss,
                                       const UltraProbe *probe,
                                       const struct timeval *rcvdtime) {
+  long delta;
+
   if (rcvdtime == NULL)
     return;
 
+  /* The histogram gets every time, including the outliers that
+     adjust_timeouts2 leaves out of its estimate. A slightly negative time
+     comes from pcap and gettimeofday disagreeing, and counts as 0. */
+  delta = TIMEVAL_SUBTRACT(*rcvdtime, probe->sent);
+  latency_hist_add(&hss->rtts, (u32) MAX(delta, 0L));
+
   adjust_timeouts2(&(probe->sent), rcvdtime, &(hss->target->to));
   adjust_timeouts2(&(probe->sent), rcvdtime, &(USI->gstats->to));
 
@@ -1629,8 +1678,10 @@ static void ultrascan_adjust_timing(UltraScanInfo *USI, HostScanStats *hss,
   /* Increase the window for a positive reply. This can overlap with case (1)
      above. */
   if (rcvdtime != NULL) {
-    USI->gstats->timing.ack(&USI->perf, ping_magnifier);
-    hss->timing.ack(&USI->perf, ping_magnifier);
+    USI->gstats->timing.ack(&USI->perf, ping_magnifier, &USI->now,
+                            USI->gstats->to.srtt);
+    hss->timing.ack(&USI->perf, ping_magnifier, &USI->now,
+                    hss->target->to.srtt);
   }
 
   /* If packet drops are particularly bad, enforce a delay between
@@ -69,6 +69,7 @@
 #include "probespec.h"
 
 #include "libnetutil/netutil.h"
+#include "tcpip.h"
 
 #include "timing.h"
 
@@ -271,6 +272,7 @@ public:
   GroupScanStats(UltraScanInfo *UltraSI);
   ~GroupScanStats();
   void probeSent(unsigned int nbytes);
+  void update_kernel_pacing();
   /* Returns true if the GLOBAL system says that sending is OK. */
   bool sendOK(struct timeval *when) const;
   /* Total # of probes outstanding (active) for all Hosts */
@@ -293,14 +295,16 @@ public:
      send too many pings when probes are going slowly. */
   int lastping_sent_numprobes;
 
-  /* These two variables control minimum- and maximum-rate sending (--min-rate
-     and --max-rate). send_no_earlier_than is for --max-rate and
-     send_no_later_than is for --min-rate; they have effect only when the
-     respective command-line option is given. An attempt is made to keep the
-     sending rate within the interval, however for send_no_later_than it is not
-     guaranteed. */
-  struct timeval send_no_earlier_than;
-  struct timeval send_no_later_than;
+  /* These two buckets control minimum- and maximum-rate sending (--min-rate
+     and --max-rate); they have effect only when the respective command-line
+     option is given. max_rate_bucket holds the sends we are allowed to make.
+     min_rate_bucket holds the sends we owe: when it has a whole token, a probe
+     must go out now. An attempt is made to keep the sending rate within the
+     interval, however the minimum rate is not guaranteed. */
+  TokenBucket max_rate_bucket;
+  TokenBucket min_rate_bucket;
+  /* Packets sent at the last kernel pacing rate update (see probeSent). */
+  unsigned long long pacing_updated_at;
 
   /* The host to which global pings are sent. This is kept updated to be the
      most recent host that was found up. */
@@ -468,6 +472,9 @@ public:
      memberval instead. */
   void getTiming(struct ultra_timing_vals *tmng) const;
   struct ultra_timing_vals timing;
+  /* Round-trip times of the probes answered during this scan, in
+     microseconds. Added to target->latency when the scan ends. */
+  struct latency_hist rtts;
   /* The most recently received probe response time -- initialized to scan start time. */
   struct timeval lastrcvd;
   struct timeval lastping_sent; /* The time the most recent ping was sent (initialized to scan begin time) */
@@ -639,9 +646,17 @@ public:
                   numbers.  It is set randomly in UltraScanInfo::Init() */
   u16 base_port;
   const struct sockaddr_storage *SourceSockAddr() const { return &sourceSockAddr; }
+  /* The packet template for probes from the given decoy (see
+     sendIPScanProbe). */
+  PacketTemplate *probeTemplate(int decoy) {
+    if (probe_templates.size() <= (size_t) decoy)
+      probe_templates.resize(decoy + 1);
+    return &probe_templates[decoy];
+  }
 
 private:
 
+  std::vector<PacketTemplate> probe_templates;
   unsigned int numInitialTargets;
   std::multiset<HostScanStats *, HssPredicate>::iterator nextI;
   // All targets in an invocation will have the same source address.
@@ -1196,20 +1196,32 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
 
     if (hss->target->af() == AF_INET) {
       for (decoy = 0; decoy < o.numdecoys; decoy++) {
-        packet = build_tcp_raw(&((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, hss->target->v4hostip(),
-                               o.ttl, ipid, IP_TOS_DEFAULT, false,
-                               o.ipoptions, o.ipoptionslen,
-                               sport, pspec->pd.tcp.dport,
-                               seq, ack, 0, pspec->pd.tcp.flags, 0, 0,
-                               tcpops, tcpopslen,
-                               o.extra_payload, o.extra_payload_length,
-                               &packetlen);
+        const struct in_addr *source = &((struct sockaddr_in *)&o.decoys[decoy])->sin_addr;
+        PacketTemplate *tmpl = USI->probeTemplate(decoy);
+        const u8 *p;
+        packet = NULL;
+        if (tmpl->setTCP(source, IP_TOS_DEFAULT, false,
+                         o.ipoptions, o.ipoptionslen, pspec->pd.tcp.flags, 0,
+                         tcpops, tcpopslen,
+                         o.extra_payload, o.extra_payload_length)) {
+          p = tmpl->tcp(hss->target->v4hostip(), o.ttl, ipid,
+                        sport, pspec->pd.tcp.dport, seq, ack, &packetlen);
+        } else {
+          p = packet = build_tcp_raw(source, hss->target->v4hostip(),
+                                     o.ttl, ipid, IP_TOS_DEFAULT, false,
+                                     o.ipoptions, o.ipoptionslen,
+                                     sport, pspec->pd.tcp.dport,
+                                     seq, ack, 0, pspec->pd.tcp.flags, 0, 0,
+                                     tcpops, tcpopslen,
+                                     o.extra_payload, o.extra_payload_length,
+                                     &packetlen);
+        }
         if (decoy == o.decoyturn) {
-          probe->setIP(packet, packetlen, pspec);
+          probe->setIP(p, packetlen, pspec);
           probe->sent = USI->now;
         }
         hss->probeSent(packetlen);
-        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+        send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), p, packetlen);
         free(packet);
       }
     } else if (hss->target->af() == AF_INET6) {
@@ -1241,18 +1253,29 @@ UltraProbe *sendIPScanProbe(UltraScanInfo *USI, HostScanStats *hss,
 
       if (hss->target->af() == AF_INET) {
         for (decoy = 0; decoy < o.numdecoys; decoy++) {
-          packet = build_udp_raw(&((struct sockaddr_in *)&o.decoys[decoy])->sin_addr, hss->target->v4hostip(),
-                                 o.ttl, ipid, IP_TOS_DEFAULT, false,
-                                 o.ipoptions, o.ipoptionslen,
-                                 sport, pspec->pd.udp.dport,
-                                 (char *) payload, payload_length,
-                                 &packetlen);
+          const struct in_addr *source = &((struct sockaddr_in *)&o.decoys[decoy])->sin_addr;
+          PacketTemplate *tmpl = USI->probeTemplate(decoy);
+          const u8 *p;
+          packet = NULL;
+          if (tmpl->setUDP(source, IP_TOS_DEFAULT, false,
+                           o.ipoptions, o.ipoptionslen,
+                           (char *) payload, payload_length)) {
+            p = tmpl->udp(hss->target->v4hostip(), o.ttl, ipid,
+                          sport, pspec->pd.udp.dport, &packetlen);
+          } else {
+            p = packet = build_udp_raw(source, hss->target->v4hostip(),
+                                       o.ttl, ipid, IP_TOS_DEFAULT, false,
+                                       o.ipoptions, o.ipoptionslen,
+                                       sport, pspec->pd.udp.dport,
+                                       (char *) payload, payload_length,
+                                       &packetlen);
+          }
           if (decoy == o.decoyturn) {
-            probe->setIP(packet, packetlen, pspec);
+            probe->setIP(p, packetlen, pspec);
             probe->sent = USI->now;
           }
           hss->probeSent(packetlen);
-          send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), packet, packetlen);
+          send_ip_packet(USI->rawsd, ethptr, hss->target->TargetSockAddr(), p, packetlen);
           free(packet);
         }
       } else if (hss->target->af() == AF_INET6) {
@@ -1464,6 +1487,7 @@ bool get_arp_result(UltraScanInfo *USI, struct timeval *stime) {
         continue;
       /* Add found HW address for target */
       hss->target->setMACAddress(rcvdmac);
+      mac_cache_set((struct sockaddr_storage *) &sin, rcvdmac);
       hss->target->reason.reason_id = ER_ARPRESPONSE;
 
       if (hss->probes_outstanding.empty()) {
@@ -1543,8 +1567,10 @@ bool get_ns_result(UltraScanInfo *USI, struct timeval *stime) {
         continue;
       /* Add found HW address for target */
       /* A Neighbor Advertisement packet may not include the Target link-layer address. */
-      if (has_mac)
+      if (has_mac) {
         hss->target->setMACAddress(rcvdmac);
+        mac_cache_set((struct sockaddr_storage *) &sin6, rcvdmac);
+      }
       hss->target->reason.reason_id = ER_NDRESPONSE;
 
       if (hss->probes_outstanding.empty()) {
@@ -183,6 +183,9 @@ public:
   // The time that the current probe was executed (meaning TCP connection
   // made or first UDP packet sent
   struct timeval currentprobe_exec_time;
+  // When the connection for the current probe was launched. Used to feed
+  // connect latency to the ConnectGovernor.
+  struct timeval connect_start_time;
   // Append newly-received data to the current response string (if any)
   void appendtocurrentproberesponse(const u8 *respstr, int respstrlen);
   // Get the full current response string.  Note that this pointer is
@@ -216,7 +219,10 @@ public:
   std::list<ServiceNFO *> services_finished; // Services finished (discovered or not)
   std::list<ServiceNFO *> services_in_progress; // Services currently being probed
   std::list<ServiceNFO *> services_remaining; // Probes not started yet
-  unsigned int ideal_parallelism; // Max (and desired) number of probes out at once.
+  unsigned int ideal_parallelism; // Max number of probes out at once. The
+                                  // number actually used comes from
+                                  // connect_governor.
+  unsigned int initial_parallelism; // Starting point for connect_governor
   ScanProgressMeter *SPM;
   int num_hosts_timedout; // # of hosts timed out during (or before) scan
   bool busy; // Recursion guard; if true, don't start any new events
@@ -1634,6 +1640,7 @@ ServiceNFO::ServiceNFO(AllProbes *newAP) {
   servicefp = NULL;
   tcpwrap_possible = true;
   memset(&currentprobe_exec_time, 0, sizeof(currentprobe_exec_time));
+  memset(&connect_start_time, 0, sizeof(connect_start_time));
 }
 
 ServiceNFO::~ServiceNFO() {
@@ -1943,7 +1950,6 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
   ServiceNFO *svc;
   Port *nxtport;
   Port port;
-  int desired_par;
   struct timeval now;
   num_hosts_timedout = 0;
   gettimeofday(&now, NULL);
@@ -2000,15 +2006,16 @@ ServiceGroup::ServiceGroup(std::vector<Target *> &Targets, AllProbes *AP) {
     }
   }
 
-  desired_par = 1;
-  if (o.timing_level == 3) desired_par = 20;
-  if (o.timing_level == 4) desired_par = 30;
-  if (o.timing_level >= 5) desired_par = 40;
-  // TODO: Come up with better ways to determine ideal_parallelism
+  // The parallelism is a guess based on the timing level. connect_governor
+  // may lower it as we go, but never raises it past the guess.
+  initial_parallelism = 1;
+  if (o.timing_level == 3) initial_parallelism = 20;
+  if (o.timing_level == 4) initial_parallelism = 30;
+  if (o.timing_level >= 5) initial_parallelism = 40;
   int min_par, max_par;
   min_par = o.min_parallelism;
   max_par = MAX(min_par, o.max_parallelism ? o.max_parallelism : 100);
-  ideal_parallelism = box(min_par, max_par, desired_par);
+  ideal_parallelism = box(min_par, max_par, (int) initial_parallelism);
   busy = false;
 }
 
@@ -2132,6 +2139,7 @@ static void startNextProbe(nsock_pool nsp, nsock_iod nsi, ServiceGroup *SG,
                 svc->target->TargetName(), __func__);
       }
       svc->target->TargetSockAddr(&ss, &ss_len);
+      svc->connect_start_time = *nsock_gettimeofday();
       if (svc->tunnel == SERVICE_TUNNEL_NONE) {
         if (svc->proto == IPPROTO_TCP) {
           nsock_connect_tcp(nsp, svc->niod, servicescan_connect_handler,
@@ -2218,6 +2226,7 @@ static void considerPrintingStats(ServiceGroup *SG) {
       SG->SPM->printStats(SG->services_finished.size() /
                           ((double)SG->services_remaining.size() + SG->services_in_progress.size() +
                            SG->services_finished.size()), nsock_gettimeofday());
+   connect_governor.printStats("Service scan");
    }
 
 
@@ -2305,7 +2314,7 @@ static int launchSomeServiceProbes(nsock_pool nsp, ServiceGroup *SG) {
     return 0;
   }
 
-  while (SG->services_in_progress.size() < SG->ideal_parallelism &&
+  while (SG->services_in_progress.size() < connect_governor.limit(SG->ideal_parallelism, SG->initial_parallelism) &&
          !SG->services_remaining.empty()) {
     // Start executing a probe from the new list and move it to in_progress
     svc = SG->services_remaining.front();
@@ -2355,6 +2364,8 @@ static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *m
   if (svc->target->timedOut(nsock_gettimeofday())) {
     end_svcprobe(PROBESTATE_INCOMPLETE, SG, svc, nsi);
   } else if (status == NSE_STATUS_SUCCESS) {
+    if (svc->proto == IPPROTO_TCP)
+      connect_governor.connectSucceeded(&svc->connect_start_time, nsock_gettimeofday());
 
 #if HAVE_OPENSSL
     // Snag our SSL_SESSION from the nsi for use in subsequent connections.
@@ -2389,6 +2400,10 @@ static void servicescan_connect_handler(nsock_pool nsp, nsock_event nse, void *m
       case NSE_STATUS_TIMEOUT:
       case NSE_STATUS_ERROR:
       case NSE_STATUS_PROXYERROR:
+        if (svc->proto == IPPROTO_TCP && status != NSE_STATUS_PROXYERROR) {
+          connect_governor.connectFailed(status == NSE_STATUS_TIMEOUT ? 0 : nse_errorcode(nse),
+                                         SG->services_in_progress.size(), nsock_gettimeofday());
+        }
         // This is not good.  The connect() really shouldn't generally
         // be timing out like that.  We'll mark this svc as incomplete
         // and move it to the finished bin.
@@ -2427,6 +2442,7 @@ static void servicescan_write_handler(nsock_pool nsp, nsock_event nse, void *myd
      SG->SPM->printStats(SG->services_finished.size() /
                          ((double)SG->services_remaining.size() + SG->services_in_progress.size() +
                           SG->services_finished.size()), nsock_gettimeofday());
+   connect_governor.printStats("Service scan");
   }
 
 
@@ -818,6 +818,184 @@ u8 *build_udp_raw(const struct in_addr *source, const struct in_addr *victim,
   return ip;
 }
 
+/* Adjusts the Internet checksum sum for a 16-bit word of the checksummed data
+   changing from oldval to newval, per RFC 1624 equation 3. All values are as
+   they are in the packet, in network byte order. */
+static inline u16 cksum_adjust(u16 sum, u16 oldval, u16 newval) {
+  u32 s = (u16) ~sum + (u16) ~oldval + (u32) newval;
+
+  s = (s & 0xffff) + (s >> 16);
+  s = (s & 0xffff) + (s >> 16);
+  return (u16) ~s;
+}
+
+PacketTemplate::PacketTemplate() {
+  proto = 0;
+  l4sum = 0;
+}
+
+/* Writes the 16-bit word val at offset off of the packet and adjusts the IP
+   header checksum if ipsum, and the transport checksum if l4. */
+void PacketTemplate::patch16(unsigned int off, u16 val, bool ipsum, bool l4) {
+  u8 *p = &packet[0];
+  u16 old;
+
+  memcpy(&old, p + off, 2);
+  if (old == val)
+    return;
+  memcpy(p + off, &val, 2);
+#if HAVE_IP_IP_SUM
+  if (ipsum) {
+    u16 sum;
+    memcpy(&sum, p + 10, 2);
+    sum = cksum_adjust(sum, old, val);
+    memcpy(p + 10, &sum, 2);
+  }
+#endif
+  if (l4) {
+    u16 sum;
+    memcpy(&sum, p + l4sum, 2);
+    sum = cksum_adjust(sum, old, val);
+    if (proto == IPPROTO_UDP && sum == 0)
+      sum = 0xffff;
+    memcpy(p + l4sum, &sum, 2);
+  }
+}
+
+void PacketTemplate::patch32(unsigned int off, u32 val, bool ipsum, bool l4) {
+  u16 w[2];
+
+  memcpy(w, &val, 4);
+  patch16(off, w[0], ipsum, l4);
+  patch16(off + 2, w[1], ipsum, l4);
+}
+
+/* Whether the packet already holds the given fixed fields and payload. */
+bool PacketTemplate::holds(u8 p, const struct in_addr *source, u8 tos,
+                           bool df, const u8 *opts, int optslen,
+                           const char *data, u16 datalen) const {
+  unsigned int hdrlen = sizeof(struct ip) + (p == IPPROTO_TCP ? sizeof(struct tcp_hdr) : sizeof(struct udp_hdr));
+  const struct ip *ip = (const struct ip *) &packet[0];
+
+  if (proto != p || packet.size() != hdrlen + optslen + datalen)
+    return false;
+  if (ip->ip_src.s_addr != source->s_addr || ip->ip_tos != tos
+      || (ntohs(ip->ip_off) & IP_DF) != (df ? IP_DF : 0))
+    return false;
+  if (optslen > 0 && memcmp(&packet[hdrlen], opts, optslen) != 0)
+    return false;
+  if (datalen > 0 && memcmp(&packet[hdrlen + optslen], data, datalen) != 0)
+    return false;
+  return true;
+}
+
+/* The full builders compute checksums that the template can't adjust (or
+   move the destination into IP options), so these cases don't use it. */
+static bool template_usable(int ipoptlen) {
+#if STUPID_SOLARIS_CHECKSUM_BUG
+  return false;
+#else
+  return ipoptlen == 0 && !o.badsum;
+#endif
+}
+
+bool PacketTemplate::setTCP(const struct in_addr *source, u8 tos, bool df,
+                            const u8 *ipopt, int ipoptlen, u8 flags,
+                            u16 window, const u8 *tcpopt, int tcpoptlen,
+                            const char *data, u16 datalen) {
+  struct in_addr victim;
+  const struct tcp_hdr *tcp;
+  u32 len;
+  u8 *p;
+
+  if (!template_usable(ipoptlen))
+    return false;
+  if (holds(IPPROTO_TCP, source, tos, df, tcpopt, tcpoptlen, data, datalen)) {
+    tcp = (const struct tcp_hdr *) &packet[sizeof(struct ip)];
+    if (tcp->th_flags == flags && tcp->th_win == htons(window ? window : 1024))
+      return true;
+  }
+
+  victim.s_addr = 0;
+  p = build_tcp_raw(source, &victim, 64, 0, tos, df, NULL, 0, 0, 0, 0, 0, 0,
+                    flags, window, 0, tcpopt, tcpoptlen, data, datalen, &len);
+  packet.assign(p, p + len);
+  free(p);
+  proto = IPPROTO_TCP;
+  l4sum = sizeof(struct ip) + 16;
+  return true;
+}
+
+bool PacketTemplate::setUDP(const struct in_addr *source, u8 tos, bool df,
+                            const u8 *ipopt, int ipoptlen,
+                            const char *data, u16 datalen) {
+  struct in_addr victim;
+  u32 len;
+  u8 *p;
+
+  if (!template_usable(ipoptlen))
+    return false;
+  if (holds(IPPROTO_UDP, source, tos, df, NULL, 0, data, datalen))
+    return true;
+
+  victim.s_addr = 0;
+  p = build_udp_raw(source, &victim, 64, 0, tos, df, NULL, 0, 0, 0,
+                    data, datalen, &len);
+  packet.assign(p, p + len);
+  free(p);
+  proto = IPPROTO_UDP;
+  l4sum = sizeof(struct ip) + 6;
+  return true;
+}
+
+/* Patches the fields that IP and UDP or TCP share. */
+void PacketTemplate::patchCommon(const struct in_addr *victim, int ttl,
+                                 u16 ipid, u16 sport, u16 dport) {
+  const unsigned int l4 = sizeof(struct ip);
+  u8 ttlproto[2];
+  u16 w;
+
+  if (ttl == -1)
+    ttl = (get_random_uint() % 23) + 37;
+  ttlproto[0] = ttl;
+  ttlproto[1] = proto;
+  memcpy(&w, ttlproto, 2);
+  patch16(8, w, true, false);
+  patch16(4, htons(ipid), true, false);
+  /* The destination is in the IP header and the pseudo-header. */
+  patch32(16, victim->s_addr, true, true);
+  patch16(l4, htons(sport), false, true);
+  patch16(l4 + 2, htons(dport), false, true);
+}
+
+const u8 *PacketTemplate::tcp(const struct in_addr *victim, int ttl, u16 ipid,
+                              u16 sport, u16 dport, u32 seq, u32 ack,
+                              u32 *packetlen) {
+  const unsigned int l4 = sizeof(struct ip);
+  const struct tcp_hdr *tcp = (const struct tcp_hdr *) &packet[l4];
+
+  assert(proto == IPPROTO_TCP);
+  patchCommon(victim, ttl, ipid, sport, dport);
+  if (seq)
+    seq = htonl(seq);
+  else if (tcp->th_flags & TH_SYN)
+    get_random_bytes(&seq, 4);
+  patch32(l4 + 4, seq, false, true);
+  patch32(l4 + 8, htonl(ack), false, true);
+
+  *packetlen = packet.size();
+  return &packet[0];
+}
+
+const u8 *PacketTemplate::udp(const struct in_addr *victim, int ttl, u16 ipid,
+                              u16 sport, u16 dport, u32 *packetlen) {
+  assert(proto == IPPROTO_UDP);
+  patchCommon(victim, ttl, ipid, sport, dport);
+
+  *packetlen = packet.size();
+  return &packet[0];
+}
+
 /* Builds a UDP packet (including an IPv6 header) by packing the fields
    with the given information.  It allocates a new buffer to store the
    packet contents, and then returns that buffer.  The packet is not
@@ -70,6 +70,8 @@
 
 #include <pcap.h>
 
+#include <vector>
+
 class Target;
 
 #ifndef INET_ADDRSTRLEN
@@ -248,6 +250,45 @@ int send_udp_raw_decoys(int sd, const struct eth_nfo *eth,
                          u16 sport, u16 dport,
                          const char *data, u16 datalen);
 
+/* A prebuilt IPv4 TCP or UDP packet, for sending many probes that differ
+   only in destination, TTL, IP ID, ports, and TCP sequence and
+   acknowledgment numbers, as port scans do. Each probe is written over the
+   previous one in the template's own buffer, and the IP and transport
+   checksums are adjusted for the fields that changed (RFC 1624) instead of
+   being computed again. */
+class PacketTemplate {
+public:
+  PacketTemplate();
+  /* Prepare the template for probes with the given fixed fields, unless it
+     already is. Returns false if such probes need the full builder (IP
+     options or --badsum); use build_tcp_raw or build_udp_raw then. */
+  bool setTCP(const struct in_addr *source, u8 tos, bool df,
+              const u8 *ipopt, int ipoptlen, u8 flags, u16 window,
+              const u8 *tcpopt, int tcpoptlen, const char *data, u16 datalen);
+  bool setUDP(const struct in_addr *source, u8 tos, bool df,
+              const u8 *ipopt, int ipoptlen, const char *data, u16 datalen);
+  /* Fill in the per-probe fields and return the packet, which is valid
+     until the template is next used. The arguments mean the same as for
+     build_tcp_raw and build_udp_raw, including a TTL of -1 and a sequence
+     number of 0 on a SYN for random ones. */
+  const u8 *tcp(const struct in_addr *victim, int ttl, u16 ipid,
+                u16 sport, u16 dport, u32 seq, u32 ack, u32 *packetlen);
+  const u8 *udp(const struct in_addr *victim, int ttl, u16 ipid,
+                u16 sport, u16 dport, u32 *packetlen);
+
+private:
+  bool holds(u8 p, const struct in_addr *source, u8 tos, bool df,
+             const u8 *opts, int optslen, const char *data, u16 datalen) const;
+  void patch16(unsigned int off, u16 val, bool ipsum, bool l4);
+  void patch32(unsigned int off, u32 val, bool ipsum, bool l4);
+  void patchCommon(const struct in_addr *victim, int ttl, u16 ipid,
+                   u16 sport, u16 dport);
+
+  std::vector<u8> packet;
+  u8 proto; /* IPPROTO_TCP or IPPROTO_UDP, or 0 before the first set */
+  unsigned int l4sum; /* Offset of the transport checksum */
+};
+
 /* Builds an SCTP packet (including an IP header) by packing the fields
    with the given information.  It allocates a new buffer to store the
    packet contents, and then returns that buffer.  The packet is not
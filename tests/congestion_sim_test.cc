@@ -0,0 +1,210 @@
+
+/***************************************************************************
+ * congestion_sim_test.cc -- Compares the ultra_scan congestion control    *
+ * algorithms on a simulated long, fat bottleneck link.                    *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "../timing.h"
+#include "../NmapOps.h"
+
+#include <deque>
+#include <iostream>
+#include <cstdio>
+
+/* This is a deterministic, in-process stand-in for scanning across a netem
+   link. One simulated host sits behind a bottleneck of RATE probes per second
+   with a one-way-and-back propagation delay of RTT_US and a drop-tail queue
+   of QUEUE probes. Probes are sent whenever the host and group windows allow,
+   the same way ultra_scan does, and every probe that survives the queue
+   produces a reply. A lost probe is noticed one timeout after it was sent.
+   The program reports how many replies each algorithm got back in the
+   simulated time and fails if CUBIC does not do better than Reno. */
+
+#define RATE 20000.0
+#define RTT_US 100000.0
+#define QUEUE 400
+#define DURATION_US (30 * 1000000.0)
+#define TICK_US 1000.0
+
+extern NmapOps o;
+
+struct sim_probe {
+  double sent;
+  double done; /* Reply time, or time the loss is noticed */
+  bool lost;
+};
+
+static struct timeval us2tv(double us) {
+  struct timeval tv;
+  tv.tv_sec = (time_t) (us / 1000000.0);
+  tv.tv_usec = (suseconds_t) (us - tv.tv_sec * 1000000.0);
+  return tv;
+}
+
+static void init_timing(ultra_timing_vals *timing, double cwnd,
+                        const struct scan_performance_vars *perf,
+                        const struct timeval *now) {
+  timing->cwnd = cwnd;
+  timing->ssthresh = perf->initial_ssthresh;
+  timing->num_replies_expected = 0;
+  timing->num_replies_received = 0;
+  timing->num_updates = 0;
+  timing->w_max = 0;
+  timing->epoch_start.tv_sec = 0;
+  timing->epoch_start.tv_usec = 0;
+  timing->last_drop = *now;
+}
+
+static unsigned long simulate(enum cc_algorithm algo, double *avg_cwnd) {
+  struct scan_performance_vars perf;
+  ultra_timing_vals host, group;
+  struct timeout_info to;
+  std::deque<sim_probe> pending;
+  double link_free = 0.0, cwnd_sum = 0.0;
+  unsigned long replies = 0, ticks = 0;
+  struct timeval now;
+
+  o.cc_algo = algo;
+  perf.init();
+  initialize_timeout_info(&to);
+  now = us2tv(1.0);
+  init_timing(&host, perf.host_initial_cwnd, &perf, &now);
+  init_timing(&group, perf.group_initial_cwnd, &perf, &now);
+
+  for (double t = 1.0; t < DURATION_US; t += TICK_US, ticks++) {
+    now = us2tv(t);
+
+    /* Process replies and noticed losses, in order of occurrence. */
+    while (!pending.empty()) {
+      std::deque<sim_probe>::iterator best = pending.begin();
+      for (std::deque<sim_probe>::iterator it = pending.begin(); it != pending.end(); it++) {
+        if (it->done < best->done)
+          best = it;
+      }
+      if (best->done > t)
+        break;
+      sim_probe p = *best;
+      pending.erase(best);
+
+      struct timeval sent = us2tv(p.sent);
+      host.num_replies_expected++;
+      host.num_updates++;
+      group.num_replies_expected++;
+      group.num_updates++;
+      if (p.lost) {
+        if (TIMEVAL_AFTER(sent, host.last_drop))
+          host.drop(pending.size(), &perf, &now);
+        if (TIMEVAL_AFTER(sent, group.last_drop))
+          group.drop_group(pending.size(), &perf, &now);
+      } else {
+        struct timeval rcvd = us2tv(p.done);
+        adjust_timeouts2(&sent, &rcvd, &to);
+        replies++;
+        group.ack(&perf, 1.0, &now, to.srtt);
+        host.ack(&perf, 1.0, &now, to.srtt);
+      }
+    }
+
+    /* Send as much as the windows allow. */
+    while (pending.size() < MIN(host.cwnd, group.cwnd)) {
+      sim_probe p;
+      double start = MAX(t, link_free);
+      p.sent = t;
+      if ((start - t) * RATE / 1000000.0 >= QUEUE) {
+        p.lost = true;
+        p.done = t + MAX(to.timeout, 2 * RTT_US);
+      } else {
+        link_free = start + 1000000.0 / RATE;
+        p.lost = false;
+        p.done = link_free + RTT_US;
+      }
+      pending.push_back(p);
+    }
+    cwnd_sum += MIN(host.cwnd, group.cwnd);
+  }
+
+  *avg_cwnd = cwnd_sum / ticks;
+  return replies;
+}
+
+int main()
+{
+  unsigned long reno, cubic;
+  double reno_cwnd, cubic_cwnd;
+
+  o.timing_level = 4;
+  o.max_parallelism = 5000;
+
+  reno = simulate(CC_RENO, &reno_cwnd);
+  cubic = simulate(CC_CUBIC, &cubic_cwnd);
+
+  printf("Bottleneck %.0f probes/s, RTT %.0f ms, %.0f s: capacity %.0f probes\n",
+         RATE, RTT_US / 1000.0, DURATION_US / 1000000.0,
+         RATE * DURATION_US / 1000000.0);
+  printf("reno:  %lu replies (%.1f%%), average window %.1f\n",
+         reno, 100.0 * reno / (RATE * DURATION_US / 1000000.0), reno_cwnd);
+  printf("cubic: %lu replies (%.1f%%), average window %.1f\n",
+         cubic, 100.0 * cubic / (RATE * DURATION_US / 1000000.0), cubic_cwnd);
+
+  if (cubic <= reno) {
+    printf("FAIL: cubic did not outperform reno\n");
+    return 1;
+  }
+
+  return 0;
+}
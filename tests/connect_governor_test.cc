@@ -0,0 +1,177 @@
+
+/***************************************************************************
+ * connect_governor_test.cc -- Drives the ConnectGovernor shared by        *
+ * service scan and NSE through its starting window and a local            *
+ * resource error.                                                         *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "../timing.h"
+#include "../NmapOps.h"
+
+#include <errno.h>
+#include <cstdio>
+
+/* The governor only reads the clock it is given, so the test can step through
+   time without waiting. Connections "complete" in CONNECT_US. */
+
+#define CONNECT_US 1000
+
+extern NmapOps o;
+
+static int failures = 0;
+
+static struct timeval us2tv(long us) {
+  struct timeval tv;
+  tv.tv_sec = us / 1000000;
+  tv.tv_usec = us % 1000000;
+  return tv;
+}
+
+static void check(bool ok, const char *what, unsigned int got) {
+  if (!ok) {
+    printf("FAIL: %s (got %u)\n", what, got);
+    failures++;
+  }
+}
+
+/* Report n timely connects ending at *now_us, one CONNECT_US apart. */
+static void succeed(ConnectGovernor *g, int n, long *now_us) {
+  for (int i = 0; i < n; i++) {
+    struct timeval start = us2tv(*now_us);
+    *now_us += CONNECT_US;
+    struct timeval now = us2tv(*now_us);
+    g->connectSucceeded(&start, &now);
+  }
+}
+
+/* At -T2 service scan starts from one connection, but NSE must still get
+   its whole socket allowance rather than being held to service scan's
+   guess. */
+static void test_initial_window(void) {
+  ConnectGovernor service_first, nse_only;
+  unsigned int n;
+
+  o.timing_level = 2;
+  n = nse_only.limit(20, 20);
+  check(n == 20, "NSE starts with its own allowance at -T2", n);
+
+  n = service_first.limit(100, 1);
+  check(n == 1, "service scan starts from its -T2 guess", n);
+  n = service_first.limit(20, 20);
+  check(n == 20, "NSE after service scan still gets its allowance", n);
+  n = service_first.limit(1, 1);
+  check(n == 1, "service scan is not raised to NSE's allowance", n);
+  n = nse_only.limit(100, 1);
+  check(n == 1, "service scan after NSE starts from its own guess", n);
+}
+
+/* Running out of descriptors caps the window at what was open, and the cap
+   goes away once a timeout period passes without another error. */
+static void test_resource_error(void) {
+  ConnectGovernor g;
+  long now_us = 1000000;
+  struct timeval now;
+  unsigned int n, highest;
+
+  o.timing_level = 4;
+  n = g.limit(100, 30);
+  check(n == 30, "starts from the -T4 guess", n);
+
+  now = us2tv(now_us);
+  g.connectFailed(EMFILE, 30, &now);
+  n = g.limit(100, 30);
+  check(n == 15, "window halves on EMFILE", n);
+
+  /* Plenty of successes right away: the window grows back, but not past
+     what was open when descriptors ran out. */
+  highest = 0;
+  for (int i = 0; i < 50; i++) {
+    succeed(&g, 10, &now_us);
+    highest = MAX(highest, g.limit(100, 30));
+    if (now_us - 1000000 >= 100000)
+      break;
+  }
+  check(highest <= 29, "capped below the connections open at EMFILE", highest);
+
+  /* Keep connecting past the timeout period; the cap must lift and the
+     window grow past it. */
+  highest = 0;
+  for (int i = 0; i < 200 && highest <= 30; i++) {
+    succeed(&g, 10, &now_us);
+    highest = g.limit(100, 30);
+  }
+  check(highest > 30, "cap lifted after a timeout period", highest);
+
+  /* The starting guess doesn't override a window that was cut. */
+  now = us2tv(now_us);
+  g.connectFailed(EADDRNOTAVAIL, 0, &now);
+  n = g.limit(100, 30);
+  check(n < 30, "initial allowance ignored once congestion is seen", n);
+}
+
+int main()
+{
+  o.max_parallelism = 0;
+  o.min_parallelism = 0;
+
+  test_initial_window();
+  test_resource_error();
+
+  printf("connect governor: %d failures\n", failures);
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,261 @@
+
+/***************************************************************************
+ * idle_scan_sim_test.cc -- Drives the idle scan IP ID arithmetic with     *
+ * simulated zombies that scan disjoint port groups at the same time.      *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "../idle_scan.h"
+#include "../osscan2.h"
+#include "../NmapOps.h"
+
+#include <cstdio>
+#include <set>
+#include <vector>
+
+/* A fake zombie. It has an IP ID counter that goes up by one or two for every
+   packet it sends, and (for IPID_SEQ_BROKEN_INCR) reports it in the wrong
+   byte order, as Windows once did. It answers our IP ID probes, and sends a
+   RST whenever the target sends it a SYN/ACK from an open port. */
+class FakeZombie {
+public:
+  FakeZombie(int seqclass, u32 firstid)
+    : seqclass(seqclass), counter(firstid) {}
+
+  /* Answer one of our SYN/ACK probes with a RST and return its IP ID. */
+  u32 probe() {
+    return send();
+  }
+
+  /* The target replied to a spoofed SYN with a SYN/ACK (open port) or a RST
+     (closed port). The zombie only sends something for the SYN/ACK. */
+  void targetReply(bool open) {
+    if (open)
+      send();
+  }
+
+  int seqclass;
+
+private:
+  u32 send() {
+    u16 id;
+
+    counter += (seqclass == IPID_SEQ_INCR_BY_2) ? 2 : 1;
+    id = (u16) counter;
+    if (seqclass == IPID_SEQ_BROKEN_INCR)
+      id = (u16) ((id << 8) | (id >> 8));
+    return id;
+  }
+
+  u32 counter;
+};
+
+/* Count open ports in the given group through the zombie with
+   idle_count_ports(), the way idlescan_countopen_multi() does. When late is
+   true, the target's replies for the second half of the group only reach the
+   zombie after our first IP ID probe, so a second try is needed to see them
+   all. The largest count over the tries wins. */
+static int count_open(FakeZombie &zombie, u32 &latestid, const u16 *ports,
+                      int numports, const std::set<u16> &open, bool late) {
+  int half = late ? numports / 2 : numports;
+  int probes_sent = 0, count, best = -1;
+  u32 newid = 0;
+  int i, tries;
+
+  for (i = 0; i < half; i++)
+    zombie.targetReply(open.count(ports[i]) > 0);
+  for (tries = 0; tries < 2; tries++) {
+    newid = zombie.probe();
+    probes_sent++;
+    count = idle_count_ports(zombie.seqclass, latestid, newid, probes_sent);
+    if (count > best)
+      best = count;
+    for (; i < numports; i++)
+      zombie.targetReply(open.count(ports[i]) > 0);
+  }
+  latestid = newid;
+
+  return best;
+}
+
+int main()
+{
+  const int classes[] = { IPID_SEQ_INCR, IPID_SEQ_BROKEN_INCR, IPID_SEQ_INCR_BY_2 };
+  const int nzombies = sizeof(classes) / sizeof(classes[0]);
+  int groupsz[nzombies] = { 30, 7, 19 };
+  int starts[MAX_IDLE_ZOMBIES], lens[MAX_IDLE_ZOMBIES];
+  u16 portarray[1000];
+  const int numports = sizeof(portarray) / sizeof(portarray[0]);
+  std::set<u16> open;
+  int num_fail = 0, num_run = 0;
+  int ngroups, portidx, z;
+
+  for (int i = 0; i < numports; i++)
+    portarray[i] = i + 1;
+
+  /* Some open ports scattered through 1-1000. */
+  for (u16 port = 7; port <= 1000; port += 37)
+    open.insert(port);
+
+  /* Start every zombie close to the 16-bit wraparound so that every class
+     has to cope with it during the scan. */
+  for (u32 firstid = 0xFFF0; firstid <= 0x1FFF0; firstid += 0x10000) {
+    std::vector<FakeZombie> zombies;
+    std::vector<u32> latest;
+    std::vector<bool> seen(numports, false);
+    int round = 0;
+
+    for (z = 0; z < nzombies; z++) {
+      zombies.push_back(FakeZombie(classes[z], firstid + z * 3));
+      latest.push_back(zombies[z].probe());
+    }
+
+    /* Let idle_split_ports() hand out the port groups as idle_scan() does
+       with several zombies, and check each zombie's count against the truth
+       for its own group. */
+    portidx = 0;
+    while (portidx < numports) {
+      ngroups = idle_split_ports(numports, portidx, groupsz, nzombies,
+                                 starts, lens);
+      num_run++;
+      if (ngroups < 1 || ngroups > nzombies || starts[0] != portidx) {
+        printf("FAIL: idle_split_ports returned %d groups from index %d\n",
+               ngroups, portidx);
+        num_fail++;
+        break;
+      }
+      for (z = 0; z < ngroups; z++) {
+        int expected = 0, counted;
+
+        num_run++;
+        if (lens[z] < 1 || lens[z] > groupsz[z]
+            || (z > 0 && starts[z] != starts[z - 1] + lens[z - 1])) {
+          printf("FAIL: group %d of round %d is %d ports from index %d\n",
+                 z, round, lens[z], starts[z]);
+          num_fail++;
+        }
+        for (int i = starts[z]; i < starts[z] + lens[z]; i++) {
+          if (seen[i]) {
+            printf("FAIL: port %hu was handed out twice\n", portarray[i]);
+            num_fail++;
+          }
+          seen[i] = true;
+          expected += open.count(portarray[i]);
+        }
+        counted = count_open(zombies[z], latest[z], portarray + starts[z],
+                             lens[z], open, (round + z) % 2 == 1);
+        if (counted != expected) {
+          printf("FAIL: zombie class %d, ports %hu-%hu: counted %d open, expected %d\n",
+                 classes[z], portarray[starts[z]],
+                 portarray[starts[z] + lens[z] - 1], counted, expected);
+          num_fail++;
+        }
+        portidx += lens[z];
+      }
+      /* Group sizes change between rounds as the zombies' timing does. */
+      groupsz[round % nzombies] = 1 + (groupsz[round % nzombies] * 3) % 40;
+      round++;
+    }
+
+    num_run++;
+    for (int i = 0; i < numports; i++) {
+      if (!seen[i]) {
+        printf("FAIL: port %hu was never handed out\n", portarray[i]);
+        num_fail++;
+        break;
+      }
+    }
+  }
+
+  /* A zombie whose group size has dropped to nothing still gets a port, and
+     the last round stops when the ports run out. */
+  num_run++;
+  groupsz[0] = 0;
+  groupsz[1] = 5;
+  groupsz[2] = 5;
+  ngroups = idle_split_ports(numports, numports - 3, groupsz, nzombies,
+                             starts, lens);
+  if (ngroups != 2 || lens[0] != 1 || lens[1] != 2) {
+    printf("FAIL: idle_split_ports at the end of the ports gave %d groups\n",
+           ngroups);
+    num_fail++;
+  }
+
+  /* An IP ID probe that never reached the zombie shows up as an impossible
+     count. */
+  num_run++;
+  {
+    FakeZombie zombie(IPID_SEQ_INCR, 100);
+    u32 first = zombie.probe();
+    if (idle_count_ports(zombie.seqclass, first, zombie.probe(), 2) >= 0) {
+      printf("FAIL: idle_count_ports with a lost probe\n");
+      num_fail++;
+    }
+  }
+
+  /* Distances that can't be computed for other sequence classes */
+  num_run++;
+  if (ipid_distance(IPID_SEQ_RD, 1, 2) != -1
+      || idle_count_ports(IPID_SEQ_RD, 1, 2, 0) >= 0) {
+    printf("FAIL: ipid_distance for a random IP ID sequence\n");
+    num_fail++;
+  }
+
+  printf("Ran %d tests. %d failures.\n", num_run, num_fail);
+
+  return num_fail == 0 ? 0 : 1;
+}
@@ -0,0 +1,258 @@
+
+/***************************************************************************
+ * nse_diskcache_test.cc -- Checks eviction in the nmapdiskcache NSE       *
+ * module and several processes writing to one cache at the same time.     *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "../nse_lua.h"
+#include "../nse_diskcache.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifndef WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <dirent.h>
+#include <unistd.h>
+
+/* Each test is a chunk run in a fresh Lua state with the module loaded. It
+   gets the cache directory and a number as arguments and returns the number
+   of failures. */
+
+static const char common[] =
+"local diskcache, dir, n = require 'nmapdiskcache', ...\n"
+"local fails = 0\n"
+"local function check (ok, what)\n"
+"  if not ok then print('FAIL: ' .. what); fails = fails + 1 end\n"
+"end\n"
+"local function body (key) return ('body of ' .. key .. '\\n'):rep(50) end\n";
+
+/* A small cache only holds a few entries. Storing more must evict some and
+   keep the cache within its size, and an entry that is read before every new
+   one is stored must survive (CLOCK gives it a second chance each time),
+   while one that is not read must eventually go. */
+static const char eviction[] =
+"local max = 16 * #body('key-00')\n"
+"local c = assert(diskcache.open(dir, max))\n"
+"local shared = ('x'):rep(100)\n"
+"for i = 1, 10 do\n"
+"  local key = ('key-%02d'):format(i)\n"
+"  check(c:put(key, 'meta ' .. key, body(key)), 'put ' .. key)\n"
+"end\n"
+"local stats = c:stats()\n"
+"check(stats.entries == 10, 'ten entries before any eviction')\n"
+"for i = 11, 100 do\n"
+"  local key = ('key-%02d'):format(i)\n"
+"  local meta, b = c:get('key-01')\n"
+"  check(meta == 'meta key-01' and b == body('key-01'),\n"
+"    'key-01 still there before ' .. key)\n"
+"  check(c:put(key, 'meta ' .. key, body(key)), 'put ' .. key)\n"
+"  stats = c:stats()\n"
+"  check(stats.bytes <= max, 'over the size limit after ' .. key)\n"
+"end\n"
+"check(c:get('key-02') == nil, 'key-02 was evicted')\n"
+"local present = 0\n"
+"for i = 1, 100 do\n"
+"  local key = ('key-%02d'):format(i)\n"
+"  local meta, b = c:get(key)\n"
+"  if meta then\n"
+"    present = present + 1\n"
+"    check(meta == 'meta ' .. key and b == body(key), 'contents of ' .. key)\n"
+"  end\n"
+"end\n"
+"check(present == c:stats().entries, 'entries counted')\n"
+"check(present > 1 and present < 17, 'entries left: ' .. present)\n"
+"-- A body stored under several keys is on disk once.\n"
+"for i = 1, 3 do c:put('shared-' .. i, 'meta', shared) end\n"
+"stats = c:stats()\n"
+"check(stats.blobs < 2 * stats.entries, 'shared body stored once')\n"
+"check(select(2, c:get('shared-2')) == shared, 'shared body')\n"
+"-- An entry bigger than the whole cache is refused.\n"
+"check(not c:put('huge', 'meta', ('y'):rep(max + 1)), 'refuses huge entry')\n"
+"c:close()\n"
+"return fails\n";
+
+/* Run by each of several processes at once: store entries of its own, and
+   read back the other writers' entries, which may or may not be there yet
+   but must be complete if they are. */
+static const char writer[] =
+"local c = assert(diskcache.open(dir, 64 * 1024 * 1024))\n"
+"for i = 1, 200 do\n"
+"  local key = ('w%d-%d'):format(n, i)\n"
+"  check(c:put(key, 'meta ' .. key, body(key)), 'put ' .. key)\n"
+"  for w = 1, 4 do\n"
+"    local other = ('w%d-%d'):format(w, i)\n"
+"    local meta, b = c:get(other)\n"
+"    check(meta == nil or (meta == 'meta ' .. other and b == body(other)),\n"
+"      'contents of ' .. other .. ' read by writer ' .. n)\n"
+"  end\n"
+"end\n"
+"c:close()\n"
+"return fails\n";
+
+/* After the writers: every entry of every writer must be there. If a process
+   had seen the index half-written, it would have emptied the cache. */
+static const char verify[] =
+"local c = assert(diskcache.open(dir, 64 * 1024 * 1024))\n"
+"for w = 1, n do\n"
+"  for i = 1, 200 do\n"
+"    local key = ('w%d-%d'):format(w, i)\n"
+"    local meta, b = c:get(key)\n"
+"    check(meta == 'meta ' .. key and b == body(key), 'contents of ' .. key)\n"
+"  end\n"
+"end\n"
+"check(c:stats().entries == n * 200, 'entry count')\n"
+"c:close()\n"
+"return fails\n";
+
+#define WRITERS 4
+
+static int run (const char *test, const char *dir, int n)
+{
+  std::string chunk = std::string(common) + test;
+  lua_State *L = luaL_newstate();
+  int fails;
+
+  luaL_openlibs(L);
+  luaL_requiref(L, NSE_DISKCACHELIBNAME, luaopen_diskcache, 1);
+  lua_pop(L, 1);
+
+  if (luaL_loadstring(L, chunk.c_str()) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    lua_close(L);
+    return 1;
+  }
+  lua_pushstring(L, dir);
+  lua_pushinteger(L, n);
+  if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    lua_close(L);
+    return 1;
+  }
+  fails = (int) lua_tointeger(L, -1);
+  lua_close(L);
+  return fails;
+}
+
+static void remove_cache (const char *dir)
+{
+  std::string blobs = std::string(dir) + "/blobs";
+  struct dirent *ent;
+  DIR *d = opendir(blobs.c_str());
+
+  if (d != NULL) {
+    while ((ent = readdir(d)) != NULL) {
+      if (ent->d_name[0] != '.')
+        unlink((blobs + "/" + ent->d_name).c_str());
+    }
+    closedir(d);
+  }
+  rmdir(blobs.c_str());
+  unlink((std::string(dir) + "/index").c_str());
+  rmdir(dir);
+}
+
+int main()
+{
+  char dir[] = "/tmp/nse_diskcache_test.XXXXXX";
+  int fails = 0, status, i;
+  pid_t pids[WRITERS];
+
+  if (mkdtemp(dir) == NULL) {
+    perror("mkdtemp");
+    return 1;
+  }
+
+  fails += run(eviction, dir, 0);
+  remove_cache(dir);
+
+  fflush(stdout);
+  for (i = 0; i < WRITERS; i++) {
+    pids[i] = fork();
+    if (pids[i] == -1) {
+      perror("fork");
+      return 1;
+    }
+    if (pids[i] == 0)
+      _exit(run(writer, dir, i + 1) == 0 ? 0 : 1);
+  }
+  for (i = 0; i < WRITERS; i++) {
+    if (waitpid(pids[i], &status, 0) == -1 || !WIFEXITED(status)
+        || WEXITSTATUS(status) != 0) {
+      printf("FAIL: writer %d\n", i + 1);
+      fails++;
+    }
+  }
+  fails += run(verify, dir, WRITERS);
+  remove_cache(dir);
+
+  printf("nse_diskcache: %d failures\n", fails);
+  return fails != 0;
+}
+
+#else
+
+int main()
+{
+  /* The disk cache is not supported on Windows. */
+  return 0;
+}
+
+#endif
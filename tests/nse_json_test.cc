@@ -0,0 +1,166 @@
+
+/***************************************************************************
+ * nse_json_test.cc -- Checks the nmapjson NSE module against itself,      *
+ * including documents and long tokens fed to a decoder in pieces.         *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "../nse_lua.h"
+#include "../nse_json.h"
+
+#include <cstdio>
+
+/* The document is an array of records resembling the hits of a search API,
+   with nested objects, escapes, non-ASCII text and every JSON type. It is
+   parsed all at once and in pieces, written back out, and parsed again; all
+   of the results must be the same. A pretty-printed copy exercises the
+   whitespace scanner.
+
+   Long strings and numbers are then fed to a decoder a few bytes at a time,
+   so that every escape is cut at every possible place. The decoder must not
+   scan such a token again from its start for every piece: the megabyte
+   string below would take minutes to get through if it did. */
+
+#define RECORDS 2000
+
+static const char tests[] =
+"local json, records = require 'nmapjson', ...\n"
+"local function equal (a, b)\n"
+"  if type(a) ~= 'table' or type(b) ~= 'table' then return a == b end\n"
+"  if (getmetatable(a) or {}).json ~= (getmetatable(b) or {}).json then return false end\n"
+"  for k, v in pairs(a) do if not equal(v, b[k]) then return false end end\n"
+"  for k in pairs(b) do if a[k] == nil then return false end end\n"
+"  return true\n"
+"end\n"
+"local function arr (t) return setmetatable(t, {json = 'array'}) end\n"
+"local function obj (t) return setmetatable(t, {json = 'object'}) end\n"
+"local t = {}\n"
+"for i = 1, records do\n"
+"  t[i] = obj{_id = 'host-' .. i, _score = i / 8, found = i % 3 == 0,\n"
+"    parent = json.NULL, count = i * 1000003,\n"
+"    _source = obj{name = ('srv%d.example.com'):format(i),\n"
+"      banner = 'HTTP/1.1 200 OK\\r\\nServer: \"x/1.0\"\\r\\n\\\\',\n"
+"      city = 'S\\195\\163o Paulo', ports = arr{22, 80, 443, i % 65536},\n"
+"      geo = obj{lat = -23.5 + i / 1024, lon = -46.6, tags = arr{}}}}\n"
+"end\n"
+"local function pieces (doc, size)\n"
+"  local d = json.decoder()\n"
+"  for i = 1, #doc, size do d:feed(doc:sub(i, i + size - 1)) end\n"
+"  return d:finish()\n"
+"end\n"
+"local fails = 0\n"
+"local function check (ok, what)\n"
+"  if not ok then print('FAIL: ' .. what); fails = fails + 1 end\n"
+"end\n"
+"local doc = json.encode(arr(t))\n"
+"local pretty = doc:gsub(', ', ',\\n        ')\n"
+"local small = json.encode(arr{t[1], t[2], t[3]})\n"
+"check(equal(json.decode(doc), t), 'decode')\n"
+"check(equal(pieces(doc, 4096), t), 'decode in pieces')\n"
+"check(equal(json.decode(pretty), t), 'decode pretty-printed')\n"
+"check(equal(json.decode(json.encode(json.decode(doc))), t), 'encode')\n"
+"for size = 1, 17 do\n"
+"  check(equal(pieces(small, size), json.decode(small)), 'pieces of ' .. size)\n"
+"end\n"
+"-- One long string with escapes, cut at every place in them.\n"
+"local unit = 'abc\\\\\"\\\\u00e9\\\\n\\\\uD83D\\\\uDE00xyz'\n"
+"local body = unit:rep(64)\n"
+"local expect = ('abc\"\\195\\169\\n\\240\\159\\152\\128xyz'):rep(64)\n"
+"for size = 1, 13 do\n"
+"  local ok, v = pcall(pieces, '[\"' .. body .. '\"]', size)\n"
+"  check(ok and v[1] == expect, 'escaped string in pieces of ' .. size)\n"
+"end\n"
+"local long = ('0123456789abcdef'):rep(65536)\n"
+"local ok, v = pcall(pieces, '{\"k\":\"' .. long .. '\"}', 7)\n"
+"check(ok and v.k == long, 'megabyte string in pieces of 7')\n"
+"ok, v = pcall(pieces, '\"' .. long .. '\\\\', 7)\n"
+"check(not ok, 'unterminated megabyte string in pieces of 7')\n"
+"local digits = '1' .. ('0'):rep(20000)\n"
+"ok, v = pcall(pieces, '[' .. digits .. ', -' .. digits .. 'e-20000]', 3)\n"
+"check(ok and v[1] == tonumber(digits) and v[2] == -1,\n"
+"  'long numbers in pieces of 3')\n"
+"for _, bad in ipairs{'', '[1,]', '{\"a\" 1}', '[1 2]', '{\"a\":1', '\"abc',\n"
+"    'nul', 'truex', '[.]', '[1e]', '{} {}', '[\"\\\\uDC00\"]'} do\n"
+"  check(not pcall(json.decode, bad), 'rejects ' .. bad)\n"
+"  check(not pcall(pieces, bad, 1), 'rejects in pieces ' .. bad)\n"
+"end\n"
+"return fails\n";
+
+int main()
+{
+  lua_State *L = luaL_newstate();
+  int fails;
+
+  luaL_openlibs(L);
+  luaL_requiref(L, NSE_JSONLIBNAME, luaopen_json, 1);
+  lua_pop(L, 1);
+
+  if (luaL_loadstring(L, tests) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  lua_pushinteger(L, RECORDS);
+  if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  fails = (int) lua_tointeger(L, -1);
+  lua_close(L);
+
+  printf("nse_json: %d failures\n", fails);
+  return fails != 0;
+}
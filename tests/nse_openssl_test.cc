@@ -0,0 +1,292 @@
+
+/***************************************************************************
+ * nse_openssl_test.cc -- Checks the openssl NSE module's digests, HMAC    *
+ * and ciphers, and its batches and contexts, against known answers.       *
+ * Usage: nse_openssl_test [-b]                                            *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "../nse_lua.h"
+#include "../nse_openssl.h"
+
+#include <openssl/hmac.h>
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+/* Checks the digest, HMAC and cipher functions against known answers and
+   against each other: one-shot calls, batches and reusable contexts must
+   all agree, and HMAC must agree with OpenSSL's own HMAC() for every key
+   length around the block size. Algorithms are looked up once and the
+   one-shot functions share their contexts, which must survive errors.
+
+   With -b, it also times workloads that resemble brute-force scripts, which
+   hash or encrypt one short password at a time. */
+
+#define PASSWORDS 1000
+#define BENCH_PASSWORDS 200000
+
+/* ref_hmac(algorithm, key, message) */
+static int ref_hmac (lua_State *L)
+{
+  size_t key_len, msg_len;
+  const EVP_MD *md = EVP_get_digestbyname(luaL_checkstring(L, 1));
+  const char *key = luaL_checklstring(L, 2, &key_len);
+  const char *msg = luaL_checklstring(L, 3, &msg_len);
+  unsigned char out[EVP_MAX_MD_SIZE];
+  unsigned int out_len;
+
+  if (md == NULL || HMAC(md, key, (int) key_len, (const unsigned char *) msg, msg_len, out, &out_len) == NULL)
+    return luaL_error(L, "HMAC failed");
+  lua_pushlstring(L, (const char *) out, out_len);
+  return 1;
+}
+
+/* cache_info() returns the number of digests and ciphers looked up and the
+   shared digest and cipher contexts, as light userdata. */
+static int cache_info (lua_State *L)
+{
+  size_t ndigests, nciphers;
+  const void *md_ctx, *cipher_ctx;
+
+  nse_openssl_cache_info(&ndigests, &nciphers, &md_ctx, &cipher_ctx);
+  lua_pushinteger(L, (lua_Integer) ndigests);
+  lua_pushinteger(L, (lua_Integer) nciphers);
+  lua_pushlightuserdata(L, (void *) md_ctx);
+  lua_pushlightuserdata(L, (void *) cipher_ctx);
+  return 4;
+}
+
+static const char common[] =
+"local openssl, passwords = require 'openssl', ...\n"
+"local function hex (s) return (s:gsub('.', function (c) return ('%02x'):format(c:byte()) end)) end\n"
+"local function unhex (s) return (s:gsub('%x%x', function (h) return string.char(tonumber(h, 16)) end)) end\n"
+"local fails = 0\n"
+"local function check (ok, what)\n"
+"  if not ok then print('FAIL: ' .. what); fails = fails + 1 end\n"
+"end\n"
+"local function same (a, b, what)\n"
+"  for i = 1, #a do\n"
+"    if a[i] ~= b[i] then check(false, what .. ' ' .. i); return end\n"
+"  end\n"
+"  check(#a == #b, what .. ' length')\n"
+"end\n"
+"local key, iv = unhex('2b7e151628aed2a6abf7158809cf4f3c'), unhex('000102030405060708090a0b0c0d0e0f')\n"
+"local pw = {}\n"
+"for i = 1, passwords do pw[i] = ('p\\0a\\0s\\0s\\0%d'):format(i):gsub('%d', '%0\\0') end\n";
+
+static const char tests[] =
+"check(hex(openssl.md5('abc')) == '900150983cd24fb0d6963f7d28e17f72', 'md5')\n"
+"check(hex(openssl.sha1('abc')) == 'a9993e364706816aba3e25717850c26c9cd0d89d', 'sha1')\n"
+"check(hex(openssl.hmac('md5', 'Jefe', 'what do ya want for nothing?')) == '750c783e6ab0b503eaa86e310a5db738', 'hmac-md5')\n"
+"check(hex(openssl.hmac('sha256', ('\\11'):rep(20), 'Hi There')) ==\n"
+"  'b0344c61d8db38535ca8afceaf0bf12b881dc200c9833da726e9376c2e32cff7', 'hmac-sha256')\n"
+"check(hex(openssl.hmac('sha256', ('\\170'):rep(131), 'Test Using Larger Than Block-Size Key - Hash Key First')) ==\n"
+"  '60e431591ee0b67f0d8a26aacbf5b77f8e0bc6213728c5140546040f0ee37f54', 'hmac-sha256 long key')\n"
+"check(hex(openssl.hmac('sha512', ('\\11'):rep(20), 'Hi There')) ==\n"
+"  '87aa7cdea5ef619d4ff0b4241a1d6cb02379f4e2ce4ec2787ad0b30545e17cde' ..\n"
+"  'daa833b7d6b8a702038b274eaea3f4e4be9d914eeb61f1702e696c203a126854', 'hmac-sha512')\n"
+"for _, alg in ipairs{'md5', 'sha1', 'sha256', 'sha512', 'sha3-256'} do\n"
+"  for len = 0, 200, 7 do\n"
+"    local key, msg = ('k'):rep(len), ('m'):rep(len * 3)\n"
+"    local want = ref_hmac(alg, key, msg)\n"
+"    check(openssl.hmac(alg, key, msg) == want, ('hmac %s %d'):format(alg, len))\n"
+"    check(openssl.hmac_many(alg, key, {msg})[1] == want, ('hmac_many %s %d'):format(alg, len))\n"
+"    local ctx = openssl.hmac_context(alg, key)\n"
+"    check(ctx:update(msg:sub(1, len), msg:sub(len + 1)):final() == want, ('hmac_context %s %d'):format(alg, len))\n"
+"    check(ctx:digest(msg) == want, ('hmac_context reused %s %d'):format(alg, len))\n"
+"  end\n"
+"  local ctx = openssl.digest_context(alg)\n"
+"  check(ctx:update('a', 'b'):update('c'):final() == openssl.digest(alg, 'abc'), 'digest_context ' .. alg)\n"
+"  check(ctx:digest('') == openssl.digest(alg, ''), 'digest_context reused ' .. alg)\n"
+"end\n"
+"check(not pcall(openssl.digest, 'no-such-digest', 'x'), 'unknown digest')\n"
+"check(not pcall(openssl.digest_many, 'md5', {'a', {}}), 'bad batch')\n"
+"\n"
+"local plain = unhex('6bc1bee22e409f96e93d7e117393172a')\n"
+"check(hex(openssl.encrypt('aes-128-cbc', key, iv, plain)) == '7649abac8119b246cee98e9b12e9197d', 'aes-128-cbc')\n"
+"local long = ('0123456789abcdef'):rep(64)\n"
+"local whole = openssl.encrypt('aes-128-cbc', key, iv, long, true)\n"
+"local enc = openssl.cipher_context('aes-128-cbc', key, iv, true, true)\n"
+"local parts = {}\n"
+"for i = 1, #long, 100 do parts[#parts + 1] = enc:update(long:sub(i, i + 99)) end\n"
+"parts[#parts + 1] = enc:final()\n"
+"check(table.concat(parts) == whole, 'cipher_context in pieces')\n"
+"enc:reset(iv)\n"
+"check(enc:update(long) .. enc:final() == whole, 'cipher_context reset')\n"
+"local dec = openssl.cipher_context('aes-128-cbc', key, iv, false, true)\n"
+"check(dec:update(whole) .. dec:final() == long, 'cipher_context decrypt')\n"
+"check(openssl.decrypt('aes-128-cbc', key, iv, whole, true) == long, 'decrypt')\n"
+"check(not pcall(openssl.encrypt, 'aes-128-cbc', key, 'short', plain), 'iv length')\n"
+"check(openssl.encrypt('aes-128-cbc', key, iv, plain) == unhex('7649abac8119b246cee98e9b12e9197d'), 'after error')\n"
+"\n"
+"-- Batches and contexts give the same results as one call per message.\n"
+"local one, mac, ecb = {}, {}, {}\n"
+"for i = 1, passwords do\n"
+"  one[i] = openssl.sha1(pw[i])\n"
+"  mac[i] = openssl.hmac('md5', 'secret', pw[i])\n"
+"  ecb[i] = openssl.encrypt('aes-128-ecb', key, nil, pw[i], true)\n"
+"end\n"
+"same(openssl.digest_many('sha1', pw), one, 'digest_many')\n"
+"same(openssl.hmac_many('md5', 'secret', pw), mac, 'hmac_many')\n"
+"local ctx, hctx, t, h = openssl.digest_context('sha1'), openssl.hmac_context('md5', 'secret'), {}, {}\n"
+"for i = 1, passwords do t[i] = ctx:digest(pw[i]); h[i] = hctx:digest(pw[i]) end\n"
+"same(t, one, 'digest_context')\n"
+"same(h, mac, 'hmac_context')\n"
+"check(#openssl.digest_many('sha1', {}) == 0, 'empty batch')\n"
+"\n"
+"-- Algorithms are looked up once, and the one-shot functions keep using the\n"
+"-- same contexts, through errors too.\n"
+"local nd, nc, md_ctx, cipher_ctx = cache_info()\n"
+"check(md_ctx ~= nil and cipher_ctx ~= nil, 'shared contexts set up')\n"
+"for i = 1, 100 do\n"
+"  openssl.sha1(pw[i]); openssl.md5(pw[i]); openssl.digest('sha256', pw[i])\n"
+"  openssl.hmac('sha1', 'k', pw[i]); openssl.digest_many('md5', {pw[i]})\n"
+"  openssl.encrypt('aes-128-cbc', key, iv, plain)\n"
+"  openssl.decrypt('aes-128-ecb', key, nil, ecb[i], true)\n"
+"end\n"
+"pcall(openssl.digest, 'no-such-digest', 'x')\n"
+"pcall(openssl.encrypt, 'aes-128-cbc', key, 'short', plain)\n"
+"local nd2, nc2, md_ctx2, cipher_ctx2 = cache_info()\n"
+"check(nd2 == nd and nc2 == nc, ('no new lookups: %d/%d digests, %d/%d ciphers'):format(nd, nd2, nc, nc2))\n"
+"check(md_ctx2 == md_ctx and cipher_ctx2 == cipher_ctx, 'same shared contexts')\n"
+"openssl.digest('sha384', 'x')\n"
+"check(select(1, cache_info()) == nd + 1, 'new digest looked up once')\n"
+"openssl.digest('sha384', 'y')\n"
+"check(select(1, cache_info()) == nd + 1, 'new digest cached')\n"
+"check(hex(openssl.sha1('abc')) == 'a9993e364706816aba3e25717850c26c9cd0d89d', 'sha1 after errors')\n"
+"return fails\n";
+
+/* Only run with -b. */
+static const char bench[] =
+"local clock = os.clock\n"
+"local function time (what, n, f)\n"
+"  collectgarbage()\n"
+"  local start = clock()\n"
+"  local r = f()\n"
+"  local elapsed = clock() - start\n"
+"  print(('%-28s %8d %7.3f s %9.0f /s'):format(what, n, elapsed, n / math.max(elapsed, 1e-6)))\n"
+"  return r\n"
+"end\n"
+"time('sha1, one call each', passwords, function ()\n"
+"  for i = 1, passwords do openssl.sha1(pw[i]) end\n"
+"end)\n"
+"time('sha1, digest_many', passwords, function () return openssl.digest_many('sha1', pw) end)\n"
+"local ctx = openssl.digest_context('sha1')\n"
+"time('sha1, digest_context', passwords, function ()\n"
+"  for i = 1, passwords do ctx:digest(pw[i]) end\n"
+"end)\n"
+"if pcall(openssl.md4, '') then\n"
+"  time('md4 (NTLM), one call each', passwords, function ()\n"
+"    for i = 1, passwords do openssl.md4(pw[i]) end\n"
+"  end)\n"
+"end\n"
+"time('hmac-md5, one call each', passwords, function ()\n"
+"  for i = 1, passwords do openssl.hmac('md5', 'secret', pw[i]) end\n"
+"end)\n"
+"time('hmac-md5, hmac_many', passwords, function () return openssl.hmac_many('md5', 'secret', pw) end)\n"
+"local hctx = openssl.hmac_context('md5', 'secret')\n"
+"time('hmac-md5, hmac_context', passwords, function ()\n"
+"  for i = 1, passwords do hctx:digest(pw[i]) end\n"
+"end)\n"
+"time('aes-128-ecb, one call each', passwords, function ()\n"
+"  for i = 1, passwords do openssl.encrypt('aes-128-ecb', key, nil, pw[i], true) end\n"
+"end)\n"
+"local g, p = openssl.bignum_dec2bn('2'), openssl.bignum_hex2bn(('f'):rep(256))\n"
+"time('bignum_mod_exp (1024 bits)', 2000, function ()\n"
+"  for i = 1, 2000 do openssl.bignum_mod_exp(g, openssl.bignum_dec2bn(tostring(i * 7919)), p) end\n"
+"end)\n"
+"return fails\n";
+
+static int run (lua_State *L, const char *test, int passwords)
+{
+  std::string chunk = std::string(common) + test;
+
+  if (luaL_loadstring(L, chunk.c_str()) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  lua_pushinteger(L, passwords);
+  if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  int fails = (int) lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  return fails;
+}
+
+int main(int argc, char *argv[])
+{
+  lua_State *L = luaL_newstate();
+  int fails;
+
+  luaL_openlibs(L);
+  luaL_requiref(L, OPENSSLLIBNAME, luaopen_openssl, 1);
+  lua_pop(L, 1);
+  lua_register(L, "ref_hmac", ref_hmac);
+  lua_register(L, "cache_info", cache_info);
+
+  fails = run(L, tests, PASSWORDS);
+  if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    fails += run(L, bench, BENCH_PASSWORDS);
+  lua_close(L);
+
+  printf("nse_openssl: %d failures\n", fails);
+  return fails != 0;
+}
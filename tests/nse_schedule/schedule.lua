@@ -0,0 +1,49 @@
+-- The work shared by schedule-light and schedule-heavy. Not a script itself:
+-- they load it with loadfile.
+
+local nmap = require "nmap"
+local stdnse = require "stdnse"
+local clock = os.clock
+
+local _ENV = {}
+
+-- CPU seconds of one round of work: more than the main loop's slice, so that
+-- only one of the scripts can be resumed in each pass. os.clock counts CPU
+-- time, not elapsed time, so a loaded machine doesn't change the outcome.
+local ROUND_CPU = 0.02
+-- Rounds schedule-light does. schedule-heavy works until those are done.
+LIGHT_ROUNDS = 40
+
+local function round ()
+  local start = clock()
+  while clock() - start < ROUND_CPU do
+  end
+  stdnse.sleep(0)
+end
+
+--- Does rounds of work for the script named name and records how many in
+-- <code>nmap.registry.schedule_test</code>.
+function rounds (name)
+  local reg = nmap.registry.schedule_test
+  if not reg then
+    reg = {}
+    nmap.registry.schedule_test = reg
+  end
+  local count = 0
+  if name == "schedule-light" then
+    while count < LIGHT_ROUNDS do
+      round()
+      count = count + 1
+    end
+    reg.light_done = true
+  else
+    -- Stop on our own if the light script is starved, rather than hang.
+    while not reg.light_done and count < LIGHT_ROUNDS * 4 do
+      round()
+      count = count + 1
+    end
+  end
+  reg[name] = count
+end
+
+return _ENV
@@ -0,0 +1,193 @@
+
+/***************************************************************************
+ * nse_zlib_test.cc -- Checks that the zlib NSE module gives back what     *
+ * went into it, reuses its pooled streams, and rejects bad input.         *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "../nse_lua.h"
+#include "../nse_zlib.h"
+
+#include <cstdio>
+
+/* The bodies look like gzipped HTTP responses: pages of markup and text of a
+   few kilobytes up to a hundred or so. Each is inflated the ways scripts do
+   it, by zlib.decompress and by reading an inflate stream whole or in pieces,
+   and compressed again; everything must come back as it went in.
+
+   Streams are pooled (see lz_pool_get in nse_zlib.cc): one that is done with
+   must be reset and handed to the next user with the same parameters, and
+   must work for it even if its last user hit an error. Truncated and corrupt
+   input must fail rather than hang. */
+
+#define BODIES 100
+
+static const char tests[] =
+"local zlib, bodies, pool_len = require 'zlib', ...\n"
+"local words = {'<div class=\"item\">', 'nmap', 'scan', '</a>', 'port', 'host',\n"
+"  '<td>', 'service', 'version', '\\n', 'open', 'filtered', '<br/>', 'tcp'}\n"
+"local seed = 7\n"
+"local function rand (n) seed = (seed * 1103515245 + 12345) % 2147483648; return seed % n + 1 end\n"
+"local plain, gz = {}, {}\n"
+"for i = 1, bodies do\n"
+"  local t, n = {}, i % 10 == 0 and 20000 or 600\n"
+"  for j = 1, n do t[j] = words[rand(#words)] .. (j % 7 == 0 and j or '') end\n"
+"  plain[i] = table.concat(t, ' ')\n"
+"  gz[i] = zlib.compress(plain[i], 6, 8, 31)\n"
+"end\n"
+"local fails = 0\n"
+"local function check (ok, what)\n"
+"  if not ok then print('FAIL: ' .. what); fails = fails + 1 end\n"
+"end\n"
+"local function same (f, what)\n"
+"  for i = 1, bodies do\n"
+"    if f(i) ~= plain[i] then check(false, what .. ' ' .. i); return end\n"
+"  end\n"
+"end\n"
+"same(function (i) return zlib.decompress(gz[i], 47) end, 'decompress')\n"
+"same(function (i) return zlib.inflate(gz[i]):read('*a') end, 'read *a')\n"
+"same(function (i) return zlib.inflate(gz[i]):read(#plain[i] + 1) end, 'read n')\n"
+"same(function (i)\n"
+"  local s = gz[i]\n"
+"  local pos = 1\n"
+"  local z = zlib.inflate(function ()\n"
+"    local piece = s:sub(pos, pos + 511); pos = pos + 512\n"
+"    return piece ~= '' and piece or nil\n"
+"  end)\n"
+"  local t = {}\n"
+"  repeat local c = z:read(1000); t[#t + 1] = c until not c or c == ''\n"
+"  return table.concat(t)\n"
+"end, 'read in pieces')\n"
+"same(function (i) return zlib.decompress((zlib.compress(plain[i]))) end, 'compress')\n"
+"same(function (i)\n"
+"  local t = {}\n"
+"  local z = zlib.deflate(function (data) t[#t + 1] = data end, 6, 8, 31)\n"
+"  local p = plain[i]\n"
+"  for j = 1, #p, 4096 do z:write(p:sub(j, j + 4095)) end\n"
+"  z:close()\n"
+"  return zlib.decompress(table.concat(t), 31)\n"
+"end, 'deflate stream')\n"
+"local lines = {}\n"
+"for l in zlib.inflate((zlib.compress('a\\nbb\\r\\nccc\\n\\ndddd'))):lines() do lines[#lines + 1] = l end\n"
+"check(table.concat(lines, ',') == 'a,bb,ccc,,dddd', 'lines')\n"
+"local z = zlib.inflate(gz[1])\n"
+"local head = z:read(10)\n"
+"check(head .. z:read('*a') == plain[1], 'read after read')\n"
+"check(zlib.decompress((zlib.compress(''))) == '', 'empty')\n"
+"local big = string.rep('0123456789', 1e5)\n"
+"check(zlib.decompress((zlib.compress(big, 9, 8, 31)), 47) == big, 'gzip size hint')\n"
+"check(zlib.decompress((zlib.compress(big))) == big, 'zlib')\n"
+"check(zlib.decompress((zlib.compress(big, 1, 8, -15)), -15) == big, 'raw deflate')\n"
+"-- The pool\n"
+"collectgarbage()\n"
+"local streams = {}\n"
+"for i = 1, 12 do streams[i] = zlib.inflate(gz[i]) end\n"
+"for i = 1, 12 do streams[i]:close() end\n"
+"check(pool_len() == 8, 'pool holds 8 streams, not ' .. pool_len())\n"
+"zlib.decompress(gz[1], 47)\n"
+"check(pool_len() == 8, 'decompress takes a stream from the pool and returns it')\n"
+"z = zlib.inflate(gz[2])\n"
+"check(pool_len() == 7, 'inflate takes a stream from the pool')\n"
+"check(z:read('*a') == plain[2], 'pooled stream inflates')\n"
+"z:close()\n"
+"check(pool_len() == 8, 'closed stream goes back to the pool')\n"
+"-- Errors, and pooled streams after errors\n"
+"local lying = gz[1]:sub(1, -5) .. '\\255\\255\\255\\127'\n"
+"check(not pcall(zlib.decompress, lying, 47), 'wrong gzip size')\n"
+"check(not pcall(zlib.decompress, gz[1]:sub(1, #gz[1] // 2), 47), 'truncated')\n"
+"check(not pcall(zlib.decompress, 'not compressed at all', 47), 'corrupt')\n"
+"z = zlib.inflate('not compressed at all')\n"
+"check(not pcall(z.read, z, '*a'), 'corrupt stream')\n"
+"z:close()\n"
+"check(pool_len() <= 8, 'pool after errors')\n"
+"for i = 1, 20 do\n"
+"  check(zlib.decompress(gz[i], 47) == plain[i], 'decompress after errors ' .. i)\n"
+"  check(zlib.inflate(gz[i]):read('*a') == plain[i], 'inflate after errors ' .. i)\n"
+"end\n"
+"return fails\n";
+
+static int pool_len(lua_State *L)
+{
+  lua_pushinteger(L, nse_zlib_pool_len());
+  return 1;
+}
+
+int main()
+{
+  lua_State *L = luaL_newstate();
+  int fails;
+
+  luaL_openlibs(L);
+  luaL_requiref(L, NSE_ZLIBNAME, luaopen_zlib, 1);
+  lua_pop(L, 1);
+
+  if (luaL_loadstring(L, tests) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  lua_pushinteger(L, BODIES);
+  lua_pushcfunction(L, pool_len);
+  if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+    fprintf(stderr, "%s\n", lua_tostring(L, -1));
+    return 1;
+  }
+  fails = (int) lua_tointeger(L, -1);
+  lua_close(L);
+
+  printf("nse_zlib: %d failures\n", fails);
+  return fails != 0;
+}
@@ -0,0 +1,336 @@
+
+/***************************************************************************
+ * packet_parser_test.cc -- Checks PacketParser's packet views against the *
+ * header chains it builds. With -b, it also compares their speed.         *
+ * Usage: packet_parser_test [-b] [file.pcap]                              *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "../nmap.h"
+#include "../tcpip.h"
+#include "../NmapOps.h"
+#include "../libnetutil/PacketParser.h"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+/* Parses a few known packets and every truncation of them, checking the
+   headers found and the chains split from them, and checks the packets in
+   the pcap file given as an argument the same way. With -b, it also reports
+   how many packets per second parse_view and split go through, over those
+   packets or the ones in the pcap file. */
+
+#define BENCH_PACKETS 2000000
+/* Header types start at 0 (IPv6 hop-by-hop options), so this marks none. */
+#define NO_HEADER 0xffffffff
+
+extern NmapOps o;
+
+struct test_packet {
+  std::vector<u8> data;
+  bool eth;
+  std::vector<u32> types; /* Expected headers, outermost first */
+};
+
+static std::vector<test_packet> corpus;
+
+static double elapsed(const struct timeval *start) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return TIMEVAL_FSEC_SUBTRACT(now, *start);
+}
+
+/* Adds a packet built by one of the build_*_raw functions, which is freed,
+   along with a copy of it behind an Ethernet header. */
+static void add(u8 *pkt, u32 len, bool v6, u32 t1, u32 t2, u32 t3 = NO_HEADER) {
+  static const u8 eth[12] = { 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 6 };
+  test_packet p;
+  u32 t[] = { t1, t2, t3 };
+
+  p.data.assign(pkt, pkt + len);
+  p.eth = false;
+  for (int i = 0; i < 3 && t[i] != NO_HEADER; i++)
+    p.types.push_back(t[i]);
+  corpus.push_back(p);
+
+  p.data.assign(eth, eth + sizeof(eth));
+  p.data.push_back(v6 ? 0x86 : 0x08);
+  p.data.push_back(v6 ? 0xdd : 0x00);
+  p.data.insert(p.data.end(), pkt, pkt + len);
+  p.eth = true;
+  p.types.insert(p.types.begin(), HEADER_TYPE_ETHERNET);
+  corpus.push_back(p);
+  free(pkt);
+}
+
+static void build_corpus() {
+  struct in_addr src, dst;
+  struct in6_addr src6, dst6;
+  const u8 mss[] = { 0x02, 0x04, 0x05, 0xb4 };
+  const char data[] = "payload";
+  char init[20];
+  /* Hop-by-hop options (one PadN) followed by a UDP header */
+  const char hopopt[] = { 17, 0, 1, 4, 0, 0, 0, 0,
+                          0x12, 0x34, 0, 53, 0, 8, 0, 0 };
+  u8 *pkt;
+  u32 len;
+
+  src.s_addr = htonl(0xc0000202);
+  dst.s_addr = htonl(0xc0000201);
+  memset(&src6, 0, sizeof(src6));
+  src6.s6_addr[0] = 0x20;
+  src6.s6_addr[1] = 0x01;
+  src6.s6_addr[15] = 2;
+  dst6 = src6;
+  dst6.s6_addr[15] = 1;
+  memset(init, 0, sizeof(init));
+  init[0] = 1; /* INIT */
+  init[3] = sizeof(init);
+
+  pkt = build_tcp_raw(&src, &dst, 64, 1, 0, false, NULL, 0, 40000, 80, 1, 0, 0,
+                      TH_SYN, 1024, 0, mss, sizeof(mss), NULL, 0, &len);
+  add(pkt, len, false, HEADER_TYPE_IPv4, HEADER_TYPE_TCP);
+  pkt = build_tcp_raw(&src, &dst, 64, 1, 0, false, NULL, 0, 40000, 80, 1, 2, 0,
+                      TH_ACK, 1024, 0, NULL, 0, data, sizeof(data), &len);
+  add(pkt, len, false, HEADER_TYPE_IPv4, HEADER_TYPE_TCP, HEADER_TYPE_RAW_DATA);
+  pkt = build_udp_raw(&src, &dst, 64, 1, 0, false, NULL, 0, 40000, 53,
+                      data, sizeof(data), &len);
+  add(pkt, len, false, HEADER_TYPE_IPv4, HEADER_TYPE_UDP, HEADER_TYPE_RAW_DATA);
+  pkt = build_icmp_raw(&src, &dst, 64, 1, 0, false, NULL, 0, 1, 2, 8, 0,
+                       NULL, 0, &len);
+  add(pkt, len, false, HEADER_TYPE_IPv4, HEADER_TYPE_ICMPv4);
+  pkt = build_sctp_raw(&src, &dst, 64, 1, 0, false, NULL, 0, 40000, 80, 0,
+                       init, sizeof(init), NULL, 0, &len);
+  add(pkt, len, false, HEADER_TYPE_IPv4, HEADER_TYPE_SCTP, HEADER_TYPE_RAW_DATA);
+  pkt = build_tcp_raw_ipv6(&src6, &dst6, 0, 0, 64, 40000, 80, 1, 0, 0, TH_SYN,
+                           1024, 0, mss, sizeof(mss), NULL, 0, &len);
+  add(pkt, len, true, HEADER_TYPE_IPv6, HEADER_TYPE_TCP);
+  pkt = build_udp_raw_ipv6(&src6, &dst6, 0, 0, 64, 40000, 53,
+                           data, sizeof(data), &len);
+  add(pkt, len, true, HEADER_TYPE_IPv6, HEADER_TYPE_UDP, HEADER_TYPE_RAW_DATA);
+  pkt = build_icmpv6_raw(&src6, &dst6, 0, 0, 64, 1, 2, 128, 0, NULL, 0, &len);
+  add(pkt, len, true, HEADER_TYPE_IPv6, HEADER_TYPE_ICMPv6);
+  pkt = build_ipv6_raw(&src6, &dst6, 0, 0, HEADER_TYPE_IPv6_HOPOPT, 64,
+                       hopopt, sizeof(hopopt), &len);
+  add(pkt, len, true, HEADER_TYPE_IPv6, HEADER_TYPE_IPv6_HOPOPT, HEADER_TYPE_UDP);
+}
+
+/* Checks that the headers of the view lie within the packet, one after
+   another, and that splitting the view gives a chain of the same headers. */
+static int check_view(const packet_view_t *view, const char *what, size_t n) {
+  PacketElement *chain, *e;
+  u32 end = 0;
+  int i;
+
+  for (i = 0; i < view->count; i++) {
+    if (view->offset[i] != end || view->offset[i] + view->hdr[i].length > view->pktlen) {
+      printf("FAIL: %s packet %lu: header %d out of place\n", what, (unsigned long) n, i);
+      return 1;
+    }
+    end += view->hdr[i].length;
+  }
+  chain = PacketParser::split(view);
+  for (i = 0, e = chain; e != NULL; i++, e = e->getNextElement()) {
+    /* getLen() counts the headers after this one too, and there is no
+       class for SCTP headers, so they become RawData. */
+    if (i >= view->count
+        || (u32) e->getLen() != end - view->offset[i]
+        || ((u32) e->protocol_id() != view->hdr[i].type
+            && !(view->hdr[i].type == HEADER_TYPE_SCTP
+                 && e->protocol_id() == HEADER_TYPE_RAW_DATA))) {
+      printf("FAIL: %s packet %lu: chain differs at header %d\n", what, (unsigned long) n, i);
+      PacketParser::freePacketChain(chain);
+      return 1;
+    }
+  }
+  PacketParser::freePacketChain(chain);
+  if (i != view->count) {
+    printf("FAIL: %s packet %lu: chain has %d headers, not %d\n",
+           what, (unsigned long) n, i, view->count);
+    return 1;
+  }
+  return 0;
+}
+
+static int check_corpus(bool known) {
+  packet_view_t view;
+  int failures = 0;
+
+  for (size_t n = 0; n < corpus.size(); n++) {
+    const test_packet *p = &corpus[n];
+
+    PacketParser::parse_view(&p->data[0], p->data.size(), p->eth, &view);
+    if (known) {
+      bool same = view.count == (int) p->types.size();
+      for (int i = 0; same && i < view.count; i++)
+        same = view.hdr[i].type == p->types[i];
+      if (!same) {
+        printf("FAIL: packet %lu parsed as", (unsigned long) n);
+        for (int i = 0; i < view.count; i++)
+          printf(" %s", PacketParser::header_type2string(view.hdr[i].type));
+        printf("\n");
+        failures++;
+      }
+    }
+    failures += check_view(&view, "whole", n);
+
+    /* Nothing may be found beyond the end of a truncated packet. */
+    for (size_t len = 1; known && len < p->data.size(); len++) {
+      std::vector<u8> cut(p->data.begin(), p->data.begin() + len);
+      PacketParser::parse_view(&cut[0], len, p->eth, &view);
+      failures += check_view(&view, "truncated", n);
+    }
+  }
+  return failures;
+}
+
+/* Replaces the corpus with the packets of a pcap file. */
+static bool read_pcap(const char *filename) {
+  char errbuf[PCAP_ERRBUF_SIZE];
+  struct pcap_pkthdr *head;
+  const u_char *data;
+  pcap_t *pd;
+  bool eth;
+
+  pd = pcap_open_offline(filename, errbuf);
+  if (pd == NULL) {
+    printf("%s\n", errbuf);
+    return false;
+  }
+  switch (pcap_datalink(pd)) {
+  case DLT_EN10MB:
+    eth = true;
+    break;
+  case DLT_RAW:
+    eth = false;
+    break;
+  default:
+    printf("%s: only Ethernet and raw IP captures are supported\n", filename);
+    pcap_close(pd);
+    return false;
+  }
+  corpus.clear();
+  while (pcap_next_ex(pd, &head, &data) == 1) {
+    test_packet p;
+    if (head->caplen == 0)
+      continue;
+    p.data.assign(data, data + head->caplen);
+    p.eth = eth;
+    corpus.push_back(p);
+  }
+  pcap_close(pd);
+  return !corpus.empty();
+}
+
+static void bench() {
+  packet_view_t view;
+  struct timeval start;
+  unsigned long sum = 0;
+  double t_view, t_split;
+  size_t n = 0;
+
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < BENCH_PACKETS; i++) {
+    const test_packet *p = &corpus[n];
+    sum += PacketParser::parse_view(&p->data[0], p->data.size(), p->eth, &view);
+    if (++n == corpus.size())
+      n = 0;
+  }
+  t_view = elapsed(&start);
+
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < BENCH_PACKETS; i++) {
+    const test_packet *p = &corpus[n];
+    PacketElement *chain = PacketParser::split(&p->data[0], p->data.size(), p->eth);
+    sum += chain != NULL;
+    PacketParser::freePacketChain(chain);
+    if (++n == corpus.size())
+      n = 0;
+  }
+  t_split = elapsed(&start);
+
+  printf("Packets parsed into a view: %10.0f/s\n", BENCH_PACKETS / t_view);
+  printf("Packets split into a chain: %10.0f/s (%lu)\n", BENCH_PACKETS / t_split, sum & 1);
+}
+
+int main(int argc, char *argv[])
+{
+  bool do_bench = false;
+  int failures;
+
+  if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+    do_bench = true;
+    argc--;
+    argv++;
+  }
+
+  build_corpus();
+  failures = check_corpus(true);
+
+  if (argc > 1) {
+    if (!read_pcap(argv[1]))
+      return 1;
+    printf("%lu packets from %s\n", (unsigned long) corpus.size(), argv[1]);
+    failures += check_corpus(false);
+  }
+  if (do_bench)
+    bench();
+
+  printf("packet_parser: %d failures\n", failures);
+  return failures != 0;
+}
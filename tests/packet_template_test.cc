@@ -0,0 +1,212 @@
+
+/***************************************************************************
+ * packet_template_test.cc -- Checks that probes patched from a packet     *
+ * template match the full packet builders. With -b, it also compares      *
+ * their speed.                                                            *
+ *                                                                         *
+ ***********************IMPORTANT NMAP LICENSE TERMS************************
+ *
+ * The Nmap Security Scanner is (C) 1996-2025 Nmap Software LLC ("The Nmap
+ * Project"). Nmap is also a registered trademark of the Nmap Project.
+ *
+ * This program is distributed under the terms of the Nmap Public Source
+ * License (NPSL). The exact license text applying to a particular Nmap
+ * release or source code control revision is contained in the LICENSE
+ * file distributed with that version of Nmap or source code control
+ * revision. More Nmap copyright/legal information is available from
+ * https://nmap.org/book/man-legal.html, and further information on the
+ * NPSL license itself can be found at https://nmap.org/npsl/ . This
+ * header summarizes some key points from the Nmap license, but is no
+ * substitute for the actual license text.
+ *
+ * Nmap is generally free for end users to download and use themselves,
+ * including commercial use. It is available from https://nmap.org.
+ *
+ * The Nmap license generally prohibits companies from using and
+ * redistributing Nmap in commercial products, but we sell a special Nmap
+ * OEM Edition with a more permissive license and special features for
+ * this purpose. See https://nmap.org/oem/
+ *
+ * If you have received a written Nmap license agreement or contract
+ * stating terms other than these (such as an Nmap OEM license), you may
+ * choose to use and redistribute Nmap under those terms instead.
+ *
+ * The official Nmap Windows builds include the Npcap software
+ * (https://npcap.com) for packet capture and transmission. It is under
+ * separate license terms which forbid redistribution without special
+ * permission. So the official Nmap Windows builds may not be redistributed
+ * without special permission (such as an Nmap OEM license).
+ *
+ * Source is provided to this software because we believe users have a
+ * right to know exactly what a program is going to do before they run it.
+ * This also allows you to audit the software for security holes.
+ *
+ * Source code also allows you to port Nmap to new platforms, fix bugs, and
+ * add new features. You are highly encouraged to submit your changes as a
+ * Github PR or by email to the dev@nmap.org mailing list for possible
+ * incorporation into the main distribution. Unless you specify otherwise, it
+ * is understood that you are offering us very broad rights to use your
+ * submissions as described in the Nmap Public Source License Contributor
+ * Agreement. This is important because we fund the project by selling licenses
+ * with various terms, and also because the inability to relicense code has
+ * caused devastating problems for other Free Software projects (such as KDE
+ * and NASM).
+ *
+ * The free version of Nmap is distributed in the hope that it will be
+ * useful, but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. Warranties,
+ * indemnification and commercial support are all available through the
+ * Npcap OEM program--see https://nmap.org/oem/
+ *
+ ***************************************************************************/
+
+#include "../nmap.h"
+#include <dnet.h>
+#include "../tcpip.h"
+#include "../NmapOps.h"
+
+#include <cstdio>
+#include <cstring>
+
+/* Builds probes with random per-probe fields both ways and counts the ones
+   that differ. With -b, it also reports how many probes per second each way
+   builds. */
+
+#define CHECKS 200000
+#define BENCH 2000000
+
+extern NmapOps o;
+
+static const u8 syn_options[] = "\x02\x04\x05\xb4";
+
+static double elapsed(const struct timeval *start) {
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return TIMEVAL_FSEC_SUBTRACT(now, *start);
+}
+
+static int check_tcp(PacketTemplate *tmpl, const struct in_addr *src, u8 flags,
+                     const u8 *tcpopt, int tcpoptlen, const char *data, u16 datalen) {
+  int failures = 0;
+
+  for (int i = 0; i < CHECKS; i++) {
+    struct in_addr dst;
+    u16 ipid = get_random_u16(), sport = get_random_u16(), dport = get_random_u16();
+    /* Zero would make both builders choose a random sequence number. */
+    u32 seq = get_random_u32() | 1, ack = (i % 2) ? get_random_u32() : 0;
+    int ttl = 1 + get_random_u8() % 255;
+    u32 len1, len2;
+    const u8 *p1;
+    u8 *p2;
+
+    dst.s_addr = get_random_u32();
+    if (!tmpl->setTCP(src, IP_TOS_DEFAULT, false, NULL, 0, flags, 0,
+                      tcpopt, tcpoptlen, data, datalen)) {
+      printf("FAIL: template refused TCP probe\n");
+      return 1;
+    }
+    p1 = tmpl->tcp(&dst, ttl, ipid, sport, dport, seq, ack, &len1);
+    p2 = build_tcp_raw(src, &dst, ttl, ipid, IP_TOS_DEFAULT, false, NULL, 0,
+                       sport, dport, seq, ack, 0, flags, 0, 0,
+                       tcpopt, tcpoptlen, data, datalen, &len2);
+    if (len1 != len2 || memcmp(p1, p2, len1) != 0) {
+      if (failures++ < 5)
+        printf("FAIL: TCP probe %d differs\n", i);
+    }
+    free(p2);
+  }
+  return failures;
+}
+
+static int check_udp(PacketTemplate *tmpl, const struct in_addr *src,
+                     const char *data, u16 datalen) {
+  int failures = 0;
+
+  for (int i = 0; i < CHECKS; i++) {
+    struct in_addr dst;
+    u16 ipid = get_random_u16(), sport = get_random_u16(), dport = get_random_u16();
+    int ttl = 1 + get_random_u8() % 255;
+    u32 len1, len2;
+    const u8 *p1;
+    u8 *p2;
+
+    dst.s_addr = get_random_u32();
+    if (!tmpl->setUDP(src, IP_TOS_DEFAULT, false, NULL, 0, data, datalen)) {
+      printf("FAIL: template refused UDP probe\n");
+      return 1;
+    }
+    p1 = tmpl->udp(&dst, ttl, ipid, sport, dport, &len1);
+    p2 = build_udp_raw(src, &dst, ttl, ipid, IP_TOS_DEFAULT, false, NULL, 0,
+                       sport, dport, data, datalen, &len2);
+    if (len1 != len2 || memcmp(p1, p2, len1) != 0) {
+      if (failures++ < 5)
+        printf("FAIL: UDP probe %d differs\n", i);
+    }
+    free(p2);
+  }
+  return failures;
+}
+
+static void bench(const struct in_addr *src) {
+  PacketTemplate tmpl;
+  struct timeval start;
+  struct in_addr dst;
+  u32 len, sum = 0;
+  double t_full, t_tmpl;
+
+  dst.s_addr = htonl(0x0a000000);
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < BENCH; i++) {
+    dst.s_addr = htonl(0x0a000000 + (i >> 4));
+    u8 *p = build_tcp_raw(src, &dst, -1, i, IP_TOS_DEFAULT, false, NULL, 0,
+                          40000 + (i & 3), 1 + (i & 0xfff), 0x5000 + i, 0, 0,
+                          TH_SYN, 0, 0, syn_options, 4, NULL, 0, &len);
+    sum += p[len - 1];
+    free(p);
+  }
+  t_full = elapsed(&start);
+
+  gettimeofday(&start, NULL);
+  for (int i = 0; i < BENCH; i++) {
+    dst.s_addr = htonl(0x0a000000 + (i >> 4));
+    tmpl.setTCP(src, IP_TOS_DEFAULT, false, NULL, 0, TH_SYN, 0,
+                syn_options, 4, NULL, 0);
+    const u8 *p = tmpl.tcp(&dst, -1, i, 40000 + (i & 3), 1 + (i & 0xfff),
+                           0x5000 + i, 0, &len);
+    sum += p[len - 1];
+  }
+  t_tmpl = elapsed(&start);
+
+  printf("SYN probes built by build_tcp_raw: %10.0f/s\n", BENCH / t_full);
+  printf("SYN probes built from a template:  %10.0f/s (%u)\n", BENCH / t_tmpl, sum & 1);
+}
+
+int main(int argc, char *argv[])
+{
+  PacketTemplate tmpl;
+  struct in_addr src;
+  const char payload[] = "\x00\x01\x02\x03 a payload of odd length";
+  int failures = 0;
+
+  src.s_addr = htonl(0xc0000202);
+
+  failures += check_tcp(&tmpl, &src, TH_SYN, syn_options, 4, NULL, 0);
+  failures += check_tcp(&tmpl, &src, TH_ACK, NULL, 0, payload, sizeof(payload) - 1);
+  failures += check_udp(&tmpl, &src, NULL, 0);
+  failures += check_udp(&tmpl, &src, payload, sizeof(payload) - 1);
+  /* Switching back must rebuild the template. */
+  failures += check_tcp(&tmpl, &src, TH_FIN | TH_PUSH | TH_URG, NULL, 0, NULL, 0);
+
+  o.badsum = true;
+  if (tmpl.setTCP(&src, IP_TOS_DEFAULT, false, NULL, 0, TH_SYN, 0, NULL, 0, NULL, 0)) {
+    printf("FAIL: template used with --badsum\n");
+    failures++;
+  }
+  o.badsum = false;
+
+  if (argc > 1 && strcmp(argv[1], "-b") == 0)
+    bench(&src);
+
+  printf("packet_template: %d failures\n", failures);
+  return failures != 0;
+}
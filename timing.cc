@@ -217,8 +217,32 @@ double ultra_timing_vals::cc_scale(const struct scan_performance_vars *perf) {
   return MIN(ratio, perf->cc_scale_max);
 }
 
+/* Return the CUBIC window target t seconds into the current epoch (RFC 8312
+   section 4.1):
+     W_cubic(t) = C*(t - K)^3 + W_max,  K = cbrt(W_max*(1 - beta)/C)
+   The curve is concave up to W_max, where it flattens out, and convex beyond
+   it as it probes for more bandwidth. If we have an RTT estimate, don't let
+   the target fall below what Reno would have reached in the same time (the
+   "TCP-friendly region", section 4.2). */
+static double cubic_target(const struct scan_performance_vars *perf,
+                           double w_max, double t, int srtt) {
+  double beta = perf->cubic_beta;
+  double k, target;
+
+  k = cbrt(w_max * (1.0 - beta) / perf->cubic_c);
+  target = perf->cubic_c * (t - k) * (t - k) * (t - k) + w_max;
+  if (srtt > 0) {
+    double w_est = w_max * beta
+      + 3.0 * (1.0 - beta) / (1.0 + beta) * perf->ca_incr * t / (srtt / 1000000.0);
+    target = MAX(target, w_est);
+  }
+
+  return target;
+}
+
 /* Update congestion variables for the receipt of a reply. */
-void ultra_timing_vals::ack(const struct scan_performance_vars *perf, double scale) {
+void ultra_timing_vals::ack(const struct scan_performance_vars *perf, double scale,
+                            const struct timeval *now, int srtt) {
   num_replies_received++;
 
   if (cwnd < ssthresh) {
@@ -227,6 +251,24 @@ void ultra_timing_vals::ack(const struct scan_performance_vars *perf, double sca
     cwnd += perf->slow_incr * cc_scale(perf) * scale;
     if (cwnd > ssthresh)
       cwnd = ssthresh;
+  } else if (perf->cc_algo == CC_CUBIC && now != NULL) {
+    /* CUBIC congestion avoidance. Each reply moves cwnd a 1/cwnd share of the
+       way to the target, so the window reaches it in about one RTT. */
+    double target;
+
+    if (epoch_start.tv_sec == 0 && epoch_start.tv_usec == 0) {
+      epoch_start = *now;
+      /* Leaving slow start without a drop; start the curve at its plateau. */
+      if (w_max < cwnd)
+        w_max = cwnd;
+    }
+    target = cubic_target(perf, w_max,
+                          TIMEVAL_FSEC_SUBTRACT(*now, epoch_start), srtt);
+    if (target > cwnd)
+      cwnd += (target - cwnd) / cwnd * cc_scale(perf) * scale;
+    else
+      /* Grow very slowly while at or above the target. */
+      cwnd += 0.01 / cwnd * scale;
   } else {
     /* Congestion avoidance mode. "During congestion avoidance, cwnd is
        incremented by 1 full-sized segment per round-trip time (RTT). The
@@ -240,9 +282,31 @@ void ultra_timing_vals::ack(const struct scan_performance_vars *perf, double sca
     cwnd = perf->max_cwnd;
 }
 
+/* Record the window at the time of a drop for CUBIC and start a new epoch.
+   With "fast convergence", if the window didn't get back to where it was at
+   the previous drop, remember an even lower plateau so that we give up
+   bandwidth to competing flows sooner. */
+void ultra_timing_vals::cubic_drop(const struct scan_performance_vars *perf) {
+  if (cwnd < w_max)
+    w_max = cwnd * (1.0 + perf->cubic_beta) / 2.0;
+  else
+    w_max = cwnd;
+  epoch_start.tv_sec = 0;
+  epoch_start.tv_usec = 0;
+}
+
 /* Update congestion variables for a detected drop. */
 void ultra_timing_vals::drop(unsigned in_flight,
   const struct scan_performance_vars *perf, const struct timeval *now) {
+  if (perf->cc_algo == CC_CUBIC) {
+    /* CUBIC keeps a beta fraction of the window instead of restarting from
+       the bottom, and goes straight back into congestion avoidance. */
+    cubic_drop(perf);
+    cwnd = MAX(perf->low_cwnd, cwnd * perf->cubic_beta);
+    ssthresh = (int) MAX(cwnd, 2);
+    last_drop = *now;
+    return;
+  }
   /* "When a TCP sender detects segment loss using the retransmission timer, the
      value of ssthresh MUST be set to no more than the value
        ssthresh = max (FlightSize / 2, 2*SMSS)
@@ -258,6 +322,13 @@ void ultra_timing_vals::drop(unsigned in_flight,
    group congestion control. */
 void ultra_timing_vals::drop_group(unsigned in_flight,
   const struct scan_performance_vars *perf, const struct timeval *now) {
+  if (perf->cc_algo == CC_CUBIC) {
+    cubic_drop(perf);
+    cwnd = MAX(perf->low_cwnd, cwnd * perf->cubic_beta);
+    ssthresh = (int) MAX(cwnd, 2);
+    last_drop = *now;
+    return;
+  }
   cwnd = MAX(perf->low_cwnd, cwnd / perf->group_drop_cwnd_divisor);
   ssthresh = (int) MAX(in_flight / perf->group_drop_ssthresh_divisor, 2);
   last_drop = *now;
@@ -290,6 +361,27 @@ void scan_performance_vars::init() {
     ssthresh_divisor = (5.0 / 4.0);
   group_drop_ssthresh_divisor = ssthresh_divisor;
   host_drop_ssthresh_divisor = ssthresh_divisor;
+  cc_algo = o.cc_algo;
+  cubic_beta = 0.7;
+  cubic_c = 0.4;
+}
+
+const char *cc_algorithm_name(enum cc_algorithm algo) {
+  switch (algo) {
+  case CC_RENO:
+    return "reno";
+  case CC_CUBIC:
+    return "cubic";
+  }
+  return "unknown";
+}
+
+int cc_algorithm_from_name(const char *name) {
+  if (strcasecmp(name, "reno") == 0)
+    return CC_RENO;
+  if (strcasecmp(name, "cubic") == 0)
+    return CC_CUBIC;
+  return -1;
 }
 
 /* current_rate_history defines how far back (in seconds) we look when
@@ -494,6 +586,231 @@ unsigned long long PacketRateMeter::getNumBytes(void) const {
   return (unsigned long long) byte_rate_meter.getTotal();
 }
 
+TokenBucket::TokenBucket() {
+  rate = depth = floor = tokens = 0.0;
+  last.tv_sec = 0;
+  last.tv_usec = 0;
+}
+
+void TokenBucket::init(double rate, double depth, double floor,
+                       const struct timeval *now) {
+  assert(depth >= 1.0);
+  assert(floor <= 0.0);
+  this->rate = rate;
+  this->depth = depth;
+  this->floor = floor;
+  /* Allow one send immediately, but don't start with a full bucket. */
+  tokens = 1.0;
+  last = *now;
+}
+
+double TokenBucket::available(const struct timeval *now) const {
+  double elapsed;
+
+  elapsed = TIMEVAL_FSEC_SUBTRACT(*now, last);
+  if (elapsed <= 0.0)
+    return tokens;
+
+  return MIN(depth, tokens + elapsed * rate);
+}
+
+void TokenBucket::take(const struct timeval *now, double n) {
+  tokens = MAX(floor, available(now) - n);
+  if (TIMEVAL_AFTER(*now, last))
+    last = *now;
+}
+
+void TokenBucket::nextAvailable(const struct timeval *now, struct timeval *when,
+                                double n) const {
+  double have, wait_us;
+
+  have = available(now);
+  if (have >= n || rate <= 0.0) {
+    *when = *now;
+    return;
+  }
+  /* Round up so that the token really is there at the returned time. */
+  wait_us = ceil((n - have) / rate * 1000000.0);
+  TIMEVAL_ADD(*when, *now, (long) wait_us);
+}
+
+ConnectGovernor connect_governor;
+
+ConnectGovernor::ConnectGovernor() {
+  initialized = false;
+  window = min_window = max_window = full_max_window = 1.0;
+  seed_window = 0.0;
+  to.srtt = to.rttvar = to.timeout = -1;
+  last_drop.tv_sec = 0;
+  last_drop.tv_usec = 0;
+  last_exhausted = last_drop;
+  num_successes = num_slow = num_timeouts = num_errors = num_exhausted = 0;
+}
+
+/* The governor is a global, so it can't look at NmapOps until the first time
+   it is used. The window starts at the minimum; until the first drop, each
+   caller is allowed at least its own starting point. */
+void ConnectGovernor::init() {
+  min_window = o.min_parallelism ? o.min_parallelism : 1;
+  full_max_window = MAX(min_window, o.max_parallelism ? o.max_parallelism : 100);
+  max_window = full_max_window;
+  window = min_window;
+  initialize_timeout_info(&to);
+  initialized = true;
+}
+
+unsigned int ConnectGovernor::limit(unsigned int cap, unsigned int initial) {
+  unsigned int n;
+
+  if (!initialized)
+    init();
+  n = (unsigned int) window;
+  /* Service scan and NSE start from different guesses (NSE from its whole
+     socket allowance, service scan from a per-timing-level guess), so
+     neither should be held to, or raised to, the other's until there is a
+     reason to. The floor is this caller's alone; the shared window is left
+     as it is. */
+  if (last_drop.tv_sec == 0) {
+    double floor = box(min_window, max_window, (double) initial);
+    seed_window = MAX(seed_window, floor);
+    n = MAX(n, (unsigned int) floor);
+  }
+  return box(1U, MAX(cap, 1U), n);
+}
+
+/* The first drop cuts from the most any caller was allowed, not from the
+   shared window underneath the callers' floors. */
+void ConnectGovernor::leaveSeed() {
+  if (last_drop.tv_sec == 0)
+    window = MAX(window, seed_window);
+}
+
+/* Like ultra_timing_vals::last_drop, only cut the window once per timeout
+   period so that a burst of failures from connections launched together
+   doesn't collapse it to the minimum. */
+bool ConnectGovernor::mayDrop(const struct timeval *now) const {
+  if (last_drop.tv_sec == 0)
+    return true;
+  return TIMEVAL_SUBTRACT(*now, last_drop) >= to.timeout;
+}
+
+void ConnectGovernor::connectSucceeded(const struct timeval *start,
+                                       const struct timeval *now) {
+  long delta;
+
+  if (!initialized)
+    init();
+  num_successes++;
+  delta = TIMEVAL_SUBTRACT(*now, *start);
+
+  /* A resource error caps the window at what was open at the time, but the
+     descriptors or ports may have been held by something else that has since
+     let go. Lift the cap once a timeout period passes without another. */
+  if (max_window < full_max_window
+      && TIMEVAL_SUBTRACT(*now, last_exhausted) >= to.timeout)
+    max_window = full_max_window;
+
+  /* A connect that took much longer than usual means queues are building up
+     somewhere between us and the target. Back off gently instead of
+     growing. */
+  if (to.srtt != -1 && delta > to.timeout) {
+    num_slow++;
+    if (mayDrop(now)) {
+      leaveSeed();
+      window = MAX(min_window, window * 0.875);
+      last_drop = *now;
+    }
+  } else {
+    window = MIN(max_window, window + 1.0 / window);
+  }
+  adjust_timeouts2(start, now, &to);
+}
+
+bool ConnectGovernor::isResourceError(int err) {
+  switch (err) {
+#ifdef EMFILE
+    case EMFILE:
+#endif
+#ifdef ENFILE
+    case ENFILE:
+#endif
+#ifdef EADDRNOTAVAIL
+    case EADDRNOTAVAIL:
+#endif
+    case ENOBUFS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+void ConnectGovernor::connectFailed(int err, unsigned int in_flight,
+                                    const struct timeval *now) {
+  if (!initialized)
+    init();
+
+  if (isResourceError(err)) {
+    /* We ran out of descriptors or ephemeral ports. Going above the number of
+       connections we had open when that happened is pointless, so make it the
+       new ceiling. */
+    num_exhausted++;
+    leaveSeed();
+    if (in_flight == 0)
+      in_flight = (unsigned int) window;
+    max_window = MAX(min_window, in_flight > 1 ? in_flight - 1 : 1);
+    window = MAX(min_window, MIN(window, in_flight) / 2);
+    last_drop = last_exhausted = *now;
+    return;
+  }
+
+  /* Otherwise it's a timeout, or a refused or reset connection to a port we
+     already know is open, which is typically a rate limiter or an overloaded
+     state table. */
+  if (err == 0)
+    num_timeouts++;
+  else
+    num_errors++;
+
+  if (mayDrop(now)) {
+    leaveSeed();
+    window = MAX(min_window, window * 0.5);
+    last_drop = *now;
+  }
+}
+
+void ConnectGovernor::printStats(const char *scantypestr) const {
+  if (!initialized)
+    return;
+  log_write(LOG_STDOUT, "%s Concurrency: %d connections allowed (max %d); "
+      "srtt: %dms; %lu connected (%lu slow), %lu timed out, %lu failed, %lu resource errors\n",
+      scantypestr, (int) window, (int) max_window,
+      to.srtt == -1 ? -1 : to.srtt / 1000, num_successes, num_slow,
+      num_timeouts, num_errors, num_exhausted);
+  log_flush(LOG_STDOUT);
+}
+
+LatencyStats scan_latencies;
+
+LatencyStats::LatencyStats() {
+  latency_hist_init(&all);
+}
+
+void LatencyStats::add(stype scantype, const struct latency_hist *h) {
+  std::vector<std::pair<stype, struct latency_hist> >::iterator it;
+
+  if (h->count == 0)
+    return;
+  latency_hist_merge(&all, h);
+  /* A scan runs only a handful of phases, so a linear search is fine. */
+  for (it = phases.begin(); it != phases.end(); it++) {
+    if (it->first == scantype) {
+      latency_hist_merge(&it->second, h);
+      return;
+    }
+  }
+  phases.push_back(std::make_pair(scantype, *h));
+}
+
 ScanProgressMeter::ScanProgressMeter(const char *stypestr) {
   scantypestr = strdup(stypestr);
   gettimeofday(&begin, NULL);
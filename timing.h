@@ -78,6 +78,16 @@
 #endif
 
 #include <nbase.h> /* u32 */
+#include "scan_lists.h" /* stype */
+
+#include <utility>
+#include <vector>
+
+/* Congestion control algorithms that can be selected with
+   --congestion-control. Reno is the classic RFC 2581 behavior; CUBIC (RFC
+   8312) grows the window as a function of the time since the last drop rather
+   than of the number of replies, so it fills long, fat paths much faster. */
+enum cc_algorithm { CC_RENO, CC_CUBIC };
 
 /* Based on TCP congestion control techniques from RFC2581. */
 struct ultra_timing_vals {
@@ -97,13 +107,21 @@ struct ultra_timing_vals {
      to adjust again based on probes sent after that adjustment so a
      sudden batch of drops doesn't destroy timing.  Init to now */
   struct timeval last_drop;
+  /* CUBIC state: the window size just before the last reduction, and the
+     start of the current growth epoch (zero if no epoch has begun). */
+  double w_max;
+  struct timeval epoch_start;
 
   double cc_scale(const struct scan_performance_vars *perf);
-  void ack(const struct scan_performance_vars *perf, double scale = 1.0);
+  /* now and srtt (in microseconds, as in struct timeout_info) are only used
+     by CUBIC; without them, congestion avoidance falls back to Reno. */
+  void ack(const struct scan_performance_vars *perf, double scale = 1.0,
+    const struct timeval *now = NULL, int srtt = -1);
   void drop(unsigned in_flight,
     const struct scan_performance_vars *perf, const struct timeval *now);
   void drop_group(unsigned in_flight,
     const struct scan_performance_vars *perf, const struct timeval *now);
+  void cubic_drop(const struct scan_performance_vars *perf);
 };
 
 /* These are mainly initializers for ultra_timing_vals. */
@@ -126,6 +144,9 @@ struct scan_performance_vars {
                                          any drop occurs */
   double host_drop_ssthresh_divisor; /* used to drop the host ssthresh when
                                          any drop occurs */
+  enum cc_algorithm cc_algo; /* Window growth and reduction strategy */
+  double cubic_beta; /* CUBIC multiplicative decrease factor */
+  double cubic_c; /* CUBIC scaling constant, in probes per second cubed */
 
   /* Do initialization after the global NmapOps table has been filled in. */
   void init();
@@ -153,6 +174,11 @@ void adjust_timeouts2(const struct timeval *sent,
    response.  We update our RTT averages, etc. */
 void adjust_timeouts(struct timeval sent, struct timeout_info *to);
 
+/* Convert between enum cc_algorithm and its name for --congestion-control.
+   cc_algorithm_from_name returns -1 for an unknown name. */
+const char *cc_algorithm_name(enum cc_algorithm algo);
+int cc_algorithm_from_name(const char *name);
+
 #define DEFAULT_CURRENT_RATE_HISTORY 5.0
 
 /* Sleeps if necessary to ensure that it isn't called twice within less
@@ -212,6 +238,109 @@ class PacketRateMeter {
     RateMeter byte_rate_meter;
 };
 
+/* A token bucket for pacing sends to a given average rate. Tokens accrue at
+   rate per second, up to depth. Taking a token may drive the balance
+   negative, but never below floor; a negative balance is a debt that must be
+   paid back before the next token is available. Rates are kept as doubles so
+   that intervals below a microsecond are not rounded away.
+
+   Nothing here looks at the clock; callers pass in the time they already
+   have, so pacing a packet costs a few floating-point operations and no
+   system calls. */
+class TokenBucket {
+  public:
+    TokenBucket();
+
+    void init(double rate, double depth, double floor,
+              const struct timeval *now);
+    bool isSet() const { return rate > 0.0; }
+    /* The number of tokens available at time now. */
+    double available(const struct timeval *now) const;
+    /* Remove n tokens at time now. */
+    void take(const struct timeval *now, double n = 1.0);
+    /* Set when to the earliest time at which n tokens will be available
+       (which is now if they already are). */
+    void nextAvailable(const struct timeval *now, struct timeval *when,
+                       double n = 1.0) const;
+
+  private:
+    double rate; /* Tokens per second */
+    double depth;
+    double floor;
+    double tokens; /* Balance as of last */
+    struct timeval last;
+};
+
+/* An AIMD governor for the number of connections the connect-based engines
+   (service scan and NSE) may have outstanding at once. There is one of these
+   for the whole process, so a window learned in one host group (for instance
+   after running out of local ports or overwhelming a stateful middlebox)
+   carries over to the next group and to script scanning. */
+class ConnectGovernor {
+  public:
+    ConnectGovernor();
+
+    /* Returns how many connections may be outstanding right now. The answer
+       is never more than cap, nor less than one. initial is the caller's own
+       starting allowance: until a connection has been slow, timed out, or
+       failed, the caller gets at least that much. Other callers are not
+       affected. */
+    unsigned int limit(unsigned int cap, unsigned int initial);
+    /* Record a connection to a port believed to be open that completed
+       successfully. start is when the connect was launched. */
+    void connectSucceeded(const struct timeval *start, const struct timeval *now);
+    /* Record a connection that failed. err is the nsock error code, or 0 for a
+       timeout. in_flight is how many connections the caller had outstanding
+       at the time, or 0 if it doesn't know. */
+    void connectFailed(int err, unsigned int in_flight, const struct timeval *now);
+    /* Returns true if err means we ran out of a local resource (descriptors,
+       ephemeral ports, buffers) rather than something about the target. */
+    static bool isResourceError(int err);
+    /* Print the current state of the governor, for --stats-every and the
+       interactive status key. */
+    void printStats(const char *scantypestr) const;
+
+  private:
+    void init();
+    bool mayDrop(const struct timeval *now) const;
+    void leaveSeed();
+
+    bool initialized;
+    double window; /* Current number of connections allowed */
+    double min_window;
+    double max_window; /* Ceiling, lowered by resource errors */
+    double full_max_window; /* Ceiling allowed by the options */
+    double seed_window; /* Largest starting allowance given before a drop */
+    struct timeout_info to; /* Connect latency estimate */
+    struct timeval last_drop;
+    struct timeval last_exhausted; /* Time of the last resource error */
+    unsigned long num_successes;
+    unsigned long num_slow;
+    unsigned long num_timeouts;
+    unsigned long num_errors;
+    unsigned long num_exhausted;
+};
+
+extern ConnectGovernor connect_governor;
+
+/* Distributions of round-trip times, in microseconds: one for each scan phase
+   (scan type) that measured any, in the order they ran, and one for all of
+   them together. ultra_scan() keeps a histogram per host while a phase runs
+   and adds it both to the host's Target and to scan_latencies, which covers
+   the whole run. */
+class LatencyStats {
+  public:
+    LatencyStats();
+
+    /* Merge a histogram of times measured during the given phase. */
+    void add(stype scantype, const struct latency_hist *h);
+
+    struct latency_hist all;
+    std::vector<std::pair<stype, struct latency_hist> > phases;
+};
+
+extern LatencyStats scan_latencies;
+
 class ScanProgressMeter {
  public:
   /* A COPY of stypestr is made and saved for when stats are printed */
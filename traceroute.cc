@@ -89,6 +89,13 @@ TTL 13 -> SYN/ACK, or whatever is the target's response to the probe
 
 The output for this host would then say "Hops 1-7 are the same as for ...".
 
+With --traceroute-cache, the completed traces are also saved to a file,
+indexed by source address and destination prefix (/24 for IPv4, /48 for IPv6).
+On a later run, the distance recorded for a target's prefix is used as the
+starting TTL, and when a reply matches the hop recorded at the same TTL, the
+lower hops are copied from the file instead of being probed, just as if they
+had been found in the in-memory cache.
+
 The detection of shared traces rests on the assumption that all paths going
 through a router at a certain TTL will be identical up to and including the
 router. This assumption is not always true. Even if two targets are each one hop
@@ -118,6 +125,9 @@ individually.
 
 #include <dnet.h>
 
+#include <errno.h>
+#include <fcntl.h>
+
 #include <algorithm>
 #include <list>
 #include <map>
@@ -132,9 +142,16 @@ extern NmapOps o;
 #define MAX_RESENDS 2
 /* In milliseconds. */
 #define PROBE_TIMEOUT 1000
+/* When tracing many hosts at once, allow this many outstanding probes per
+   active host, up to MAX_OUTSTANDING_PROBES_GROUP in total. */
+#define OUTSTANDING_PROBES_PER_HOST 2
+#define MAX_OUTSTANDING_PROBES_GROUP 300
 /* If the hop cache (including timed-out hops) is bigger than this after a
    round, the hop is cleared and rebuilt from scratch. */
 #define MAX_HOP_CACHE_SIZE 1000
+/* Prefix lengths used to index the --traceroute-cache file. */
+#define PERSISTENT_PREFIX_LEN_INET 24
+#define PERSISTENT_PREFIX_LEN_INET6 48
 
 struct Hop;
 class HostState;
@@ -178,8 +195,35 @@ static std::list<Hop *> *timedout_hops = NULL;
    true distance makes the trace faster but is not needed for accuracy. */
 static u8 initial_ttl = 10;
 
+/* A hop read from or to be written to the --traceroute-cache file. */
+struct PersistentHop {
+  u8 ttl;
+  struct sockaddr_storage addr;
+  float rtt;
+};
+
+/* Index for the --traceroute-cache file: the source address we traced from
+   and the prefix of the destination. */
+struct PersistentKey {
+  struct sockaddr_storage source;
+  struct sockaddr_storage prefix;
+
+  bool operator<(const struct PersistentKey &other) const {
+    int cmp = sockaddr_storage_cmp(&source, &other.source);
+    if (cmp != 0)
+      return cmp < 0;
+    return sockaddr_storage_cmp(&prefix, &other.prefix) < 0;
+  }
+};
+
+/* Paths loaded from the --traceroute-cache file, plus those completed during
+   this run. Each vector is sorted by increasing TTL. */
+static std::map<struct PersistentKey, std::vector<PersistentHop> > persistent_paths;
+static bool persistent_paths_loaded = false;
+
 static struct timeval get_now(struct timeval *now = NULL);
 static const char *ss_to_string(const struct sockaddr_storage *ss);
+static const std::vector<PersistentHop> *persistent_path_lookup(const Target *target);
 
 struct Hop {
   Hop *parent;
@@ -273,6 +317,13 @@ public:
 };
 u16 Probe::token_counter = 0x0000;
 
+/* Dummy class to use sockaddr_storage as a map key. */
+struct lt_sockaddr_storage {
+  bool operator()(const struct sockaddr_storage& a, const struct sockaddr_storage& b) const {
+    return sockaddr_storage_cmp(&a, &b) < 0;
+  }
+};
+
 class TracerouteState {
 public:
   std::list<HostState *> active_hosts;
@@ -300,11 +351,19 @@ private:
   std::vector<HostState *> hosts;
   std::list<HostState *>::iterator next_sending_host;
 
+  /* Active hosts indexed by target address, for matching replies. */
+  /* More than one target may have the same address (two names that resolve
+     alike), so this is a multimap. */
+  std::multimap<struct sockaddr_storage, HostState *, struct lt_sockaddr_storage> hosts_by_addr;
+
   void next_active_host();
+  int max_outstanding_probes() const;
   Probe *lookup_probe(const struct sockaddr_storage *target_addr, u16 token);
   void set_host_hop(HostState *host, u8 ttl,
     const struct sockaddr_storage *from_addr, float rtt);
   void set_host_hop_timedout(HostState *host, u8 ttl);
+  bool fill_from_persistent(HostState *host, u8 ttl,
+    const struct sockaddr_storage *from_addr);
 };
 
 static Hop *merge_hops(const struct sockaddr_storage *tag, Hop *a, Hop *b);
@@ -516,12 +575,18 @@ void HostState::child_parent_ttl(u8 ttl, Hop **child, Hop **parent) const {
 }
 
 u8 HostState::distance_guess(const Target *target) {
+  const std::vector<PersistentHop> *path;
+
   /* Use the distance from OS detection if we have it. */
   if (target->distance != -1)
     return target->distance;
-  else
-    /* initial_ttl is a variable with file-level scope. */
-    return initial_ttl;
+  /* Otherwise use the length of a path to the same prefix from an earlier
+     run. */
+  path = persistent_path_lookup(target);
+  if (path != NULL && !path->empty())
+    return path->back().ttl;
+  /* initial_ttl is a variable with file-level scope. */
+  return initial_ttl;
 }
 
 /* Get the probe that will be used for the traceroute. This is the
@@ -854,6 +919,7 @@ TracerouteState::TracerouteState(std::vector<Target *> &targets) {
     HostState *state = new HostState(*it);
     hosts.push_back(state);
     active_hosts.push_back(state);
+    hosts_by_addr.insert(std::make_pair(*(*it)->TargetSockAddr(), state));
   }
 
   num_active_probes = 0;
@@ -879,16 +945,30 @@ void TracerouteState::next_active_host() {
     next_sending_host = active_hosts.begin();
 }
 
+/* The number of probes that may be outstanding for the whole group. This is
+   MAX_OUTSTANDING_PROBES for small groups, and grows with the number of hosts
+   still being traced so that large groups don't wait on each other. */
+int TracerouteState::max_outstanding_probes() const {
+  int n;
+
+  n = active_hosts.size() * OUTSTANDING_PROBES_PER_HOST;
+  if (o.max_parallelism)
+    return box(1, o.max_parallelism, n);
+  return box(MAX_OUTSTANDING_PROBES, MAX_OUTSTANDING_PROBES_GROUP, n);
+}
+
 void TracerouteState::send_new_probes() {
   std::list<HostState *>::const_iterator failed_host;
   struct timeval now;
+  int max_probes;
 
   now = get_now();
+  max_probes = this->max_outstanding_probes();
 
   assert(!active_hosts.empty());
   failed_host = active_hosts.end();
   while (next_sending_host != failed_host
-    && num_active_probes < MAX_OUTSTANDING_PROBES
+    && num_active_probes < max_probes
     && !TIMEVAL_BEFORE(now, next_send_time)) {
     if ((*next_sending_host)->send_next_probe(rawsd, ethsd)) {
       num_active_probes++;
@@ -939,6 +1019,195 @@ void traceroute_hop_cache_clear() {
   timedout_hops->clear();
 }
 
+/* Mask the address in ss to the prefix length used for the persistent
+   cache. */
+static struct sockaddr_storage persistent_prefix(const struct sockaddr_storage *ss) {
+  struct sockaddr_storage prefix;
+  int bits, i;
+  u8 *p;
+
+  memset(&prefix, 0, sizeof(prefix));
+  prefix.ss_family = ss->ss_family;
+  if (ss->ss_family == AF_INET) {
+    const struct sockaddr_in *sin = (const struct sockaddr_in *) ss;
+    ((struct sockaddr_in *) &prefix)->sin_addr = sin->sin_addr;
+    p = (u8 *) &((struct sockaddr_in *) &prefix)->sin_addr;
+    bits = PERSISTENT_PREFIX_LEN_INET;
+    i = 4;
+  } else if (ss->ss_family == AF_INET6) {
+    const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *) ss;
+    ((struct sockaddr_in6 *) &prefix)->sin6_addr = sin6->sin6_addr;
+    p = (u8 *) &((struct sockaddr_in6 *) &prefix)->sin6_addr;
+    bits = PERSISTENT_PREFIX_LEN_INET6;
+    i = 16;
+  } else {
+    return prefix;
+  }
+  /* The prefix lengths are multiples of 8. */
+  memset(p + bits / 8, 0, i - bits / 8);
+
+  return prefix;
+}
+
+static struct PersistentKey persistent_key(const Target *target) {
+  struct PersistentKey key;
+
+  memset(&key, 0, sizeof(key));
+  key.source = *target->SourceSockAddr();
+  key.prefix = persistent_prefix(target->TargetSockAddr());
+
+  return key;
+}
+
+static const std::vector<PersistentHop> *persistent_path_lookup(const Target *target) {
+  std::map<struct PersistentKey, std::vector<PersistentHop> >::const_iterator it;
+
+  if (persistent_paths.empty())
+    return NULL;
+  it = persistent_paths.find(persistent_key(target));
+  if (it == persistent_paths.end())
+    return NULL;
+  return &it->second;
+}
+
+/* Load the --traceroute-cache file. Each line is
+     <source> <prefix>/<bits> <ttl> <hop address> <rtt>
+   Lines that don't parse, or that use a different prefix length than we do,
+   are ignored. A missing file is not an error; it will be created when the
+   cache is saved. */
+static void persistent_paths_load(const char *filename) {
+  char *filestr, *p, *end, *eol;
+  s64 filelen;
+  int n;
+
+  persistent_paths_loaded = true;
+  filestr = mmapfile((char *) filename, &filelen, O_RDONLY);
+  if (filestr == NULL) {
+    /* mmap fails with EINVAL on an empty file. */
+    if (errno != ENOENT && errno != EINVAL)
+      error("Could not read traceroute cache %s: %s", filename, strerror(errno));
+    return;
+  }
+
+  n = 0;
+  end = filestr + filelen;
+  for (p = filestr; p < end; p = eol + 1) {
+    char line[256], source[INET6_ADDRSTRLEN], prefix[INET6_ADDRSTRLEN], addr[INET6_ADDRSTRLEN];
+    struct PersistentKey key;
+    PersistentHop hop;
+    size_t sslen;
+    int bits, ttl;
+
+    eol = (char *) memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+    if (eol - p == 0 || *p == '#' || (size_t) (eol - p) >= sizeof(line))
+      continue;
+    memcpy(line, p, eol - p);
+    line[eol - p] = '\0';
+
+    if (sscanf(line, "%45s %45[^/]/%d %d %45s %f", source, prefix, &bits, &ttl, addr, &hop.rtt) != 6)
+      continue;
+    if (ttl < 1 || ttl > MAX_TTL)
+      continue;
+    memset(&key, 0, sizeof(key));
+    memset(&hop.addr, 0, sizeof(hop.addr));
+    if (resolve_numeric(source, 0, &key.source, &sslen, AF_UNSPEC) != 0
+        || resolve_numeric(prefix, 0, &key.prefix, &sslen, AF_UNSPEC) != 0
+        || resolve_numeric(addr, 0, &hop.addr, &sslen, AF_UNSPEC) != 0)
+      continue;
+    if (bits != (key.prefix.ss_family == AF_INET ? PERSISTENT_PREFIX_LEN_INET : PERSISTENT_PREFIX_LEN_INET6))
+      continue;
+    key.prefix = persistent_prefix(&key.prefix);
+    hop.ttl = ttl;
+    persistent_paths[key].push_back(hop);
+    n++;
+  }
+  munmap(filestr, filelen);
+
+  if (o.debugging)
+    log_write(LOG_STDOUT, "Loaded %d hops for %u prefixes from traceroute cache %s\n",
+      n, (unsigned int) persistent_paths.size(), filename);
+}
+
+static bool persistent_hop_lt(const PersistentHop &a, const PersistentHop &b) {
+  return a.ttl < b.ttl;
+}
+
+/* Remember the completed traces of this group for saving in the persistent
+   cache. Traces that never reached their target are not recorded. */
+static void persistent_paths_record(const std::vector<Target *> &targets) {
+  std::vector<Target *>::const_iterator it;
+  std::list<TracerouteHop>::const_iterator hop_iter;
+
+  for (it = targets.begin(); it != targets.end(); it++) {
+    std::vector<PersistentHop> path;
+
+    if ((*it)->distance_calculation_method != DIST_METHOD_TRACEROUTE)
+      continue;
+    for (hop_iter = (*it)->traceroute_hops.begin(); hop_iter != (*it)->traceroute_hops.end(); hop_iter++) {
+      PersistentHop hop;
+
+      if (hop_iter->timedout)
+        continue;
+      hop.ttl = hop_iter->ttl;
+      hop.addr = hop_iter->addr;
+      hop.rtt = hop_iter->rtt;
+      path.push_back(hop);
+    }
+    if (path.empty())
+      continue;
+    std::sort(path.begin(), path.end(), persistent_hop_lt);
+    persistent_paths[persistent_key(*it)] = path;
+  }
+}
+
+/* Write the persistent cache to the --traceroute-cache file. It is written
+   to a temporary file that is then renamed over the old one, so that another
+   Nmap reading it at the same time, or a run that is interrupted, never sees a
+   truncated cache. */
+void traceroute_cache_save() {
+  std::map<struct PersistentKey, std::vector<PersistentHop> >::const_iterator it;
+  std::vector<PersistentHop>::const_iterator hop_iter;
+  char source[INET6_ADDRSTRLEN], prefix[INET6_ADDRSTRLEN];
+  char suffix[16];
+  std::string tmp;
+  FILE *fp;
+
+  if (o.traceroute_cache_file == NULL || !persistent_paths_loaded)
+    return;
+  Snprintf(suffix, sizeof(suffix), ".%08lx.tmp", (unsigned long) get_random_u32());
+  tmp = std::string(o.traceroute_cache_file) + suffix;
+  fp = fopen(tmp.c_str(), "w");
+  if (fp == NULL) {
+    error("Could not write traceroute cache %s: %s", tmp.c_str(), strerror(errno));
+    return;
+  }
+  fprintf(fp, "# Nmap traceroute cache. Format: <source> <prefix>/<bits> <ttl> <hop> <rtt>\n");
+  for (it = persistent_paths.begin(); it != persistent_paths.end(); it++) {
+    Strncpy(source, ss_to_string(&it->first.source), sizeof(source));
+    Strncpy(prefix, ss_to_string(&it->first.prefix), sizeof(prefix));
+    for (hop_iter = it->second.begin(); hop_iter != it->second.end(); hop_iter++) {
+      fprintf(fp, "%s %s/%d %d %s %.2f\n", source, prefix,
+        it->first.prefix.ss_family == AF_INET ? PERSISTENT_PREFIX_LEN_INET : PERSISTENT_PREFIX_LEN_INET6,
+        hop_iter->ttl, ss_to_string(&hop_iter->addr), hop_iter->rtt);
+    }
+  }
+  if (ferror(fp) | fclose(fp)) {
+    error("Could not write traceroute cache %s: %s", tmp.c_str(), strerror(errno));
+    remove(tmp.c_str());
+    return;
+  }
+#ifdef WIN32
+  /* rename doesn't replace an existing file on Windows. */
+  remove(o.traceroute_cache_file);
+#endif
+  if (rename(tmp.c_str(), o.traceroute_cache_file) != 0) {
+    error("Could not write traceroute cache %s: %s", o.traceroute_cache_file, strerror(errno));
+    remove(tmp.c_str());
+  }
+}
+
 /* Merge two hop chains together and return the head of the merged chain. This
    is done when a cache hit finds that two targets share the same intermediate
    hop; rather than doing a full trace for each target, one is linked to the
@@ -1025,6 +1294,9 @@ void TracerouteState::set_host_hop(HostState *host, u8 ttl,
     /* A new hop, never before seen with this address and TTL. Add it to the
        host's chain and to the global cache. */
     hop = host->insert_hop(ttl, from_addr, rtt);
+    /* If an earlier run saw the same hop at this TTL on the way to this
+       prefix, take the rest of the path below it from there. */
+    this->fill_from_persistent(host, ttl, from_addr);
   } else {
     /* An existing hop at this address and TTL. Link this host's chain to it. */
     if (o.debugging > 1) {
@@ -1058,6 +1330,59 @@ void TracerouteState::set_host_hop(HostState *host, u8 ttl,
   }
 }
 
+/* Copy the hops below ttl from the --traceroute-cache path for this host's
+   prefix, if the hop at ttl matches the one recorded there. Returns true if
+   any hops were copied. */
+bool TracerouteState::fill_from_persistent(HostState *host, u8 ttl,
+  const struct sockaddr_storage *from_addr) {
+  static struct sockaddr_storage EMPTY_ADDR = { 0 };
+  const PersistentHop *by_ttl[MAX_TTL + 1] = { NULL };
+  const std::vector<PersistentHop> *path;
+  std::vector<PersistentHop>::const_iterator it;
+  int t;
+
+  if (ttl <= 1)
+    return false;
+  path = persistent_path_lookup(host->target);
+  if (path == NULL)
+    return false;
+  for (it = path->begin(); it != path->end(); it++) {
+    if (it->ttl <= MAX_TTL)
+      by_ttl[it->ttl] = &*it;
+  }
+  if (by_ttl[ttl] == NULL || !sockaddr_storage_equal(&by_ttl[ttl]->addr, from_addr))
+    return false;
+
+  if (o.debugging > 1) {
+    log_write(LOG_STDOUT, "Traceroute persistent cache hit %s TTL %d for %s\n",
+      ss_to_string(from_addr), ttl, host->target->targetipstr());
+  }
+
+  num_active_probes -= host->cancel_probes_below(ttl);
+  for (t = ttl - 1; t >= 1; t--) {
+    Hop *hop;
+
+    host->sent_ttls[t] = true;
+    if (by_ttl[t] == NULL) {
+      host->insert_hop(t, &EMPTY_ADDR, -1.0);
+      continue;
+    }
+    hop = hop_cache_lookup(t, &by_ttl[t]->addr);
+    if (hop != NULL) {
+      /* Joined a trace already known in this run. */
+      host->link_to(hop);
+      for (t--; t >= 1; t--)
+        host->sent_ttls[t] = true;
+      break;
+    }
+    host->insert_hop(t, &by_ttl[t]->addr, by_ttl[t]->rtt);
+  }
+  if (host->state == HostState::COUNTING_DOWN)
+    host->state = HostState::COUNTING_UP;
+
+  return true;
+}
+
 /* Record that a hop at the given TTL for the given host timed out. */
 void TracerouteState::set_host_hop_timedout(HostState *host, u8 ttl) {
   static struct sockaddr_storage EMPTY_ADDR = { 0 };
@@ -1297,6 +1622,9 @@ void TracerouteState::cull_timeouts() {
 }
 
 void TracerouteState::remove_finished_hosts() {
+  std::multimap<struct sockaddr_storage, HostState *, struct lt_sockaddr_storage>::iterator host_iter;
+  std::pair<std::multimap<struct sockaddr_storage, HostState *, struct lt_sockaddr_storage>::iterator,
+    std::multimap<struct sockaddr_storage, HostState *, struct lt_sockaddr_storage>::iterator> range;
   std::list<HostState *>::iterator it, next;
 
   for (it = active_hosts.begin(); it != active_hosts.end(); it = next) {
@@ -1305,18 +1633,20 @@ void TracerouteState::remove_finished_hosts() {
     if ((*it)->is_finished()) {
       if (next_sending_host == it)
         next_active_host();
+      /* Erase only this host's entry, not another target's with the same
+         address. */
+      range = hosts_by_addr.equal_range(*(*it)->target->TargetSockAddr());
+      for (host_iter = range.first; host_iter != range.second; host_iter++) {
+        if (host_iter->second == *it) {
+          hosts_by_addr.erase(host_iter);
+          break;
+        }
+      }
       active_hosts.erase(it);
     }
   }
 }
 
-/* Dummy class to use sockaddr_storage as a map key. */
-struct lt_sockaddr_storage {
-  bool operator()(const struct sockaddr_storage& a, const struct sockaddr_storage& b) const {
-    return sockaddr_storage_cmp(&a, &b) < 0;
-  }
-};
-
 /* Find the reverse-DNS names of the hops. */
 void TracerouteState::resolve_hops() {
   std::set<sockaddr_storage, lt_sockaddr_storage> addrs;
@@ -1401,15 +1731,17 @@ void TracerouteState::transfer_hops() {
 
 Probe *TracerouteState::lookup_probe(
   const struct sockaddr_storage *target_addr, u16 token) {
-  std::list<HostState *>::const_iterator host_iter;
+  std::multimap<struct sockaddr_storage, HostState *, struct lt_sockaddr_storage>::const_iterator host_iter;
+  std::pair<std::multimap<struct sockaddr_storage, HostState *, struct lt_sockaddr_storage>::const_iterator,
+    std::multimap<struct sockaddr_storage, HostState *, struct lt_sockaddr_storage>::const_iterator> range;
   std::list<Probe *>::iterator probe_iter;
 
-  for (host_iter = active_hosts.begin(); host_iter != active_hosts.end(); host_iter++) {
-
-    if (!sockaddr_storage_equal((*host_iter)->target->TargetSockAddr(), target_addr))
-      continue;
-    for (probe_iter = (*host_iter)->unanswered_probes.begin();
-         probe_iter != (*host_iter)->unanswered_probes.end();
+  /* Tokens are unique across hosts, so the probe can belong to only one of
+     the targets with this address. */
+  range = hosts_by_addr.equal_range(*target_addr);
+  for (host_iter = range.first; host_iter != range.second; host_iter++) {
+    for (probe_iter = host_iter->second->unanswered_probes.begin();
+         probe_iter != host_iter->second->unanswered_probes.end();
          probe_iter++) {
       if ((*probe_iter)->token == token)
         return *probe_iter;
@@ -1464,6 +1796,8 @@ static int traceroute_remote(std::vector<Target *> targets) {
   if (timedout_hops == NULL) {
     timedout_hops = new std::list<Hop *>;
   }
+  if (o.traceroute_cache_file != NULL && !persistent_paths_loaded)
+    persistent_paths_load(o.traceroute_cache_file);
 
   TracerouteState global_state(targets);
 
@@ -1494,6 +1828,8 @@ static int traceroute_remote(std::vector<Target *> targets) {
     global_state.resolve_hops();
   /* This puts the hops into the targets known by the global_state. */
   global_state.transfer_hops();
+  if (o.traceroute_cache_file != NULL)
+    persistent_paths_record(targets);
 
   /* Update initial_ttl to be the highest distance seen in this host group, as
      an estimate for the next. */
@@ -71,4 +71,7 @@ int traceroute(std::vector<Target *> &Targets);
 
 void traceroute_hop_cache_clear();
 
+/* Save the traces of this run to the file given with --traceroute-cache. */
+void traceroute_cache_save();
+
 #endif